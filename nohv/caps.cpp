@@ -0,0 +1,106 @@
+#include "caps.h"
+
+#include <intrin.h>
+#include <ntddk.h>
+
+// One entry for every logical processor, indexed by processor index.
+static cpu_caps* processor_caps = nullptr;
+
+// Query the capabilities of the current logical processor.
+static void query_cpu_caps(cpu_caps& caps) {
+  __cpuid(reinterpret_cast<int*>(&caps.cpuid_01), 0x01);
+  __cpuid(reinterpret_cast<int*>(&caps.cpuid_06), 0x06);
+  __cpuidex(reinterpret_cast<int*>(&caps.cpuid_0d), 0x0D, 0x00);
+  __cpuid(reinterpret_cast<int*>(&caps.cpuid_80000008), 0x80000008);
+
+  int regs[4] = {};
+  __cpuid(regs, 0x00);
+  auto const max_leaf = static_cast<uint32_t>(regs[0]);
+
+  caps.core_type = core_type_unknown;
+
+  // CPUID.07H:EDX[15] indicates a hybrid processor, in which case
+  // CPUID.1AH:EAX[31:24] is the core type of this logical processor
+  if (max_leaf >= 0x1A) {
+    __cpuidex(regs, 0x07, 0x00);
+
+    if (regs[3] & (1 << 15)) {
+      __cpuidex(regs, 0x1A, 0x00);
+      caps.core_type = static_cast<uint8_t>(static_cast<uint32_t>(regs[0]) >> 24);
+    }
+  }
+
+  __try {
+    caps.feature_control.flags = __readmsr(IA32_FEATURE_CONTROL);
+    caps.feature_control_valid = true;
+  }
+  __except (1) {
+    caps.feature_control_valid = false;
+  }
+
+  __try {
+    caps.vmx_cr0_fixed0  = __readmsr(IA32_VMX_CR0_FIXED0);
+    caps.vmx_cr0_fixed1  = __readmsr(IA32_VMX_CR0_FIXED1);
+    caps.vmx_cr4_fixed0  = __readmsr(IA32_VMX_CR4_FIXED0);
+    caps.vmx_cr4_fixed1  = __readmsr(IA32_VMX_CR4_FIXED1);
+    caps.vmx_fixed_valid = true;
+  }
+  __except (1) {
+    caps.vmx_fixed_valid = false;
+  }
+}
+
+// IPI callback that queries the capabilities of every logical processor.
+static ULONG_PTR query_ipi_callback(ULONG_PTR) {
+  query_cpu_caps(processor_caps[KeGetCurrentProcessorNumberEx(nullptr)]);
+  return 0;
+}
+
+// Query the capabilities of every logical processor.
+bool create_cpu_caps() {
+  auto const count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+  processor_caps = static_cast<cpu_caps*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, count * sizeof(cpu_caps), 'spaC'));
+
+  if (!processor_caps)
+    return false;
+
+  RtlZeroMemory(processor_caps, count * sizeof(cpu_caps));
+  KeIpiGenericCall(query_ipi_callback, 0);
+
+  return true;
+}
+
+// Free the memory that was allocated by create_cpu_caps().
+void free_cpu_caps() {
+  if (processor_caps)
+    ExFreePoolWithTag(processor_caps, 'spaC');
+
+  processor_caps = nullptr;
+}
+
+// Query the capabilities of the current logical processor again.
+void refresh_cpu_caps() {
+  query_cpu_caps(processor_caps[KeGetCurrentProcessorNumberEx(nullptr)]);
+}
+
+// Get the capabilities of the current logical processor.
+cpu_caps const& current_cpu_caps() {
+  return processor_caps[KeGetCurrentProcessorNumberEx(nullptr)];
+}
+
+// Get the capabilities of the logical processor with the specified index.
+cpu_caps const& processor_cpu_caps(uint32_t const index) {
+  return processor_caps[index];
+}
+
+// Get a short, printable name for the specified core type.
+char const* core_type_name(uint8_t const core_type) {
+  switch (core_type) {
+  case core_type_unknown: return "core";
+  case core_type_atom:    return "e-core";
+  case core_type_core:    return "p-core";
+  default:                return "other";
+  }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <ia32.hpp>
+
+// Native core types that are reported by CPUID leaf 0x1A on hybrid
+// processors. Non-hybrid processors are always core_type_unknown.
+inline constexpr uint8_t core_type_unknown = 0x00;
+inline constexpr uint8_t core_type_atom    = 0x20;
+inline constexpr uint8_t core_type_core    = 0x40;
+
+// A snapshot of the CPU capabilities that the detections depend on. This
+// is queried once per logical processor before any detection is ran, since
+// every CPUID (and possibly every RDMSR) is a vm-exit under a hypervisor.
+struct cpu_caps {
+  cpuid_eax_01        cpuid_01;
+  cpuid_eax_06        cpuid_06;
+  cpuid_eax_0d_ecx_00 cpuid_0d;
+  cpuid_eax_80000008  cpuid_80000008;
+
+  // native core type of this logical processor (see core_type_*)
+  uint8_t core_type;
+
+  // IA32_FEATURE_CONTROL (only valid if the RDMSR didn't raise an exception)
+  bool feature_control_valid;
+  ia32_feature_control_register feature_control;
+
+  // IA32_VMX_CR0_FIXED0/1 and IA32_VMX_CR4_FIXED0/1 (only valid if
+  // every RDMSR succeeded)
+  bool vmx_fixed_valid;
+  uint64_t vmx_cr0_fixed0;
+  uint64_t vmx_cr0_fixed1;
+  uint64_t vmx_cr4_fixed0;
+  uint64_t vmx_cr4_fixed1;
+};
+
+// Query the capabilities of every logical processor.
+bool create_cpu_caps();
+
+// Free the memory that was allocated by create_cpu_caps().
+void free_cpu_caps();
+
+// Query the capabilities of the current logical processor again, e.g. to
+// notice a hypervisor that was loaded after create_cpu_caps().
+void refresh_cpu_caps();
+
+// Get the capabilities of the current logical processor.
+cpu_caps const& current_cpu_caps();
+
+// Get the capabilities of the logical processor with the specified index.
+cpu_caps const& processor_cpu_caps(uint32_t index);
+
+// Get a short, printable name for the specified core type.
+char const* core_type_name(uint8_t core_type);
@@ -0,0 +1,66 @@
+#include "config.h"
+
+// Read a REG_DWORD from the specified key. The value is left
+// untouched if it doesn't exist or if it isn't a REG_DWORD.
+static void read_dword(HANDLE const key, PCWSTR const name, ULONG& value) {
+  UNICODE_STRING value_name;
+  RtlInitUnicodeString(&value_name, name);
+
+  UCHAR buffer[sizeof(KEY_VALUE_PARTIAL_INFORMATION) + sizeof(ULONG)] = {};
+  auto const info = reinterpret_cast<PKEY_VALUE_PARTIAL_INFORMATION>(buffer);
+
+  ULONG size = 0;
+  auto const status = ZwQueryValueKey(key, &value_name,
+    KeyValuePartialInformation, info, sizeof(buffer), &size);
+
+  if (!NT_SUCCESS(status))
+    return;
+
+  if (info->Type != REG_DWORD || info->DataLength != sizeof(ULONG))
+    return;
+
+  value = *reinterpret_cast<ULONG*>(info->Data);
+}
+
+// Read the configuration from the driver's Parameters registry key.
+void load_config(PUNICODE_STRING const registry_path) {
+  OBJECT_ATTRIBUTES attributes;
+  InitializeObjectAttributes(&attributes, registry_path,
+    OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, nullptr, nullptr);
+
+  HANDLE service_key = nullptr;
+  if (!NT_SUCCESS(ZwOpenKey(&service_key, KEY_READ, &attributes)))
+    return;
+
+  UNICODE_STRING parameters_name = RTL_CONSTANT_STRING(L"Parameters");
+  InitializeObjectAttributes(&attributes, &parameters_name,
+    OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, service_key, nullptr);
+
+  HANDLE key = nullptr;
+  if (NT_SUCCESS(ZwOpenKey(&key, KEY_READ, &attributes))) {
+    read_dword(key, L"Asynchronous", config.asynchronous);
+    read_dword(key, L"IrqBudgetUs", config.irq_budget_us);
+    read_dword(key, L"SampleArenaKb", config.sample_arena_kb);
+    read_dword(key, L"SeriesSamples", config.series_samples);
+    read_dword(key, L"CompressSamples", config.compress_samples);
+    read_dword(key, L"TimingIterations", config.timing_iterations);
+    read_dword(key, L"MonitorIntervalMs", config.monitor_interval_ms);
+    read_dword(key, L"MonitorBudgetPpm", config.monitor_budget_ppm);
+    read_dword(key, L"RecordTraceKb", config.record_trace_kb);
+    read_dword(key, L"HypercallScan", config.hypercall_scan);
+    read_dword(key, L"HypercallFirst", config.hypercall_first);
+    read_dword(key, L"HypercallCount", config.hypercall_count);
+    read_dword(key, L"HypercallRegisters", config.hypercall_registers);
+    read_dword(key, L"HypercallEncodings", config.hypercall_encodings);
+    read_dword(key, L"ClockWindowMs", config.clock_window_ms);
+    read_dword(key, L"ClockTolerancePpm", config.clock_tolerance_ppm);
+    read_dword(key, L"ScheduleChecks", config.schedule_checks);
+    read_dword(key, L"ProcessorSweep", config.processor_sweep);
+    read_dword(key, L"SweepPerNode", config.sweep_per_node);
+    read_dword(key, L"QuickBudgetUs", config.quick_budget_us);
+    read_dword(key, L"Fingerprint", config.fingerprint);
+    ZwClose(key);
+  }
+
+  ZwClose(service_key);
+}
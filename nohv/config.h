@@ -0,0 +1,101 @@
+#pragma once
+
+#include <ntddk.h>
+
+// Runtime configuration. Every value can be overridden through a
+// REG_DWORD of the same name under the driver's Parameters key.
+struct nohv_config {
+  // Asynchronous: run the detections on a system thread and return from
+  // DriverEntry right away. NohvSuiteComplete is signaled once they're done.
+  ULONG asynchronous = 1;
+
+  // IrqBudgetUs: maximum amount of time (in microseconds) that a detection
+  // should keep interrupts disabled before briefly re-enabling them, or 0
+  // to never re-enable interrupts in the middle of a detection.
+  ULONG irq_budget_us = 100;
+
+  // SampleArenaKb: size of the preallocated sample storage of every
+  // logical processor (in kilobytes). Multiples of 2048 are backed by
+  // large pages when possible.
+  ULONG sample_arena_kb = 256;
+
+  // SeriesSamples: maximum number of raw samples that are kept for every
+  // series of a detection.
+  ULONG series_samples = 4096;
+
+  // CompressSamples: print samples in their encoded form (base64 after a
+  // "[#z]" marker), which is a fraction of the size of the decimal form.
+  ULONG compress_samples = 0;
+
+  // TimingIterations: number of times that the timing detections measure
+  // their instruction (they keep the lowest measurement).
+  ULONG timing_iterations = 10;
+
+  // MonitorIntervalMs: once the detections are done, keep running the
+  // cheapest ones on a different logical processor every interval (in
+  // milliseconds) until the driver is unloaded, or 0 to not monitor.
+  ULONG monitor_interval_ms = 0;
+
+  // MonitorBudgetPpm: maximum fraction of a single logical processor (in
+  // parts per million) that monitoring is allowed to use.
+  ULONG monitor_budget_ppm = 500;
+
+  // RecordTraceKb: maximum size of the trace (in kilobytes) that a
+  // recording build (see record.h) keeps for all logical processors.
+  ULONG record_trace_kb = 16384;
+
+  // HypercallScan: scan the hypercall interface after running the
+  // detections (see hypercall.cpp). This is disabled by default, since
+  // a real hypervisor might act on some of these hypercalls.
+  ULONG hypercall_scan = 0;
+
+  // HypercallFirst/HypercallCount: range of values that is placed
+  // in each of the argument registers.
+  ULONG hypercall_first = 0;
+  ULONG hypercall_count = 0x100;
+
+  // HypercallRegisters: argument registers to scan
+  // (RAX=0x1, RCX=0x2, RDX=0x4, R8=0x8, R9=0x10).
+  ULONG hypercall_registers = 0x1F;
+
+  // HypercallEncodings: instructions to scan with (VMCALL=0x1, VMMCALL=0x2).
+  ULONG hypercall_encodings = 0x3;
+
+  // ClockWindowMs: length of the window (in milliseconds) that
+  // timing_detected_8 measures the TSC against the ACPI PM timer
+  // for, or 0 to skip that detection.
+  ULONG clock_window_ms = 400;
+
+  // ClockTolerancePpm: maximum difference (in parts per million) between
+  // the TSC rate in idle and exit-heavy windows.
+  ULONG clock_tolerance_ppm = 10'000;
+
+  // ScheduleChecks: order the detections by their cost and by what they
+  // change (see schedule.h), or 0 to run them in the order of detections.h.
+  ULONG schedule_checks = 1;
+
+  // ProcessorSweep: once the detections are done, run the ones that only
+  // look at their own logical processor on every logical processor in
+  // parallel (see sweep.h).
+  ULONG processor_sweep = 1;
+
+  // SweepPerNode: number of logical processors per NUMA node that the
+  // sweep runs on, or 0 for all of them.
+  ULONG sweep_per_node = 0;
+
+  // QuickBudgetUs: only run the detections that cover the most exit
+  // reasons and bug classes within this budget (in microseconds, see
+  // schedule_select()) and print a verdict, or 0 to run every detection.
+  ULONG quick_budget_us = 0;
+
+  // Fingerprint: once the detections are done, print the features of this
+  // host and the hypervisor family that they match (see fingerprint.h).
+  // Off until signatures.h ships trained signatures, since only the known
+  // bugs would match. Turn it on to collect "[#f]" lines to train with.
+  ULONG fingerprint = 0;
+};
+
+inline nohv_config config;
+
+// Read the configuration from the driver's Parameters registry key.
+void load_config(PUNICODE_STRING registry_path);
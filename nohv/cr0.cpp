@@ -1,10 +1,13 @@
 #include <ia32.hpp>
 #include <intrin.h>
 
+#include "caps.h"
+#include "irq.h"
+
 // This detection checks to see if the hypervisor properly handles
 // the guest modifying CR0.NE, which is usually reserved during VMX-operation.
-bool cr0_detected_1() {
-  _disable();
+bool cr0_detected_1(cpu_caps const&) {
+  irq_disable();
 
   cr0 curr_cr0;
   curr_cr0.flags = __readcr0();
@@ -20,7 +23,7 @@ bool cr0_detected_1() {
       // restore CR0
       __writecr0(curr_cr0.flags);
 
-      _enable();
+      irq_enable();
       return true;
     }
 
@@ -28,11 +31,11 @@ bool cr0_detected_1() {
     __writecr0(curr_cr0.flags);
   }
   __except (1) {
-    _enable();
+    irq_enable();
     return true;
   }
 
-  _enable();
+  irq_enable();
   return false;
 }
 
@@ -40,13 +43,17 @@ bool cr0_detected_1() {
 // that should trigger an exception.
 // 
 // Vol3[2.5(Control Registers)]
-bool cr0_detected_2() {
-  _disable();
+bool cr0_detected_2(cpu_caps const&) {
+  irq_disable();
 
   cr0 curr_cr0;
   curr_cr0.flags = __readcr0();
 
   for (int i = 32; i < 64; ++i) {
+    // CR0 might've been changed while interrupts were enabled
+    if (irq_yield())
+      curr_cr0.flags = __readcr0();
+
     __try {
       auto test_cr0 = curr_cr0;
 
@@ -62,7 +69,7 @@ bool cr0_detected_2() {
       // restore CR0 after the hypervisor mucked it
       __writecr0(curr_cr0.flags);
 
-      _enable();
+      irq_enable();
       return true;
     } __except (1) {
       // maybe the write went through even though an exception was raised?
@@ -70,20 +77,20 @@ bool cr0_detected_2() {
         // restore CR0 after the hypervisor mucked it
         __writecr0(curr_cr0.flags);
 
-        _enable();
+        irq_enable();
         return true;
       }
     }
   }
 
-  _enable();
+  irq_enable();
   return false;
 }
 
 // Some hypervisisors improperly handle reserved bits in cr0
 // Attempting to set any reserved bits in CR0[31:0] is ignored.
-bool cr0_detected_3() {
-  _disable();
+bool cr0_detected_3(cpu_caps const&) {
+  irq_disable();
   
   cr0 curr_cr0;
   curr_cr0.flags = __readcr0();
@@ -107,7 +114,7 @@ bool cr0_detected_3() {
       // restore correct cr0
       __writecr0(curr_cr0.flags);
       
-      _enable();
+      irq_enable();
       return true;
     }
     
@@ -116,10 +123,10 @@ bool cr0_detected_3() {
     // restore correct cr0
     __writecr0(curr_cr0.flags);
             
-    _enable();
+    irq_enable();
     return true;
   }
 
-  _enable();
+  irq_enable();
   return false;
 }
@@ -1,21 +1,46 @@
 #include <ia32.hpp>
 #include <intrin.h>
+#include <ntddk.h>
+
+#include "caps.h"
+#include "config.h"
+#include "cycles.h"
+#include "irq.h"
+#include "measure.h"
+#include "samples.h"
+
+// Number of pages that cr3_detected_4 touches after every CR3 write, which
+// is enough to need a TLB refill without taking long.
+inline constexpr ULONG cr3_working_set_pages = 64;
+
+// Upper bound on the fastest MOV to CR3 (flush included), see cycles.h.
+// CR3-load exiting makes every kind of write cost a whole vm-exit round
+// trip. These aren't measured: they're the original 1'000 tick limit of
+// this detection, taken as core cycles, with twice that without
+// APERF/MPERF for a core that runs at half of its nominal frequency. A
+// native write takes a few hundred cycles, so there's plenty of room
+// until real bare-metal logs narrow them down (see timing.cpp).
+inline constexpr core_type_limits cr3_write_limits = {
+  { 1'000, 2'000 },
+  { 1'000, 2'000 }
+};
 
 // This function tries to detect hypervisors that don't properly check
 // reserved bits in CR3 (aka bits [63:MAXPHYSADDR]).
 // 
 // Vol3[26.3.1.1(Checks on Guest Control Registers, Debug Registers, and MSRs)]
-bool cr3_detected_1() {
-  _disable();
+bool cr3_detected_1(cpu_caps const& caps) {
+  irq_disable();
 
   cr3 curr_cr3;
   curr_cr3.flags = __readcr3();
 
-  cpuid_eax_80000008 cpuid_80000008;
-  __cpuid(reinterpret_cast<int*>(&cpuid_80000008), 0x80000008);
-
   // try to set every reserved bit (besides last one, theres a seperate test for that)
-  for (int i = cpuid_80000008.eax.number_of_linear_address_bits; i < 63; ++i) {
+  for (int i = caps.cpuid_80000008.eax.number_of_linear_address_bits; i < 63; ++i) {
+    // CR3 might've been changed while interrupts were enabled
+    if (irq_yield())
+      curr_cr3.flags = __readcr3();
+
     __try {
       auto test_cr3 = curr_cr3;
       test_cr3.flags |= (1ull << i);
@@ -25,7 +50,7 @@ bool cr3_detected_1() {
       __writecr3(curr_cr3.flags);
 
       // hypervisor should've raised an exception >:(
-      _enable();
+      irq_enable();
 
       return true;
     } __except (1) {
@@ -34,13 +59,13 @@ bool cr3_detected_1() {
         // restore old CR3 after hypervisor pooped on it
         __writecr3(curr_cr3.flags);
 
-        _enable();
+        irq_enable();
         return true;
       }
     }
   }
 
-  _enable();
+  irq_enable();
   return false;
 }
 
@@ -49,8 +74,8 @@ bool cr3_detected_1() {
 // 
 // Vol3[4.10.4.1(Operations that Invalidate TLBs and Paging-Structure Caches)]
 // Vol3[26.3.1.1(Checks on Guest Control Registers, Debug Registers, and MSRs)]
-bool cr3_detected_2() {
-  _disable();
+bool cr3_detected_2(cpu_caps const&) {
+  irq_disable();
 
   cr3 curr_cr3;
   curr_cr3.flags = __readcr3();
@@ -67,7 +92,7 @@ bool cr3_detected_2() {
     }
     __except (1) {
       // shouldn't raise an exception
-      _enable();
+      irq_enable();
       return true;
     }
   }
@@ -99,26 +124,26 @@ bool cr3_detected_2() {
       __writecr3(curr_cr3.flags);
 
       // shouldn't raise an exception
-      _enable();
+      irq_enable();
       return true;
     }
   }
 
-  _enable();
+  irq_enable();
   return false;
 }
 
 // This function tries to detect hypervisors that unconditionally ignore
 // bit 63 of CR3, even when CR4.PCIDE=0.
-bool cr3_detected_3() {
-  _disable();
+bool cr3_detected_3(cpu_caps const&) {
+  irq_disable();
 
   cr4 curr_cr4;
   curr_cr4.flags = __readcr4();
 
   // TODO: add support for when PCIDE is set
   if (curr_cr4.pcid_enable) {
-    _enable();
+    irq_enable();
     return false;
   }
 
@@ -143,7 +168,201 @@ bool cr3_detected_3() {
   // restore CR3
   __writecr3(curr_cr3.flags);
 
-  _enable();
+  irq_enable();
   return detected;
 }
 
+
+// Write CR3 and return how long that took.
+static uint64_t time_cr3_write(uint64_t const value) {
+  auto const start = fenced_rdtsc();
+
+  __writecr3(value);
+
+  auto const end = fenced_rdtsc();
+
+  return (end - start);
+}
+
+// Touch every page of the working set and return how long that took.
+static uint64_t time_working_set(uint8_t volatile* const pages) {
+  auto const start = fenced_rdtsc();
+
+  for (ULONG i = 0; i < cr3_working_set_pages; ++i)
+    pages[i * PAGE_SIZE] += 1;
+
+  auto const end = fenced_rdtsc();
+
+  return (end - start);
+}
+
+// Switch CR4.PCIDE to the specified value, and return the CR3 to write in
+// that mode. CR3[11:0] has to be zero while PCIDE is being set, and would
+// be misinterpreted after it's cleared, so it's cleared either way.
+static uint64_t switch_pcide(cr3 const curr_cr3, cr4 const curr_cr4, bool const pcide) {
+  if (curr_cr4.pcid_enable == pcide)
+    return curr_cr3.flags;
+
+  auto test_cr3 = curr_cr3;
+  test_cr3.flags &= ~0xFFFull;
+  __writecr3(test_cr3.flags);
+
+  auto test_cr4 = curr_cr4;
+  test_cr4.pcid_enable = pcide;
+  __writecr4(test_cr4.flags);
+
+  return test_cr3.flags;
+}
+
+// Undo switch_pcide().
+static void restore_pcide(cr3 const curr_cr3, cr4 const curr_cr4) {
+  __writecr3(curr_cr3.flags & ~0xFFFull);
+  __writecr4(curr_cr4.flags);
+  __writecr3(curr_cr3.flags);
+}
+
+// This detection measures the latency of MOV to CR3 with PCIDE=0, with
+// PCIDE=1, and with PCIDE=1 and the no-flush hint (bit 63) set, along with
+// how long it takes to touch a working set afterwards (the TLB refill).
+// Hypervisors that exit on CR3 writes make every write as slow as a
+// vm-exit, and ones that emulate them without honoring the no-flush hint
+// throw away translations that should've been kept.
+//
+// Vol3[4.10.4.1(Operations that Invalidate TLBs and Paging-Structure Caches)]
+bool cr3_detected_4(cpu_caps const& caps) {
+  auto const pages = static_cast<uint8_t*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, cr3_working_set_pages * PAGE_SIZE, 'teSW'));
+
+  if (!pages)
+    return false;
+
+  // CPUID.01H:ECX.PCID
+  auto const pcid_supported = (caps.cpuid_01.cpuid_feature_information_ecx.flags & (1 << 17)) != 0;
+
+  irq_disable();
+
+  cr3 curr_cr3;
+  curr_cr3.flags = __readcr3();
+
+  cr4 curr_cr4;
+  curr_cr4.flags = __readcr4();
+
+  uint64_t lowest_flush   = MAXULONG64;
+  uint64_t lowest_pcid    = MAXULONG64;
+  uint64_t lowest_noflush = MAXULONG64;
+
+  // working set latencies with a warm TLB, after a flushing write with
+  // PCIDE=1, and after a write with the no-flush hint
+  uint64_t lowest_warm    = MAXULONG64;
+  uint64_t lowest_flushed = MAXULONG64;
+  uint64_t lowest_kept    = MAXULONG64;
+
+  // the fastest write of any kind in every iteration
+  auto const writes = samples_allocate(config.timing_iterations);
+
+  bool detected = false;
+
+  auto clock = core_clock_begin(caps);
+
+  for (ULONG i = 0; i < config.timing_iterations && !detected; ++i) {
+    // CR3 and CR4 might've been changed while interrupts were enabled
+    if (irq_yield()) {
+      curr_cr3.flags = __readcr3();
+      curr_cr4.flags = __readcr4();
+    }
+
+    __try {
+      // PCIDE=0, which flushes every non-global translation
+      auto test_cr3 = switch_pcide(curr_cr3, curr_cr4, false);
+
+      time_working_set(pages);
+      auto const warm    = time_working_set(pages);
+      auto const flush   = time_cr3_write(test_cr3);
+      auto const flushed = time_working_set(pages);
+
+      restore_pcide(curr_cr3, curr_cr4);
+
+      if (warm < lowest_warm)
+        lowest_warm = warm;
+      if (flush < lowest_flush)
+        lowest_flush = flush;
+
+      record_sample("flush", flush);
+      record_sample("refill", (flushed > warm) ? (flushed - warm) : 0);
+
+      auto fastest = flush;
+
+      if (pcid_supported) {
+        // PCIDE=1, which only flushes the translations of this PCID
+        test_cr3 = switch_pcide(curr_cr3, curr_cr4, true);
+
+        time_working_set(pages);
+        auto const pcid        = time_cr3_write(test_cr3);
+        auto const pcid_refill = time_working_set(pages);
+
+        // PCIDE=1 with the no-flush hint, which doesn't flush anything
+        time_working_set(pages);
+        auto const noflush = time_cr3_write(test_cr3 | (1ull << 63));
+        auto const kept    = time_working_set(pages);
+
+        restore_pcide(curr_cr3, curr_cr4);
+
+        if (pcid < lowest_pcid)
+          lowest_pcid = pcid;
+        if (noflush < lowest_noflush)
+          lowest_noflush = noflush;
+        if (pcid_refill < lowest_flushed)
+          lowest_flushed = pcid_refill;
+        if (kept < lowest_kept)
+          lowest_kept = kept;
+
+        record_sample("pcid", pcid);
+        record_sample("noflush", noflush);
+
+        if (pcid < fastest)
+          fastest = pcid;
+        if (noflush < fastest)
+          fastest = noflush;
+      }
+
+      if (writes)
+        writes[i] = fastest;
+    }
+    __except (1) {
+      // cr3_detected_2 already checks which of these writes should fault
+      restore_pcide(curr_cr3, curr_cr4);
+      detected = true;
+    }
+  }
+
+  core_clock_end(clock);
+  irq_enable();
+
+  ExFreePoolWithTag(pages, 'teSW');
+
+  if (detected)
+    return true;
+
+  for (ULONG i = 0; writes && i < config.timing_iterations; ++i)
+    record_sample("cycles", to_core_cycles(clock, writes[i]));
+
+  auto lowest_write = lowest_flush;
+  if (pcid_supported && lowest_pcid < lowest_write)
+    lowest_write = lowest_pcid;
+  if (pcid_supported && lowest_noflush < lowest_write)
+    lowest_write = lowest_noflush;
+
+  // every kind of write caused a vm-exit (a single slow kind is more
+  // likely to be the microarchitecture than a hypervisor)
+  if (exceeds_limit(caps, clock, cr3_write_limits, lowest_write))
+    return true;
+
+  // the working set only depends on the TLB if a flush made it measurably
+  // slower (it doesn't if the pages are global), in which case the no-flush
+  // hint should've kept it as fast as with a warm TLB
+  if (pcid_supported && lowest_flushed > 2 * lowest_warm &&
+      lowest_kept > (lowest_warm + lowest_flushed) / 2)
+    return true;
+
+  return false;
+}
@@ -1,10 +1,13 @@
 #include <ia32.hpp>
 #include <intrin.h>
 
+#include "caps.h"
+#include "irq.h"
+
 // This detection checks to see if CR4.VMXE is set to 1.
 // 
 // Vol3[23.7(Enabling and Entering VMX Operation)]
-bool cr4_detected_1() {
+bool cr4_detected_1(cpu_caps const&) {
   cr4 curr_cr4;
   curr_cr4.flags = __readcr4();
   return curr_cr4.vmx_enable;
@@ -14,8 +17,8 @@ bool cr4_detected_1() {
 // 
 // Vol3[23.7(Enabling and Entering VMX Operation)]
 // Vol3[23.8(Restrictions on VMX Operation)]
-bool cr4_detected_2() {
-  _disable();
+bool cr4_detected_2(cpu_caps const&) {
+  irq_disable();
 
   cr4 curr_cr4;
   curr_cr4.flags = __readcr4();
@@ -30,7 +33,7 @@ bool cr4_detected_2() {
       // restore CR4
       __writecr4(curr_cr4.flags);
 
-      _enable();
+      irq_enable();
       return true;
     }
 
@@ -39,17 +42,17 @@ bool cr4_detected_2() {
 
     // not sure how this would happen but might as well throw it in :)
     if (__readcr4() != curr_cr4.flags) {
-      _enable();
+      irq_enable();
       return true;
     }
   }
   __except (1) {
     // an exception should not have been raised...
-    _enable();
+    irq_enable();
     return true;
   }
 
-  _enable();
+  irq_enable();
   return false;
 }
 
@@ -59,8 +62,8 @@ bool cr4_detected_2() {
 // 
 // Vol2[4.3(MOV - Move to/from Control Registers)]
 // Vol3[2.5(Control Registers)]
-bool cr4_detected_3() {
-  _disable();
+bool cr4_detected_3(cpu_caps const&) {
+  irq_disable();
 
   cr4 curr_cr4;
   curr_cr4.flags = __readcr4();
@@ -80,7 +83,7 @@ bool cr4_detected_3() {
     __writecr4(curr_cr4.flags);
 
     // an exception should have been raised
-    _enable();
+    irq_enable();
     return true;
   }
   __except (1) {}
@@ -100,7 +103,7 @@ bool cr4_detected_3() {
     __writecr4(curr_cr4.flags);
 
     // an exception should have been raised
-    _enable();
+    irq_enable();
     return true;
   }
   __except (1) {}
@@ -111,7 +114,7 @@ bool cr4_detected_3() {
   }
   __except (1) {}
 
-  _enable();
+  irq_enable();
   return false;
 }
 
@@ -119,13 +122,17 @@ bool cr4_detected_3() {
 // that should trigger an exception.
 // 
 // Vol3[2.5(Control Registers)]
-bool cr4_detected_4() {
-  _disable();
+bool cr4_detected_4(cpu_caps const&) {
+  irq_disable();
 
   cr4 curr_cr4;
   curr_cr4.flags = __readcr4();
 
   for (int i = 32; i < 64; ++i) {
+    // CR4 might've been changed while interrupts were enabled
+    if (irq_yield())
+      curr_cr4.flags = __readcr4();
+
     __try {
       auto test_cr4 = curr_cr4;
 
@@ -141,7 +148,7 @@ bool cr4_detected_4() {
       // restore CR4 after the hypervisor mucked it
       __writecr4(curr_cr4.flags);
 
-      _enable();
+      irq_enable();
       return true;
     } __except (1) {
       // maybe the write went through even though an exception was raised?
@@ -149,12 +156,12 @@ bool cr4_detected_4() {
         // restore CR4 after the hypervisor mucked it
         __writecr0(curr_cr4.flags);
 
-        _enable();
+        irq_enable();
         return true;
       }
     }
   }
 
-  _enable();
+  irq_enable();
   return false;
 }
@@ -0,0 +1,70 @@
+#include <ia32.hpp>
+#include <intrin.h>
+#include <ntddk.h>
+
+#include "cycles.h"
+
+// Start measuring the core clock.
+core_clock core_clock_begin(cpu_caps const& caps) {
+  core_clock clock = {};
+
+  // IA32_MPERF/IA32_APERF MSRs are not supported
+  if (!caps.cpuid_06.ecx.hardware_coordination_feedback_capability)
+    return clock;
+
+  __try {
+    clock.mperf = __readmsr(IA32_MPERF);
+    clock.aperf = __readmsr(IA32_APERF);
+    clock.valid = true;
+  }
+  __except (1) {
+    clock.valid = false;
+  }
+
+  return clock;
+}
+
+// Stop measuring the core clock.
+void core_clock_end(core_clock& clock) {
+  if (!clock.valid)
+    return;
+
+  __try {
+    clock.mperf = __readmsr(IA32_MPERF) - clock.mperf;
+    clock.aperf = __readmsr(IA32_APERF) - clock.aperf;
+  }
+  __except (1) {
+    clock.valid = false;
+  }
+
+  // the counters went backwards or are too large to scale with
+  if (!clock.mperf || (clock.mperf >> 40) || (clock.aperf >> 40))
+    clock.valid = false;
+}
+
+// Convert a TSC delta into core cycles.
+uint64_t to_core_cycles(core_clock const& clock, uint64_t const tsc) {
+  if (!clock.valid || (tsc >> 20))
+    return tsc;
+
+  return tsc * clock.aperf / clock.mperf;
+}
+
+// The limit for the core type of the current logical processor.
+cycle_limit const& core_type_limit(cpu_caps const& caps, core_type_limits const& limits) {
+  if (caps.core_type == core_type_atom)
+    return limits.atom;
+
+  return limits.core;
+}
+
+// Whether a delta takes longer than the limit for the current core type.
+bool exceeds_limit(cpu_caps const& caps, core_clock const& clock,
+    core_type_limits const& limits, uint64_t const tsc) {
+  auto const& limit = core_type_limit(caps, limits);
+
+  if (!clock.valid)
+    return tsc > limit.tsc;
+
+  return to_core_cycles(clock, tsc) > limit.cycles;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "caps.h"
+
+// The ratio between the actual core clock (APERF) and the reference clock
+// (MPERF, which ticks at the TSC rate) over a window of measurements. TSC
+// deltas scale with the current P-state while the cost of an instruction
+// in core cycles doesn't, so latency limits are applied to deltas that
+// are converted into core cycles.
+//
+// Vol3[14.2(P-State Hardware Coordination)]
+struct core_clock {
+  bool valid;
+  uint64_t mperf;
+  uint64_t aperf;
+};
+
+// Start measuring the core clock.
+core_clock core_clock_begin(cpu_caps const& caps);
+
+// Stop measuring the core clock. Afterwards, the clock holds the
+// number of MPERF and APERF ticks that passed since core_clock_begin().
+void core_clock_end(core_clock& clock);
+
+// Convert a TSC delta into core cycles. If APERF/MPERF aren't available,
+// the core is assumed to be running at its nominal frequency.
+uint64_t to_core_cycles(core_clock const& clock, uint64_t tsc);
+
+// How long something takes natively at most, in core cycles, and in TSC
+// ticks for when APERF/MPERF aren't available (and the core could be
+// running at its lowest P-state).
+struct cycle_limit {
+  uint64_t cycles;
+  uint64_t tsc;
+};
+
+// Native latencies differ a lot between the core types of a hybrid
+// processor, so every core type has its own limit. P-cores share theirs
+// with every core of a non-hybrid processor.
+struct core_type_limits {
+  cycle_limit core;
+  cycle_limit atom;
+};
+
+// The limit for the core type of the current logical processor.
+cycle_limit const& core_type_limit(cpu_caps const& caps, core_type_limits const& limits);
+
+// Whether a delta that ticks at the TSC rate (TSC, REF_TSC, or MPERF)
+// takes longer than the limit for the current core type.
+bool exceeds_limit(cpu_caps const& caps, core_clock const& clock,
+  core_type_limits const& limits, uint64_t tsc);
@@ -1,12 +1,19 @@
 #include <ia32.hpp>
 #include <intrin.h>
 
+#include "caps.h"
+#include "config.h"
+#include "cycles.h"
+#include "irq.h"
+#include "measure.h"
+#include "samples.h"
+
 // This detection checks to see if the hypervisor properly stores and
 // restores the guest DR7 register during a vm-exit.
 // 
 // Vol3[27.5.1(Loading Host Control Registers, Debug Registers, MSRs)]
-bool debug_detected_1() {
-  _disable();
+bool debug_detected_1(cpu_caps const&) {
+  irq_disable();
 
   dr7 curr_dr7;
   curr_dr7.flags = __readdr(7);
@@ -22,18 +29,277 @@ bool debug_detected_1() {
     // restore DR7, although hypervisor will fuck with it anyways
     __writedr(7, curr_dr7.flags);
 
-    _enable();
+    irq_enable();
     return true;
   }
 
   // restore DR7, although hypervisor will fuck with it anyways
   __writedr(7, curr_dr7.flags);
 
-  _enable();
+  irq_enable();
   return false;
 }
 
-bool debug_detected_2() {
-  return false;
+// Instructions that (usually) cause a vm-exit, which debug_detected_2 and
+// debug_detected_3 execute between writing the debug state and reading it.
+static void exit_cpuid() {
+  int regs[4];
+  __cpuid(regs, 0);
+}
+
+static void exit_cpuid_hv() {
+  int regs[4];
+  __cpuid(regs, 0x4000'0000);
+}
+
+static void exit_xsetbv() {
+  _xsetbv(0, _xgetbv(0));
+}
+
+static void exit_rdmsr() {
+  __readmsr(IA32_FEATURE_CONTROL);
+}
+
+struct debug_exit {
+  char const* name;
+  void (*exit)();
+};
+
+// Exits that raise an exception (e.g. XSETBV with CR4.OSXSAVE=0) are
+// skipped, since the debug state has nothing to do with that.
+inline constexpr debug_exit debug_exits[] = {
+  { "cpuid(0x0)",        exit_cpuid    },
+  { "cpuid(0x40000000)", exit_cpuid_hv },
+  { "xsetbv(0)",         exit_xsetbv   },
+  { "rdmsr(0x3A)",       exit_rdmsr    },
+};
+
+// Distinct linear addresses for DR0-DR3. They're in user space, so the
+// breakpoints that DR7 enables for them never hit while we're running.
+static uint64_t breakpoint_address(uint32_t const index) {
+  return 0x0000'1234'5678'0000ull + (index + 1) * 0x1000;
+}
+
+// Debug registers that debug_detected_2 checks (DR4 and DR5 are aliases).
+inline constexpr uint32_t debug_registers[] = { 0, 1, 2, 3, 6, 7 };
+
+// L0-L3 (instruction breakpoints), and bit 10, which is always set.
+inline constexpr uint64_t test_dr7 = 0x455;
+
+// B0 and B2, and every bit that is set in DR6's initial value.
+inline constexpr uint64_t test_dr6 = 0xFFFF'0FF5;
+
+// This detection checks that the hypervisor preserves DR0-DR3, DR6, and
+// DR7 across every vm-exit in debug_exits. DR6 is compared against what
+// it read as right after it was written, since some of its bits are
+// reserved (and fixed).
+// 
+// Vol3[17.2(Debug Registers)]
+// Vol3[27.5.1(Loading Host Control Registers, Debug Registers, MSRs)]
+bool debug_detected_2(cpu_caps const&) {
+  irq_disable();
+
+  uint64_t curr_dr[8];
+  for (auto const i : debug_registers)
+    curr_dr[i] = __readdr(i);
+
+  bool detected = false;
+
+  for (auto const& test : debug_exits) {
+    // DR7 is disabled while the breakpoint addresses change
+    __writedr(7, 0x400);
+
+    __writedr(6, test_dr6);
+    auto const expected_dr6 = __readdr(6);
+
+    for (uint32_t i = 0; i < 4; ++i)
+      __writedr(i, breakpoint_address(i));
+
+    __writedr(7, test_dr7);
+
+    __try {
+      test.exit();
+    }
+    __except (1) {
+      continue;
+    }
+
+    uint64_t dr[8];
+    for (auto const i : debug_registers)
+      dr[i] = __readdr(i);
+
+    for (uint32_t i = 0; i < 4; ++i) {
+      if (dr[i] != breakpoint_address(i)) {
+        DbgPrint("    %s changed DR%u to 0x%llX.\n", test.name, i, dr[i]);
+        detected = true;
+      }
+    }
+
+    if (dr[6] != expected_dr6) {
+      DbgPrint("    %s changed DR6 to 0x%llX.\n", test.name, dr[6]);
+      detected = true;
+    }
+
+    if (dr[7] != test_dr7) {
+      DbgPrint("    %s changed DR7 to 0x%llX.\n", test.name, dr[7]);
+      detected = true;
+    }
+  }
+
+  // restore the old debug state, DR7 last
+  __writedr(7, 0x400);
+  for (auto const i : debug_registers)
+    __writedr(i, curr_dr[i]);
+
+  irq_enable();
+  return detected;
+}
+
+// IA32_DEBUGCTL.LBR and IA32_DEBUGCTL.BTF. BTF only changes anything
+// while RFLAGS.TF is set, and the recorded branches aren't read.
+inline constexpr uint64_t test_debugctl = 0x3;
+
+// This detection checks that the hypervisor preserves IA32_DEBUGCTL across
+// every vm-exit in debug_exits. It's loaded and saved by the "load debug
+// controls" and "save debug controls" VM-entry and VM-exit controls, which
+// a hypervisor that doesn't care about the guest's debuggers might clear.
+// Only the bits that stuck when they were written are checked.
+// 
+// Vol3[17.4.1(IA32_DEBUGCTL MSR)]
+// Vol3[27.3.1(Saving Control Registers, Debug Registers, and MSRs)]
+bool debug_detected_3(cpu_caps const&) {
+  irq_disable();
+
+  uint64_t curr_debugctl = 0;
+  uint64_t expected      = 0;
+
+  __try {
+    curr_debugctl = __readmsr(IA32_DEBUGCTL);
+    __writemsr(IA32_DEBUGCTL, curr_debugctl | test_debugctl);
+    expected = __readmsr(IA32_DEBUGCTL);
+  }
+  __except (1) {
+    // IA32_DEBUGCTL isn't supported (or these bits aren't)
+    irq_enable();
+    return false;
+  }
+
+  bool detected = false;
+
+  for (auto const& test : debug_exits) {
+    __try {
+      test.exit();
+    }
+    __except (1) {
+      continue;
+    }
+
+    auto const debugctl = __readmsr(IA32_DEBUGCTL);
+
+    if (debugctl != expected) {
+      DbgPrint("    %s changed IA32_DEBUGCTL from 0x%llX to 0x%llX.\n",
+        test.name, expected, debugctl);
+
+      __writemsr(IA32_DEBUGCTL, curr_debugctl | test_debugctl);
+      detected = true;
+    }
+  }
+
+  __writemsr(IA32_DEBUGCTL, curr_debugctl);
+
+  irq_enable();
+  return detected;
+}
+
+// Upper bound on a MOV to or from DR0/DR7 (see cycles.h). Neither one
+// exits unless the hypervisor intercepts debug register accesses, which
+// those that virtualize hardware breakpoints have to do. Not measured
+// either: the detection's original 500 tick bound, taken as core cycles,
+// and twice that in ticks like cr3_write_limits.
+inline constexpr core_type_limits mov_dr_limits = {
+  { 500, 1'000 },
+  { 500, 1'000 }
+};
+
+// Time a MOV from the specified debug register.
+static uint64_t time_readdr(uint32_t const dr, uint64_t& value) {
+  auto const start = fenced_rdtsc();
+
+  value = __readdr(dr);
+
+  auto const end = fenced_rdtsc();
+
+  return (end - start);
+}
+
+// Time a MOV to the specified debug register.
+static uint64_t time_writedr(uint32_t const dr, uint64_t const value) {
+  auto const start = fenced_rdtsc();
+
+  __writedr(dr, value);
+
+  auto const end = fenced_rdtsc();
+
+  return (end - start);
+}
+
+// This detection measures the latency of MOV from and to DR0 and DR7
+// (writing back the value that was read), and checks if they're slow
+// enough to cause vm-exits. Hypervisors that switch the debug registers
+// lazily enable MOV-DR exiting while the guest's are in use, so this is
+// also what every DR access costs a guest debugger.
+// 
+// Vol3[25.1.3(Instructions That Cause VM Exits Conditionally)]
+bool debug_detected_4(cpu_caps const& caps) {
+  irq_disable();
+
+  uint64_t lowest_read  = MAXULONG64;
+  uint64_t lowest_write = MAXULONG64;
+
+  // the fastest read and write of every iteration
+  auto const reads  = samples_allocate(config.timing_iterations);
+  auto const writes = samples_allocate(config.timing_iterations);
+
+  auto clock = core_clock_begin(caps);
+
+  for (ULONG i = 0; i < config.timing_iterations; ++i) {
+    irq_yield();
+
+    uint64_t dr0 = 0, dr7 = 0;
+
+    auto const read_dr0  = time_readdr(0, dr0);
+    auto const write_dr0 = time_writedr(0, dr0);
+    auto const read_dr7  = time_readdr(7, dr7);
+    auto const write_dr7 = time_writedr(7, dr7);
+
+    record_sample("read_dr0",  read_dr0);
+    record_sample("write_dr0", write_dr0);
+    record_sample("read_dr7",  read_dr7);
+    record_sample("write_dr7", write_dr7);
+
+    auto const read  = (read_dr0 < read_dr7) ? read_dr0 : read_dr7;
+    auto const write = (write_dr0 < write_dr7) ? write_dr0 : write_dr7;
+
+    if (reads)
+      reads[i] = read;
+    if (writes)
+      writes[i] = write;
+
+    if (read < lowest_read)
+      lowest_read = read;
+    if (write < lowest_write)
+      lowest_write = write;
+  }
+
+  core_clock_end(clock);
+  irq_enable();
+
+  for (ULONG i = 0; reads && writes && i < config.timing_iterations; ++i) {
+    record_sample("read_cycles",  to_core_cycles(clock, reads[i]));
+    record_sample("write_cycles", to_core_cycles(clock, writes[i]));
+  }
+
+  return exceeds_limit(caps, clock, mov_dr_limits, lowest_read) ||
+    exceeds_limit(caps, clock, mov_dr_limits, lowest_write);
 }
 
@@ -1,50 +1,62 @@
 #pragma once
 
+#include "caps.h"
+
 // cpuid.cpp
-bool cpuid_detected_1();
+bool cpuid_detected_1(cpu_caps const& caps);
 
 // msr.cpp
-bool msr_detected_1();
-bool msr_detected_2();
+bool msr_detected_1(cpu_caps const& caps);
+bool msr_detected_2(cpu_caps const& caps);
 
 // cr0.cpp
-bool cr0_detected_1();
-bool cr0_detected_2();
-bool cr0_detected_3();
+bool cr0_detected_1(cpu_caps const& caps);
+bool cr0_detected_2(cpu_caps const& caps);
+bool cr0_detected_3(cpu_caps const& caps);
 
 // cr3.cpp
-bool cr3_detected_1();
-bool cr3_detected_2();
-bool cr3_detected_3();
+bool cr3_detected_1(cpu_caps const& caps);
+bool cr3_detected_2(cpu_caps const& caps);
+bool cr3_detected_3(cpu_caps const& caps);
+bool cr3_detected_4(cpu_caps const& caps);
 
 // cr4.cpp
-bool cr4_detected_1();
-bool cr4_detected_2();
-bool cr4_detected_3();
-bool cr4_detected_4();
+bool cr4_detected_1(cpu_caps const& caps);
+bool cr4_detected_2(cpu_caps const& caps);
+bool cr4_detected_3(cpu_caps const& caps);
+bool cr4_detected_4(cpu_caps const& caps);
 
 // xsetbv.cpp
-bool xsetbv_detected_1();
-bool xsetbv_detected_2();
-bool xsetbv_detected_3();
-bool xsetbv_detected_4();
-bool xsetbv_detected_5();
+bool xsetbv_detected_1(cpu_caps const& caps);
+bool xsetbv_detected_2(cpu_caps const& caps);
+bool xsetbv_detected_3(cpu_caps const& caps);
+bool xsetbv_detected_4(cpu_caps const& caps);
+bool xsetbv_detected_5(cpu_caps const& caps);
+
+// xstate.cpp
+bool xstate_detected_1(cpu_caps const& caps);
 
 // timing.cpp
-bool timing_detected_1();
-bool timing_detected_2();
-bool timing_detected_3();
-bool timing_detected_4();
-bool timing_detected_5();
-bool timing_detected_6();
-bool timing_detected_7();
+bool timing_detected_1(cpu_caps const& caps);
+bool timing_detected_2(cpu_caps const& caps);
+bool timing_detected_3(cpu_caps const& caps);
+bool timing_detected_4(cpu_caps const& caps);
+bool timing_detected_5(cpu_caps const& caps);
+bool timing_detected_6(cpu_caps const& caps);
+bool timing_detected_7(cpu_caps const& caps);
+bool timing_detected_8(cpu_caps const& caps);
 
 // debug.cpp
-bool debug_detected_1();
-bool debug_detected_2();
+bool debug_detected_1(cpu_caps const& caps);
+bool debug_detected_2(cpu_caps const& caps);
+bool debug_detected_3(cpu_caps const& caps);
+bool debug_detected_4(cpu_caps const& caps);
 
 // vmx.cpp
-bool vmx_detected_1();
-bool vmx_detected_2();
-bool vmx_detected_3();
+bool vmx_detected_1(cpu_caps const& caps);
+bool vmx_detected_2(cpu_caps const& caps);
+bool vmx_detected_3(cpu_caps const& caps);
+
+// regs.cpp
+bool regs_detected_1(cpu_caps const& caps);
 
@@ -0,0 +1,213 @@
+#pragma once
+
+// Compact encoding of sample series. This is shared with the tools in
+// tools/ so that the driver and the decoder always agree on the format.
+//
+// Every sample is stored as the difference from the previous sample (the
+// first one from 0), zigzag-encoded so that small negative differences
+// stay small, as an LEB128 varint. Consecutive timing measurements are
+// close to each other, so most samples take one or two bytes instead of
+// eight.
+//
+// In the debug log, an encoded series is printed as base64 after a
+// "[#z]" marker instead of "[#]":
+//
+//   [#z] <detection>[@<tag>] <series>: <base64>
+//
+// Every line is encoded on its own (starting from 0), so lines can be
+// decoded independently of each other.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Size of the largest possible encoded sample.
+inline constexpr size_t max_encoded_sample_size = 10;
+
+inline uint64_t zigzag_encode(int64_t const value) {
+  return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t zigzag_decode(uint64_t const value) {
+  return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+struct sample_encoder {
+  uint8_t* buffer;
+  size_t capacity;
+  size_t size;
+
+  // number of samples that were encoded
+  size_t count;
+
+  uint64_t previous;
+};
+
+inline void encoder_initialize(sample_encoder& encoder, uint8_t* const buffer, size_t const capacity) {
+  encoder.buffer   = buffer;
+  encoder.capacity = capacity;
+  encoder.size     = 0;
+  encoder.count    = 0;
+  encoder.previous = 0;
+}
+
+// Write an LEB128 varint, which takes up to max_encoded_sample_size
+// bytes. Returns the number of bytes that were written.
+inline size_t encode_varint(uint8_t* const output, uint64_t value) {
+  size_t length = 0;
+
+  do {
+    output[length] = static_cast<uint8_t>(value & 0x7F);
+    value >>= 7;
+
+    if (value)
+      output[length] |= 0x80;
+
+    ++length;
+  } while (value);
+
+  return length;
+}
+
+// Read an LEB128 varint and advance past it. Returns false at the end of
+// the data, or if the varint is truncated.
+inline bool decode_varint(uint8_t const*& position, uint8_t const* const end, uint64_t& value) {
+  if (position >= end)
+    return false;
+
+  value = *position & 0x7F;
+
+  // fast path for single-byte varints, which is most of them
+  if (!(*position++ & 0x80))
+    return true;
+
+  for (unsigned int shift = 7; ; shift += 7) {
+    if (position >= end || shift >= 64)
+      return false;
+
+    auto const byte = *position++;
+    value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+
+    if (!(byte & 0x80))
+      return true;
+  }
+}
+
+// Append a sample. Returns false (and leaves the encoder untouched) if
+// there's no room left for it.
+inline bool encode_sample(sample_encoder& encoder, uint64_t const value) {
+  uint8_t bytes[max_encoded_sample_size];
+  auto const length = encode_varint(bytes, zigzag_encode(static_cast<int64_t>(value - encoder.previous)));
+
+  if (encoder.capacity - encoder.size < length)
+    return false;
+
+  for (size_t i = 0; i < length; ++i)
+    encoder.buffer[encoder.size + i] = bytes[i];
+
+  encoder.size    += length;
+  encoder.count   += 1;
+  encoder.previous = value;
+  return true;
+}
+
+struct sample_decoder {
+  uint8_t const* position;
+  uint8_t const* end;
+  uint64_t previous;
+};
+
+inline void decoder_initialize(sample_decoder& decoder, uint8_t const* const data, size_t const size) {
+  decoder.position = data;
+  decoder.end      = data + size;
+  decoder.previous = 0;
+}
+
+// Read the next sample. Returns false at the end of the data, or if the
+// last varint is truncated.
+inline bool decode_sample(sample_decoder& decoder, uint64_t& value) {
+  uint64_t encoded = 0;
+  if (!decode_varint(decoder.position, decoder.end, encoded))
+    return false;
+
+  value = decoder.previous + static_cast<uint64_t>(zigzag_decode(encoded));
+  decoder.previous = value;
+  return true;
+}
+
+inline constexpr char base64_alphabet[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Number of characters that base64_encode() writes for the specified
+// number of bytes (not including the null-terminator).
+inline constexpr size_t base64_length(size_t const size) {
+  return (size + 2) / 3 * 4;
+}
+
+// Write the null-terminated base64 encoding of the specified data.
+// The output has to hold at least base64_length(size) + 1 characters.
+inline void base64_encode(uint8_t const* const data, size_t const size, char* output) {
+  for (size_t i = 0; i < size; i += 3) {
+    uint32_t block = static_cast<uint32_t>(data[i]) << 16;
+
+    if (i + 1 < size)
+      block |= static_cast<uint32_t>(data[i + 1]) << 8;
+    if (i + 2 < size)
+      block |= data[i + 2];
+
+    *output++ = base64_alphabet[(block >> 18) & 0x3F];
+    *output++ = base64_alphabet[(block >> 12) & 0x3F];
+    *output++ = (i + 1 < size) ? base64_alphabet[(block >> 6) & 0x3F] : '=';
+    *output++ = (i + 2 < size) ? base64_alphabet[block & 0x3F] : '=';
+  }
+
+  *output = '\0';
+}
+
+// Decode base64 into the specified buffer, which has to hold at least
+// (length / 4 * 3) bytes. Returns the number of bytes, or -1 if the
+// input isn't valid base64.
+inline ptrdiff_t base64_decode(char const* const text, size_t const length, uint8_t* const output) {
+  if (length % 4)
+    return -1;
+
+  auto const lookup = [](char const c) -> int {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+  };
+
+  size_t size = 0;
+
+  for (size_t i = 0; i < length; i += 4) {
+    uint32_t block = 0;
+    size_t padding = 0;
+
+    for (size_t j = 0; j < 4; ++j) {
+      auto const c = text[i + j];
+
+      // padding is only allowed at the very end
+      if (c == '=' && i + 4 == length && j >= 2) {
+        ++padding;
+        block <<= 6;
+        continue;
+      }
+
+      auto const bits = lookup(c);
+      if (bits < 0 || padding)
+        return -1;
+
+      block = (block << 6) | static_cast<uint32_t>(bits);
+    }
+
+    output[size++] = static_cast<uint8_t>(block >> 16);
+    if (padding < 2)
+      output[size++] = static_cast<uint8_t>(block >> 8);
+    if (padding < 1)
+      output[size++] = static_cast<uint8_t>(block);
+  }
+
+  return static_cast<ptrdiff_t>(size);
+}
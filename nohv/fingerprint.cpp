@@ -0,0 +1,208 @@
+#include "fingerprint.h"
+#include "host-features.h"
+#include "irq.h"
+#include "measure.h"
+#include "schedule.h"
+#include "signatures.h"
+
+#include <ia32.hpp>
+#include <intrin.h>
+#include <ntddk.h>
+#include <ntstrsafe.h>
+
+extern "C" void vmx_vmcall(uint64_t rcx, uint64_t rdx, uint64_t r8, uint64_t r9);
+
+// Number of CPUID latency samples that the percentiles are taken from.
+inline constexpr ULONG fingerprint_latency_samples = 64;
+
+// Number of features per "[#f] features" line.
+inline constexpr size_t features_per_print = 16;
+
+static probe_outcome classify_exception(unsigned long const ecode) {
+  switch (ecode) {
+  case STATUS_ILLEGAL_INSTRUCTION:
+    return probe_ud;
+
+  // a #GP is reported as either, depending on the instruction
+  case STATUS_PRIVILEGED_INSTRUCTION:
+  case STATUS_ACCESS_VIOLATION:
+    return probe_gp;
+
+  default:
+    return probe_other;
+  }
+}
+
+// Execute a probe and return the exception that it raised.
+static probe_outcome run_probe(size_t const index) {
+  cr4 curr_cr4;
+  curr_cr4.flags = __readcr4();
+
+  // VMXON only exits unconditionally while CR4.VMXE is clear, and
+  // enabling VMX ourselves is what the vmx detections are for
+  if (index == 0 && curr_cr4.vmx_enable)
+    return probe_skipped;
+
+  auto outcome = probe_returned;
+  unsigned long ecode = 0;
+
+  irq_disable();
+
+  __try {
+    switch (index) {
+    case 0: __vmx_on(nullptr); break;
+    case 1: vmx_vmcall(0, 0, 0, 0); break;
+    case 2: __readmsr(0x4000'0000); break;
+    case 3: __readmsr(0x4B56'4D00); break;
+    case 4: _xsetbv(69, _xgetbv(0)); break;
+    }
+  }
+  __except (ecode = GetExceptionCode(), 1) {
+    outcome = classify_exception(ecode);
+  }
+
+  irq_enable();
+
+  return outcome;
+}
+
+// Features of the hypervisor leaves (CPUID.40000000H).
+static void extract_cpuid_features(int32_t* const features) {
+  int regs[4] = {};
+
+  __cpuid(regs, 1);
+
+  // CPUID.01H:ECX.hypervisor
+  auto const present = (static_cast<uint32_t>(regs[2]) >> 31) & 1;
+  features[feature_hypervisor_offset] = present * feature_one;
+
+  __cpuid(regs, 0x4000'0000);
+
+  auto const max_leaf = static_cast<uint32_t>(regs[0]);
+
+  // the leaves are reserved without a hypervisor, and return whatever
+  // the highest basic leaf returns
+  if (!present || max_leaf < 0x4000'0000 || max_leaf > 0x4000'FFFF)
+    return;
+
+  features[feature_leaves_offset] = feature_log2(max_leaf - 0x4000'0000 + 1);
+
+  char vendor[12];
+  memcpy(vendor + 0, &regs[1], 4);
+  memcpy(vendor + 4, &regs[2], 4);
+  memcpy(vendor + 8, &regs[3], 4);
+
+  auto index = fingerprint_vendor_count - 1;
+  for (size_t i = 0; i + 1 < fingerprint_vendor_count; ++i) {
+    if (!memcmp(vendor, fingerprint_vendors[i], sizeof(vendor)))
+      index = i;
+  }
+
+  features[feature_vendor_offset + index] = feature_one;
+}
+
+// Percentiles of the CPUID latency.
+static void extract_latency_features(int32_t* const features) {
+  uint64_t samples[fingerprint_latency_samples];
+
+  irq_disable();
+
+  for (ULONG i = 0; i < fingerprint_latency_samples; ++i) {
+    int regs[4] = {};
+
+    auto const start = fenced_rdtsc();
+
+    __cpuid(regs, 0);
+
+    samples[i] = fenced_rdtsc() - start;
+    irq_yield();
+  }
+
+  irq_enable();
+
+  for (ULONG i = 1; i < fingerprint_latency_samples; ++i) {
+    auto const sample = samples[i];
+
+    auto j = i;
+    for (; j > 0 && samples[j - 1] > sample; --j)
+      samples[j] = samples[j - 1];
+
+    samples[j] = sample;
+  }
+
+  for (size_t i = 0; i < fingerprint_percentile_count; ++i) {
+    auto const index = fingerprint_percentiles[i] * fingerprint_latency_samples / 100;
+    features[feature_latency_offset + i] = feature_log2(samples[index]);
+  }
+}
+
+// Results of the detections on the logical processor that the suite ran
+// on (and on the first one of every core type).
+static void extract_check_features(int32_t* const features) {
+  for (size_t i = 0; i < fingerprint_check_count; ++i) {
+    features[feature_check_offset + i] = feature_one / 2;
+
+    for (ULONG j = 0; j < schedule_count(); ++j) {
+      auto const& detection = schedule_entry(j);
+
+      if (detection.ran && !strcmp(detection.name, fingerprint_checks[i]))
+        features[feature_check_offset + i] = detection.detected ? feature_one : 0;
+    }
+  }
+}
+
+static void print_features(int32_t const* const features) {
+  for (size_t i = 0; i < fingerprint_feature_count; i += features_per_print) {
+    char line[features_per_print * 12 + 1] = {};
+    char* end = line;
+    size_t remaining = sizeof(line);
+
+    for (size_t j = i; j < fingerprint_feature_count && j < i + features_per_print; ++j)
+      RtlStringCbPrintfExA(end, remaining, &end, &remaining, 0, " %ld", static_cast<long>(features[j]));
+
+    DbgPrint("[#f] features:%s\n", line);
+  }
+
+  DbgPrint("[#f] layout: %lu\n", static_cast<ULONG>(fingerprint_layout_version));
+}
+
+void fingerprint_host() {
+  int32_t features[fingerprint_feature_count] = {};
+
+  extract_check_features(features);
+
+  for (size_t i = 0; i < fingerprint_probe_count; ++i) {
+    auto const outcome = run_probe(i);
+
+    if (outcome != probe_skipped)
+      features[feature_probe_offset + i * probe_outcome_count + outcome] = feature_one;
+  }
+
+  extract_cpuid_features(features);
+  extract_latency_features(features);
+
+  print_features(features);
+
+  for (size_t i = 0; i < fingerprint_known_bug_count; ++i) {
+    auto const& bug = fingerprint_known_bugs[i];
+
+    if (fingerprint_has_known_bug(features, bug))
+      DbgPrint("Fingerprint: %s() fails on %s.\n", bug.check, bug.families);
+  }
+
+  if (fingerprint_signature_count && fingerprint_signature_layout != fingerprint_layout_version) {
+    DbgPrint("Fingerprint: the signatures are for feature layout %lu, retrain them.\n",
+      static_cast<ULONG>(fingerprint_signature_layout));
+    return;
+  }
+
+  auto const match = fingerprint_classify(features, fingerprint_signatures,
+    fingerprint_signature_count, fingerprint_weights);
+
+  if (!match.family)
+    DbgPrint("Fingerprint: no signatures (see tools/fingerprint).\n");
+  else if (!match.known)
+    DbgPrint("Fingerprint: unknown (closest to %s).\n", match.family);
+  else
+    DbgPrint("Fingerprint: %s (%lu%% confidence).\n", match.family, match.confidence);
+}
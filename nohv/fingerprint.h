@@ -0,0 +1,8 @@
+#pragma once
+
+// Extract the features of this host (see host-features.h) from the
+// results of the detections, a few probes, the hypervisor leaves and the
+// CPUID latency, print them as "[#f]" lines, and print the known bugs in
+// signatures.h that the host ran into and the family that it's closest
+// to, along with a confidence.
+void fingerprint_host();
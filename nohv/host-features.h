@@ -0,0 +1,207 @@
+#pragma once
+
+// Features that describe how a host behaves, which the driver extracts
+// once the detections are done (see fingerprint.h) and tools/fingerprint
+// trains the signatures in signatures.h from. This is shared with the
+// tools so that the driver and the trainer always agree on the layout.
+//
+// Every feature is a fixed-point number with 8 fractional bits, so that
+// the driver never touches floating-point state. In order:
+//
+//   - the result of every detection in fingerprint_checks: 0 if it
+//     passed, 1 if it failed, or 0.5 if it didn't run
+//   - the exception that every probe in fingerprint_probes raised, one-hot
+//     (all zero if the probe was skipped)
+//   - the vendor in CPUID.40000000H, one-hot
+//   - CPUID.01H:ECX[31], and log2 of the number of hypervisor leaves
+//   - log2 of the 10th, 50th and 90th percentile of the CPUID latency
+//
+// In the debug log, the features are printed as decimal numbers after a
+// "[#f]" marker, split over as many lines as needed (DbgPrint() truncates
+// anything past 512 bytes). The lines of a host are concatenated by name
+// like those of a trace (see trace.h), and its layout version ends it:
+//
+//   [#f] features: <feature> <feature> ...
+//   [#f] layout: <fingerprint_layout_version>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+inline constexpr int32_t feature_one = 256;
+
+// Incremented whenever the features below change in any way, appending a
+// detection or a probe included: a signature is a centroid with a
+// coordinate for every feature, so one that was trained with another
+// layout can't be compared with this host. tools/fingerprint skips hosts
+// that were printed with another layout, and records the layout that the
+// signatures were trained with (see signatures.h).
+inline constexpr uint32_t fingerprint_layout_version = 1;
+
+// Detections whose results are features.
+inline constexpr char const* fingerprint_checks[] = {
+  "cpuid_detected_1",  "msr_detected_1",    "msr_detected_2",    "cr0_detected_1",
+  "cr0_detected_2",    "cr0_detected_3",    "cr3_detected_1",    "cr3_detected_2",
+  "cr3_detected_3",    "cr3_detected_4",    "cr4_detected_1",    "cr4_detected_2",
+  "cr4_detected_3",    "cr4_detected_4",    "xsetbv_detected_1", "xsetbv_detected_2",
+  "xsetbv_detected_3", "xsetbv_detected_4", "xsetbv_detected_5", "xstate_detected_1",
+  "timing_detected_1", "timing_detected_2", "timing_detected_3", "timing_detected_4",
+  "timing_detected_5", "timing_detected_6", "timing_detected_7", "timing_detected_8",
+  "debug_detected_1",  "debug_detected_2",  "debug_detected_3",  "debug_detected_4",
+  "vmx_detected_1",    "vmx_detected_2",    "vmx_detected_3",    "regs_detected_1",
+};
+
+// Instructions whose exception tells hypervisors apart: VMXON with
+// CR4.VMXE clear, VMCALL, RDMSR of the first synthetic MSR of Hyper-V and
+// of KVM's wall clock, and XSETBV to a missing XCR.
+inline constexpr char const* fingerprint_probes[] = {
+  "vmxon", "vmcall", "rdmsr(0x40000000)", "rdmsr(0x4B564D00)", "xsetbv(69)"
+};
+
+// Exceptions that a probe can raise (or not).
+enum probe_outcome : uint32_t {
+  probe_returned,
+  probe_ud,
+  probe_gp,
+  probe_other,
+  probe_outcome_count,
+
+  // not a feature, every outcome is zero
+  probe_skipped = probe_outcome_count
+};
+
+// Vendors in CPUID.40000000H (EBX, ECX, EDX). The last one is any other
+// vendor, and none of them is set if there is no hypervisor leaf.
+inline constexpr char const* fingerprint_vendors[] = {
+  "Microsoft Hv", "KVMKVMKVM\0\0\0", "VMwareVMware", "XenVMMXenVMM",
+  "VBoxVBoxVBox", "TCGTCGTCGTCG", "other"
+};
+
+inline constexpr size_t fingerprint_check_count  = sizeof(fingerprint_checks) / sizeof(fingerprint_checks[0]);
+inline constexpr size_t fingerprint_probe_count  = sizeof(fingerprint_probes) / sizeof(fingerprint_probes[0]);
+inline constexpr size_t fingerprint_vendor_count = sizeof(fingerprint_vendors) / sizeof(fingerprint_vendors[0]);
+
+// Percentiles of the CPUID latency.
+inline constexpr uint32_t fingerprint_percentiles[] = { 10, 50, 90 };
+
+inline constexpr size_t fingerprint_percentile_count =
+  sizeof(fingerprint_percentiles) / sizeof(fingerprint_percentiles[0]);
+
+inline constexpr size_t feature_check_offset      = 0;
+inline constexpr size_t feature_probe_offset      = feature_check_offset + fingerprint_check_count;
+inline constexpr size_t feature_vendor_offset     = feature_probe_offset + fingerprint_probe_count * probe_outcome_count;
+inline constexpr size_t feature_hypervisor_offset = feature_vendor_offset + fingerprint_vendor_count;
+inline constexpr size_t feature_leaves_offset     = feature_hypervisor_offset + 1;
+inline constexpr size_t feature_latency_offset    = feature_leaves_offset + 1;
+inline constexpr size_t fingerprint_feature_count = feature_latency_offset + fingerprint_percentile_count;
+
+// A detection that fails because of a bug that it cites, which is known
+// to be in a few hypervisors. Failing it narrows the host down to those,
+// whether or not there are logs of them to train a centroid with.
+struct fingerprint_known_bug {
+  char const* check;
+  char const* families;
+};
+
+// Whether a host failed the detection of a known bug.
+inline bool fingerprint_has_known_bug(int32_t const* const features,
+    fingerprint_known_bug const& bug) {
+  for (size_t i = 0; i < fingerprint_check_count; ++i) {
+    if (!strcmp(fingerprint_checks[i], bug.check))
+      return features[feature_check_offset + i] == feature_one;
+  }
+
+  return false;
+}
+
+// A family's centroid, along with how far from it (see feature_distance())
+// a host may be and still belong to it.
+struct fingerprint_signature {
+  char const* family;
+  int32_t centroid[fingerprint_feature_count];
+  uint32_t radius;
+};
+
+// log2 of a value, with 8 fractional bits (linearly interpolated between
+// powers of two).
+inline int32_t feature_log2(uint64_t const value) {
+  if (!value)
+    return 0;
+
+  int32_t msb = 63;
+  while (!(value >> msb))
+    --msb;
+
+  auto const fraction = (msb >= 8)
+    ? (value >> (msb - 8)) & 0xFF
+    : (value << (8 - msb)) & 0xFF;
+
+  return msb * feature_one + static_cast<int32_t>(fraction);
+}
+
+// Weighted L1 distance between two feature vectors. The weights (with 8
+// fractional bits) scale every feature by how much it varies within a
+// family, so that a noisy latency doesn't outweigh a check result.
+inline uint64_t feature_distance(int32_t const* const a, int32_t const* const b,
+    uint32_t const* const weights) {
+  uint64_t distance = 0;
+
+  for (size_t i = 0; i < fingerprint_feature_count; ++i) {
+    auto const difference = (a[i] > b[i]) ? a[i] - b[i] : b[i] - a[i];
+    distance += static_cast<uint64_t>(difference) * weights[i];
+  }
+
+  return distance >> 8;
+}
+
+// Distance that every radius is padded with, so that a family that was
+// trained on identical hosts still matches one that differs a little.
+inline constexpr uint64_t fingerprint_min_radius = 2 * feature_one;
+
+struct fingerprint_match {
+  // the nearest family, or null if there are no signatures
+  char const* family;
+
+  // whether the host is within the nearest family's radius
+  bool known;
+
+  // 50-100%: how much closer the nearest family is than the next one
+  // (or than the edge of its radius)
+  uint32_t confidence;
+};
+
+// Classify a host by its nearest centroid.
+inline fingerprint_match fingerprint_classify(int32_t const* const features,
+    fingerprint_signature const* const signatures, size_t const count,
+    uint32_t const* const weights) {
+  fingerprint_match match = { nullptr, false, 0 };
+
+  uint64_t nearest = ~0ull, second = ~0ull;
+  uint64_t limit = 0;
+
+  for (size_t i = 0; i < count; ++i) {
+    auto const distance = feature_distance(features, signatures[i].centroid, weights);
+
+    if (distance < nearest) {
+      second = nearest;
+      nearest = distance;
+      match.family = signatures[i].family;
+      limit = signatures[i].radius + fingerprint_min_radius;
+    }
+    else if (distance < second)
+      second = distance;
+  }
+
+  if (!match.family)
+    return match;
+
+  match.known = nearest <= limit;
+
+  // without a runner-up (or past it), the edge of the radius stands in
+  auto const other = (second < limit) ? second : (nearest < limit ? limit : nearest);
+
+  match.confidence = (nearest + other)
+    ? static_cast<uint32_t>(other * 100 / (nearest + other)) : 100;
+
+  return match;
+}
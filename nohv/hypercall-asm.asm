@@ -0,0 +1,23 @@
+.code
+
+hypercall_vmcall proc
+  mov rax, [rcx + 00h]
+  mov rdx, [rcx + 10h]
+  mov r8,  [rcx + 18h]
+  mov r9,  [rcx + 20h]
+  mov rcx, [rcx + 08h]
+  vmcall
+  ret
+hypercall_vmcall endp
+
+hypercall_vmmcall proc
+  mov rax, [rcx + 00h]
+  mov rdx, [rcx + 10h]
+  mov r8,  [rcx + 18h]
+  mov r9,  [rcx + 20h]
+  mov rcx, [rcx + 08h]
+  db 0Fh, 01h, 0D9h ; vmmcall
+  ret
+hypercall_vmmcall endp
+
+end
@@ -0,0 +1,255 @@
+#include "hypercall.h"
+#include "config.h"
+
+#include <intrin.h>
+#include <ntddk.h>
+
+// Argument registers, in the order that the hypercall stubs load them.
+inline constexpr char const* register_names[] = { "rax", "rcx", "rdx", "r8", "r9" };
+inline constexpr ULONG register_count = 5;
+
+// Hypercall instructions, in the same order as the HypercallEncodings bits.
+inline constexpr char const* encoding_names[] = { "vmcall", "vmmcall" };
+inline constexpr ULONG encoding_count = 2;
+
+// Largest number of combinations that a scan covers, which keeps both
+// bitmaps at 4MB in total and every combination's index within a ULONG.
+inline constexpr uint64_t max_hypercall_combinations = 1ull << 24;
+
+// Largest number of ranges of responsive combinations that a scan prints
+// (every hypercall returns under Hyper-V, for example), the rest are only
+// counted.
+inline constexpr ULONG max_printed_ranges = 64;
+
+// These functions load RAX, RCX, RDX, R8, and R9 from the specified
+// array and execute VMCALL or VMMCALL.
+extern "C" void hypercall_vmcall(uint64_t const* regs);
+extern "C" void hypercall_vmmcall(uint64_t const* regs);
+
+// The scan results of a single logical processor. Combinations are dealt
+// out round-robin, so shard N scans every combination whose index is N
+// modulo the number of shards, and the combination with index I is bit
+// (I / number of shards) in the bitmaps of its shard.
+struct hypercall_shard {
+  ULONG index;
+  ULONG shard_count;
+
+  // number of combinations of every shard together
+  ULONG total;
+
+  PROCESSOR_NUMBER processor;
+  PKTHREAD thread;
+  bool (*cancelled)();
+
+  // the hypercall completed without raising an exception
+  RTL_BITMAP returned;
+
+  // the hypercall raised an exception other than #UD
+  RTL_BITMAP faulted;
+};
+
+// Decode a bit index into the combination that it represents.
+static void decode_combination(ULONG const index, ULONG& encoding, ULONG& reg, ULONG& value) {
+  value    = index % config.hypercall_count;
+  reg      = (index / config.hypercall_count) % register_count;
+  encoding = (index / config.hypercall_count) / register_count;
+}
+
+// Scan every combination that belongs to this shard.
+static void scan_thread(PVOID const context) {
+  auto& shard = *static_cast<hypercall_shard*>(context);
+
+  GROUP_AFFINITY affinity = {};
+  affinity.Group = shard.processor.Group;
+  affinity.Mask  = 1ull << shard.processor.Number;
+  KeSetSystemGroupAffinityThread(&affinity, nullptr);
+
+  for (auto i = shard.index; i < shard.total && !shard.cancelled(); i += shard.shard_count) {
+    ULONG encoding, reg, value;
+    decode_combination(i, encoding, reg, value);
+
+    if (!(config.hypercall_encodings & (1 << encoding)) ||
+        !(config.hypercall_registers & (1 << reg)))
+      continue;
+
+    uint64_t regs[register_count] = {};
+    regs[reg] = static_cast<uint64_t>(config.hypercall_first) + value;
+
+    unsigned long ecode = 0;
+
+    __try {
+      if (encoding == 0)
+        hypercall_vmcall(regs);
+      else
+        hypercall_vmmcall(regs);
+
+      RtlSetBit(&shard.returned, i / shard.shard_count);
+    }
+    __except (ecode = GetExceptionCode(), 1) {
+      if (ecode != STATUS_ILLEGAL_INSTRUCTION)
+        RtlSetBit(&shard.faulted, i / shard.shard_count);
+    }
+  }
+
+  PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+// Consecutive values of one register and instruction that got the same
+// response.
+struct hypercall_range {
+  ULONG encoding;
+  ULONG reg;
+  ULONG first;
+  ULONG last;
+  bool returned;
+};
+
+static void print_range(hypercall_range const& range, ULONG& printed, ULONG& hidden) {
+  if (printed >= max_printed_ranges) {
+    ++hidden;
+    return;
+  }
+
+  auto const first = static_cast<uint64_t>(config.hypercall_first) + range.first;
+  auto const last  = static_cast<uint64_t>(config.hypercall_first) + range.last;
+  auto const what  = range.returned ? "returned" : "raised an exception other than #UD";
+
+  if (first == last)
+    DbgPrint("[!] %s with %s=0x%llX %s.\n", encoding_names[range.encoding],
+      register_names[range.reg], first, what);
+  else
+    DbgPrint("[!] %s with %s=0x%llX-0x%llX %s.\n", encoding_names[range.encoding],
+      register_names[range.reg], first, last, what);
+
+  ++printed;
+}
+
+// Scan the hypercall interface on every logical processor.
+void scan_hypercalls(bool (* const cancelled)()) {
+  if (!config.hypercall_count)
+    return;
+
+  auto const combinations = static_cast<uint64_t>(encoding_count) * register_count * config.hypercall_count;
+  if (combinations > max_hypercall_combinations) {
+    DbgPrint("HypercallCount is too large (%lu), the scan covers at most %llu combinations.\n",
+      config.hypercall_count, max_hypercall_combinations);
+    return;
+  }
+
+  auto const count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  auto const total = static_cast<ULONG>(combinations);
+
+  auto const shard_bits = (total + count - 1) / count;
+
+  // both bitmaps of every shard share a single allocation
+  auto const bitmap_size  = ((shard_bits + 63) / 64) * sizeof(ULONG64);
+  auto const shard_size   = sizeof(hypercall_shard) + 2 * bitmap_size;
+  auto const shard_memory = static_cast<UCHAR*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, count * shard_size, 'llcH'));
+
+  if (!shard_memory) {
+    DbgPrint("Failed to allocate hypercall scan results.\n");
+    return;
+  }
+
+  RtlZeroMemory(shard_memory, count * shard_size);
+
+  auto const get_shard = [&](ULONG const index) {
+    return reinterpret_cast<hypercall_shard*>(shard_memory + index * shard_size);
+  };
+
+  for (ULONG i = 0; i < count; ++i) {
+    auto const shard   = get_shard(i);
+    auto const bitmaps = reinterpret_cast<PULONG>(shard + 1);
+
+    shard->index       = i;
+    shard->shard_count = count;
+    shard->total       = total;
+    shard->cancelled   = cancelled;
+    KeGetProcessorNumberFromIndex(i, &shard->processor);
+
+    RtlInitializeBitMap(&shard->returned, bitmaps, shard_bits);
+    RtlInitializeBitMap(&shard->faulted, bitmaps + bitmap_size / sizeof(ULONG), shard_bits);
+
+    HANDLE handle = nullptr;
+    if (!NT_SUCCESS(PsCreateSystemThread(&handle, THREAD_ALL_ACCESS,
+        nullptr, nullptr, nullptr, scan_thread, shard)))
+      continue;
+
+    // without a reference, the only way to know when the thread is done
+    // with its shard is to wait for it right away
+    if (!NT_SUCCESS(ObReferenceObjectByHandle(handle, SYNCHRONIZE, *PsThreadType,
+        KernelMode, reinterpret_cast<PVOID*>(&shard->thread), nullptr))) {
+      shard->thread = nullptr;
+      ZwWaitForSingleObject(handle, FALSE, nullptr);
+    }
+
+    ZwClose(handle);
+  }
+
+  for (ULONG i = 0; i < count; ++i) {
+    auto const shard = get_shard(i);
+    if (!shard->thread)
+      continue;
+
+    KeWaitForSingleObject(shard->thread, Executive, KernelMode, FALSE, nullptr);
+    ObDereferenceObject(shard->thread);
+  }
+
+  // the shards stopped at different combinations
+  if (cancelled()) {
+    DbgPrint("Hypercall scan cancelled.\n");
+    ExFreePoolWithTag(shard_memory, 'llcH');
+    return;
+  }
+
+  ULONG scanned = 0, responsive = 0;
+  ULONG printed = 0, hidden = 0;
+
+  hypercall_range range = {};
+  auto in_range = false;
+
+  for (ULONG i = 0; i < total; ++i) {
+    ULONG encoding, reg, value;
+    decode_combination(i, encoding, reg, value);
+
+    if (!(config.hypercall_encodings & (1 << encoding)) ||
+        !(config.hypercall_registers & (1 << reg)))
+      continue;
+
+    ++scanned;
+
+    auto const shard    = get_shard(i % count);
+    auto const returned = RtlCheckBit(&shard->returned, i / count);
+    auto const faulted  = RtlCheckBit(&shard->faulted, i / count);
+
+    if (!returned && !faulted)
+      continue;
+
+    ++responsive;
+
+    // values are consecutive within a register and instruction
+    if (in_range && range.encoding == encoding && range.reg == reg &&
+        range.last + 1 == value && range.returned == (returned != 0)) {
+      range.last = value;
+      continue;
+    }
+
+    if (in_range)
+      print_range(range, printed, hidden);
+
+    range    = { encoding, reg, value, value, returned != 0 };
+    in_range = true;
+  }
+
+  if (in_range)
+    print_range(range, printed, hidden);
+
+  if (hidden)
+    DbgPrint("[!] ... and %lu more range(s).\n", hidden);
+
+  DbgPrint("Scanned %lu hypercall(s) on %lu processor(s), %lu responded.\n",
+    scanned, count, responsive);
+
+  ExFreePoolWithTag(shard_memory, 'llcH');
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+// Scan the configured range of values in every configured argument register
+// using every configured hypercall instruction, and print every combination
+// that didn't raise a #UD. The work is split between every logical processor.
+// The scan stops early once cancelled() returns true.
+void scan_hypercalls(bool (*cancelled)());
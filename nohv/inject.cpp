@@ -0,0 +1,131 @@
+#include "inject.h"
+#include "config.h"
+#include "irq.h"
+#include "measure.h"
+#include "samples.h"
+
+#include <ia32.hpp>
+#include <intrin.h>
+#include <ntddk.h>
+
+// The lowest address that is non-canonical with 4-level and 5-level paging.
+inline constexpr uint64_t noncanonical_address = 0x8000'0000'0000'0000ull;
+
+// Raises a #UD without a vm-exit.
+static void native_ud() {
+  __ud2();
+}
+
+// Raises a #UD after a vm-exit, since VMXON always exits in VMX non-root
+// operation (and is only called while CR4.VMXE is clear).
+static void exit_ud() {
+  __vmx_on(nullptr);
+}
+
+// Raises a #GP without a vm-exit.
+static void native_gp() {
+  *reinterpret_cast<uint64_t volatile*>(noncanonical_address);
+}
+
+// Raises a #GP after a vm-exit, since XSETBV always exits and XCR69
+// doesn't exist (see xsetbv_detected_1). Both XGETBV and XSETBV raise a
+// #UD natively while CR4.OSXSAVE is clear, so this is only called while
+// it's set.
+static void exit_gp() {
+  _xsetbv(69, _xgetbv(0));
+}
+
+// An exception vector, along with an instruction that raises it natively
+// and one that raises it through the hypervisor.
+struct injection_vector {
+  char const* name;
+  void (*native)();
+  void (*exit)();
+};
+
+inline constexpr injection_vector injection_vectors[] = {
+  { "ud", native_ud, exit_ud },
+  { "gp", native_gp, exit_gp },
+};
+
+// Time an instruction from right before it executes until our exception
+// handler runs, or return 0 if it didn't raise an exception.
+static uint64_t time_fault(void (* const fault)()) {
+  uint64_t end = 0;
+
+  auto const start = fenced_rdtsc();
+
+  __try {
+    fault();
+  }
+  __except (1) {
+    end = fenced_rdtsc();
+  }
+
+  return end ? (end - start) : 0;
+}
+
+// Record the delivery latency of the native and exiting instruction of
+// the specified vector, and return the lowest of each.
+static void measure_vector(injection_vector const& vector,
+    uint64_t& lowest_native, uint64_t& lowest_exit) {
+  lowest_native = MAXULONG64;
+  lowest_exit   = MAXULONG64;
+
+  irq_disable();
+
+  for (ULONG i = 0; i < config.timing_iterations; ++i) {
+    irq_yield();
+
+    auto const native = time_fault(vector.native);
+    auto const exit   = time_fault(vector.exit);
+
+    // the hypervisor emulated the instruction instead of injecting anything
+    if (!native || !exit)
+      continue;
+
+    record_sample("native", native);
+    record_sample("exit", exit);
+
+    if (native < lowest_native)
+      lowest_native = native;
+    if (exit < lowest_exit)
+      lowest_exit = exit;
+  }
+
+  irq_enable();
+}
+
+void benchmark_injection() {
+  cr4 curr_cr4;
+  curr_cr4.flags = __readcr4();
+
+  for (auto const& vector : injection_vectors) {
+    // VMXON would succeed (or fail without an exception)
+    if (vector.exit == exit_ud && curr_cr4.vmx_enable) {
+      DbgPrint("  #%s: skipped, CR4.VMXE is set.\n", vector.name);
+      continue;
+    }
+
+    // XGETBV would raise a #UD before XSETBV gets to exit
+    if (vector.exit == exit_gp && !curr_cr4.os_xsave) {
+      DbgPrint("  #%s: skipped, CR4.OSXSAVE is clear.\n", vector.name);
+      continue;
+    }
+
+    uint64_t lowest_native = 0, lowest_exit = 0;
+
+    samples_begin("benchmark_injection", vector.name);
+    measure_vector(vector, lowest_native, lowest_exit);
+    samples_end();
+
+    if (lowest_native == MAXULONG64 || lowest_exit == MAXULONG64) {
+      DbgPrint("  #%s: no exception was raised.\n", vector.name);
+      continue;
+    }
+
+    DbgPrint("  #%s: %llu ticks natively, %llu ticks through a vm-exit (%+lld).\n",
+      vector.name, lowest_native, lowest_exit,
+      static_cast<int64_t>(lowest_exit - lowest_native));
+  }
+}
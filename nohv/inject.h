@@ -0,0 +1,9 @@
+#pragma once
+
+// Measure how long it takes for an exception to be delivered to our
+// handler, once for an instruction that faults natively (without a
+// vm-exit) and once for one that causes a vm-exit after which the
+// hypervisor injects the same vector. The samples are printed as
+// "benchmark_injection@<vector>", and the difference is the cost of the
+// hypervisor's exit and injection path.
+void benchmark_injection();
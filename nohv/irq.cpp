@@ -0,0 +1,159 @@
+#include "irq.h"
+#include "config.h"
+
+#include <intrin.h>
+#include <ntddk.h>
+
+struct irq_state {
+  // TSC at the start of the current interrupt-disabled window
+  uint64_t window_start;
+
+  irq_stats stats;
+};
+
+// One entry for every logical processor, indexed by processor index.
+static irq_state* processor_states = nullptr;
+
+// Measured TSC frequency (in ticks per second).
+static uint64_t tsc_frequency = 0;
+
+// Configured budget (in TSC ticks), or 0 if there is none.
+static uint64_t budget_tsc = 0;
+
+// Measure the TSC frequency against the performance counter.
+static uint64_t measure_tsc_frequency() {
+  LARGE_INTEGER frequency;
+
+  auto const qpc_start = KeQueryPerformanceCounter(&frequency).QuadPart;
+  auto const tsc_start = __rdtsc();
+
+  // 10ms should be more than enough to get a decent estimate
+  KeStallExecutionProcessor(10'000);
+
+  auto const qpc_end = KeQueryPerformanceCounter(nullptr).QuadPart;
+  auto const tsc_end = __rdtsc();
+
+  return (tsc_end - tsc_start) * frequency.QuadPart / (qpc_end - qpc_start);
+}
+
+// The TSC frequency that CPUID.15H reports (or the base frequency in
+// CPUID.16H, which the TSC runs at on processors without the crystal
+// frequency), or 0 if neither leaf is there.
+static uint64_t cpuid_tsc_frequency() {
+  int regs[4] = {};
+
+  __cpuid(regs, 0);
+  auto const max_leaf = static_cast<uint32_t>(regs[0]);
+
+  if (max_leaf >= 0x15) {
+    __cpuid(regs, 0x15);
+
+    auto const denominator = static_cast<uint32_t>(regs[0]);
+    auto const numerator   = static_cast<uint32_t>(regs[1]);
+    auto const crystal_hz  = static_cast<uint32_t>(regs[2]);
+
+    if (denominator && numerator && crystal_hz)
+      return static_cast<uint64_t>(crystal_hz) * numerator / denominator;
+  }
+
+  if (max_leaf >= 0x16) {
+    __cpuid(regs, 0x16);
+
+    auto const base_mhz = static_cast<uint32_t>(regs[0]) & 0xFFFF;
+    if (base_mhz)
+      return base_mhz * 1'000'000ull;
+  }
+
+  return 0;
+}
+
+static irq_state& current_state() {
+  return processor_states[KeGetCurrentProcessorNumberEx(nullptr)];
+}
+
+// Calibrate the TSC and allocate the per-processor state.
+bool irq_initialize() {
+  auto const count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+  processor_states = static_cast<irq_state*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, count * sizeof(irq_state), ' qrI'));
+
+  if (!processor_states)
+    return false;
+
+  RtlZeroMemory(processor_states, count * sizeof(irq_state));
+
+  // quick mode can't afford to stall for 10ms, and only uses the frequency
+  // to budget interrupt-disabled windows and print how long things took
+  tsc_frequency = config.quick_budget_us ? cpuid_tsc_frequency() : 0;
+
+  if (!tsc_frequency)
+    tsc_frequency = measure_tsc_frequency();
+  budget_tsc    = config.irq_budget_us * tsc_frequency / 1'000'000;
+
+  return true;
+}
+
+// Free the memory that was allocated by irq_initialize().
+void irq_free() {
+  if (processor_states)
+    ExFreePoolWithTag(processor_states, ' qrI');
+
+  processor_states = nullptr;
+}
+
+// Disable interrupts on the current logical processor.
+void irq_disable() {
+  _disable();
+  current_state().window_start = __rdtsc();
+}
+
+// Enable interrupts on the current logical processor.
+void irq_enable() {
+  auto& state = current_state();
+  auto const duration = __rdtsc() - state.window_start;
+
+  state.stats.windows   += 1;
+  state.stats.total_tsc += duration;
+
+  if (duration > state.stats.max_tsc)
+    state.stats.max_tsc = duration;
+
+  _enable();
+}
+
+// Briefly re-enable interrupts if the current window has exceeded the
+// configured budget.
+bool irq_yield() {
+  if (!budget_tsc || __rdtsc() - current_state().window_start < budget_tsc)
+    return false;
+
+  irq_enable();
+
+  // interrupts are only recognized after the instruction following STI,
+  // so give any pending interrupts a chance to be delivered
+  _mm_pause();
+
+  irq_disable();
+  return true;
+}
+
+// Reset the statistics of the current logical processor.
+void irq_reset_stats() {
+  current_state().stats = {};
+}
+
+// Get the statistics of the current logical processor.
+irq_stats const& irq_current_stats() {
+  return current_state().stats;
+}
+
+// Convert TSC ticks into microseconds.
+uint64_t irq_tsc_to_us(uint64_t const tsc) {
+  return tsc_frequency ? (tsc * 1'000'000 / tsc_frequency) : 0;
+}
+
+// Measured TSC frequency (in ticks per second).
+uint64_t irq_tsc_frequency() {
+  return tsc_frequency;
+}
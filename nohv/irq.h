@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+
+// Statistics about the interrupt-disabled windows of a single detection.
+struct irq_stats {
+  // number of times that interrupts were disabled
+  uint64_t windows;
+
+  // longest and accumulated interrupt-disabled time (in TSC ticks)
+  uint64_t max_tsc;
+  uint64_t total_tsc;
+};
+
+// Calibrate the TSC (or take its frequency from CPUID in quick mode) and
+// allocate the per-processor state.
+bool irq_initialize();
+
+// Free the memory that was allocated by irq_initialize().
+void irq_free();
+
+// Disable interrupts on the current logical processor. This should be
+// used instead of _disable() so that the window can be accounted for.
+void irq_disable();
+
+// Enable interrupts on the current logical processor. This should be
+// used instead of _enable() so that the window can be accounted for.
+void irq_enable();
+
+// Briefly re-enable interrupts if the current window has exceeded the
+// configured budget. Returns true if interrupts were re-enabled, in which
+// case any cached processor state should be re-read.
+bool irq_yield();
+
+// Reset the statistics of the current logical processor.
+void irq_reset_stats();
+
+// Get the statistics of the current logical processor.
+irq_stats const& irq_current_stats();
+
+// Convert TSC ticks into microseconds.
+uint64_t irq_tsc_to_us(uint64_t tsc);
+
+// Measured TSC frequency (in ticks per second).
+uint64_t irq_tsc_frequency();
@@ -1,84 +1,529 @@
 #include <ntddk.h>
 
-#include "detections.h"
+#include "config.h"
+#include "fingerprint.h"
+#include "hypercall.h"
+#include "inject.h"
+#include "irq.h"
+#include "monitor.h"
+#include "record.h"
+#include "samples.h"
+#include "schedule.h"
+#include "sweep.h"
+#include "xstate.h"
 
-#define EXEC_DETECTION(x)\
-  if (x())\
-    DbgPrint("[-] Failed check: " #x "().\n");\
-  else\
-    DbgPrint("[+] Passed check: " #x "().\n");
+// The suite runs on its own system thread, so that DriverEntry
+// returns right away. If the thread can't be referenced, its handle is
+// kept open to wait on instead.
+static PKTHREAD suite_thread;
+static HANDLE suite_thread_handle;
+
+// Set by driver_unload() to stop the suite after the current detection.
+static volatile LONG suite_cancel;
+
+// Number of detections that the suite runs, counting the ones that run
+// on every core type once per core type.
+static ULONG suite_selected;
+
+// Number of detections that ran.
+static ULONG suite_completed;
+
+// Number of detections that detected a hypervisor.
+static ULONG suite_failed;
+
+// \BaseNamedObjects\NohvSuiteComplete, which is signaled once the suite
+// finished (or was cancelled), so that a user-mode agent can wait on it
+// (as Global\NohvSuiteComplete).
+static HANDLE complete_event_handle;
+static PKEVENT complete_event;
+
+// Volatile Progress key under the driver's service key, whose Selected,
+// Completed and Failed values are updated after every detection, and
+// \BaseNamedObjects\NohvSuiteProgress (Global\NohvSuiteProgress), an
+// auto-reset event that is signaled each time, so that an agent can
+// follow the suite without parsing the debug output.
+static HANDLE progress_key;
+static HANDLE progress_event_handle;
+static PKEVENT progress_event;
+
+// Set once monitoring started, in which case the per-processor state is
+// freed by driver_unload() instead of the suite thread.
+static bool monitoring;
+
+static bool suite_cancelled() {
+  return InterlockedCompareExchange(&suite_cancel, 0, 0) != 0;
+}
+
+static void set_progress_value(PCWSTR const name, ULONG value) {
+  UNICODE_STRING value_name;
+  RtlInitUnicodeString(&value_name, name);
+
+  ZwSetValueKey(progress_key, &value_name, 0, REG_DWORD, &value, sizeof(value));
+}
+
+// Publish the number of detections that ran (and failed) so far.
+static void report_progress() {
+  if (progress_key) {
+    set_progress_value(L"Selected", suite_selected);
+    set_progress_value(L"Completed", suite_completed);
+    set_progress_value(L"Failed", suite_failed);
+  }
+
+  if (progress_event)
+    KeSetEvent(progress_event, IO_NO_INCREMENT, FALSE);
+}
+
+// Create the Progress key under the driver's service key.
+static void open_progress_key(PUNICODE_STRING const registry_path) {
+  OBJECT_ATTRIBUTES attributes;
+  InitializeObjectAttributes(&attributes, registry_path,
+    OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, nullptr, nullptr);
+
+  HANDLE service_key = nullptr;
+  if (!NT_SUCCESS(ZwOpenKey(&service_key, KEY_READ, &attributes)))
+    return;
+
+  UNICODE_STRING progress_name = RTL_CONSTANT_STRING(L"Progress");
+  InitializeObjectAttributes(&attributes, &progress_name,
+    OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, service_key, nullptr);
+
+  // it's only meaningful while the driver is loaded
+  if (!NT_SUCCESS(ZwCreateKey(&progress_key, KEY_SET_VALUE,
+      &attributes, 0, nullptr, REG_OPTION_VOLATILE, nullptr)))
+    progress_key = nullptr;
+
+  ZwClose(service_key);
+}
+
+// Print how long the last detection kept interrupts disabled for.
+static void print_irq_stats() {
+  auto const& stats = irq_current_stats();
+  if (!stats.windows)
+    return;
+
+  DbgPrint("    Interrupts disabled: %llu window(s), %lluus max, %lluus total.\n",
+    stats.windows, irq_tsc_to_us(stats.max_tsc), irq_tsc_to_us(stats.total_tsc));
+}
+
+// Run a single detection on the current logical processor, and update
+// its cost.
+static void exec_detection(detection_entry& detection, char const* const tag) {
+  if (!detection.selected || suite_cancelled())
+    return;
+
+  irq_reset_stats();
+  samples_begin(detection.name, tag);
+  record_begin(detection.name);
+
+  // interrupt time is in 100ns units, and KeQueryInterruptTime() only
+  // advances once per clock tick, which is longer than most detections
+  // take (the TSC isn't used so that a trace only holds the detection)
+  ULONG64 qpc = 0;
+  auto const start    = KeQueryInterruptTimePrecise(&qpc);
+  auto const detected = detection.detect(current_cpu_caps());
+  auto const elapsed  = KeQueryInterruptTimePrecise(&qpc) - start;
+
+  record_end(detected);
+
+  if (detected)
+    DbgPrint("[-] Failed check: %s().\n", detection.name);
+  else
+    DbgPrint("[+] Passed check: %s().\n", detection.name);
+
+  print_irq_stats();
+  samples_end();
+
+  schedule_update_cost(detection, elapsed / 10);
+  detection.ran = true;
+  detection.detected |= detected;
+  ++suite_completed;
+  suite_failed += detected;
+
+  report_progress();
+}
+
+// Whether a detection runs in the specified phase (see schedule.h).
+static bool in_phase(detection_entry const& detection, bool const polluting) {
+  return ((detection.flags & detection_pollutes) != 0) == polluting;
+}
+
+// Run the detections of the specified phase that run on every core type
+// on the current logical processor. Their samples are tagged with the
+// core type on hybrid processors.
+static void run_core_type_detections(bool const polluting) {
+  auto const& caps = current_cpu_caps();
+  auto const  tag  = (caps.core_type == core_type_unknown)
+    ? nullptr : core_type_name(caps.core_type);
+
+  for (ULONG i = 0; i < schedule_count(); ++i) {
+    auto& detection = schedule_entry(i);
+
+    if ((detection.flags & detection_core_type) && in_phase(detection, polluting))
+      exec_detection(detection, tag);
+  }
+}
+
+// Whether the specified logical processor is the first one of its core type.
+static bool first_of_core_type(ULONG const index) {
+  auto const core_type = processor_cpu_caps(index).core_type;
+
+  for (ULONG i = 0; i < index; ++i) {
+    if (processor_cpu_caps(i).core_type == core_type)
+      return false;
+  }
+
+  return true;
+}
+
+// Run the detections of the specified phase that run on every core type
+// (the timing detections) on the first logical processor of every core
+// type, since native latencies (and the thresholds) depend on it.
+static void run_core_type_detections_per_core_type(bool const polluting) {
+  bool any = false;
+  for (ULONG i = 0; i < schedule_count() && !any; ++i) {
+    auto const& detection = schedule_entry(i);
+    any = (detection.flags & detection_core_type) && detection.selected &&
+      in_phase(detection, polluting);
+  }
+
+  // don't move between processors for nothing
+  if (!any)
+    return;
+
+  auto const count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+  for (ULONG i = 0; i < count && !suite_cancelled(); ++i) {
+    if (!first_of_core_type(i))
+      continue;
+
+    auto const core_type = processor_cpu_caps(i).core_type;
+
+    PROCESSOR_NUMBER number = {};
+    KeGetProcessorNumberFromIndex(i, &number);
+
+    GROUP_AFFINITY affinity = {}, previous = {};
+    affinity.Group = number.Group;
+    affinity.Mask  = 1ull << number.Number;
+    KeSetSystemGroupAffinityThread(&affinity, &previous);
+
+    DbgPrint("Testing timing on processor %lu (%s):\n", i, core_type_name(core_type));
+    run_core_type_detections(polluting);
+
+    KeRevertToUserGroupAffinityThread(&previous);
+  }
+}
+
+// Run every detection of the specified phase, in the order of the
+// schedule.
+static void run_phase(bool const polluting) {
+  run_core_type_detections_per_core_type(polluting);
+
+  char const* file = nullptr;
+
+  for (ULONG i = 0; i < schedule_count(); ++i) {
+    auto& detection = schedule_entry(i);
+
+    if ((detection.flags & detection_core_type) || !in_phase(detection, polluting) ||
+        !detection.selected)
+      continue;
+
+    if (!file || strcmp(file, detection.file)) {
+      file = detection.file;
+      DbgPrint("Testing %s:\n", file);
+    }
+
+    exec_detection(detection, nullptr);
+  }
+}
+
+static ULONG count_core_types() {
+  auto const count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+  ULONG core_types = 0;
+  for (ULONG i = 0; i < count; ++i)
+    core_types += first_of_core_type(i);
+
+  return core_types;
+}
+
+// Number of times that the selected detections run.
+static ULONG count_selected_runs() {
+  auto const core_types = count_core_types();
+
+  ULONG runs = 0;
+  for (ULONG i = 0; i < schedule_count(); ++i) {
+    auto const& detection = schedule_entry(i);
+
+    if (detection.selected)
+      runs += (detection.flags & detection_core_type) ? core_types : 1;
+  }
+
+  return runs;
+}
+
+// Select the detections that quick mode runs, and print what they cover.
+static ULONG select_quick_detections() {
+  auto const covered = schedule_select(config.quick_budget_us, count_core_types());
+
+  ULONG selected = 0;
+  for (ULONG i = 0; i < schedule_count(); ++i)
+    selected += schedule_entry(i).selected;
+
+  DbgPrint("Quick mode: %lu detection(s) within %luus.\n", selected, config.quick_budget_us);
+
+  return covered;
+}
+
+// Print the verdict of quick mode. A failed detection is a reliable sign
+// of a hypervisor, while passing them only means as much as they cover.
+// A hypervisor misses every detection that ran at most as often as it
+// misses the most sensitive one, however they're correlated, so that's
+// the confidence (see the sensitivities in schedule.cpp).
+static void print_quick_verdict(ULONG const covered) {
+  if (suite_failed) {
+    DbgPrint("Quick verdict: hypervisor detected by %lu of %lu detection(s).\n",
+      suite_failed, suite_completed);
+    return;
+  }
+
+  ULONG weight = 0;
+  for (ULONG i = 0; i < coverage_count; ++i)
+    weight += (covered >> i) & 1;
+
+  ULONG sensitivity = 0;
+  for (ULONG i = 0; i < schedule_count(); ++i) {
+    auto const& detection = schedule_entry(i);
+
+    if (detection.ran && detection.sensitivity > sensitivity)
+      sensitivity = detection.sensitivity;
+  }
+
+  DbgPrint("Quick verdict: clean, with %lu of %lu exit reasons and bug classes covered "
+    "(at least %lu.%lu%% confidence: roc's hypervisors fail them that often).\n",
+    weight, coverage_count, sensitivity / 10, sensitivity % 10);
+
+  for (ULONG i = 0; i < coverage_count; ++i) {
+    if (!(covered & (1 << i)))
+      DbgPrint("    Not covered: %s.\n", coverage_names[i]);
+  }
+}
+
+// Run every detection, and free everything that driver_entry() allocated
+// (unless monitoring keeps using it).
+static void suite_thread_routine(PVOID) {
+  auto const start = KeQueryInterruptTime();
+
+  // bind execution to a single logical processor
+  auto const affinity = KeSetSystemAffinityThreadEx(1);
+
+  ULONG covered = 0;
+  if (config.quick_budget_us)
+    covered = select_quick_detections();
+
+  suite_selected = count_selected_runs();
+  report_progress();
+
+  // detections that pollute the caches run last, so that they don't
+  // change what the others measure
+  run_phase(false);
+  run_phase(true);
+
+  schedule_save();
+
+  record_finish();
+
+  // quick mode only wants the verdict, so it skips everything else
+  if (config.quick_budget_us && !suite_cancelled())
+    print_quick_verdict(covered);
+
+  if (config.fingerprint && !config.quick_budget_us && !suite_cancelled()) {
+    DbgPrint("Fingerprinting:\n");
+    fingerprint_host();
+  }
+
+  if (config.processor_sweep && !config.quick_budget_us && !suite_cancelled()) {
+    DbgPrint("Sweeping processors:\n");
+    sweep_processors(suite_cancelled);
+  }
+
+  if (!config.quick_budget_us && !suite_cancelled()) {
+    DbgPrint("Benchmarking xstate:\n");
+    benchmark_xstate();
+  }
+
+  if (!config.quick_budget_us && !suite_cancelled()) {
+    DbgPrint("Benchmarking injection:\n");
+    benchmark_injection();
+  }
+
+  if (config.hypercall_scan && !config.quick_budget_us && !suite_cancelled()) {
+    DbgPrint("Scanning hypercalls:\n");
+    scan_hypercalls(suite_cancelled);
+  }
+
+  KeRevertToUserAffinityThreadEx(affinity);
+
+  if (config.monitor_interval_ms && !suite_cancelled()) {
+    monitor_start();
+    monitoring = true;
+  }
+  else {
+    samples_free();
+    irq_free();
+    free_cpu_caps();
+  }
+
+  // interrupt time is in 100ns units
+  DbgPrint("Suite %s: %lu detection(s) in %llums.\n",
+    suite_cancelled() ? "cancelled" : "finished", suite_completed,
+    (KeQueryInterruptTime() - start) / 10'000);
+
+  if (complete_event)
+    KeSetEvent(complete_event, IO_NO_INCREMENT, FALSE);
+
+  PsTerminateSystemThread(STATUS_SUCCESS);
+}
 
 void driver_unload(PDRIVER_OBJECT) {
+  InterlockedExchange(&suite_cancel, 1);
+
+  // the detection that is currently running still has to finish
+  if (suite_thread) {
+    KeWaitForSingleObject(suite_thread, Executive, KernelMode, FALSE, nullptr);
+    ObDereferenceObject(suite_thread);
+  }
+  else if (suite_thread_handle) {
+    ZwWaitForSingleObject(suite_thread_handle, FALSE, nullptr);
+    ZwClose(suite_thread_handle);
+  }
+
+  if (monitoring) {
+    monitor_stop();
+
+    samples_free();
+    irq_free();
+    free_cpu_caps();
+  }
+
+  if (complete_event_handle)
+    ZwClose(complete_event_handle);
+
+  if (progress_event_handle)
+    ZwClose(progress_event_handle);
+
+  if (progress_key)
+    ZwClose(progress_key);
+
   DbgPrint("Driver unloaded.\n");
 }
 
-NTSTATUS driver_entry(PDRIVER_OBJECT driver, PUNICODE_STRING) {
+// Allocate the per-processor state that the detections use.
+static bool initialize() {
+  // query the capabilities of every logical processor up front, so
+  // that the detections don't cause any unnecessary vm-exits
+  if (!create_cpu_caps()) {
+    DbgPrint("Failed to query CPU capabilities.\n");
+    return false;
+  }
+
+  if (!irq_initialize()) {
+    free_cpu_caps();
+    DbgPrint("Failed to initialize interrupt accounting.\n");
+    return false;
+  }
+
+  if (!samples_initialize()) {
+    irq_free();
+    free_cpu_caps();
+    DbgPrint("Failed to allocate sample storage.\n");
+    return false;
+  }
+
+  return true;
+}
+
+NTSTATUS driver_entry(PDRIVER_OBJECT driver, PUNICODE_STRING registry_path) {
   DbgPrint("Driver loaded.\n");
 
   driver->DriverUnload = driver_unload;
 
-  // bind execution to a single logical processor
+  load_config(registry_path);
+  schedule_initialize(registry_path);
+
+  if (!record_initialize())
+    DbgPrint("Failed to allocate the trace.\n");
+
+  // the TSC calibration shouldn't move between processors halfway
+  // through, and a trace has to know where it ran
   auto const affinity = KeSetSystemAffinityThreadEx(1);
 
-  // cpuid.cpp
-  DbgPrint("Testing cpuid:\n");
-  EXEC_DETECTION(cpuid_detected_1);
-
-  // msr.cpp
-  DbgPrint("Testing msr:\n");
-  EXEC_DETECTION(msr_detected_1);
-  EXEC_DETECTION(msr_detected_2);
-
-  // cr0.cpp
-  DbgPrint("Testing cr0:\n");
-  EXEC_DETECTION(cr0_detected_1);
-  EXEC_DETECTION(cr0_detected_2);
-  EXEC_DETECTION(cr0_detected_3);
-
-  // cr3.cpp
-  DbgPrint("Testing cr3:\n");
-  EXEC_DETECTION(cr3_detected_1);
-  EXEC_DETECTION(cr3_detected_2);
-  EXEC_DETECTION(cr3_detected_3);
-
-  // cr4.cpp
-  DbgPrint("Testing cr4:\n");
-  EXEC_DETECTION(cr4_detected_1);
-  EXEC_DETECTION(cr4_detected_2);
-  EXEC_DETECTION(cr4_detected_3);
-  EXEC_DETECTION(cr4_detected_4);
-
-  // xsetbv.cpp
-  DbgPrint("Testing xsetbv:\n");
-  EXEC_DETECTION(xsetbv_detected_1);
-  EXEC_DETECTION(xsetbv_detected_2);
-  EXEC_DETECTION(xsetbv_detected_3);
-  EXEC_DETECTION(xsetbv_detected_4);
-  EXEC_DETECTION(xsetbv_detected_5);
-
-  // timing.cpp
-  DbgPrint("Testing timing:\n");
-  EXEC_DETECTION(timing_detected_1);
-  EXEC_DETECTION(timing_detected_2);
-  EXEC_DETECTION(timing_detected_3);
-  EXEC_DETECTION(timing_detected_4);
-  EXEC_DETECTION(timing_detected_5);
-  EXEC_DETECTION(timing_detected_6);
-  EXEC_DETECTION(timing_detected_7);
-
-  // debug.cpp
-  DbgPrint("Testing debug:\n");
-  EXEC_DETECTION(debug_detected_1);
-  EXEC_DETECTION(debug_detected_2);
-
-  // vmx.cpp
-  DbgPrint("Testing vmx:\n");
-  EXEC_DETECTION(vmx_detected_1);
-  EXEC_DETECTION(vmx_detected_2);
-  EXEC_DETECTION(vmx_detected_3);
+  record_begin("initialize");
+  auto const initialized = initialize();
+  record_end(initialized);
 
   KeRevertToUserAffinityThreadEx(affinity);
 
+  if (!initialized) {
+    record_finish();
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+
+  // this is only for convenience, so the suite still runs without it
+  UNICODE_STRING event_name = RTL_CONSTANT_STRING(L"\\BaseNamedObjects\\NohvSuiteComplete");
+  complete_event = IoCreateNotificationEvent(&event_name, &complete_event_handle);
+
+  // the event might be left over (signaled) from a previous load
+  if (complete_event)
+    KeClearEvent(complete_event);
+  else
+    DbgPrint("Failed to create the completion event.\n");
+
+  UNICODE_STRING progress_name = RTL_CONSTANT_STRING(L"\\BaseNamedObjects\\NohvSuiteProgress");
+  progress_event = IoCreateSynchronizationEvent(&progress_name, &progress_event_handle);
+
+  if (progress_event)
+    KeClearEvent(progress_event);
+
+  open_progress_key(registry_path);
+
+  HANDLE handle = nullptr;
+  auto const status = PsCreateSystemThread(&handle, THREAD_ALL_ACCESS,
+    nullptr, nullptr, nullptr, suite_thread_routine, nullptr);
+
+  if (!NT_SUCCESS(status)) {
+    if (complete_event_handle)
+      ZwClose(complete_event_handle);
+
+    if (progress_event_handle)
+      ZwClose(progress_event_handle);
+
+    if (progress_key)
+      ZwClose(progress_key);
+
+    record_finish();
+    samples_free();
+    irq_free();
+    free_cpu_caps();
+    DbgPrint("Failed to create the suite thread.\n");
+    return status;
+  }
+
+  if (NT_SUCCESS(ObReferenceObjectByHandle(handle, SYNCHRONIZE, *PsThreadType,
+      KernelMode, reinterpret_cast<PVOID*>(&suite_thread), nullptr)))
+    ZwClose(handle);
+  else {
+    suite_thread        = nullptr;
+    suite_thread_handle = handle;
+  }
+
+  // the old behavior, for scripts that expect every result to be
+  // printed by the time that the driver is loaded
+  if (!config.asynchronous) {
+    if (suite_thread)
+      KeWaitForSingleObject(suite_thread, Executive, KernelMode, FALSE, nullptr);
+    else
+      ZwWaitForSingleObject(suite_thread_handle, FALSE, nullptr);
+  }
+
   return STATUS_SUCCESS;
 }
-
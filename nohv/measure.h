@@ -0,0 +1,46 @@
+#pragma once
+
+// Measurement primitives that the detections depend on. These are shared
+// with the benchmarks in tools/ so that both always measure the same code.
+
+#if __has_include(<intrin.h>)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+#include <stdint.h>
+
+// Read the TSC, with LFENCE on both sides so that it can't be
+// reordered with the code that is being measured.
+inline uint64_t fenced_rdtsc() {
+  _mm_lfence();
+  auto const tsc = __rdtsc();
+  _mm_lfence();
+  return tsc;
+}
+
+// Read the TSC with RDTSCP, which waits for every previous instruction
+// to execute, followed by an LFENCE for the instructions after it.
+inline uint64_t fenced_rdtscp() {
+  unsigned int aux = 0;
+  auto const tsc = __rdtscp(&aux);
+  _mm_lfence();
+  return tsc;
+}
+
+// Measures the amount of time it takes to read+write
+// to every byte in the specified array.
+inline uint64_t time_cacheline(uint8_t cacheline[64]) {
+  // touch the memory and ensure that it is in the cache
+  cacheline[0] = 1;
+
+  auto const start = fenced_rdtsc();
+
+  for (int i = 0; i < 64; ++i)
+    cacheline[i] += 1;
+
+  auto const end = fenced_rdtsc();
+
+  return (end - start);
+}
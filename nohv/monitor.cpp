@@ -0,0 +1,207 @@
+#include "monitor.h"
+#include "config.h"
+#include "detections.h"
+#include "irq.h"
+#include "schedule.h"
+
+#include <intrin.h>
+#include <ntddk.h>
+
+// cpuid_detected_1() only looks at the capabilities, which are a snapshot
+// from when the driver was loaded.
+static bool monitor_cpuid_detected_1(cpu_caps const&) {
+  refresh_cpu_caps();
+  return cpuid_detected_1(current_cpu_caps());
+}
+
+struct monitor_check {
+  char const* name;
+  bool (*detect)(cpu_caps const&);
+
+  // running average of how long the check takes (in TSC ticks), which
+  // starts out as the cost that the schedule has for it
+  uint64_t cost_tsc;
+
+  uint64_t runs;
+
+  // result of the last run
+  bool detected;
+};
+
+// Checks that are cheap enough to run over and over, in the order that
+// they are ran in.
+static monitor_check checks[] = {
+  { "cpuid_detected_1",  monitor_cpuid_detected_1 },
+  { "cr4_detected_1",    cr4_detected_1 },
+  { "timing_detected_7", timing_detected_7 },
+  { "timing_detected_1", timing_detected_1 },
+};
+
+inline constexpr ULONG check_count = sizeof(checks) / sizeof(checks[0]);
+
+static KTIMER monitor_timer;
+static KDPC monitor_dpc;
+
+// A tick that takes longer than the interval would otherwise overlap
+// with the next one (on another logical processor).
+static volatile LONG monitor_busy;
+
+// Index of the next check, and of the logical processor that the next
+// tick runs on.
+static ULONG next_check;
+static ULONG next_processor;
+
+// Every tick adds its share of the budget to this, and every check that
+// runs subtracts what it actually took. A check only runs if there's
+// enough credit for its average cost, so expensive checks just run less
+// often instead of going over the budget. Unused credit is capped at a
+// tick's budget or a whole round, whichever is more, so that a long
+// stretch of skipped ticks doesn't turn into a burst of checks.
+static int64_t credit_tsc;
+static int64_t tick_budget_tsc;
+
+static uint64_t total_ticks;
+static uint64_t total_tsc;
+
+// number of checks whose last run detected a hypervisor
+static ULONG detected_count;
+
+// Run as many checks as the budget allows on the current logical
+// processor, and move on to the next one.
+static void monitor_dpc_routine(PKDPC, PVOID, PVOID, PVOID) {
+  if (InterlockedCompareExchange(&monitor_busy, 1, 0))
+    return;
+
+  auto const processor = KeGetCurrentProcessorNumberEx(nullptr);
+
+  ++total_ticks;
+
+  int64_t round_tsc = 0;
+  for (auto const& check : checks)
+    round_tsc += static_cast<int64_t>(check.cost_tsc);
+
+  auto const max_credit_tsc = (round_tsc > tick_budget_tsc) ? round_tsc : tick_budget_tsc;
+
+  credit_tsc += tick_budget_tsc;
+  if (credit_tsc > max_credit_tsc)
+    credit_tsc = max_credit_tsc;
+
+  // at most one round per tick
+  for (ULONG i = 0; i < check_count; ++i) {
+    auto& check = checks[next_check];
+    if (credit_tsc < static_cast<int64_t>(check.cost_tsc))
+      break;
+
+    auto const start    = __rdtsc();
+    auto const detected = check.detect(current_cpu_caps());
+    auto const cost     = __rdtsc() - start;
+
+    credit_tsc -= static_cast<int64_t>(cost);
+    total_tsc  += cost;
+
+    check.cost_tsc = check.runs ? (check.cost_tsc * 7 + cost) / 8 : cost;
+
+    auto const was_clean = (detected_count == 0);
+
+    if (!check.runs)
+      detected_count += detected;
+    else if (detected != check.detected) {
+      DbgPrint("[monitor] %s() %s on processor %lu.\n", check.name,
+        detected ? "started failing" : "passes again", processor);
+
+      detected ? ++detected_count : --detected_count;
+    }
+
+    if (was_clean != (detected_count == 0)) {
+      DbgPrint("[monitor] State changed: %s.\n",
+        detected_count ? "hypervisor detected" : "clean");
+    }
+
+    check.detected = detected;
+    ++check.runs;
+
+    next_check = (next_check + 1) % check_count;
+  }
+
+  next_processor = (next_processor + 1) % KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+  PROCESSOR_NUMBER number = {};
+  KeGetProcessorNumberFromIndex(next_processor, &number);
+  KeSetTargetProcessorDpcEx(&monitor_dpc, &number);
+
+  InterlockedExchange(&monitor_busy, 0);
+}
+
+// Seed the cost of every check, so that its first run in a tick is held
+// to the budget as well: run it once here, timed with the TSC like the
+// ticks do, and take that or what the schedule has for the detection,
+// whichever is more.
+static void seed_costs() {
+  for (auto& check : checks) {
+    ULONG cost_us = 0;
+
+    for (ULONG i = 0; i < schedule_count(); ++i) {
+      auto const& detection = schedule_entry(i);
+
+      if (!strcmp(detection.name, check.name))
+        cost_us = detection.cost_us;
+    }
+
+    // at the IRQL that the ticks run at, which also keeps the thread on
+    // the processor whose capabilities the check gets
+    KIRQL irql = 0;
+    KeRaiseIrql(DISPATCH_LEVEL, &irql);
+
+    auto const start    = __rdtsc();
+    check.detect(current_cpu_caps());
+    auto const measured = __rdtsc() - start;
+
+    KeLowerIrql(irql);
+
+    auto const scheduled = irq_tsc_frequency() * cost_us / 1'000'000;
+
+    check.cost_tsc = (measured > scheduled) ? measured : scheduled;
+  }
+}
+
+// Start running the checks every MonitorIntervalMs.
+void monitor_start() {
+  auto const interval_tsc = irq_tsc_frequency() * config.monitor_interval_ms / 1'000;
+  tick_budget_tsc = static_cast<int64_t>(interval_tsc * config.monitor_budget_ppm / 1'000'000);
+
+  seed_costs();
+
+  KeInitializeDpc(&monitor_dpc, monitor_dpc_routine, nullptr);
+  KeInitializeTimerEx(&monitor_timer, NotificationTimer);
+
+  PROCESSOR_NUMBER number = {};
+  KeGetProcessorNumberFromIndex(next_processor, &number);
+  KeSetTargetProcessorDpcEx(&monitor_dpc, &number);
+
+  LARGE_INTEGER due_time = {};
+  due_time.QuadPart = -10'000ll * config.monitor_interval_ms;
+  KeSetTimerEx(&monitor_timer, due_time, static_cast<LONG>(config.monitor_interval_ms), &monitor_dpc);
+
+  DbgPrint("Monitoring every %lums, within %lu ppm (%lluus per tick).\n",
+    config.monitor_interval_ms, config.monitor_budget_ppm,
+    irq_tsc_to_us(static_cast<uint64_t>(tick_budget_tsc)));
+}
+
+// Stop running the checks.
+void monitor_stop() {
+  KeCancelTimer(&monitor_timer);
+
+  // wait for a tick that might still be running
+  KeFlushQueuedDpcs();
+
+  auto const interval_tsc = irq_tsc_frequency() * config.monitor_interval_ms / 1'000;
+  auto const elapsed_tsc  = total_ticks * interval_tsc;
+
+  DbgPrint("Monitored for %llu tick(s), overhead was %llu ppm of one processor.\n",
+    total_ticks, elapsed_tsc ? (total_tsc * 1'000'000 / elapsed_tsc) : 0);
+
+  for (auto const& check : checks) {
+    DbgPrint("    %s(): %llu run(s), %lluus average.\n",
+      check.name, check.runs, irq_tsc_to_us(check.cost_tsc));
+  }
+}
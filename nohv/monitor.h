@@ -0,0 +1,10 @@
+#pragma once
+
+// Keep running the cheapest detections from a periodic timer DPC, on a
+// different logical processor every time, to notice a hypervisor that is
+// loaded after the driver. Every change in a detection's result is
+// printed. The time that is spent is kept within MonitorBudgetPpm.
+void monitor_start();
+
+// Stop monitoring and print how much time it took.
+void monitor_stop();
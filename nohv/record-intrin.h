@@ -0,0 +1,324 @@
+#pragma once
+
+// Force-included into every source file of a recording build (see
+// record.h), after which every intrinsic (and assembly stub) that the
+// detections base their decisions on is a wrapper that executes the real
+// instruction and records what it returned, or which exception it raised.
+// Exceptions are re-raised with the same code, so the detections can't
+// tell the difference (other than by timing it).
+//
+// Everything that the wrappers are defined in terms of has to be
+// included before any of the macros are defined.
+
+#include <ntddk.h>
+#include <intrin.h>
+#include <aux_klib.h>
+
+#include "record.h"
+
+extern "C" bool check_rdtscp_regs();
+extern "C" void xsetbv_full(uint64_t rcx, uint64_t rdx, uint64_t rax);
+extern "C" void vmx_vmcall(uint64_t rcx, uint64_t rdx, uint64_t r8, uint64_t r9);
+extern "C" void regs_cpuid(uint64_t* regs);
+extern "C" void regs_rdtscp(uint64_t* regs);
+extern "C" void regs_rdmsr(uint64_t* regs);
+extern "C" void regs_xgetbv(uint64_t* regs);
+extern "C" void regs_rdpid(uint64_t* regs);
+extern "C" void regs_vmcall(uint64_t* regs);
+
+struct xstate_registers;
+
+extern "C" void xstate_sse(xstate_registers const* input,
+  xstate_registers* output, uint32_t leaf, uint32_t count);
+extern "C" void xstate_avx(xstate_registers const* input,
+  xstate_registers* output, uint32_t leaf, uint32_t count);
+extern "C" void xstate_avx512(xstate_registers const* input,
+  xstate_registers* output, uint32_t leaf, uint32_t count);
+
+// Execute an instruction and return the code of the exception that it
+// raised, or 0.
+template <typename Fn>
+inline uint32_t record_try(Fn&& fn) {
+  uint32_t status = 0;
+
+  __try {
+    fn();
+  }
+  __except (status = GetExceptionCode(), 1) {}
+
+  return status;
+}
+
+// Record an event and re-raise the exception that the instruction raised.
+inline void record(trace_event const kind, uint32_t const status, uint64_t const* const fields) {
+  record_event(kind, status, fields);
+
+  if (status)
+    ExRaiseStatus(static_cast<NTSTATUS>(status));
+}
+
+inline unsigned __int64 record_rdtsc() {
+  uint64_t const fields[] = { __rdtsc() };
+  record(trace_event::rdtsc, 0, fields);
+  return fields[0];
+}
+
+inline unsigned __int64 record_rdtscp(unsigned int* const aux) {
+  uint64_t const fields[] = { __rdtscp(aux), *aux };
+  record(trace_event::rdtscp, 0, fields);
+  return fields[0];
+}
+
+inline void record_cpuidex(int regs[4], int const leaf, int const subleaf) {
+  __cpuidex(regs, leaf, subleaf);
+
+  uint64_t const fields[] = { static_cast<uint32_t>(leaf), static_cast<uint32_t>(subleaf),
+    static_cast<uint32_t>(regs[0]), static_cast<uint32_t>(regs[1]),
+    static_cast<uint32_t>(regs[2]), static_cast<uint32_t>(regs[3]) };
+
+  record(trace_event::cpuid, 0, fields);
+}
+
+inline unsigned __int64 record_readmsr(unsigned long const msr) {
+  uint64_t fields[] = { msr, 0 };
+  auto const status = record_try([&] { fields[1] = __readmsr(msr); });
+  record(trace_event::readmsr, status, fields);
+  return fields[1];
+}
+
+inline void record_writemsr(unsigned long const msr, unsigned __int64 const value) {
+  uint64_t const fields[] = { msr, value };
+  record(trace_event::writemsr, record_try([&] { __writemsr(msr, value); }), fields);
+}
+
+inline unsigned __int64 record_readcr(int const cr) {
+  uint64_t fields[] = { static_cast<uint64_t>(cr), 0 };
+
+  auto const status = record_try([&] {
+    if (cr == 0)
+      fields[1] = __readcr0();
+    else if (cr == 3)
+      fields[1] = __readcr3();
+    else
+      fields[1] = __readcr4();
+  });
+
+  record(trace_event::readcr, status, fields);
+  return fields[1];
+}
+
+inline void record_writecr(int const cr, unsigned __int64 const value) {
+  uint64_t const fields[] = { static_cast<uint64_t>(cr), value };
+
+  auto const status = record_try([&] {
+    if (cr == 0)
+      __writecr0(value);
+    else if (cr == 3)
+      __writecr3(value);
+    else
+      __writecr4(value);
+  });
+
+  record(trace_event::writecr, status, fields);
+}
+
+inline unsigned __int64 record_readdr(unsigned int const dr) {
+  uint64_t fields[] = { dr, 0 };
+  auto const status = record_try([&] { fields[1] = __readdr(dr); });
+  record(trace_event::readdr, status, fields);
+  return fields[1];
+}
+
+inline void record_writedr(unsigned int const dr, unsigned __int64 const value) {
+  uint64_t const fields[] = { dr, value };
+  record(trace_event::writedr, record_try([&] { __writedr(dr, value); }), fields);
+}
+
+inline unsigned __int64 record_xgetbv(unsigned int const xcr) {
+  uint64_t fields[] = { xcr, 0 };
+  auto const status = record_try([&] { fields[1] = _xgetbv(xcr); });
+  record(trace_event::xgetbv, status, fields);
+  return fields[1];
+}
+
+// XSETBV only uses the lower halves of RCX and RAX, so this is recorded
+// the same way as xsetbv_full()
+inline void record_xsetbv(unsigned int const xcr, unsigned __int64 const value) {
+  uint64_t const fields[] = { xcr, value >> 32, value & 0xFFFF'FFFF };
+  record(trace_event::xsetbv, record_try([&] { _xsetbv(xcr, value); }), fields);
+}
+
+inline unsigned char record_vmx_on(unsigned __int64* const address) {
+  uint64_t fields[] = { address ? *address : 0, 0 };
+  auto const status = record_try([&] { fields[1] = __vmx_on(address); });
+  record(trace_event::vmxon, status, fields);
+  return static_cast<unsigned char>(fields[1]);
+}
+
+inline unsigned long record_indword(unsigned short const port) {
+  uint64_t fields[] = { port, 0 };
+  auto const status = record_try([&] { fields[1] = __indword(port); });
+  record(trace_event::indword, status, fields);
+  return static_cast<unsigned long>(fields[1]);
+}
+
+extern "C" inline bool record_check_rdtscp_regs() {
+  uint64_t const fields[] = { check_rdtscp_regs() };
+  record(trace_event::rdtscp_regs, 0, fields);
+  return fields[0] != 0;
+}
+
+extern "C" inline void record_xsetbv_full(uint64_t const rcx, uint64_t const rdx, uint64_t const rax) {
+  uint64_t const fields[] = { rcx, rdx, rax };
+  record(trace_event::xsetbv, record_try([&] { xsetbv_full(rcx, rdx, rax); }), fields);
+}
+
+extern "C" inline void record_vmx_vmcall(uint64_t const rcx, uint64_t const rdx,
+    uint64_t const r8, uint64_t const r9) {
+  uint64_t const fields[] = { rcx, rdx, r8, r9 };
+  record(trace_event::vmcall, record_try([&] { vmx_vmcall(rcx, rdx, r8, r9); }), fields);
+}
+
+// The GPR snapshot stubs (see regs.cpp) record what the instruction
+// changed in every register, since RSP is different every time.
+inline void record_regs(trace_regs const instruction, void (*stub)(uint64_t*), uint64_t* const regs) {
+  uint64_t const fields[] = { static_cast<uint64_t>(instruction), regs[0], regs[1] };
+  auto const status = record_try([&] { stub(regs); });
+
+  uint64_t changes[trace_gpr_count];
+  for (size_t i = 0; i < trace_gpr_count; ++i)
+    changes[i] = regs[trace_gpr_count + i] ^ regs[i];
+
+  record_event(trace_event::regs, status, fields, changes);
+
+  if (status)
+    ExRaiseStatus(static_cast<NTSTATUS>(status));
+}
+
+extern "C" inline void record_regs_cpuid(uint64_t* const regs) {
+  record_regs(trace_regs::cpuid, regs_cpuid, regs);
+}
+
+extern "C" inline void record_regs_rdtscp(uint64_t* const regs) {
+  record_regs(trace_regs::rdtscp, regs_rdtscp, regs);
+}
+
+extern "C" inline void record_regs_rdmsr(uint64_t* const regs) {
+  record_regs(trace_regs::rdmsr, regs_rdmsr, regs);
+}
+
+extern "C" inline void record_regs_xgetbv(uint64_t* const regs) {
+  record_regs(trace_regs::xgetbv, regs_xgetbv, regs);
+}
+
+extern "C" inline void record_regs_rdpid(uint64_t* const regs) {
+  record_regs(trace_regs::rdpid, regs_rdpid, regs);
+}
+
+extern "C" inline void record_regs_vmcall(uint64_t* const regs) {
+  record_regs(trace_regs::vmcall, regs_vmcall, regs);
+}
+
+// The extended state stubs (see xstate.cpp) record what changed in every
+// register that they stored, like the GPR snapshot stubs.
+inline void record_xstate(uint32_t const vector_size,
+    void (*stub)(xstate_registers const*, xstate_registers*, uint32_t, uint32_t),
+    xstate_registers const* const input, xstate_registers* const output,
+    uint32_t const leaf, uint32_t const count) {
+  uint64_t const fields[] = { vector_size, leaf, count };
+  auto const status = record_try([&] { stub(input, output, leaf, count); });
+
+  auto const before = reinterpret_cast<uint8_t const*>(input);
+  auto const after  = reinterpret_cast<uint8_t const*>(output);
+
+  uint8_t changes[trace_xstate_size];
+  for (size_t i = 0; i < trace_xstate_size; ++i)
+    changes[i] = after[i] ^ before[i];
+
+  record_event(trace_event::xstate, status, fields, changes);
+
+  if (status)
+    ExRaiseStatus(static_cast<NTSTATUS>(status));
+}
+
+extern "C" inline void record_xstate_sse(xstate_registers const* const input,
+    xstate_registers* const output, uint32_t const leaf, uint32_t const count) {
+  record_xstate(16, xstate_sse, input, output, leaf, count);
+}
+
+extern "C" inline void record_xstate_avx(xstate_registers const* const input,
+    xstate_registers* const output, uint32_t const leaf, uint32_t const count) {
+  record_xstate(32, xstate_avx, input, output, leaf, count);
+}
+
+extern "C" inline void record_xstate_avx512(xstate_registers const* const input,
+    xstate_registers* const output, uint32_t const leaf, uint32_t const count) {
+  record_xstate(64, xstate_avx512, input, output, leaf, count);
+}
+
+inline LARGE_INTEGER record_query_performance_counter(PLARGE_INTEGER const frequency) {
+  LARGE_INTEGER local_frequency;
+  auto const counter = KeQueryPerformanceCounter(&local_frequency);
+
+  if (frequency)
+    *frequency = local_frequency;
+
+  uint64_t const fields[] = { static_cast<uint64_t>(counter.QuadPart),
+    static_cast<uint64_t>(local_frequency.QuadPart) };
+
+  record(trace_event::performance_counter, 0, fields);
+  return counter;
+}
+
+inline NTSTATUS record_get_system_firmware_table(ULONG const provider, ULONG const table,
+    PVOID const buffer, ULONG const length, PULONG const return_length) {
+  ULONG size = 0;
+  auto const status = AuxKlibGetSystemFirmwareTable(provider, table, buffer, length, &size);
+
+  if (return_length)
+    *return_length = size;
+
+  uint64_t const fields[] = { provider, table, buffer ? length : 0,
+    static_cast<uint32_t>(status), size };
+
+  record_event(trace_event::firmware_table, 0, fields, buffer);
+  return status;
+}
+
+// the detections declare the assembly stubs themselves, which turns
+// those declarations into (matching) declarations of the wrappers
+#define check_rdtscp_regs record_check_rdtscp_regs
+#define xsetbv_full record_xsetbv_full
+#define vmx_vmcall record_vmx_vmcall
+#define regs_cpuid record_regs_cpuid
+#define regs_rdtscp record_regs_rdtscp
+#define regs_rdmsr record_regs_rdmsr
+#define regs_xgetbv record_regs_xgetbv
+#define regs_rdpid record_regs_rdpid
+#define regs_vmcall record_regs_vmcall
+#define xstate_sse record_xstate_sse
+#define xstate_avx record_xstate_avx
+#define xstate_avx512 record_xstate_avx512
+
+#define __rdtsc() record_rdtsc()
+#define __rdtscp(aux) record_rdtscp(aux)
+#define __cpuid(regs, leaf) record_cpuidex(regs, leaf, 0)
+#define __cpuidex(regs, leaf, subleaf) record_cpuidex(regs, leaf, subleaf)
+#define __readmsr(msr) record_readmsr(msr)
+#define __writemsr(msr, value) record_writemsr(msr, value)
+#define __readcr0() record_readcr(0)
+#define __readcr3() record_readcr(3)
+#define __readcr4() record_readcr(4)
+#define __writecr0(value) record_writecr(0, value)
+#define __writecr3(value) record_writecr(3, value)
+#define __writecr4(value) record_writecr(4, value)
+#define __readdr(dr) record_readdr(dr)
+#define __writedr(dr, value) record_writedr(dr, value)
+#define _xgetbv(xcr) record_xgetbv(xcr)
+#define _xsetbv(xcr, value) record_xsetbv(xcr, value)
+#define __vmx_on(address) record_vmx_on(address)
+#define __indword(port) record_indword(port)
+
+#define KeQueryPerformanceCounter(frequency) record_query_performance_counter(frequency)
+#define AuxKlibGetSystemFirmwareTable(provider, table, buffer, length, return_length)\
+  record_get_system_firmware_table(provider, table, buffer, length, return_length)
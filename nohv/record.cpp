@@ -0,0 +1,257 @@
+#include "record.h"
+
+#ifdef NOHV_RECORD
+
+#include "config.h"
+
+#include <ntddk.h>
+#include <ntstrsafe.h>
+
+// Number of bytes that are printed per "[#t]" line (see samples.cpp).
+inline constexpr size_t trace_bytes_per_line = 288;
+
+// Streams grow in chunks that are handed out from a single pool, since
+// most of the trace ends up on whichever processors the suite runs on.
+inline constexpr size_t trace_chunk_size = 64 * 1024;
+
+struct trace_chunk {
+  trace_chunk* next;
+  size_t size;
+  uint8_t data[trace_chunk_size - 2 * sizeof(size_t)];
+};
+
+struct trace_stream {
+  trace_chunk* first;
+  trace_chunk* last;
+
+  // total number of bytes in the stream
+  size_t size;
+
+  // set once the pool ran out, after which nothing else is recorded
+  bool truncated;
+
+  trace_history history;
+};
+
+// Every processor's stream, followed by the script.
+static trace_stream* streams = nullptr;
+static ULONG processor_count = 0;
+
+static trace_chunk* pool = nullptr;
+static size_t pool_capacity = 0;
+static volatile LONG64 pool_used = 0;
+
+static volatile LONG recording = 0;
+
+static trace_stream& script() {
+  return streams[processor_count];
+}
+
+static trace_chunk* allocate_chunk() {
+  auto const index = InterlockedIncrement64(&pool_used) - 1;
+  if (static_cast<size_t>(index) >= pool_capacity)
+    return nullptr;
+
+  auto const chunk = &pool[index];
+  chunk->next = nullptr;
+  chunk->size = 0;
+  return chunk;
+}
+
+// Append bytes to a stream, or mark it as truncated if it doesn't fit.
+static void stream_write(trace_stream& stream, uint8_t const* data, size_t size) {
+  if (stream.truncated)
+    return;
+
+  while (size) {
+    auto chunk = stream.last;
+
+    if (!chunk || chunk->size == sizeof(chunk->data)) {
+      chunk = allocate_chunk();
+
+      if (!chunk) {
+        stream.truncated = true;
+        return;
+      }
+
+      if (stream.last)
+        stream.last->next = chunk;
+      else
+        stream.first = chunk;
+
+      stream.last = chunk;
+    }
+
+    auto const room   = sizeof(chunk->data) - chunk->size;
+    auto const length = (size < room) ? size : room;
+    memcpy(chunk->data + chunk->size, data, length);
+
+    chunk->size += length;
+    stream.size += length;
+    data        += length;
+    size        -= length;
+  }
+}
+
+static void stream_write_varint(trace_stream& stream, uint64_t const value) {
+  uint8_t bytes[max_encoded_sample_size];
+  stream_write(stream, bytes, encode_varint(bytes, value));
+}
+
+// Allocate the trace (RecordTraceKb) and start recording.
+bool record_initialize() {
+  processor_count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+  auto const streams_size = (processor_count + 1) * sizeof(trace_stream);
+  streams = static_cast<trace_stream*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, streams_size, 'carT'));
+
+  pool_capacity = static_cast<size_t>(config.record_trace_kb) * 1024 / sizeof(trace_chunk);
+  pool = static_cast<trace_chunk*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, pool_capacity * sizeof(trace_chunk), 'carT'));
+
+  if (!streams || !pool) {
+    record_finish();
+    return false;
+  }
+
+  RtlZeroMemory(streams, streams_size);
+
+  DbgPrint("Recording a trace of up to %luKB.\n", config.record_trace_kb);
+
+  InterlockedExchange(&recording, 1);
+  return true;
+}
+
+void record_begin(char const* const name) {
+  if (!streams || !recording)
+    return;
+
+  auto& s = script();
+  auto const length = strlen(name);
+
+  stream_write_varint(s, static_cast<uint64_t>(trace_script::section));
+  stream_write_varint(s, length);
+  stream_write(s, reinterpret_cast<uint8_t const*>(name), length);
+  stream_write_varint(s, KeGetCurrentProcessorNumberEx(nullptr));
+
+  // nothing else is running on any of the other processors in between
+  // two sections, so their history can be reset from here
+  for (ULONG i = 0; i < processor_count; ++i) {
+    stream_write_varint(s, streams[i].size);
+    trace_history_reset(streams[i].history);
+  }
+}
+
+void record_end(bool const result) {
+  if (!streams || !recording)
+    return;
+
+  stream_write_varint(script(), static_cast<uint64_t>(trace_script::result));
+  stream_write_varint(script(), result ? 1 : 0);
+}
+
+void record_event(trace_event const kind, uint32_t const status,
+    uint64_t const* const fields, void const* const table) {
+  if (!recording)
+    return;
+
+  auto& stream = streams[KeGetCurrentProcessorNumberEx(nullptr)];
+
+  uint8_t bytes[trace_max_event_size];
+  stream_write(stream, bytes, trace_encode_event(stream.history, bytes, kind, status, fields));
+
+  if (table && !status)
+    stream_write(stream, static_cast<uint8_t const*>(table), trace_table_size(kind, fields));
+}
+
+// Print a header or a stream as "[#t]" lines.
+static void print_bytes(char const* const name, trace_chunk const* chunk,
+    uint8_t const* data, size_t size) {
+  uint8_t line[trace_bytes_per_line];
+  size_t line_size = 0;
+
+  while (size || chunk) {
+    if (!size && chunk) {
+      data  = chunk->data;
+      size  = chunk->size;
+      chunk = chunk->next;
+      continue;
+    }
+
+    auto const room   = sizeof(line) - line_size;
+    auto const length = (size < room) ? size : room;
+    memcpy(line + line_size, data, length);
+
+    line_size += length;
+    data      += length;
+    size      -= length;
+
+    if (line_size < sizeof(line) && (size || chunk))
+      continue;
+
+    char text[base64_length(trace_bytes_per_line) + 1];
+    base64_encode(line, line_size, text);
+    DbgPrint("[#t] %s: %s\n", name, text);
+
+    line_size = 0;
+  }
+}
+
+// Stop recording, print the trace, and free it.
+void record_finish() {
+  InterlockedExchange(&recording, 0);
+
+  // the size of every stream makes the header too large for the stack
+  auto const header_capacity = (6 + 2 * (processor_count + 1)) * max_encoded_sample_size;
+  auto const header = streams && pool ? static_cast<uint8_t*>(
+    ExAllocatePoolWithTag(NonPagedPoolNx, header_capacity, 'carT')) : nullptr;
+
+  if (header) {
+    size_t size = 0;
+
+    auto const write = [&](uint64_t const value) {
+      size += encode_varint(header + size, value);
+    };
+
+    write(trace_version);
+    write(processor_count);
+    write(config.irq_budget_us);
+    write(config.timing_iterations);
+    write(config.clock_window_ms);
+    write(config.clock_tolerance_ppm);
+
+    for (ULONG i = 0; i <= processor_count; ++i) {
+      write(streams[i].size);
+      write(streams[i].truncated);
+    }
+
+    print_bytes("header", nullptr, header, size);
+    print_bytes("script", script().first, nullptr, 0);
+
+    for (ULONG i = 0; i < processor_count; ++i) {
+      char name[16];
+      RtlStringCbPrintfA(name, sizeof(name), "%lu", i);
+      print_bytes(name, streams[i].first, nullptr, 0);
+    }
+
+    auto const chunks = static_cast<size_t>(pool_used);
+    DbgPrint("Recorded a %lluKB trace.\n", static_cast<uint64_t>(
+      ((chunks < pool_capacity) ? chunks : pool_capacity) * sizeof(trace_chunk) / 1024));
+
+    ExFreePoolWithTag(header, 'carT');
+  }
+  else if (streams && pool)
+    DbgPrint("Failed to allocate the trace header.\n");
+
+  if (pool)
+    ExFreePoolWithTag(pool, 'carT');
+
+  if (streams)
+    ExFreePoolWithTag(streams, 'carT');
+
+  pool    = nullptr;
+  streams = nullptr;
+}
+
+#endif
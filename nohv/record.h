@@ -0,0 +1,45 @@
+#pragma once
+
+// Recording of every processor interaction that the detections base their
+// decisions on (the values returned by CPUID, RDMSR, MOV CR, XGETBV, RDTSC
+// and friends, and which of them faulted) into a compact trace (see
+// trace.h), which tools/replay feeds back to the same detections on Linux.
+//
+// This is only compiled in when building with NohvRecord=true (which
+// defines NOHV_RECORD and force-includes record-intrin.h, which routes
+// the intrinsics through here). Otherwise, every function is a no-op.
+
+#include <stdint.h>
+
+#ifdef NOHV_RECORD
+
+#include "trace.h"
+
+// Allocate the trace (RecordTraceKb) and start recording.
+bool record_initialize();
+
+// Start a new section of the trace (e.g. a detection) on the current
+// logical processor.
+void record_begin(char const* name);
+
+// Record the result of the current section.
+void record_end(bool result);
+
+// Stop recording, print the trace, and free it.
+void record_finish();
+
+// Record an event on the current logical processor. The fields are the
+// arguments followed by the results (see trace_event_formats), and the
+// status is the exception code if the instruction faulted. The table is
+// appended to the event (see trace_table_size()).
+void record_event(trace_event kind, uint32_t status,
+  uint64_t const* fields, void const* table = nullptr);
+
+#else
+
+inline bool record_initialize() { return true; }
+inline void record_begin(char const*) {}
+inline void record_end(bool) {}
+inline void record_finish() {}
+
+#endif
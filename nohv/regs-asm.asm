@@ -0,0 +1,94 @@
+; Every stub takes a pointer to 32 qwords. It loads every general-purpose
+; register other than RSP from regs[0..15], executes a single instruction,
+; and stores every general-purpose register into regs[16..31]. Registers
+; are in the order of their encoding (rax, rcx, rdx, rbx, rsp, rbp, rsi,
+; rdi, r8-r15), and regs[4] is set to RSP right before the instruction.
+;
+; The nonvolatile registers are described by the unwind info, so that an
+; exception that the instruction raises can be caught by the caller.
+
+REGS_STUB macro name, instruction
+name proc frame
+  push rbx
+  .pushreg rbx
+  push rbp
+  .pushreg rbp
+  push rdi
+  .pushreg rdi
+  push rsi
+  .pushreg rsi
+  push r12
+  .pushreg r12
+  push r13
+  .pushreg r13
+  push r14
+  .pushreg r14
+  push r15
+  .pushreg r15
+  push rcx
+  .allocstack 8
+  .endprolog
+
+  mov [rcx + 20h], rsp
+  mov rax, [rcx + 00h]
+  mov rdx, [rcx + 10h]
+  mov rbx, [rcx + 18h]
+  mov rbp, [rcx + 28h]
+  mov rsi, [rcx + 30h]
+  mov rdi, [rcx + 38h]
+  mov r8,  [rcx + 40h]
+  mov r9,  [rcx + 48h]
+  mov r10, [rcx + 50h]
+  mov r11, [rcx + 58h]
+  mov r12, [rcx + 60h]
+  mov r13, [rcx + 68h]
+  mov r14, [rcx + 70h]
+  mov r15, [rcx + 78h]
+  mov rcx, [rcx + 08h]
+
+  instruction
+
+  ; every register is live, so spill rax to get at regs
+  push rax
+  mov rax, [rsp + 8]
+  mov [rax + 88h], rcx
+  mov [rax + 90h], rdx
+  mov [rax + 98h], rbx
+  mov [rax + 0A8h], rbp
+  mov [rax + 0B0h], rsi
+  mov [rax + 0B8h], rdi
+  mov [rax + 0C0h], r8
+  mov [rax + 0C8h], r9
+  mov [rax + 0D0h], r10
+  mov [rax + 0D8h], r11
+  mov [rax + 0E0h], r12
+  mov [rax + 0E8h], r13
+  mov [rax + 0F0h], r14
+  mov [rax + 0F8h], r15
+  pop rcx
+  mov [rax + 80h], rcx
+  mov [rax + 0A0h], rsp
+
+  add rsp, 8
+  pop r15
+  pop r14
+  pop r13
+  pop r12
+  pop rsi
+  pop rdi
+  pop rbp
+  pop rbx
+  ret
+name endp
+endm
+
+.code
+
+REGS_STUB regs_cpuid, cpuid
+REGS_STUB regs_rdtscp, rdtscp
+REGS_STUB regs_rdmsr, rdmsr
+REGS_STUB regs_xgetbv, xgetbv
+REGS_STUB regs_rdpid, <db 0F3h, 0Fh, 0C7h, 0F8h> ; rdpid rax
+REGS_STUB regs_vmcall, vmcall
+
+end
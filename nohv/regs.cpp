@@ -0,0 +1,128 @@
+#include <intrin.h>
+#include <ntddk.h>
+
+#include "caps.h"
+
+// These functions load every general-purpose register (other than RSP)
+// from regs[0..15], execute a single instruction, and store every
+// general-purpose register into regs[16..31] (see regs-asm.asm).
+extern "C" void regs_cpuid(uint64_t* regs);
+extern "C" void regs_rdtscp(uint64_t* regs);
+extern "C" void regs_rdmsr(uint64_t* regs);
+extern "C" void regs_xgetbv(uint64_t* regs);
+extern "C" void regs_rdpid(uint64_t* regs);
+extern "C" void regs_vmcall(uint64_t* regs);
+
+// General-purpose registers, in the order of their encoding.
+inline constexpr char const* gpr_names[] = {
+  "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+  "r8",  "r9",  "r10", "r11", "r12", "r13", "r14", "r15"
+};
+
+inline constexpr uint32_t gpr_count = 16;
+
+inline constexpr uint16_t gpr_rax = 1 << 0;
+inline constexpr uint16_t gpr_rcx = 1 << 1;
+inline constexpr uint16_t gpr_rdx = 1 << 2;
+inline constexpr uint16_t gpr_rbx = 1 << 3;
+
+// An instruction to execute, and the registers that it architecturally
+// writes (all of which are zero-extended, since the results are 32-bit).
+struct regs_test {
+  char const* name;
+  void (*stub)(uint64_t* regs);
+
+  // ECX is only an input for some instructions, but it doesn't hurt
+  uint32_t eax;
+  uint32_t ecx;
+
+  uint16_t written;
+};
+
+// XGETBV and RDPID don't cause vm-exits by themselves, but they're cheap
+// and show what an untouched snapshot looks like. VMCALL should raise a
+// #UD (in which case it's skipped), but a hypervisor that lets it return
+// has no business writing to any register.
+inline constexpr regs_test regs_tests[] = {
+  { "cpuid(0x0)",        regs_cpuid,  0x0000'0000, 0, gpr_rax | gpr_rbx | gpr_rcx | gpr_rdx },
+  { "cpuid(0x1)",        regs_cpuid,  0x0000'0001, 0, gpr_rax | gpr_rbx | gpr_rcx | gpr_rdx },
+  { "cpuid(0x7)",        regs_cpuid,  0x0000'0007, 0, gpr_rax | gpr_rbx | gpr_rcx | gpr_rdx },
+  { "cpuid(0xB)",        regs_cpuid,  0x0000'000B, 0, gpr_rax | gpr_rbx | gpr_rcx | gpr_rdx },
+  { "cpuid(0xD, 0x1)",   regs_cpuid,  0x0000'000D, 1, gpr_rax | gpr_rbx | gpr_rcx | gpr_rdx },
+  { "cpuid(0x40000000)", regs_cpuid,  0x4000'0000, 0, gpr_rax | gpr_rbx | gpr_rcx | gpr_rdx },
+  { "cpuid(0x80000001)", regs_cpuid,  0x8000'0001, 0, gpr_rax | gpr_rbx | gpr_rcx | gpr_rdx },
+  { "cpuid(0x80000008)", regs_cpuid,  0x8000'0008, 0, gpr_rax | gpr_rbx | gpr_rcx | gpr_rdx },
+  { "rdtscp",            regs_rdtscp, 0,           0, gpr_rax | gpr_rcx | gpr_rdx },
+  { "rdmsr(0x10)",       regs_rdmsr,  0,        0x10, gpr_rax | gpr_rdx },
+  { "rdmsr(0x3A)",       regs_rdmsr,  0,        0x3A, gpr_rax | gpr_rdx },
+  { "xgetbv(0)",         regs_xgetbv, 0,           0, gpr_rax | gpr_rdx },
+  { "rdpid",             regs_rdpid,  0,           0, gpr_rax },
+  { "vmcall",            regs_vmcall, 0,           0, 0 },
+};
+
+inline constexpr uint32_t regs_test_count = sizeof(regs_tests) / sizeof(regs_tests[0]);
+
+// A distinct value for every register. The upper half is never zero, so
+// that a register that isn't zero-extended stands out as well.
+static uint64_t gpr_poison(uint32_t const index) {
+  return 0xA5A5'0000'5A5A'0000ull | (static_cast<uint64_t>(index) << 40) | index;
+}
+
+// This detection executes every instruction in regs_tests with every
+// general-purpose register set to a distinct value, and then checks that
+// each one only wrote the registers that it architecturally writes (and
+// zero-extended them). An exit handler that forgets to restore a register,
+// or that writes a 64-bit value into one, is caught the same way for every
+// instruction. Instructions that raise an exception (e.g. RDPID on older
+// processors, or an MSR that doesn't exist) are skipped.
+//
+// Vol1[3.4.1.1(General-Purpose Registers in 64-Bit Mode)]
+bool regs_detected_1(cpu_caps const&) {
+  uint64_t snapshots[regs_test_count][gpr_count * 2];
+  bool faulted[regs_test_count] = {};
+
+  for (uint32_t i = 0; i < regs_test_count; ++i) {
+    auto const& test = regs_tests[i];
+    auto const  regs = snapshots[i];
+
+    for (uint32_t j = 0; j < gpr_count; ++j)
+      regs[j] = gpr_poison(j);
+
+    // only the lower halves are inputs
+    regs[0] = (regs[0] & ~0xFFFF'FFFFull) | test.eax;
+    regs[1] = (regs[1] & ~0xFFFF'FFFFull) | test.ecx;
+
+    __try {
+      test.stub(regs);
+    }
+    __except (1) {
+      faulted[i] = true;
+    }
+  }
+
+  bool detected = false;
+
+  for (uint32_t i = 0; i < regs_test_count; ++i) {
+    if (faulted[i])
+      continue;
+
+    auto const& test   = regs_tests[i];
+    auto const  input  = snapshots[i];
+    auto const  output = snapshots[i] + gpr_count;
+
+    for (uint32_t j = 0; j < gpr_count; ++j) {
+      auto const preserved = (test.written & (1 << j))
+        ? (output[j] >> 32) == 0 : output[j] == input[j];
+
+      if (preserved)
+        continue;
+
+      DbgPrint("    %s changed %s from 0x%llX to 0x%llX.\n",
+        test.name, gpr_names[j], input[j], output[j]);
+
+      detected = true;
+    }
+  }
+
+  return detected;
+}
@@ -0,0 +1,349 @@
+#include "samples.h"
+#include "config.h"
+#include "encoding.h"
+
+#include <ntddk.h>
+#include <ntstrsafe.h>
+
+// Number of samples that are printed per line, since DbgPrint()
+// truncates anything longer than 512 bytes.
+inline constexpr size_t samples_per_line = 16;
+
+// Number of encoded bytes that are printed per "[#z]" line, which leaves
+// room for the name of the detection and the series (4 base64 characters
+// for every 3 bytes).
+inline constexpr size_t encoded_bytes_per_line = 288;
+
+inline constexpr size_t large_page_size = 0x200000;
+
+// Size of the chunks that series are stored in, in arena words.
+inline constexpr size_t series_chunk_words = 32;
+
+// A piece of a series, which holds whole encoded samples. The encoder
+// carries on from one chunk into the next (the first sample of a chunk
+// is still relative to the last one of the previous chunk), so a series
+// decodes as if it was contiguous.
+struct sample_chunk {
+  sample_chunk* next;
+
+  // number of encoded bytes that follow the header
+  size_t size;
+};
+
+inline constexpr size_t series_chunk_capacity = series_chunk_words * sizeof(uint64_t) - sizeof(sample_chunk);
+
+static uint8_t* chunk_data(sample_chunk* const chunk) {
+  return reinterpret_cast<uint8_t*>(chunk + 1);
+}
+
+struct sample_series {
+  char const* name;
+
+  // samples are kept encoded (see encoding.h) in chunks that are carved
+  // from the arena as the series grows, so that a detection with a
+  // single series can use all of it
+  sample_chunk* first;
+  sample_chunk* last;
+  sample_encoder encoder;
+};
+
+// Decodes a series chunk by chunk.
+struct series_reader {
+  sample_chunk* chunk;
+  sample_decoder decoder;
+};
+
+static void reader_initialize(series_reader& reader, sample_series const& series) {
+  reader.chunk = series.first;
+  decoder_initialize(reader.decoder, nullptr, 0);
+
+  if (reader.chunk)
+    decoder_initialize(reader.decoder, chunk_data(reader.chunk), reader.chunk->size);
+}
+
+// Read the next sample of a series. Returns false at the end of it.
+static bool read_sample(series_reader& reader, uint64_t& value) {
+  while (!decode_sample(reader.decoder, value)) {
+    if (!reader.chunk || !reader.chunk->next)
+      return false;
+
+    reader.chunk = reader.chunk->next;
+    reader.decoder.position = chunk_data(reader.chunk);
+    reader.decoder.end      = reader.decoder.position + reader.chunk->size;
+  }
+
+  return true;
+}
+
+struct sample_state {
+  // name of the detection that is being recorded, or null
+  char const* name;
+
+  // optional tag that is appended to the name, or null
+  char const* tag;
+
+  size_t series_count;
+  sample_series series[max_sample_series];
+
+  // Preallocated storage for the samples of the current detection, which
+  // is handed out front to back and reset by samples_begin(). This way,
+  // nothing is allocated while a detection is running (possibly at a
+  // raised IRQL) and the samples don't have to fit on the stack.
+  uint64_t* arena;
+  size_t arena_capacity;
+  size_t arena_used;
+
+  // non-null if the arena is backed by large pages
+  PMDL arena_mdl;
+};
+
+// One entry for every logical processor, indexed by processor index.
+static sample_state* processor_states = nullptr;
+
+static sample_state& current_state() {
+  return processor_states[KeGetCurrentProcessorNumberEx(nullptr)];
+}
+
+// Allocate an arena out of large pages, so that walking through it
+// doesn't cause TLB misses in the middle of a measurement.
+static uint64_t* allocate_large_arena(size_t const size, PMDL& mdl) {
+  PHYSICAL_ADDRESS low = {}, high = {}, skip = {};
+  high.QuadPart = MAXLONGLONG;
+
+  mdl = MmAllocateNodePagesForMdlEx(low, high, skip, size, MmCached,
+    MM_ANY_NODE_OK, MM_ALLOCATE_FULLY_REQUIRED | MM_ALLOCATE_FAST_LARGE_PAGES);
+
+  if (!mdl)
+    return nullptr;
+
+  auto const arena = MmMapLockedPagesSpecifyCache(mdl, KernelMode, MmCached,
+    nullptr, FALSE, NormalPagePriority | MdlMappingNoExecute);
+
+  if (!arena) {
+    MmFreePagesFromMdl(mdl);
+    ExFreePool(mdl);
+    mdl = nullptr;
+  }
+
+  return static_cast<uint64_t*>(arena);
+}
+
+static void free_arena(sample_state& state) {
+  if (state.arena_mdl) {
+    MmUnmapLockedPages(state.arena, state.arena_mdl);
+    MmFreePagesFromMdl(state.arena_mdl);
+    ExFreePool(state.arena_mdl);
+  }
+  else if (state.arena)
+    ExFreePoolWithTag(state.arena, 'lpmS');
+
+  state.arena     = nullptr;
+  state.arena_mdl = nullptr;
+}
+
+// Allocate the per-processor sample storage.
+bool samples_initialize() {
+  auto const count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+  processor_states = static_cast<sample_state*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, count * sizeof(sample_state), 'lpmS'));
+
+  if (!processor_states)
+    return false;
+
+  RtlZeroMemory(processor_states, count * sizeof(sample_state));
+
+  auto const arena_size = static_cast<size_t>(config.sample_arena_kb) * 1024;
+  size_t large_count = 0;
+
+  for (ULONG i = 0; i < count; ++i) {
+    auto& state = processor_states[i];
+
+    // large pages only make sense for whole large pages
+    if (arena_size && arena_size % large_page_size == 0)
+      state.arena = allocate_large_arena(arena_size, state.arena_mdl);
+
+    if (state.arena_mdl)
+      ++large_count;
+    else if (arena_size) {
+      state.arena = static_cast<uint64_t*>(ExAllocatePoolWithTag(
+        NonPagedPoolNx, arena_size, 'lpmS'));
+    }
+
+    if (arena_size && !state.arena) {
+      samples_free();
+      return false;
+    }
+
+    // this also makes sure that every page is present ahead of time
+    if (state.arena)
+      RtlZeroMemory(state.arena, arena_size);
+
+    state.arena_capacity = arena_size / sizeof(uint64_t);
+  }
+
+  DbgPrint("Sample arena: %lluKB per processor, %llu of %lu with large pages.\n",
+    static_cast<uint64_t>(arena_size / 1024), static_cast<uint64_t>(large_count), count);
+
+  return true;
+}
+
+// Free the memory that was allocated by samples_initialize().
+void samples_free() {
+  if (processor_states) {
+    auto const count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    for (ULONG i = 0; i < count; ++i)
+      free_arena(processor_states[i]);
+
+    ExFreePoolWithTag(processor_states, 'lpmS');
+  }
+
+  processor_states = nullptr;
+}
+
+// Start recording samples for the specified detection.
+void samples_begin(char const* const name, char const* const tag) {
+  auto& state = current_state();
+  state.name         = name;
+  state.tag          = tag;
+  state.series_count = 0;
+  state.arena_used   = 0;
+}
+
+// Carve a buffer out of the current logical processor's arena.
+uint64_t* samples_allocate(size_t const count) {
+  auto& state = current_state();
+  if (!state.name || state.arena_capacity - state.arena_used < count)
+    return nullptr;
+
+  auto const buffer = state.arena + state.arena_used;
+  state.arena_used += count;
+
+  return buffer;
+}
+
+// Record a raw measurement for the specified series.
+void record_sample(char const* const series, uint64_t const value) {
+  auto& state = current_state();
+  if (!state.name)
+    return;
+
+  sample_series* entry = nullptr;
+
+  for (size_t i = 0; i < state.series_count; ++i) {
+    if (strcmp(state.series[i].name, series) == 0) {
+      entry = &state.series[i];
+      break;
+    }
+  }
+
+  if (!entry) {
+    if (state.series_count >= max_sample_series)
+      return;
+
+    entry = &state.series[state.series_count++];
+    entry->name  = series;
+    entry->first = nullptr;
+    entry->last  = nullptr;
+
+    // the first sample allocates the first chunk
+    encoder_initialize(entry->encoder, nullptr, 0);
+  }
+
+  // samples that don't fit are dropped
+  if (entry->encoder.count >= config.series_samples)
+    return;
+
+  if (!encode_sample(entry->encoder, value)) {
+    auto const chunk = reinterpret_cast<sample_chunk*>(samples_allocate(series_chunk_words));
+    if (!chunk)
+      return;
+
+    chunk->next = nullptr;
+    chunk->size = 0;
+
+    if (entry->last)
+      entry->last->next = chunk;
+    else
+      entry->first = chunk;
+
+    entry->last = chunk;
+
+    // the count and the previous sample carry on into the new chunk
+    entry->encoder.buffer   = chunk_data(chunk);
+    entry->encoder.capacity = series_chunk_capacity;
+    entry->encoder.size     = 0;
+
+    encode_sample(entry->encoder, value);
+  }
+
+  entry->last->size = entry->encoder.size;
+}
+
+// Print a series as plain decimal samples.
+static void print_plain_series(sample_state const& state, sample_series const& series) {
+  series_reader reader;
+  reader_initialize(reader, series);
+
+  uint64_t value = 0;
+  auto pending = read_sample(reader, value);
+
+  while (pending) {
+    char line[512];
+    char* end        = line;
+    size_t remaining = sizeof(line);
+
+    RtlStringCbPrintfExA(end, remaining, &end, &remaining, 0,
+      "[#] %s%s%s %s:", state.name, state.tag ? "@" : "",
+      state.tag ? state.tag : "", series.name);
+
+    for (size_t k = 0; pending && k < samples_per_line; ++k) {
+      RtlStringCbPrintfExA(end, remaining, &end, &remaining, 0, " %llu", value);
+      pending = read_sample(reader, value);
+    }
+
+    DbgPrint("%s\n", line);
+  }
+}
+
+// Print a series in its encoded form. Every line is re-encoded from
+// scratch, so that it can be decoded on its own.
+static void print_encoded_series(sample_state const& state, sample_series const& series) {
+  series_reader reader;
+  reader_initialize(reader, series);
+
+  uint64_t value = 0;
+  auto pending = read_sample(reader, value);
+
+  while (pending) {
+    uint8_t chunk[encoded_bytes_per_line];
+    sample_encoder encoder;
+    encoder_initialize(encoder, chunk, sizeof(chunk));
+
+    while (pending && encode_sample(encoder, value))
+      pending = read_sample(reader, value);
+
+    char text[base64_length(encoded_bytes_per_line) + 1];
+    base64_encode(chunk, encoder.size, text);
+
+    DbgPrint("[#z] %s%s%s %s: %s\n", state.name, state.tag ? "@" : "",
+      state.tag ? state.tag : "", series.name, text);
+  }
+}
+
+// Print every sample that was recorded since samples_begin().
+void samples_end() {
+  auto& state = current_state();
+  if (!state.name)
+    return;
+
+  for (size_t i = 0; i < state.series_count; ++i) {
+    if (config.compress_samples)
+      print_encoded_series(state, state.series[i]);
+    else
+      print_plain_series(state, state.series[i]);
+  }
+
+  state.name       = nullptr;
+  state.arena_used = 0;
+}
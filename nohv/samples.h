@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Maximum number of series (e.g. "tsc", "mperf") that a single detection
+// can record. The number of samples that a series can hold is
+// configurable (SeriesSamples), and every series is stored encoded (see
+// encoding.h) in a per-processor arena (SampleArenaKb).
+inline constexpr size_t max_sample_series = 8;
+
+// Allocate the per-processor sample storage.
+bool samples_initialize();
+
+// Free the memory that was allocated by samples_initialize().
+void samples_free();
+
+// Start recording samples for the specified detection on the
+// current logical processor. If a tag is specified (e.g. the core type
+// that the detection ran on), it is appended to the detection name.
+void samples_begin(char const* name, char const* tag = nullptr);
+
+// Allocate a buffer of the specified number of samples from the current
+// logical processor's arena, which is valid until samples_end(). This
+// never calls into the memory manager, so it can be used at any IRQL.
+// Returns null if the arena is too small, or if samples aren't currently
+// being recorded on this logical processor.
+uint64_t* samples_allocate(size_t count);
+
+// Record a raw measurement for the specified series. This is a no-op if
+// samples aren't currently being recorded on this logical processor.
+void record_sample(char const* series, uint64_t value);
+
+// Print every sample that was recorded since samples_begin() and
+// stop recording. Every line has the following format:
+//
+//   [#] <detection>[@<tag>] <series>: <sample> <sample> ...
+//
+// or, with CompressSamples, as "[#z]" lines (see encoding.h).
+void samples_end();
@@ -0,0 +1,341 @@
+#include "schedule.h"
+#include "config.h"
+#include "detections.h"
+
+#define DETECTION(x, file, flags, cost_us, coverage, sensitivity) { #x, x, file, flags, cost_us, false, coverage, sensitivity, true, false, false }
+
+// Every detection, in the order of detections.h. The costs are rough
+// estimates for the first load, which are replaced by measurements. The
+// sensitivities (in 0.1%) are what "roc --count 4000 --seed 7" reports,
+// so they're only as good as its mock hypervisors (see tools/mock).
+static detection_entry detections[] = {
+  DETECTION(cpuid_detected_1,  "cpuid",  0, 1,
+    coverage_cpuid, 91),
+  DETECTION(msr_detected_1,    "msr",    0, 300,
+    coverage_msr | coverage_injection, 93),
+  DETECTION(msr_detected_2,    "msr",    0, 5,
+    coverage_msr, 98),
+  DETECTION(cr0_detected_1,    "cr0",    detection_cr0, 100,
+    coverage_cr | coverage_reserved, 104),
+  DETECTION(cr0_detected_2,    "cr0",    detection_cr0, 100,
+    coverage_cr | coverage_reserved, 97),
+  DETECTION(cr0_detected_3,    "cr0",    detection_cr0, 50,
+    coverage_cr | coverage_reserved, 90),
+  DETECTION(cr3_detected_1,    "cr3",    detection_cr3, 50,
+    coverage_cr | coverage_reserved, 29),
+  DETECTION(cr3_detected_2,    "cr3",    detection_cr3 | detection_cr4, 10,
+    coverage_cr | coverage_reserved, 33),
+  DETECTION(cr3_detected_3,    "cr3",    detection_cr3 | detection_cr4, 10,
+    coverage_cr | coverage_reserved, 7),
+  DETECTION(cr3_detected_4,    "cr3",    detection_timing | detection_core_type | detection_cr3 | detection_cr4, 200,
+    coverage_cr | coverage_latency, 134),
+  DETECTION(cr4_detected_1,    "cr4",    detection_cr4, 5,
+    coverage_cr | coverage_vmx, 99),
+  DETECTION(cr4_detected_2,    "cr4",    detection_cr4, 5,
+    coverage_cr | coverage_reserved, 188),
+  DETECTION(cr4_detected_3,    "cr4",    detection_cr4, 100,
+    coverage_cr | coverage_reserved, 92),
+  DETECTION(cr4_detected_4,    "cr4",    detection_cr4, 50,
+    coverage_cr | coverage_reserved, 92),
+  DETECTION(xsetbv_detected_1, "xsetbv", detection_xcr0, 5,
+    coverage_xsetbv | coverage_reserved, 106),
+  DETECTION(xsetbv_detected_2, "xsetbv", detection_xcr0, 100,
+    coverage_xsetbv | coverage_reserved, 99),
+  DETECTION(xsetbv_detected_3, "xsetbv", detection_xcr0, 5,
+    coverage_xsetbv | coverage_reserved, 78),
+  DETECTION(xsetbv_detected_4, "xsetbv", detection_xcr0, 5,
+    coverage_xsetbv | coverage_reserved, 96),
+  DETECTION(xsetbv_detected_5, "xsetbv", detection_xcr0, 50,
+    coverage_xsetbv | coverage_reserved, 98),
+  DETECTION(xstate_detected_1, "xstate", 0, 100,
+    coverage_cpuid | coverage_preservation, 103),
+  DETECTION(timing_detected_1, "timing", detection_timing | detection_core_type, 50,
+    coverage_cpuid | coverage_latency, 658),
+  DETECTION(timing_detected_2, "timing", detection_timing, 1'000,
+    coverage_cpuid | coverage_compensation, 387),
+  DETECTION(timing_detected_3, "timing", detection_timing | detection_core_type | detection_msr, 50,
+    coverage_cpuid | coverage_latency, 900),
+  DETECTION(timing_detected_4, "timing", detection_timing | detection_core_type, 50,
+    coverage_cpuid | coverage_latency, 723),
+  DETECTION(timing_detected_5, "timing", detection_timing | detection_core_type, 50,
+    coverage_cpuid | coverage_latency, 723),
+  DETECTION(timing_detected_6, "timing",
+    detection_timing | detection_pollutes | detection_core_type | detection_cr0 | detection_msr, 5'000,
+    coverage_msr | coverage_memory_types, 128),
+  DETECTION(timing_detected_7, "timing", detection_core_type, 5,
+    coverage_preservation, 112),
+  DETECTION(timing_detected_8, "timing", detection_timing | detection_core_type, 400'000,
+    coverage_cpuid | coverage_compensation, 322),
+  DETECTION(debug_detected_1,  "debug",  detection_dr, 5,
+    coverage_cpuid | coverage_preservation, 100),
+  DETECTION(debug_detected_2,  "debug",  detection_dr, 20,
+    coverage_cpuid | coverage_xsetbv | coverage_preservation, 189),
+  DETECTION(debug_detected_3,  "debug",  detection_msr, 20,
+    coverage_msr | coverage_preservation, 99),
+  DETECTION(debug_detected_4,  "debug",  detection_timing | detection_core_type | detection_dr, 50,
+    coverage_dr | coverage_latency, 298),
+  DETECTION(vmx_detected_1,    "vmx",    detection_cr4, 5,
+    coverage_vmx | coverage_injection, 95),
+  DETECTION(vmx_detected_2,    "vmx",    detection_cr0 | detection_cr4, 5,
+    coverage_vmx | coverage_injection, 412),
+  DETECTION(vmx_detected_3,    "vmx",    detection_cr4, 5,
+    coverage_vmx | coverage_injection, 95),
+  DETECTION(regs_detected_1,   "regs",   0, 20,
+    coverage_cpuid | coverage_preservation | coverage_injection, 199),
+};
+
+inline constexpr ULONG detection_count = sizeof(detections) / sizeof(detections[0]);
+
+// Indices into detections, in the order that they run in.
+static ULONG order[detection_count];
+
+// Costs key, which stays open until schedule_save().
+static HANDLE costs_key;
+
+// Version of the costs in the Costs key, which changes whenever the way
+// that they're measured does. Version 1 (or no version) was measured with
+// KeQueryInterruptTime(), which only advances once per clock tick.
+inline constexpr ULONG costs_version = 2;
+
+// Convert a detection name into a registry value name.
+static void value_name(char const* const name, WCHAR (&buffer)[64], UNICODE_STRING& string) {
+  USHORT length = 0;
+  for (; name[length] && length < 63; ++length)
+    buffer[length] = static_cast<WCHAR>(name[length]);
+
+  buffer[length] = L'\0';
+
+  string.Buffer        = buffer;
+  string.Length        = length * sizeof(WCHAR);
+  string.MaximumLength = sizeof(buffer);
+}
+
+// Read a REG_DWORD from the Costs key.
+static bool query_dword(UNICODE_STRING& name, ULONG& value) {
+  UCHAR info_buffer[sizeof(KEY_VALUE_PARTIAL_INFORMATION) + sizeof(ULONG)] = {};
+  auto const info = reinterpret_cast<PKEY_VALUE_PARTIAL_INFORMATION>(info_buffer);
+
+  ULONG size = 0;
+  auto const status = ZwQueryValueKey(costs_key, &name,
+    KeyValuePartialInformation, info, sizeof(info_buffer), &size);
+
+  if (!NT_SUCCESS(status) || info->Type != REG_DWORD || info->DataLength != sizeof(ULONG))
+    return false;
+
+  value = *reinterpret_cast<ULONG*>(info->Data);
+  return true;
+}
+
+// Read the cost of every detection that a previous load saved, or delete
+// them if they were measured differently.
+static void load_costs() {
+  UNICODE_STRING version_name = RTL_CONSTANT_STRING(L"Version");
+
+  ULONG version = 0;
+  auto const current = query_dword(version_name, version) && version == costs_version;
+
+  for (auto& detection : detections) {
+    WCHAR buffer[64];
+    UNICODE_STRING name;
+    value_name(detection.name, buffer, name);
+
+    if (!current) {
+      ZwDeleteValueKey(costs_key, &name);
+      continue;
+    }
+
+    ULONG cost_us = 0;
+    if (!query_dword(name, cost_us))
+      continue;
+
+    detection.cost_us  = cost_us;
+    detection.measured = true;
+  }
+
+  if (!current) {
+    version = costs_version;
+    ZwSetValueKey(costs_key, &version_name, 0, REG_DWORD, &version, sizeof(ULONG));
+  }
+}
+
+// Open (or create) the Costs key under the driver's service key.
+static void open_costs_key(PUNICODE_STRING const registry_path) {
+  OBJECT_ATTRIBUTES attributes;
+  InitializeObjectAttributes(&attributes, registry_path,
+    OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, nullptr, nullptr);
+
+  HANDLE service_key = nullptr;
+  if (!NT_SUCCESS(ZwOpenKey(&service_key, KEY_READ, &attributes)))
+    return;
+
+  UNICODE_STRING costs_name = RTL_CONSTANT_STRING(L"Costs");
+  InitializeObjectAttributes(&attributes, &costs_name,
+    OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, service_key, nullptr);
+
+  if (!NT_SUCCESS(ZwCreateKey(&costs_key, KEY_QUERY_VALUE | KEY_SET_VALUE,
+      &attributes, 0, nullptr, REG_OPTION_NON_VOLATILE, nullptr)))
+    costs_key = nullptr;
+
+  ZwClose(service_key);
+}
+
+// 0 for detections that leave the caches alone, and 1 for the ones
+// that pollute them (and run last).
+static ULONG phase(detection_entry const& detection) {
+  return (detection.flags & detection_pollutes) ? 1 : 0;
+}
+
+// Total cost of the detections that are grouped with the specified one.
+static uint64_t group_cost(detection_entry const& detection) {
+  auto const mask = detection_pollutes | detection_timing | detection_state;
+
+  uint64_t cost = 0;
+
+  for (auto const& other : detections) {
+    if ((other.flags & mask) == (detection.flags & mask))
+      cost += other.cost_us;
+  }
+
+  return cost;
+}
+
+// Whether the first detection should run before the second one.
+static bool runs_before(detection_entry const& first, detection_entry const& second) {
+  if (phase(first) != phase(second))
+    return phase(first) < phase(second);
+
+  // timing detections measure a clean slate
+  auto const first_timing  = (first.flags & detection_timing) != 0;
+  auto const second_timing = (second.flags & detection_timing) != 0;
+
+  if (first_timing != second_timing)
+    return first_timing;
+
+  // run the detections that change the same state back-to-back,
+  // cheapest group (and then cheapest detection) first
+  auto const first_state  = first.flags & detection_state;
+  auto const second_state = second.flags & detection_state;
+
+  if (first_state != second_state) {
+    auto const first_group  = group_cost(first);
+    auto const second_group = group_cost(second);
+
+    if (first_group != second_group)
+      return first_group < second_group;
+
+    return first_state < second_state;
+  }
+
+  return first.cost_us < second.cost_us;
+}
+
+void schedule_initialize(PUNICODE_STRING const registry_path) {
+  open_costs_key(registry_path);
+
+  if (costs_key)
+    load_costs();
+
+  for (ULONG i = 0; i < detection_count; ++i)
+    order[i] = i;
+
+  if (!config.schedule_checks)
+    return;
+
+  // insertion sort, which keeps the order of detections.h for ties
+  for (ULONG i = 1; i < detection_count; ++i) {
+    auto const index = order[i];
+
+    ULONG j = i;
+    for (; j > 0 && runs_before(detections[index], detections[order[j - 1]]); --j)
+      order[j] = order[j - 1];
+
+    order[j] = index;
+  }
+}
+
+// Number of classes in a coverage mask.
+static ULONG coverage_weight(ULONG coverage) {
+  ULONG weight = 0;
+  for (; coverage; coverage &= coverage - 1)
+    ++weight;
+
+  return weight;
+}
+
+ULONG schedule_select(ULONG const budget_us, ULONG const core_types) {
+  for (auto& detection : detections)
+    detection.selected = false;
+
+  ULONG covered = 0;
+  uint64_t remaining = budget_us;
+
+  while (true) {
+    detection_entry* best = nullptr;
+    uint64_t best_cost    = 0;
+    ULONG best_weight     = 0;
+
+    for (auto& detection : detections) {
+      if (detection.selected)
+        continue;
+
+      auto const weight = coverage_weight(detection.coverage & ~covered);
+      auto const cost   = static_cast<uint64_t>(detection.cost_us) *
+        ((detection.flags & detection_core_type) ? core_types : 1);
+
+      if (!weight || cost > remaining)
+        continue;
+
+      // weight / cost > best_weight / best_cost, without dividing (or
+      // dividing by zero for detections that take less than a microsecond)
+      if (!best || weight * (best_cost + 1) > best_weight * (cost + 1)) {
+        best        = &detection;
+        best_cost   = cost;
+        best_weight = weight;
+      }
+    }
+
+    if (!best)
+      break;
+
+    best->selected = true;
+    covered   |= best->coverage;
+    remaining -= best_cost;
+  }
+
+  return covered;
+}
+
+ULONG schedule_count() {
+  return detection_count;
+}
+
+detection_entry& schedule_entry(ULONG const index) {
+  return detections[order[index]];
+}
+
+void schedule_update_cost(detection_entry& detection, uint64_t const elapsed_us) {
+  auto const elapsed = (elapsed_us > MAXULONG) ? MAXULONG : static_cast<ULONG>(elapsed_us);
+
+  // a single slow run (e.g. one that was preempted) shouldn't reorder everything
+  detection.cost_us  = detection.measured ? (detection.cost_us * 3 + elapsed) / 4 : elapsed;
+  detection.measured = true;
+}
+
+void schedule_save() {
+  if (!costs_key)
+    return;
+
+  for (auto& detection : detections) {
+    if (!detection.measured)
+      continue;
+
+    WCHAR buffer[64];
+    UNICODE_STRING name;
+    value_name(detection.name, buffer, name);
+
+    ZwSetValueKey(costs_key, &name, 0, REG_DWORD, &detection.cost_us, sizeof(ULONG));
+  }
+
+  ZwClose(costs_key);
+  costs_key = nullptr;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <ntddk.h>
+
+#include "caps.h"
+
+// What a detection does, which the scheduler orders the detections by.
+inline constexpr ULONG detection_timing    = 1 << 0; // result depends on latencies
+inline constexpr ULONG detection_pollutes  = 1 << 1; // flushes caches or changes memory types
+inline constexpr ULONG detection_core_type = 1 << 2; // runs on every core type
+inline constexpr ULONG detection_cr0       = 1 << 3; // state that the detection changes
+inline constexpr ULONG detection_cr3       = 1 << 4;
+inline constexpr ULONG detection_cr4       = 1 << 5;
+inline constexpr ULONG detection_xcr0      = 1 << 6;
+inline constexpr ULONG detection_dr        = 1 << 7;
+inline constexpr ULONG detection_msr       = 1 << 8;
+
+inline constexpr ULONG detection_state = detection_cr0 | detection_cr3 |
+  detection_cr4 | detection_xcr0 | detection_dr | detection_msr;
+
+// Exit reasons and classes of hypervisor bugs that a detection exercises,
+// which quick mode (QuickBudgetUs) tries to cover as many of as it can.
+inline constexpr ULONG coverage_cpuid         = 1 << 0;  // exit: CPUID
+inline constexpr ULONG coverage_msr           = 1 << 1;  // exit: RDMSR/WRMSR
+inline constexpr ULONG coverage_cr            = 1 << 2;  // exit: MOV to CR
+inline constexpr ULONG coverage_xsetbv        = 1 << 3;  // exit: XSETBV
+inline constexpr ULONG coverage_dr            = 1 << 4;  // exit: MOV DR
+inline constexpr ULONG coverage_vmx           = 1 << 5;  // exit: VMX instructions
+inline constexpr ULONG coverage_latency       = 1 << 6;  // bug: exits take measurably long
+inline constexpr ULONG coverage_compensation  = 1 << 7;  // bug: TSC offsetting to hide exits
+inline constexpr ULONG coverage_reserved      = 1 << 8;  // bug: reserved bits aren't checked
+inline constexpr ULONG coverage_preservation  = 1 << 9;  // bug: guest state isn't preserved
+inline constexpr ULONG coverage_injection     = 1 << 10; // bug: wrong (or no) exception injected
+inline constexpr ULONG coverage_memory_types  = 1 << 11; // bug: EPT memory types are wrong
+
+inline constexpr ULONG coverage_count = 12;
+
+inline constexpr char const* coverage_names[coverage_count] = {
+  "cpuid", "msr", "cr", "xsetbv", "dr", "vmx",
+  "latency", "compensation", "reserved", "preservation", "injection", "memory_types"
+};
+
+struct detection_entry {
+  char const* name;
+  bool (*detect)(cpu_caps const&);
+
+  // source file (without the extension), which is printed before
+  // every run of detections from the same file
+  char const* file;
+
+  ULONG flags;
+
+  // how long the detection takes (in microseconds), which is an estimate
+  // until it's been measured once (and then saved in the registry)
+  ULONG cost_us;
+  bool measured;
+
+  ULONG coverage;
+
+  // the fraction of hypervisors that fail the detection (in 0.1%)
+  ULONG sensitivity;
+
+  // whether the detection runs at all (see schedule_select())
+  bool selected;
+
+  // whether it ran, and whether it failed on any logical processor that
+  // it ran on (see fingerprint_host())
+  bool ran;
+  bool detected;
+};
+
+// Read the costs that previous loads measured from the Costs key next to
+// Parameters, and order the detections. Detections that pollute the
+// caches always run last (in their own phase). With ScheduleChecks, the
+// timing detections of a phase run before the rest, and the others are
+// grouped by the state that they change (cheapest group first).
+// Otherwise, they run in the order of detections.h.
+void schedule_initialize(PUNICODE_STRING registry_path);
+
+// Number of detections, and the detection that runs at the specified
+// position.
+ULONG schedule_count();
+detection_entry& schedule_entry(ULONG index);
+
+// Quick mode: only select the detections that cover the most exit reasons
+// and bug classes within the specified budget (in microseconds), picking
+// the one that covers the most classes that aren't covered yet per
+// microsecond until nothing else fits. Detections that run on every core
+// type cost that many times as much. Returns the classes that are covered.
+ULONG schedule_select(ULONG budget_us, ULONG core_types);
+
+// Update the cost of a detection with how long it just took.
+void schedule_update_cost(detection_entry& detection, uint64_t elapsed_us);
+
+// Save the costs in the registry.
+void schedule_save();
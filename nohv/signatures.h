@@ -0,0 +1,35 @@
+#pragma once
+
+// Generated by tools/fingerprint from 0 host(s) in 0 family(s), don't
+// edit. To add a family, collect the "[#f]" lines of hosts that run it
+// and retrain every family at once:
+//
+//   fingerprint train --output nohv/signatures.h <family>=<log>...
+
+#include "host-features.h"
+
+// the feature layout that the signatures were trained with
+inline constexpr uint32_t fingerprint_signature_layout = 1;
+
+inline constexpr uint32_t fingerprint_weights[fingerprint_feature_count] = {
+  256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256,
+  256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256,
+  256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256,
+  256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256, 256,
+  256, 256, 256, 256
+};
+
+inline constexpr size_t fingerprint_signature_count = 0;
+
+// the last entry is a sentinel, so that the array is never empty
+inline constexpr fingerprint_signature fingerprint_signatures[fingerprint_signature_count + 1] = {
+  { nullptr, {}, 0 }
+};
+
+// see known_bugs in tools/fingerprint
+inline constexpr size_t fingerprint_known_bug_count = 1;
+
+inline constexpr fingerprint_known_bug fingerprint_known_bugs[fingerprint_known_bug_count + 1] = {
+  { "xsetbv_detected_3", "hvpp, zpp_hypervisor, SimpleVisor or HyperDbg" },
+  { nullptr, nullptr }
+};
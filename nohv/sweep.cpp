@@ -0,0 +1,232 @@
+#include "sweep.h"
+#include "config.h"
+#include "schedule.h"
+
+#include <ntddk.h>
+
+// The results of a single logical processor.
+struct sweep_shard {
+  PROCESSOR_NUMBER processor;
+  PKTHREAD thread;
+  bool (*cancelled)();
+
+  // node that the processor reported that it's on
+  USHORT node;
+
+  // bit N is set if the Nth detection in the schedule ran (or detected)
+  RTL_BITMAP ran;
+  RTL_BITMAP detected;
+};
+
+// Largest number of groups that a NUMA node can span.
+inline constexpr USHORT max_node_groups = 32;
+
+// Whether a detection can run on every logical processor at the same time.
+// Timing detections would measure the contention between SMT siblings,
+// and the others already run on every core type.
+static bool sweepable(detection_entry const& detection) {
+  return !(detection.flags & (detection_timing | detection_pollutes | detection_core_type));
+}
+
+// Run every sweepable detection on the shard's logical processor.
+static void sweep_thread(PVOID const context) {
+  auto& shard = *static_cast<sweep_shard*>(context);
+
+  GROUP_AFFINITY affinity = {};
+  affinity.Group = shard.processor.Group;
+  affinity.Mask  = 1ull << shard.processor.Number;
+  KeSetSystemGroupAffinityThread(&affinity, nullptr);
+
+  shard.node = KeGetCurrentNodeNumber();
+
+  auto const count = schedule_count();
+
+  for (ULONG i = 0; i < count && !shard.cancelled(); ++i) {
+    auto const& detection = schedule_entry(i);
+    if (!sweepable(detection))
+      continue;
+
+    RtlSetBit(&shard.ran, i);
+
+    if (detection.detect(current_cpu_caps()))
+      RtlSetBit(&shard.detected, i);
+  }
+
+  PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+// Find the NUMA node whose affinity contains the specified processor, in
+// any of the groups that the node spans (KeQueryNodeActiveAffinity() only
+// reports the primary one).
+static USHORT processor_node(PROCESSOR_NUMBER const& processor) {
+  auto const highest = KeQueryHighestNodeNumber();
+
+  for (USHORT node = 0; node <= highest; ++node) {
+    GROUP_AFFINITY affinities[max_node_groups] = {};
+    USHORT count = 0;
+
+    if (!NT_SUCCESS(KeQueryNodeActiveAffinity2(node, affinities, max_node_groups, &count)))
+      continue;
+
+    for (USHORT i = 0; i < count; ++i) {
+      if (affinities[i].Group == processor.Group && (affinities[i].Mask & (1ull << processor.Number)))
+        return node;
+    }
+  }
+
+  return 0;
+}
+
+// Pick which logical processors to sweep. With SweepPerNode, that many
+// processors are picked from every node, spread out evenly over the node
+// (so that they aren't all SMT siblings of the same core).
+static ULONG select_processors(sweep_shard* const shards, ULONG const count) {
+  auto const highest = KeQueryHighestNodeNumber();
+
+  ULONG selected = 0;
+
+  for (USHORT node = 0; node <= highest; ++node) {
+    ULONG node_count = 0;
+    for (ULONG i = 0; i < count; ++i) {
+      PROCESSOR_NUMBER number = {};
+      KeGetProcessorNumberFromIndex(i, &number);
+      node_count += (processor_node(number) == node);
+    }
+
+    if (!node_count)
+      continue;
+
+    auto const stride = (config.sweep_per_node && config.sweep_per_node < node_count)
+      ? node_count / config.sweep_per_node : 1;
+
+    ULONG position = 0, picked = 0;
+
+    for (ULONG i = 0; i < count; ++i) {
+      PROCESSOR_NUMBER number = {};
+      KeGetProcessorNumberFromIndex(i, &number);
+
+      if (processor_node(number) != node)
+        continue;
+
+      if (position++ % stride)
+        continue;
+
+      if (config.sweep_per_node && picked >= config.sweep_per_node)
+        break;
+
+      shards[selected].processor = number;
+      shards[selected].node      = node;
+      ++selected;
+      ++picked;
+    }
+  }
+
+  return selected;
+}
+
+// Print how many processors of every node failed every detection.
+static void print_results(sweep_shard* const shards, ULONG const count) {
+  auto const highest    = KeQueryHighestNodeNumber();
+  auto const detections = schedule_count();
+
+  ULONG failed = 0;
+
+  for (USHORT node = 0; node <= highest; ++node) {
+    ULONG processors = 0;
+    for (ULONG i = 0; i < count; ++i)
+      processors += (shards[i].node == node);
+
+    if (!processors)
+      continue;
+
+    DbgPrint("  Node %u: %lu processor(s).\n", node, processors);
+
+    for (ULONG j = 0; j < detections; ++j) {
+      ULONG ran = 0, detected = 0;
+      PROCESSOR_NUMBER first = {};
+
+      for (ULONG i = 0; i < count; ++i) {
+        if (shards[i].node != node || !RtlCheckBit(&shards[i].ran, j))
+          continue;
+
+        ++ran;
+
+        if (RtlCheckBit(&shards[i].detected, j) && !detected++)
+          first = shards[i].processor;
+      }
+
+      if (!detected)
+        continue;
+
+      DbgPrint("  [-] %s() failed on %lu of %lu processor(s), first on %u:%u.\n",
+        schedule_entry(j).name, detected, ran, first.Group, first.Number);
+
+      ++failed;
+    }
+  }
+
+  DbgPrint("Swept %lu processor(s) in %u group(s) and %u node(s), %lu failure(s).\n",
+    count, KeQueryActiveGroupCount(), highest + 1, failed);
+}
+
+void sweep_processors(bool (* const cancelled)()) {
+  auto const count      = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  auto const detections = schedule_count();
+
+  // both bitmaps of every shard follow the shards in the same allocation
+  auto const bitmap_size = ((detections + 63) / 64) * sizeof(ULONG64);
+  auto const total_size  = count * (sizeof(sweep_shard) + 2 * bitmap_size);
+
+  auto const shards = static_cast<sweep_shard*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, total_size, 'pewS'));
+
+  if (!shards) {
+    DbgPrint("Failed to allocate sweep results.\n");
+    return;
+  }
+
+  RtlZeroMemory(shards, total_size);
+
+  auto const bitmaps = reinterpret_cast<PULONG>(shards + count);
+
+  for (ULONG i = 0; i < count; ++i) {
+    RtlInitializeBitMap(&shards[i].ran, bitmaps + (2 * i) * bitmap_size / sizeof(ULONG), detections);
+    RtlInitializeBitMap(&shards[i].detected, bitmaps + (2 * i + 1) * bitmap_size / sizeof(ULONG), detections);
+  }
+
+  auto const selected = select_processors(shards, count);
+
+  // every processor runs at the same time, so a hypervisor that handles
+  // exits on a shared lock is also exercised
+  for (ULONG i = 0; i < selected; ++i) {
+    auto& shard = shards[i];
+    shard.cancelled = cancelled;
+
+    HANDLE handle = nullptr;
+    if (!NT_SUCCESS(PsCreateSystemThread(&handle, THREAD_ALL_ACCESS,
+        nullptr, nullptr, nullptr, sweep_thread, &shard)))
+      continue;
+
+    // the shards can't be freed before the thread exits, so wait for it
+    // here if we can't wait for it below
+    if (!NT_SUCCESS(ObReferenceObjectByHandle(handle, SYNCHRONIZE, *PsThreadType,
+        KernelMode, reinterpret_cast<PVOID*>(&shard.thread), nullptr))) {
+      shard.thread = nullptr;
+      ZwWaitForSingleObject(handle, FALSE, nullptr);
+    }
+
+    ZwClose(handle);
+  }
+
+  for (ULONG i = 0; i < selected; ++i) {
+    if (!shards[i].thread)
+      continue;
+
+    KeWaitForSingleObject(shards[i].thread, Executive, KernelMode, FALSE, nullptr);
+    ObDereferenceObject(shards[i].thread);
+  }
+
+  print_results(shards, selected);
+
+  ExFreePoolWithTag(shards, 'pewS');
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+// Run every detection that only looks at the state of its own logical
+// processor (see schedule.h) on every logical processor of every group in
+// parallel, or on SweepPerNode of them per NUMA node, and print the
+// results per node. A hypervisor that only misbehaves on some vCPUs
+// (e.g. the ones on a remote node) passes the suite on processor 0.
+// The sweep stops early once cancelled() returns true.
+void sweep_processors(bool (*cancelled)());
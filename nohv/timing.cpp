@@ -1,48 +1,75 @@
 #include <ia32.hpp>
 #include <intrin.h>
 #include <ntddk.h>
-
-// Hardcoded execution times for CPUID instruction.
-inline constexpr size_t max_acceptable_tsc   = 500;
-inline constexpr size_t max_acceptable_mperf = 500;
-inline constexpr size_t max_acceptable_aperf = 500;
+#include <aux_klib.h>
+
+#include "caps.h"
+#include "config.h"
+#include "cycles.h"
+#include "irq.h"
+#include "measure.h"
+#include "samples.h"
+
+// Hardcoded execution time for the CPUID instruction (see cycles.h). These
+// are the limits that the timing detections have always used, on every
+// core type, and haven't been measured on real hybrid processors yet:
+// the per-core-type ones should come from the "[#z]" samples of real
+// bare-metal logs (see tools/aggregate and tools/regress), not from the
+// mock machines of tools/roc, whose latencies are made up.
+inline constexpr core_type_limits cpuid_limits = {
+  { 500, 500 },
+  { 500, 500 }
+};
+
+// Minimum UC/WB cacheline access ratio.
+inline constexpr uint64_t min_uc_wb_ratio = 40;
 
 // Classic timing detection that checks if the time to
 // execute the CPUID instruction is suspiciously large. This
 // check uses the TSC to measure execution time.
-bool timing_detected_1() {
-  _disable();
+bool timing_detected_1(cpu_caps const& caps) {
+  irq_disable();
 
   uint64_t lowest_tsc = MAXULONG64;
+  auto const deltas = samples_allocate(config.timing_iterations);
+
+  auto clock = core_clock_begin(caps);
 
   // we only care about the lowest TSC delta for reliability since an NMI,
   // an SMI, or TurboBoost could fuck up our timings.
-  for (int i = 0; i < 10; ++i) {
+  for (ULONG i = 0; i < config.timing_iterations; ++i) {
+    irq_yield();
+
     int regs[4] = {};
 
-    _mm_lfence();
-    auto const start = __rdtsc();
-    _mm_lfence();
+    auto const start = fenced_rdtsc();
 
     __cpuid(regs, 0);
 
-    _mm_lfence();
-    auto const end = __rdtsc();
-    _mm_lfence();
+    auto const end = fenced_rdtsc();
 
     auto const delta = (end - start);
     if (delta < lowest_tsc)
       lowest_tsc = delta;
 
+    if (deltas)
+      deltas[i] = delta;
+    record_sample("tsc", delta);
+
     // they over-accounted and TSC delta went negative
     if (delta & (1ull << 63)) {
-      _enable();
+      irq_enable();
       return true;
     }
   }
 
-  _enable();
-  return (lowest_tsc > max_acceptable_tsc);
+  core_clock_end(clock);
+  irq_enable();
+
+  for (ULONG i = 0; deltas && i < config.timing_iterations; ++i)
+    record_sample("cycles", to_core_cycles(clock, deltas[i]));
+
+  return exceeds_limit(caps, clock, cpuid_limits, lowest_tsc);
 }
 
 // IPI callback that executes CPUID in a loop on every logical processor.
@@ -52,15 +79,11 @@ static ULONG_PTR ipi_callback(ULONG_PTR const context) {
   for (size_t i = 0; i < 100; ++i) {
     int regs[4] = {};
 
-    _mm_lfence();
-    auto const start = __rdtsc();
-    _mm_lfence();
+    auto const start = fenced_rdtsc();
 
     __cpuid(regs, 0);
 
-    _mm_lfence();
-    auto const end = __rdtsc();
-    _mm_lfence();
+    auto const end = fenced_rdtsc();
 
     auto const delta = (end - start);
 
@@ -77,23 +100,17 @@ static ULONG_PTR ipi_callback(ULONG_PTR const context) {
 // hypervisors that use a shared TSC offset to bypass timing checks. Using
 // a shared TSC offset will cause the TSC delta to go negative, since it
 // was lowered in another logical processor.
-bool timing_detected_2() {
+bool timing_detected_2(cpu_caps const&) {
   size_t detected_count = 0;
   KeIpiGenericCall(ipi_callback, reinterpret_cast<ULONG_PTR>(&detected_count));
   return (detected_count > 0);
 }
 
-// This detection uses CPU_CLK_UNHALTED.REF_TSC to measure the
-// execution time of the CPUID instruction.
-// 
-// Vol3[19.2.2(Architectural Performance Monitoring Version 2)]
-bool timing_detected_3() {
-  _disable();
-
-  ia32_fixed_ctr_ctrl_register curr_fixed_ctr_ctrl;
-  curr_fixed_ctr_ctrl.flags = __readmsr(IA32_FIXED_CTR_CTRL);
-
-  ia32_perf_global_ctrl_register curr_perf_global_ctrl;
+// Enable fixed counter #2 (REF_TSC) in kernel mode, and get the values
+// of IA32_FIXED_CTR_CTRL and IA32_PERF_GLOBAL_CTRL to restore afterwards.
+static void enable_ref_tsc_counter(ia32_fixed_ctr_ctrl_register& curr_fixed_ctr_ctrl,
+    ia32_perf_global_ctrl_register& curr_perf_global_ctrl) {
+  curr_fixed_ctr_ctrl.flags   = __readmsr(IA32_FIXED_CTR_CTRL);
   curr_perf_global_ctrl.flags = __readmsr(IA32_PERF_GLOBAL_CTRL);
 
   // enable fixed counter #2
@@ -108,13 +125,33 @@ bool timing_detected_3() {
   auto new_perf_global_ctrl = curr_perf_global_ctrl;
   new_perf_global_ctrl.en_fixed_ctrn |= (1ull << 2);
   __writemsr(IA32_PERF_GLOBAL_CTRL, new_perf_global_ctrl.flags);
+}
+
+// This detection uses CPU_CLK_UNHALTED.REF_TSC to measure the
+// execution time of the CPUID instruction.
+// 
+// Vol3[19.2.2(Architectural Performance Monitoring Version 2)]
+bool timing_detected_3(cpu_caps const& caps) {
+  irq_disable();
+
+  ia32_fixed_ctr_ctrl_register curr_fixed_ctr_ctrl;
+  ia32_perf_global_ctrl_register curr_perf_global_ctrl;
+  enable_ref_tsc_counter(curr_fixed_ctr_ctrl, curr_perf_global_ctrl);
 
   bool detected = false;
   uint64_t lowest_tsc = MAXULONG64;
+  auto const deltas = samples_allocate(config.timing_iterations);
+
+  auto clock = core_clock_begin(caps);
 
   // we only care about the lowest TSC for reliability since an NMI,
   // an SMI, or TurboBoost could fuck up our timings.
-  for (int i = 0; i < 10; ++i) {
+  for (ULONG i = 0; i < config.timing_iterations; ++i) {
+    // the counters might've been reprogrammed while interrupts were
+    // enabled (and what we restore them to might've changed as well)
+    if (irq_yield())
+      enable_ref_tsc_counter(curr_fixed_ctr_ctrl, curr_perf_global_ctrl);
+
     int regs[4] = {};
 
     _mm_lfence();
@@ -131,42 +168,52 @@ bool timing_detected_3() {
     if (delta < lowest_tsc)
       lowest_tsc = delta;
 
+    if (deltas)
+      deltas[i] = delta;
+    record_sample("ref_tsc", delta);
+
     // they over-accounted and TSC delta went negative
     if (delta & (1ull << 63))
       detected = true;
   }
 
-  if (lowest_tsc > max_acceptable_tsc)
+  core_clock_end(clock);
+
+  for (ULONG i = 0; deltas && i < config.timing_iterations; ++i)
+    record_sample("cycles", to_core_cycles(clock, deltas[i]));
+
+  if (exceeds_limit(caps, clock, cpuid_limits, lowest_tsc))
     detected = true;
 
   // restore MSRs
   __writemsr(IA32_PERF_GLOBAL_CTRL, curr_perf_global_ctrl.flags);
   __writemsr(IA32_FIXED_CTR_CTRL, curr_fixed_ctr_ctrl.flags);
 
-  _enable();
+  irq_enable();
   return detected;
 }
 
 // Classic timing detection that checks if the time to
 // execute the CPUID instruction is suspiciously large. This
-// check uses the MPERF to measure execution time.
-bool timing_detected_4() {
-  _disable();
-
-  cpuid_eax_06 cpuid_06;
-  __cpuid(reinterpret_cast<int*>(&cpuid_06), 6);
-
+// check uses the MPERF to measure execution time, which ticks
+// at the TSC rate and is converted into core cycles as well.
+bool timing_detected_4(cpu_caps const& caps) {
   // IA32_MPERF/IA32_APERF MSRs are not supported
-  if (!cpuid_06.ecx.hardware_coordination_feedback_capability) {
-    _enable();
+  if (!caps.cpuid_06.ecx.hardware_coordination_feedback_capability)
     return false;
-  }
+
+  irq_disable();
 
   uint64_t lowest_mperf = MAXULONG64;
+  auto const deltas = samples_allocate(config.timing_iterations);
+
+  auto clock = core_clock_begin(caps);
 
   // we only care about the lowest MPERF delta for reliability since an NMI,
   // an SMI, or TurboBoost could fuck up our timings.
-  for (int i = 0; i < 10; ++i) {
+  for (ULONG i = 0; i < config.timing_iterations; ++i) {
+    irq_yield();
+
     int regs[4] = {};
 
     _mm_lfence();
@@ -183,38 +230,45 @@ bool timing_detected_4() {
     if (delta < lowest_mperf)
       lowest_mperf = delta;
 
+    if (deltas)
+      deltas[i] = delta;
+    record_sample("mperf", delta);
+
     // they over-accounted and MPERF delta went negative
     if (delta & (1ull << 63)) {
-      _enable();
+      irq_enable();
       return true;
     }
   }
 
-  _enable();
-  return (lowest_mperf > max_acceptable_mperf)
+  core_clock_end(clock);
+  irq_enable();
+
+  for (ULONG i = 0; deltas && i < config.timing_iterations; ++i)
+    record_sample("cycles", to_core_cycles(clock, deltas[i]));
+
+  return exceeds_limit(caps, clock, cpuid_limits, lowest_mperf)
       || (lowest_mperf <= 10);
 }
 
 // Classic timing detection that checks if the time to
 // execute the CPUID instruction is suspiciously large. This
-// check uses the APERF to measure execution time.
-bool timing_detected_5() {
-  _disable();
-
-  cpuid_eax_06 cpuid_06;
-  __cpuid(reinterpret_cast<int*>(&cpuid_06), 6);
-
+// check uses the APERF to measure execution time, which
+// already counts core cycles at whatever the current P-state is.
+bool timing_detected_5(cpu_caps const& caps) {
   // IA32_MPERF/IA32_APERF MSRs are not supported
-  if (!cpuid_06.ecx.hardware_coordination_feedback_capability) {
-    _enable();
+  if (!caps.cpuid_06.ecx.hardware_coordination_feedback_capability)
     return false;
-  }
+
+  irq_disable();
 
   uint64_t lowest_aperf = MAXULONG64;
 
   // we only care about the lowest APERF delta for reliability since an NMI,
   // an SMI, or TurboBoost could fuck up our timings.
-  for (int i = 0; i < 10; ++i) {
+  for (ULONG i = 0; i < config.timing_iterations; ++i) {
+    irq_yield();
+
     int regs[4] = {};
 
     _mm_lfence();
@@ -231,52 +285,26 @@ bool timing_detected_5() {
     if (delta < lowest_aperf)
       lowest_aperf = delta;
 
+    record_sample("aperf", delta);
+
     // they over-accounted and APERF delta went negative
     if (delta & (1ull << 63)) {
-      _enable();
+      irq_enable();
       return true;
     }
   }
 
-  _enable();
-  return (lowest_aperf > max_acceptable_aperf)
+  irq_enable();
+  return (lowest_aperf > core_type_limit(caps, cpuid_limits).cycles)
       || (lowest_aperf <= 10);
 }
 
-// Measures the amount of time it takes to read+write
-// to every byte in the specified array.
-static uint64_t time_cacheline(uint8_t cacheline[64]) {
-  // touch the memory and ensure that it is in the cache
-  cacheline[0] = 1;
-
-  _mm_lfence();
-  auto const start = __rdtsc();
-  _mm_lfence();
-
-  for (int i = 0; i < 64; ++i)
-    cacheline[i] += 1;
-
-  _mm_lfence();
-  auto const end = __rdtsc();
-  _mm_lfence();
-
-  return (end - start);
-}
-
 // This detection tries to catch hypervisors that fail to update the memory
 // types in the EPT paging structures after the guest disables caching.
 // 
 // Vol3[11.5.3(Preventing Caching)]
 // Vol3[11.11(Memory Type Range Registers (MTRRs))]
-bool timing_detected_6() {
-  _disable();
-
-  cr0 curr_cr0;
-  curr_cr0.flags = __readcr0();
-
-  ia32_mtrr_def_type_register curr_mtrr_def_type;
-  curr_mtrr_def_type.flags = __readmsr(IA32_MTRR_DEF_TYPE);
-
+bool timing_detected_6(cpu_caps const&) {
   // a cacheline that we'll be using to determine whether the memory
   // typing is WB or UC.
   alignas(64) uint8_t cacheline[64] = {};
@@ -284,12 +312,30 @@ bool timing_detected_6() {
   // amount of time to access WB memory that is in the cache
   uint64_t wb_timing = MAXUINT64;
 
-  for (int i = 0; i < 10; ++i) {
+  irq_disable();
+
+  for (ULONG i = 0; i < config.timing_iterations; ++i) {
+    irq_yield();
+
     auto const timing = time_cacheline(cacheline);
     if (timing < wb_timing)
       wb_timing = timing;
+
+    record_sample("wb", timing);
   }
 
+  irq_enable();
+
+  // caching stays disabled until CR0 and the MTRRs are restored, so the
+  // rest of this detection can't be split up and is done in one window
+  irq_disable();
+
+  cr0 curr_cr0;
+  curr_cr0.flags = __readcr0();
+
+  ia32_mtrr_def_type_register curr_mtrr_def_type;
+  curr_mtrr_def_type.flags = __readmsr(IA32_MTRR_DEF_TYPE);
+
   // set CR0.CD to 1
   __try {
     auto test_cr0 = curr_cr0;
@@ -298,7 +344,7 @@ bool timing_detected_6() {
   }
   __except (1) {
     // an exception shouldn't be thrown
-    _enable();
+    irq_enable();
     return true;
   }
 
@@ -318,10 +364,12 @@ bool timing_detected_6() {
   // amount of time to access UC memory that is in the cache
   uint64_t uc_timing = MAXUINT64;
 
-  for (int i = 0; i < 10; ++i) {
+  for (ULONG i = 0; i < config.timing_iterations; ++i) {
     auto const timing = time_cacheline(cacheline);
     if (timing < uc_timing)
       uc_timing = timing;
+
+    record_sample("uc", timing);
   }
 
   // restore MTRRs
@@ -330,14 +378,155 @@ bool timing_detected_6() {
   // restore CR0
   __writecr0(curr_cr0.flags);
 
-  _enable();
-  return (uc_timing < wb_timing * 40);
+  irq_enable();
+  return (uc_timing < wb_timing * min_uc_wb_ratio);
 }
 
 extern "C" bool check_rdtscp_regs();
 
 // This detection occurs due to an improper implementation of rdtscp
 // On processors that support the Intel 64 architecture, the high - order 32 bits of each of RAX, RDX, and RCX are cleared.
-bool timing_detected_7() {
+bool timing_detected_7(cpu_caps const&) {
   return check_rdtscp_regs();
-}
\ No newline at end of file
+}
+
+// The ACPI power management timer, which is an independent platform clock
+// that runs at a fixed 3.579545 MHz.
+// 
+// ACPI[4.8.3.3(Power Management Timer (PM_TMR))]
+struct pm_timer {
+  USHORT port;
+
+  // the timer is 32 bits wide instead of 24 bits
+  bool extended;
+};
+
+inline constexpr uint64_t pm_timer_frequency = 3'579'545;
+
+// Find the PM timer through the FADT. Returns false if there is no PM timer
+// in I/O space (e.g. on hardware-reduced ACPI platforms).
+static bool find_pm_timer(pm_timer& timer) {
+  if (!NT_SUCCESS(AuxKlibInitialize()))
+    return false;
+
+  ULONG size = 0;
+  AuxKlibGetSystemFirmwareTable('ACPI', 'PCAF', nullptr, 0, &size);
+
+  // we need everything up to (and including) PM_TMR_BLK, which even an
+  // ACPI 1.0 FADT has (X_PM_TMR_BLK is only checked if it's there)
+  if (size < 80)
+    return false;
+
+  auto const fadt = static_cast<UCHAR*>(ExAllocatePoolWithTag(NonPagedPoolNx, size, 'tdaF'));
+  if (!fadt)
+    return false;
+
+  bool found = false;
+
+  if (NT_SUCCESS(AuxKlibGetSystemFirmwareTable('ACPI', 'PCAF', fadt, size, &size))) {
+    auto const length = *reinterpret_cast<ULONG*>(fadt + 4);
+    auto port         = *reinterpret_cast<ULONG*>(fadt + 76);
+
+    // FLAGS (and TMR_VAL_EXT in it) comes after PM_TMR_BLK
+    auto const flags = (length >= 116 && size >= 116) ? *reinterpret_cast<ULONG*>(fadt + 112) : 0;
+
+    // PM_TMR_BLK is zero if the timer is only described by X_PM_TMR_BLK,
+    // which is only usable if it is in system I/O space (address space 1)
+    if (!port && length >= 220 && size >= 220 && fadt[208] == 1)
+      port = static_cast<ULONG>(*reinterpret_cast<ULONG64*>(fadt + 212));
+
+    if (port && port <= MAXUSHORT) {
+      timer.port     = static_cast<USHORT>(port);
+      timer.extended = (flags & (1 << 8)) != 0;
+      found          = true;
+    }
+  }
+
+  ExFreePoolWithTag(fadt, 'tdaF');
+  return found;
+}
+
+// Measure the TSC rate (in kHz) over the specified number of PM timer ticks,
+// optionally while continuously causing vm-exits with CPUID.
+static uint64_t measure_tsc_khz(pm_timer const& timer, uint64_t const ticks, bool const exits) {
+  auto const mask = timer.extended ? 0xFFFFFFFFull : 0xFFFFFFull;
+
+  uint64_t elapsed = 0;
+  uint64_t last    = __indword(timer.port);
+
+  auto const start = fenced_rdtsc();
+
+  // the PM timer is polled often enough that it can't wrap around
+  // in between, so summing the masked deltas handles the wrap
+  while (elapsed < ticks) {
+    if (exits) {
+      for (int i = 0; i < 16; ++i) {
+        int regs[4] = {};
+        __cpuid(regs, 0);
+      }
+    }
+
+    uint64_t const now = __indword(timer.port);
+    elapsed += (now - last) & mask;
+    last = now;
+  }
+
+  auto const end = fenced_rdtsc();
+
+  return (end - start) * pm_timer_frequency / elapsed / 1000;
+}
+
+// This detection measures the TSC against the ACPI PM timer over a long
+// window, alternating between idle windows and windows that cause vm-exits
+// as fast as possible. Hypervisors that hide the time spent handling exits
+// by lowering the TSC offset make the TSC tick slower during the exit-heavy
+// windows, which an independent clock exposes no matter how the offset or
+// the multiplier is chosen. Interrupts stay enabled, since they advance
+// both clocks equally.
+bool timing_detected_8(cpu_caps const&) {
+  if (!config.clock_window_ms)
+    return false;
+
+  pm_timer timer = {};
+  if (!find_pm_timer(timer))
+    return false;
+
+  // the window is split into this many idle and exit-heavy windows
+  constexpr uint64_t windows = 8;
+
+  auto const ticks = config.clock_window_ms * pm_timer_frequency / 1000 / (2 * windows);
+  if (!ticks)
+    return false;
+
+  uint64_t idle_khz = 0, exit_khz = 0;
+  uint64_t idle_rates[windows] = {}, exit_rates[windows] = {};
+
+  // interleave the windows so that slow frequency changes affect both
+  for (uint64_t i = 0; i < windows; ++i) {
+    idle_rates[i] = measure_tsc_khz(timer, ticks, false);
+    exit_rates[i] = measure_tsc_khz(timer, ticks, true);
+
+    idle_khz += idle_rates[i];
+    exit_khz += exit_rates[i];
+  }
+
+  idle_khz /= windows;
+  exit_khz /= windows;
+
+  for (uint64_t i = 0; i < windows; ++i) {
+    record_sample("idle_khz", idle_rates[i]);
+    record_sample("exit_khz", exit_rates[i]);
+
+    // TSC ticks that went missing in this exit-heavy window
+    auto const expected = idle_khz * ticks * 1000 / pm_timer_frequency;
+    auto const actual   = exit_rates[i] * ticks * 1000 / pm_timer_frequency;
+    record_sample("lost_tsc", (expected > actual) ? (expected - actual) : 0);
+  }
+
+  if (!idle_khz)
+    return true;
+
+  // the TSC rate should be identical in both windows
+  auto const difference = (idle_khz > exit_khz) ? (idle_khz - exit_khz) : (exit_khz - idle_khz);
+  return (difference * 1'000'000 / idle_khz > config.clock_tolerance_ppm);
+}
@@ -0,0 +1,273 @@
+#pragma once
+
+// Format of the traces that a recording build of nohv produces (see
+// record.h). This is shared with tools/mock/player.cpp, which feeds a
+// trace back to the detections on Linux.
+//
+// A trace consists of one stream of events per logical processor, plus
+// a script stream that says which detection ran where (and what it
+// returned). Every event is:
+//
+//   varint  (kind << 2) | (faulted << 1) | repeated
+//   varint  exception code                   (only if faulted)
+//   varint  zigzag delta of every field      (only if not repeated)
+//   bytes   see trace_table_size()           (only if not faulted)
+//
+// where the fields are the arguments followed by the results (there are
+// no results if the instruction faulted), and every field is encoded as
+// the difference from the same field of the previous event of the same
+// kind. Consecutive TSC reads and repeated CPUID leaves take a byte or
+// two this way, and an event whose fields are all unchanged takes a
+// single byte. The history is reset at the start of every section, so
+// that every section can be replayed on its own.
+//
+// The script is a list of entries:
+//
+//   varint  trace_script::section
+//   varint  name length, followed by the name
+//   varint  processor index
+//   varint  offset of every processor's stream when the section started
+//
+//   varint  trace_script::result
+//   varint  0 or 1
+//
+// In the debug log, the header and the streams are printed as base64
+// after a "[#t]" marker, split over as many lines as needed:
+//
+//   [#t] header: <base64>
+//   [#t] script: <base64>
+//   [#t] <processor>: <base64>
+//
+// The header is made of varints: the format version, the number of
+// processors, the configuration values that change what the detections
+// do (see trace_config), and the size of every stream (processors first,
+// then the script) along with whether it was truncated.
+
+#include "encoding.h"
+
+inline constexpr uint64_t trace_version = 1;
+
+enum class trace_event : uint8_t {
+  rdtsc,
+  rdtscp,
+  cpuid,
+  readmsr,
+  writemsr,
+  readcr,
+  writecr,
+  readdr,
+  writedr,
+  xgetbv,
+  xsetbv,
+  vmxon,
+  indword,
+  vmcall,
+  rdtscp_regs,
+  performance_counter,
+  firmware_table,
+  regs,
+  xstate,
+  count
+};
+
+inline constexpr size_t trace_event_count = static_cast<size_t>(trace_event::count);
+
+// Most fields that an event can have.
+inline constexpr size_t trace_max_fields = 6;
+
+// Size of the largest possible encoded event (not including the bytes
+// that follow it).
+inline constexpr size_t trace_max_event_size =
+  (2 + trace_max_fields) * max_encoded_sample_size;
+
+struct trace_event_format {
+  char const* name;
+  uint8_t arguments;
+  uint8_t results;
+};
+
+inline constexpr trace_event_format trace_event_formats[trace_event_count] = {
+  { "rdtsc",               0, 1 }, // | tsc
+  { "rdtscp",              0, 2 }, // | tsc, aux
+  { "cpuid",               2, 4 }, // leaf, subleaf | eax, ebx, ecx, edx
+  { "readmsr",             1, 1 }, // msr | value
+  { "writemsr",            2, 0 }, // msr, value |
+  { "readcr",              1, 1 }, // cr | value
+  { "writecr",             2, 0 }, // cr, value |
+  { "readdr",              1, 1 }, // dr | value
+  { "writedr",             2, 0 }, // dr, value |
+  { "xgetbv",              1, 1 }, // xcr | value
+  { "xsetbv",              3, 0 }, // rcx, rdx, rax |
+  { "vmxon",               1, 1 }, // vmxon region | result
+  { "indword",             1, 1 }, // port | value
+  { "vmcall",              4, 0 }, // rcx, rdx, r8, r9 |
+  { "rdtscp_regs",         0, 1 }, // | detected
+  { "performance_counter", 0, 2 }, // | counter, frequency
+  { "firmware_table",      3, 2 }, // provider, table, length | status, size
+  { "regs",                3, 0 }, // trace_regs, rax, rcx |
+  { "xstate",              3, 0 }, // vector size, leaf, count |
+};
+
+// Instructions that the GPR snapshot stubs (see regs.cpp) execute.
+enum class trace_regs : uint8_t {
+  cpuid,
+  rdtscp,
+  rdmsr,
+  xgetbv,
+  rdpid,
+  vmcall
+};
+
+// Number of general-purpose registers in a GPR snapshot.
+inline constexpr size_t trace_gpr_count = 16;
+
+// Size of the vector and opmask registers that the extended state stubs
+// (see xstate.cpp) load and store.
+inline constexpr size_t trace_xstate_size = 32 * 64 + 8 * 8;
+
+inline trace_event_format const& trace_format(trace_event const kind) {
+  return trace_event_formats[static_cast<size_t>(kind)];
+}
+
+// Number of fields that an event has.
+inline size_t trace_field_count(trace_event const kind, bool const faulted) {
+  auto const& format = trace_format(kind);
+  return format.arguments + (faulted ? 0 : format.results);
+}
+
+// Number of bytes that follow an event that didn't fault. For a
+// firmware_table event, this is everything that was copied into the
+// caller's buffer. For a regs or xstate event, this is every register
+// that the stub stored XORed with what it loaded.
+inline size_t trace_table_size(trace_event const kind, uint64_t const* const fields) {
+  if (kind == trace_event::regs)
+    return trace_gpr_count * sizeof(uint64_t);
+
+  if (kind == trace_event::xstate)
+    return trace_xstate_size;
+
+  // NT_SUCCESS(status)
+  if (kind != trace_event::firmware_table || (fields[3] & 0x8000'0000))
+    return 0;
+
+  return static_cast<size_t>(fields[2] < fields[4] ? fields[2] : fields[4]);
+}
+
+enum class trace_script : uint8_t {
+  section,
+  result
+};
+
+// Configuration values that are part of the header, in order.
+struct trace_config {
+  uint64_t irq_budget_us;
+  uint64_t timing_iterations;
+  uint64_t clock_window_ms;
+  uint64_t clock_tolerance_ppm;
+};
+
+// The previous fields of every kind of event, in one stream.
+struct trace_history {
+  uint64_t fields[trace_event_count][trace_max_fields];
+};
+
+inline void trace_history_reset(trace_history& history) {
+  for (auto& event : history.fields) {
+    for (auto& field : event)
+      field = 0;
+  }
+}
+
+// Encode an event into the specified buffer, which has to hold at least
+// trace_max_event_size bytes. Returns the number of bytes that were
+// written. The bytes that follow the event (see trace_table_size()) have
+// to be appended by the caller.
+inline size_t trace_encode_event(trace_history& history, uint8_t* const output,
+    trace_event const kind, uint32_t const status, uint64_t const* const fields) {
+  auto const faulted = (status != 0);
+  auto const count   = trace_field_count(kind, faulted);
+  auto& previous     = history.fields[static_cast<size_t>(kind)];
+
+  bool repeated = true;
+  for (size_t i = 0; i < count; ++i)
+    repeated &= (fields[i] == previous[i]);
+
+  auto const header = (static_cast<uint64_t>(kind) << 2) |
+    (faulted ? 2 : 0) | (repeated ? 1 : 0);
+
+  auto size = encode_varint(output, header);
+
+  if (faulted)
+    size += encode_varint(output + size, status);
+
+  if (!repeated) {
+    for (size_t i = 0; i < count; ++i) {
+      size += encode_varint(output + size,
+        zigzag_encode(static_cast<int64_t>(fields[i] - previous[i])));
+      previous[i] = fields[i];
+    }
+  }
+
+  return size;
+}
+
+struct trace_decoded_event {
+  trace_event kind;
+
+  // exception code, or 0 if the instruction didn't fault
+  uint32_t status;
+
+  uint64_t fields[trace_max_fields];
+
+  // the bytes that follow the event (see trace_table_size())
+  uint8_t const* table;
+  size_t table_size;
+};
+
+// Decode the next event and advance past it. Returns false at the end of
+// the stream, or if the event is truncated or malformed.
+inline bool trace_decode_event(trace_history& history, uint8_t const*& position,
+    uint8_t const* const end, trace_decoded_event& event) {
+  uint64_t header = 0;
+  if (!decode_varint(position, end, header) || (header >> 2) >= trace_event_count)
+    return false;
+
+  event.kind       = static_cast<trace_event>(header >> 2);
+  event.status     = 0;
+  event.table      = nullptr;
+  event.table_size = 0;
+
+  if (header & 2) {
+    uint64_t status = 0;
+    if (!decode_varint(position, end, status) || !status)
+      return false;
+
+    event.status = static_cast<uint32_t>(status);
+  }
+
+  auto const count = trace_field_count(event.kind, event.status != 0);
+  auto& previous   = history.fields[static_cast<size_t>(event.kind)];
+
+  for (size_t i = 0; i < count; ++i) {
+    if (!(header & 1)) {
+      uint64_t delta = 0;
+      if (!decode_varint(position, end, delta))
+        return false;
+
+      previous[i] += static_cast<uint64_t>(zigzag_decode(delta));
+    }
+
+    event.fields[i] = previous[i];
+  }
+
+  if (!event.status) {
+    event.table_size = trace_table_size(event.kind, event.fields);
+    if (static_cast<size_t>(end - position) < event.table_size)
+      return false;
+
+    event.table = position;
+    position   += event.table_size;
+  }
+
+  return true;
+}
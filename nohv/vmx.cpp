@@ -2,12 +2,15 @@
 #include <intrin.h>
 #include <ntddk.h>
 
+#include "caps.h"
+#include "irq.h"
+
 // This detection tries to execute VMXON while CR4.VMXE is
 // clear and checks to see if a #UD was successfully raised.
 // 
 // Vol3[30.3(VMXON - Enter VMX Operaton)
-bool vmx_detected_1() {
-  _disable();
+bool vmx_detected_1(cpu_caps const&) {
+  irq_disable();
 
   cr4 curr_cr4;
   curr_cr4.flags = __readcr4();
@@ -19,7 +22,7 @@ bool vmx_detected_1() {
     __writecr4(test_cr4.flags);
   }
   __except (1) {
-    _enable();
+    irq_enable();
     return true;
   }
 
@@ -42,7 +45,7 @@ bool vmx_detected_1() {
   // restore CR4
   __writecr4(curr_cr4.flags);
 
-  _enable();
+  irq_enable();
   return detected;
 }
 
@@ -50,17 +53,18 @@ bool vmx_detected_1() {
 // and checks to see if a VM error code was properly returned.
 // 
 // Vol3[30.3(VMXON - Enter VMX Operaton)
-bool vmx_detected_2() {
-  _disable();
-
-  ia32_feature_control_register feature_control;
-  feature_control.flags = __readmsr(IA32_FEATURE_CONTROL);
-
+bool vmx_detected_2(cpu_caps const& caps) {
   // check if VMX has been disabled by BIOS
-  if (!feature_control.lock_bit || !feature_control.enable_vmx_outside_smx) {
-    _enable();
+  if (!caps.feature_control_valid ||
+      !caps.feature_control.lock_bit ||
+      !caps.feature_control.enable_vmx_outside_smx)
     return false;
-  }
+
+  // the VMX fixed-bit MSRs should be readable if VMX is enabled
+  if (!caps.vmx_fixed_valid)
+    return true;
+
+  irq_disable();
 
   cr0 curr_cr0;
   cr4 curr_cr4;
@@ -75,10 +79,10 @@ bool vmx_detected_2() {
 
     test_cr4.vmx_enable = 1;
 
-    test_cr0.flags |= __readmsr(IA32_VMX_CR0_FIXED0);
-    test_cr0.flags &= __readmsr(IA32_VMX_CR0_FIXED1);
-    test_cr4.flags |= __readmsr(IA32_VMX_CR4_FIXED0);
-    test_cr4.flags &= __readmsr(IA32_VMX_CR4_FIXED1);
+    test_cr0.flags |= caps.vmx_cr0_fixed0;
+    test_cr0.flags &= caps.vmx_cr0_fixed1;
+    test_cr4.flags |= caps.vmx_cr4_fixed0;
+    test_cr4.flags &= caps.vmx_cr4_fixed1;
 
     __writecr0(test_cr0.flags);
     __writecr4(test_cr4.flags);
@@ -88,7 +92,7 @@ bool vmx_detected_2() {
     __writecr0(curr_cr0.flags);
     __writecr4(curr_cr4.flags);
 
-    _enable();
+    irq_enable();
     return true;
   }
 
@@ -114,7 +118,7 @@ bool vmx_detected_2() {
   __writecr0(curr_cr0.flags);
   __writecr4(curr_cr4.flags);
 
-  _enable();
+  irq_enable();
   return detected;
 }
 
@@ -123,7 +127,7 @@ extern "C" void vmx_vmcall(uint64_t rcx, uint64_t rdx, uint64_t r8, uint64_t r9)
 
 // This detection tries to execute VMCALL and checks if a #UD was
 // correctly raised (since we're not in VMX operation).
-bool vmx_detected_3() {
+bool vmx_detected_3(cpu_caps const&) {
   // we do a lil' bruteforcin
   for (int i = 0; i < 4; ++i) {
     for (int j = 0; j < 20; ++j) {
@@ -1,47 +1,51 @@
 #include <ia32.hpp>
 #include <intrin.h>
 
+#include "caps.h"
+#include "irq.h"
+
 // This detection tries to write to an XCR that is not supported.
 // 
 // Vol3[2.6(Extended Control Registers (Including XCR0))]
-bool xsetbv_detected_1() {
-  _disable();
+bool xsetbv_detected_1(cpu_caps const&) {
+  irq_disable();
 
   __try {
     // try to write to XCR69
     _xsetbv(69, _xgetbv(0));
 
     // an exception should have been raised...
-    _enable();
+    irq_enable();
     return true;
   }
   __except (1) {}
 
-  _enable();
+  irq_enable();
   return false;
 }
 
 // This detection tries to set every unsupported bit in XCR0.
 // 
 // Vol3[2.6(Extended Control Registers (Including XCR0))]
-bool xsetbv_detected_2() {
-  _disable();
+bool xsetbv_detected_2(cpu_caps const& caps) {
+  irq_disable();
 
   xcr0 curr_xcr0;
   curr_xcr0.flags = _xgetbv(0);
 
-  cpuid_eax_0d_ecx_00 cpuid_0d;
-  __cpuidex(reinterpret_cast<int*>(&cpuid_0d), 0x0D, 0x00);
-  
   // features in XCR0 that are supported
   auto const supported_mask = (static_cast<uint64_t>(
-    cpuid_0d.edx.flags) << 32) | cpuid_0d.eax.flags;
+    caps.cpuid_0d.edx.flags) << 32) | caps.cpuid_0d.eax.flags;
 
   for (int i = 0; i < 64; ++i) {
     // this is a bit dumb but it works well enough so whatever
     if (supported_mask & (1ull << i))
       continue;
 
+    // XCR0 might've been changed while interrupts were enabled
+    if (irq_yield())
+      curr_xcr0.flags = _xgetbv(0);
+
     __try {
       auto test_xcr0 = curr_xcr0;
       test_xcr0.flags |= (1ull << i);
@@ -52,7 +56,7 @@ bool xsetbv_detected_2() {
       _xsetbv(0, curr_xcr0.flags);
 
       // an exception should have been raised...
-      _enable();
+      irq_enable();
       return true;
     }
     __except (1) {
@@ -61,13 +65,13 @@ bool xsetbv_detected_2() {
         // restore XCR0 after the hypervisor mucked it
         _xsetbv(0, curr_xcr0.flags);
 
-        _enable();
+        irq_enable();
         return true;
       }
     }
   }
 
-  _enable();
+  irq_enable();
   return false;
 }
 
@@ -83,17 +87,15 @@ extern "C" void xsetbv_full(uint64_t rcx, uint64_t rdx, uint64_t rax);
 // https://github.com/eyalz800/zpp_hypervisor/blob/master/hypervisor/src/hypervisor/hypervisor.cpp#L1021
 // https://github.com/ionescu007/SimpleVisor/blob/989d33b1bc6569965d7aad3bd50a8d35fa4c359e/shvvmxhv.c#L163
 // https://github.com/HyperDbg/HyperDbg/blob/06c4ea79d93fe6e9851e4ce9c0a8bdb4eb0fb0a6/hyperdbg/hprdbghv/code/vmm/vmx/Vmexit.c#L402
-bool xsetbv_detected_3() {
-  _disable();
+bool xsetbv_detected_3(cpu_caps const& caps) {
+  irq_disable();
 
   xcr0 curr_xcr0;
   curr_xcr0.flags = _xgetbv(0);
 
-  cpuid_eax_0d_ecx_00 cpuid_0d;
-  __cpuidex(reinterpret_cast<int*>(&cpuid_0d), 0x0D, 0x00);
-  
-  // features that are unsupported in the high part of XCR0
-  auto const unsupported_mask = static_cast<uint64_t>(cpuid_0d.edx.flags);
+  // features that are unsupported in the high part of XCR0, placed in
+  // the high part of RAX (which XSETBV ignores, since EDX is the high part)
+  auto const unsupported_mask = ~static_cast<uint64_t>(caps.cpuid_0d.edx.flags) << 32;
 
   __try {
     xsetbv_full(0, curr_xcr0.flags >> 32,
@@ -101,11 +103,11 @@ bool xsetbv_detected_3() {
   }
   __except (1) {
     // no exception should be raised since the high part of RAX should be ignored...
-    _enable();
+    irq_enable();
     return true;
   }
 
-  _enable();
+  irq_enable();
   return false;
 }
 
@@ -113,8 +115,8 @@ bool xsetbv_detected_3() {
 // the high part of the RCX register when emulating XSETBV.
 // 
 // Vol2[5.2(XSETBV - Set Extended Control Register)]
-bool xsetbv_detected_4() {
-  _disable();
+bool xsetbv_detected_4(cpu_caps const&) {
+  irq_disable();
 
   xcr0 curr_xcr0;
   curr_xcr0.flags = _xgetbv(0);
@@ -125,19 +127,19 @@ bool xsetbv_detected_4() {
   }
   __except (1) {
     // no exception should be raised since the high part of RCX should be ignored...
-    _enable();
+    irq_enable();
     return true;
   }
 
-  _enable();
+  irq_enable();
   return false;
 }
 
 // This detection tries to write an invalid combination to XCR0.
 // 
 // Vol3[2.6(Extended Control Registers (Including XCR0))]
-bool xsetbv_detected_5() {
-  _disable();
+bool xsetbv_detected_5(cpu_caps const&) {
+  irq_disable();
 
   xcr0 curr_xcr0;
   curr_xcr0.flags = _xgetbv(0);
@@ -149,7 +151,7 @@ bool xsetbv_detected_5() {
     _xsetbv(0, test_xcr0.flags);
 
     // an exception should have been raised
-    _enable();
+    irq_enable();
     return true;
   }
   __except (1) {}
@@ -162,7 +164,7 @@ bool xsetbv_detected_5() {
     _xsetbv(0, test_xcr0.flags);
 
     // an exception should have been raised
-    _enable();
+    irq_enable();
     return true;
   }
   __except (1) {}
@@ -175,7 +177,7 @@ bool xsetbv_detected_5() {
     _xsetbv(0, test_xcr0.flags);
 
     // an exception should have been raised
-    _enable();
+    irq_enable();
     return true;
   }
   __except (1) {}
@@ -188,7 +190,7 @@ bool xsetbv_detected_5() {
     _xsetbv(0, test_xcr0.flags);
 
     // an exception should have been raised
-    _enable();
+    irq_enable();
     return true;
   }
   __except (1) {}
@@ -201,7 +203,7 @@ bool xsetbv_detected_5() {
     _xsetbv(0, test_xcr0.flags);
 
     // an exception should have been raised
-    _enable();
+    irq_enable();
     return true;
   }
   __except (1) {}
@@ -214,7 +216,7 @@ bool xsetbv_detected_5() {
     _xsetbv(0, test_xcr0.flags);
 
     // an exception should have been raised
-    _enable();
+    irq_enable();
     return true;
   }
   __except (1) {}
@@ -227,7 +229,7 @@ bool xsetbv_detected_5() {
     _xsetbv(0, test_xcr0.flags);
 
     // an exception should have been raised
-    _enable();
+    irq_enable();
     return true;
   }
   __except (1) {}
@@ -242,7 +244,7 @@ bool xsetbv_detected_5() {
     _xsetbv(0, test_xcr0.flags);
 
     // an exception should have been raised
-    _enable();
+    irq_enable();
     return true;
   }
   __except (1) {}
@@ -257,7 +259,7 @@ bool xsetbv_detected_5() {
     _xsetbv(0, test_xcr0.flags);
 
     // an exception should have been raised
-    _enable();
+    irq_enable();
     return true;
   }
   __except (1) {}
@@ -272,12 +274,12 @@ bool xsetbv_detected_5() {
     _xsetbv(0, test_xcr0.flags);
 
     // an exception should have been raised
-    _enable();
+    irq_enable();
     return true;
   }
   __except (1) {}
 
-  _enable();
+  irq_enable();
   return false;
 }
 
@@ -0,0 +1,115 @@
+; Every stub takes (input, output, leaf, count). It loads every vector
+; register of its width (and, for AVX-512, every opmask register) from the
+; input, executes CPUID with the specified leaf the specified number of
+; times, and stores the same registers into the output. Both buffers are
+; laid out as 32 vectors of 64 bytes followed by 8 opmask qwords.
+;
+; XMM6-XMM15 are nonvolatile, so they're saved on the stack (and described
+; by the unwind info, along with RBX, which CPUID writes).
+
+VECTOR_STRIDE equ 64
+OPMASK_OFFSET equ 800h
+
+; Load (or store) the specified number of vector registers.
+LOAD_VECTORS macro instruction, prefix, count
+  index = 0
+  rept count
+    instruction @CatStr(prefix, %index), [r10 + index * VECTOR_STRIDE]
+    index = index + 1
+  endm
+endm
+
+STORE_VECTORS macro instruction, prefix, count
+  index = 0
+  rept count
+    instruction [r11 + index * VECTOR_STRIDE], @CatStr(prefix, %index)
+    index = index + 1
+  endm
+endm
+
+XSTATE_PROLOG macro
+  push rbx
+  .pushreg rbx
+  sub rsp, 0A0h
+  .allocstack 0A0h
+  index = 0
+  rept 10
+    movdqa [rsp + index * 10h], @CatStr(xmm, %(index + 6))
+    .savexmm128 @CatStr(xmm, %(index + 6)), index * 10h
+    index = index + 1
+  endm
+  .endprolog
+
+  mov r10, rcx
+  mov r11, rdx
+endm
+
+XSTATE_EXITS macro
+  local next, done
+
+  test r9d, r9d
+  jz done
+next:
+  mov eax, r8d
+  xor ecx, ecx
+  cpuid
+  dec r9d
+  jnz next
+done:
+endm
+
+XSTATE_EPILOG macro
+  index = 0
+  rept 10
+    movdqa @CatStr(xmm, %(index + 6)), [rsp + index * 10h]
+    index = index + 1
+  endm
+
+  add rsp, 0A0h
+  pop rbx
+  ret
+endm
+
+.code
+
+xstate_sse proc frame
+  XSTATE_PROLOG
+  LOAD_VECTORS movdqu, xmm, 16
+  XSTATE_EXITS
+  STORE_VECTORS movdqu, xmm, 16
+  XSTATE_EPILOG
+xstate_sse endp
+
+xstate_avx proc frame
+  XSTATE_PROLOG
+  LOAD_VECTORS vmovdqu, ymm, 16
+  XSTATE_EXITS
+  STORE_VECTORS vmovdqu, ymm, 16
+  vzeroupper
+  XSTATE_EPILOG
+xstate_avx endp
+
+xstate_avx512 proc frame
+  XSTATE_PROLOG
+  LOAD_VECTORS vmovdqu64, zmm, 32
+
+  index = 0
+  rept 8
+    kmovw @CatStr(k, %index), word ptr [r10 + OPMASK_OFFSET + index * 8]
+    index = index + 1
+  endm
+
+  XSTATE_EXITS
+  STORE_VECTORS vmovdqu64, zmm, 32
+
+  index = 0
+  rept 8
+    kmovw word ptr [r11 + OPMASK_OFFSET + index * 8], @CatStr(k, %index)
+    index = index + 1
+  endm
+
+  vzeroupper
+  XSTATE_EPILOG
+xstate_avx512 endp
+
+end
@@ -0,0 +1,224 @@
+#include "xstate.h"
+#include "caps.h"
+#include "config.h"
+#include "irq.h"
+#include "measure.h"
+#include "samples.h"
+
+#include <ia32.hpp>
+#include <intrin.h>
+#include <ntddk.h>
+
+// Vector and opmask registers, in the layout that the stubs in
+// xstate-asm.asm load them from and store them into.
+struct xstate_registers {
+  uint8_t vectors[32][64];
+  uint64_t opmasks[8];
+};
+
+// These functions load every vector register of their width from the
+// input, execute CPUID with the specified leaf the specified number of
+// times, and store the same registers into the output.
+extern "C" void xstate_sse(xstate_registers const* input,
+  xstate_registers* output, uint32_t leaf, uint32_t count);
+extern "C" void xstate_avx(xstate_registers const* input,
+  xstate_registers* output, uint32_t leaf, uint32_t count);
+extern "C" void xstate_avx512(xstate_registers const* input,
+  xstate_registers* output, uint32_t leaf, uint32_t count);
+
+// The widest set of vector registers that XCR0 enables.
+struct xstate_width {
+  char const* prefix;
+  void (*stub)(xstate_registers const*, xstate_registers*, uint32_t, uint32_t);
+  uint32_t vector_count;
+  uint32_t vector_size;
+
+  // only the lower 16 bits, since KMOVQ needs AVX512BW
+  uint32_t opmask_count;
+};
+
+inline constexpr xstate_width sse_width    = { "xmm", xstate_sse,    16, 16, 0 };
+inline constexpr xstate_width avx_width    = { "ymm", xstate_avx,    16, 32, 0 };
+inline constexpr xstate_width avx512_width = { "zmm", xstate_avx512, 32, 64, 8 };
+
+// CPUID leaves to cause vm-exits with. Leaf 0xD is the one that an exit
+// handler is most likely to touch the extended state for.
+inline constexpr uint32_t xstate_leaves[] = { 0x0, 0x1, 0xD, 0x4000'0000 };
+
+// Number of vm-exits per leaf.
+inline constexpr uint32_t xstate_exits = 16;
+
+// XCR0 configurations that benchmark_xstate() measures, in addition to the
+// current one. Every configuration is valid (see xsetbv_detected_5), and is
+// only measured if the OS enabled all of its components.
+struct xcr0_configuration {
+  char const* name;
+  uint64_t flags;
+};
+
+inline constexpr xcr0_configuration xcr0_configurations[] = {
+  { "sse",    0x03 }, // x87, SSE
+  { "avx",    0x07 }, // x87, SSE, AVX
+  { "mpx",    0x1F }, // x87, SSE, AVX, BNDREG, BNDCSR
+  { "avx512", 0xE7 }, // x87, SSE, AVX, opmask, ZMM_Hi256, Hi16_ZMM
+};
+
+// Get the current XCR0, or only x87 and SSE if XGETBV isn't enabled.
+static uint64_t current_xcr0(cpu_caps const& caps) {
+  // CPUID.01H:ECX.OSXSAVE
+  if (!(caps.cpuid_01.cpuid_feature_information_ecx.flags & (1 << 27)))
+    return 0x03;
+
+  return _xgetbv(0);
+}
+
+static xstate_width const& widest_xstate(uint64_t const xcr0) {
+  if ((xcr0 & 0xE0) == 0xE0)
+    return avx512_width;
+
+  if (xcr0 & 0x04)
+    return avx_width;
+
+  return sse_width;
+}
+
+// A distinct pattern for every byte of every register.
+static void fill_xstate(xstate_registers& registers) {
+  for (uint32_t i = 0; i < 32; ++i) {
+    for (uint32_t j = 0; j < 64; ++j)
+      registers.vectors[i][j] = static_cast<uint8_t>((i * 64 + j) * 0x9D + 0x5A);
+  }
+
+  for (uint32_t i = 0; i < 8; ++i)
+    registers.opmasks[i] = 0xA5A5'A5A5'A5A5'0000ull | (0x1111u * (i + 1));
+}
+
+// This detection loads a distinct pattern into every vector register that
+// XCR0 enables (XMM, YMM, or ZMM along with the opmask registers), causes
+// a bunch of vm-exits with CPUID, and checks that every register still
+// holds its pattern. A hypervisor that uses the extended state itself
+// without saving the guest's (or that only saves part of it) fails this.
+// AMX tiles aren't covered, since they can't be used in kernel mode.
+//
+// Vol1[13.1(XSAVE-Supported Features and State-Component Bitmaps)]
+bool xstate_detected_1(cpu_caps const& caps) {
+  auto const xcr0  = current_xcr0(caps);
+  auto const width = widest_xstate(xcr0);
+
+  auto const registers = static_cast<xstate_registers*>(ExAllocatePoolWithTag(
+    NonPagedPoolNx, 2 * sizeof(xstate_registers), 'etsX'));
+
+  if (!registers)
+    return false;
+
+  auto& input  = registers[0];
+  auto& output = registers[1];
+
+  fill_xstate(input);
+
+  // the kernel doesn't save anything other than XMM0-XMM15 by itself
+  XSTATE_SAVE save;
+  auto const mask = xcr0 & RtlGetEnabledExtendedFeatures(static_cast<ULONG64>(-1)) &
+    ~static_cast<ULONG64>(XSTATE_MASK_LEGACY);
+
+  if (!NT_SUCCESS(KeSaveExtendedProcessorState(mask, &save))) {
+    ExFreePoolWithTag(registers, 'etsX');
+    return false;
+  }
+
+  bool detected = false;
+
+  for (auto const leaf : xstate_leaves) {
+    RtlZeroMemory(&output, sizeof(output));
+
+    irq_disable();
+    width.stub(&input, &output, leaf, xstate_exits);
+    irq_enable();
+
+    for (uint32_t i = 0; i < width.vector_count; ++i) {
+      if (memcmp(input.vectors[i], output.vectors[i], width.vector_size)) {
+        DbgPrint("    %s%u changed across cpuid(0x%X).\n", width.prefix, i, leaf);
+        detected = true;
+      }
+    }
+
+    for (uint32_t i = 0; i < width.opmask_count; ++i) {
+      if ((input.opmasks[i] ^ output.opmasks[i]) & 0xFFFF) {
+        DbgPrint("    k%u changed across cpuid(0x%X).\n", i, leaf);
+        detected = true;
+      }
+    }
+  }
+
+  KeRestoreExtendedProcessorState(&save);
+  ExFreePoolWithTag(registers, 'etsX');
+
+  return detected;
+}
+
+// Record the latency of CPUID with XCR0 set to the specified value. XCR0
+// is restored before interrupts can be re-enabled, since the kernel
+// expects it to be the same when it saves the thread's state.
+static void measure_cpuid(uint64_t const test_xcr0, uint64_t const curr_xcr0) {
+  irq_disable();
+
+  for (ULONG i = 0; i < config.timing_iterations; ++i) {
+    if (test_xcr0 != curr_xcr0)
+      _xsetbv(0, test_xcr0);
+
+    int regs[4] = {};
+
+    auto const start = fenced_rdtsc();
+
+    __cpuid(regs, 0);
+
+    auto const end = fenced_rdtsc();
+
+    if (test_xcr0 != curr_xcr0)
+      _xsetbv(0, curr_xcr0);
+
+    record_sample("tsc", end - start);
+    irq_yield();
+  }
+
+  irq_enable();
+}
+
+void benchmark_xstate() {
+  auto const& caps = current_cpu_caps();
+
+  xcr0 curr_xcr0;
+  curr_xcr0.flags = current_xcr0(caps);
+
+  // disabling a component throws away its state
+  XSTATE_SAVE save;
+  auto const mask = curr_xcr0.flags & RtlGetEnabledExtendedFeatures(static_cast<ULONG64>(-1)) &
+    ~static_cast<ULONG64>(XSTATE_MASK_LEGACY);
+
+  if (!NT_SUCCESS(KeSaveExtendedProcessorState(mask, &save))) {
+    DbgPrint("Failed to save the extended state.\n");
+    return;
+  }
+
+  ULONG measured = 0;
+
+  for (auto const& configuration : xcr0_configurations) {
+    if ((configuration.flags & curr_xcr0.flags) != configuration.flags)
+      continue;
+
+    samples_begin("benchmark_xstate", configuration.name);
+    measure_cpuid(configuration.flags, curr_xcr0.flags);
+    samples_end();
+
+    ++measured;
+  }
+
+  samples_begin("benchmark_xstate", "current");
+  measure_cpuid(curr_xcr0.flags, curr_xcr0.flags);
+  samples_end();
+
+  KeRestoreExtendedProcessorState(&save);
+
+  DbgPrint("Measured CPUID with %lu XCR0 configuration(s) and XCR0=0x%llX.\n",
+    measured, curr_xcr0.flags);
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+// Measure the latency of CPUID (which always causes a vm-exit) with XCR0
+// set to every configuration of the extended state that the processor
+// supports, and print the samples as "benchmark_xstate@<configuration>".
+// Hypervisors save and restore the guest's extended state on (some)
+// vm-exits, so the difference between the configurations is the cost
+// of doing that.
+void benchmark_xstate();
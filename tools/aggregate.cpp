@@ -0,0 +1,200 @@
+// Aggregates the samples of any number of nohv runs (e.g. a week of logs
+// from a fleet) into one summary per series, using the kernels in
+// analysis.h.
+//
+//   aggregate [--csv] [--scalar] [--outlier <x>] <log>...
+//   aggregate [--scalar] --benchmark <n>
+//
+// Logs are read one at a time and folded into a log-linear histogram per
+// series, so memory use doesn't grow with the number of logs. Quantiles
+// are within 1% of the exact ones (min and max are exact). Outliers are
+// samples that are more than --outlier (default 3) times the median.
+//
+// --benchmark runs every kernel (and a naive sort-based pass) on <n>
+// random timing-like samples, checks that the AVX2 and scalar kernels
+// agree, and prints how long each one took. --scalar disables the AVX2
+// kernels.
+
+#include "analysis.h"
+#include "results.h"
+#include "stats.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+struct options {
+  bool csv         = false;
+  double outlier   = 3.0;
+  size_t benchmark = 0;
+};
+
+static void print_usage() {
+  std::fprintf(stderr,
+    "usage: aggregate [--csv] [--scalar] [--outlier <x>] <log>...\n"
+    "       aggregate [--scalar] --benchmark <n>\n");
+}
+
+// Time a function, in milliseconds.
+template <typename Fn>
+static double time_ms(Fn&& fn) {
+  auto const start = std::chrono::steady_clock::now();
+  fn();
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static int run_benchmark(size_t const count) {
+  // mostly CPUID-like latencies, with a long tail of interrupted samples
+  std::mt19937_64 rng(1);
+  std::lognormal_distribution<double> body(std::log(1'500.0), 0.05);
+  std::uniform_real_distribution<double> tail(0.0, 1.0);
+
+  std::vector<double> values(count);
+  for (auto& v : values)
+    v = std::floor(body(rng) * (tail(rng) < 0.001 ? 50 : 1));
+
+  static double const quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+  auto const avx2 = analysis_use_avx2();
+
+  std::printf("%zu samples, AVX2 kernels %s\n\n", count, avx2 ? "enabled" : "disabled");
+  std::printf("%-26s %12s %12s\n", "pass", "scalar_ms", avx2 ? "avx2_ms" : "-");
+
+  auto const run = [&](char const* const name, auto&& scalar, auto&& vectorized) {
+    analysis_use_avx2() = false;
+    auto const scalar_ms = time_ms(scalar);
+
+    analysis_use_avx2() = avx2;
+    auto const avx2_ms = avx2 ? time_ms(vectorized) : NAN;
+
+    std::printf("%-26s %12.2f %12.2f\n", name, scalar_ms, avx2_ms);
+  };
+
+  value_range range_scalar = {}, range_avx2 = {};
+  run("minmax",
+    [&] { range_scalar = minmax(values.data(), count); },
+    [&] { range_avx2   = minmax(values.data(), count); });
+
+  size_t above_scalar = 0, above_avx2 = 0;
+  run("count_above",
+    [&] { above_scalar = count_above(values.data(), count, 3 * 1'500.0); },
+    [&] { above_avx2   = count_above(values.data(), count, 3 * 1'500.0); });
+
+  log_histogram histogram_scalar, histogram_avx2;
+  run("histogram",
+    [&] { histogram_add(histogram_scalar, values.data(), count); },
+    [&] { histogram_add(histogram_avx2, values.data(), count); });
+
+  double exact_scalar[4] = {}, exact_avx2[4] = {};
+  run("exact_quantiles (x4)",
+    [&] { exact_quantiles(values.data(), count, quantiles, 4, exact_scalar); },
+    [&] { exact_quantiles(values.data(), count, quantiles, 4, exact_avx2); });
+
+  // what the other tools do: sort a copy, then look the quantiles up
+  double naive[4] = {};
+  auto const naive_ms = time_ms([&] {
+    auto sorted = values;
+    std::sort(sorted.begin(), sorted.end());
+    for (int i = 0; i < 4; ++i)
+      naive[i] = sorted_quantile(sorted, quantiles[i]);
+  });
+
+  std::printf("%-26s %12.2f\n\n", "sort + sorted_quantile", naive_ms);
+
+  bool agree = (range_scalar.min == range_avx2.min && range_scalar.max == range_avx2.max &&
+    above_scalar == above_avx2 && histogram_scalar.counts == histogram_avx2.counts);
+
+  for (int i = 0; i < 4; ++i) {
+    agree &= (exact_scalar[i] == naive[i]) && (!avx2 || exact_avx2[i] == naive[i]);
+
+    std::printf("q=%-6g exact %10.1f  histogram %10.1f\n", quantiles[i], naive[i],
+      histogram_quantile(histogram_scalar, quantiles[i], range_scalar));
+  }
+
+  if (!avx2) {
+    std::printf("\n(the AVX2 results were not checked)\n");
+    return 0;
+  }
+
+  std::printf("\nscalar and AVX2 kernels %s\n", agree ? "agree" : "DISAGREE");
+  return agree ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+  options opts;
+  std::vector<std::string> paths;
+
+  for (int i = 1; i < argc; ++i) {
+    auto const has_value = (i + 1 < argc);
+
+    if (!std::strcmp(argv[i], "--csv"))
+      opts.csv = true;
+    else if (!std::strcmp(argv[i], "--scalar"))
+      analysis_use_avx2() = false;
+    else if (!std::strcmp(argv[i], "--outlier") && has_value)
+      opts.outlier = std::atof(argv[++i]);
+    else if (!std::strcmp(argv[i], "--benchmark") && has_value)
+      opts.benchmark = std::strtoull(argv[++i], nullptr, 0);
+    else if (argv[i][0] == '-') {
+      print_usage();
+      return 2;
+    }
+    else
+      paths.push_back(argv[i]);
+  }
+
+  if (opts.benchmark)
+    return run_benchmark(opts.benchmark);
+
+  if (paths.empty()) {
+    print_usage();
+    return 2;
+  }
+
+  std::map<std::string, series_aggregate> aggregates;
+
+  for (auto const& path : paths) {
+    sample_map samples;
+    if (!load_sample_log(path, samples)) {
+      std::fprintf(stderr, "failed to read %s\n", path.c_str());
+      return 2;
+    }
+
+    for (auto const& [name, values] : samples)
+      aggregate_add(aggregates[name], values.data(), values.size());
+  }
+
+  if (opts.csv)
+    std::printf("series,runs,count,min,p50,p90,p99,p99.9,max,mean,outliers\n");
+  else
+    std::printf("%-32s %5s %10s %9s %9s %9s %9s %9s %9s %9s %9s\n", "series", "runs",
+      "count", "min", "p50", "p90", "p99", "p99.9", "max", "mean", "outliers");
+
+  for (auto const& [name, a] : aggregates) {
+    auto const q = [&](double const quantile) {
+      return histogram_quantile(a.histogram, quantile, a.range);
+    };
+
+    auto const p50      = q(0.5);
+    auto const outliers = histogram_count_above(a.histogram, p50 * opts.outlier);
+    auto const mean     = a.sum / a.count;
+
+    if (opts.csv) {
+      std::printf("%s,%zu,%llu,%g,%g,%g,%g,%g,%g,%g,%llu\n", name.c_str(), a.runs,
+        static_cast<unsigned long long>(a.count), a.range.min, p50, q(0.9), q(0.99),
+        q(0.999), a.range.max, mean, static_cast<unsigned long long>(outliers));
+    }
+    else {
+      std::printf("%-32s %5zu %10llu %9.0f %9.0f %9.0f %9.0f %9.0f %9.0f %9.1f %9llu\n",
+        name.c_str(), a.runs, static_cast<unsigned long long>(a.count), a.range.min, p50,
+        q(0.9), q(0.99), q(0.999), a.range.max, mean, static_cast<unsigned long long>(outliers));
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,394 @@
+#pragma once
+
+// Kernels for aggregating large amounts of samples (millions per series,
+// across many runs). Every kernel has a scalar version and an AVX2
+// version, which is picked at runtime (see analysis_use_avx2()), and both
+// always produce the exact same result.
+//
+// Percentiles are built on a log-linear histogram: every power of two is
+// split into 2^log_histogram_sub_bits linear buckets, so the bucket of a
+// value is just the top bits of its double representation. Histograms of
+// different runs can be merged by adding them up, and any quantile of the
+// merged histogram is within 2^-log_histogram_sub_bits (relative) of the
+// exact one. exact_quantile() uses the histogram to find the bucket that
+// holds the requested rank, and only selects within that bucket.
+
+#include <immintrin.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Whether the AVX2 kernels are used. This defaults to whether the
+// processor supports AVX2, and can be turned off for comparison.
+inline bool& analysis_use_avx2() {
+  static bool use = __builtin_cpu_supports("avx2");
+  return use;
+}
+
+struct value_range {
+  double min, max;
+};
+
+// Minimum and maximum of a (non-empty) array.
+inline value_range minmax_scalar(double const* const values, size_t const count) {
+  value_range range = { values[0], values[0] };
+
+  for (size_t i = 0; i < count; ++i) {
+    // branch-free, since these compile to MINSD/MAXSD
+    range.min = (values[i] < range.min) ? values[i] : range.min;
+    range.max = (values[i] > range.max) ? values[i] : range.max;
+  }
+
+  return range;
+}
+
+__attribute__((target("avx2")))
+inline value_range minmax_avx2(double const* const values, size_t const count) {
+  if (count < 8)
+    return minmax_scalar(values, count);
+
+  // two sets of accumulators to hide the latency of MINPD/MAXPD
+  auto min0 = _mm256_loadu_pd(values), min1 = min0;
+  auto max0 = min0, max1 = min0;
+
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    auto const a = _mm256_loadu_pd(values + i);
+    auto const b = _mm256_loadu_pd(values + i + 4);
+    min0 = _mm256_min_pd(min0, a);
+    min1 = _mm256_min_pd(min1, b);
+    max0 = _mm256_max_pd(max0, a);
+    max1 = _mm256_max_pd(max1, b);
+  }
+
+  double mins[4], maxs[4];
+  _mm256_storeu_pd(mins, _mm256_min_pd(min0, min1));
+  _mm256_storeu_pd(maxs, _mm256_max_pd(max0, max1));
+
+  value_range range = { mins[0], maxs[0] };
+  for (int j = 1; j < 4; ++j) {
+    range.min = std::min(range.min, mins[j]);
+    range.max = std::max(range.max, maxs[j]);
+  }
+
+  for (; i < count; ++i) {
+    range.min = std::min(range.min, values[i]);
+    range.max = std::max(range.max, values[i]);
+  }
+
+  return range;
+}
+
+inline value_range minmax(double const* const values, size_t const count) {
+  return analysis_use_avx2() ? minmax_avx2(values, count) : minmax_scalar(values, count);
+}
+
+// Number of values that are strictly greater than the threshold.
+inline size_t count_above_scalar(double const* const values, size_t const count, double const threshold) {
+  size_t above = 0;
+  for (size_t i = 0; i < count; ++i)
+    above += (values[i] > threshold);
+
+  return above;
+}
+
+__attribute__((target("avx2")))
+inline size_t count_above_avx2(double const* const values, size_t const count, double const threshold) {
+  auto const limit = _mm256_set1_pd(threshold);
+
+  // every lane of the mask is -1 for values above the threshold
+  auto counts = _mm256_setzero_si256();
+
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    auto const mask = _mm256_cmp_pd(_mm256_loadu_pd(values + i), limit, _CMP_GT_OQ);
+    counts = _mm256_sub_epi64(counts, _mm256_castpd_si256(mask));
+  }
+
+  uint64_t lanes[4];
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), counts);
+
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+    count_above_scalar(values + i, count - i, threshold);
+}
+
+inline size_t count_above(double const* const values, size_t const count, double const threshold) {
+  return analysis_use_avx2()
+    ? count_above_avx2(values, count, threshold) : count_above_scalar(values, count, threshold);
+}
+
+inline constexpr unsigned int log_histogram_sub_bits = 7;
+
+// Values are clamped to [0, 2^64], which is every possible raw sample.
+// Bucket 0 holds everything below 1.
+inline constexpr double log_histogram_max_value = 18446744073709551616.0;
+inline constexpr size_t log_histogram_buckets   = (65ull << log_histogram_sub_bits) + 1;
+
+// Bucket index of a value in [1, 2^64]: the exponent and the top
+// mantissa bits of its double representation.
+inline size_t log_histogram_bucket(double const value) {
+  if (!(value >= 1.0))
+    return 0;
+
+  uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+
+  return static_cast<size_t>((bits >> (52 - log_histogram_sub_bits)) -
+    (1023ull << log_histogram_sub_bits)) + 1;
+}
+
+// Smallest value in the specified bucket.
+inline double log_histogram_lower_bound(size_t const bucket) {
+  if (bucket == 0)
+    return 0.0;
+
+  auto const bits = ((bucket - 1) + (1023ull << log_histogram_sub_bits)) <<
+    (52 - log_histogram_sub_bits);
+
+  double value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+struct log_histogram {
+  std::vector<uint64_t> counts = std::vector<uint64_t>(log_histogram_buckets);
+  uint64_t total = 0;
+};
+
+inline void histogram_add_scalar(log_histogram& histogram, double const* const values, size_t const count) {
+  for (size_t i = 0; i < count; ++i)
+    ++histogram.counts[log_histogram_bucket(std::min(values[i], log_histogram_max_value))];
+
+  histogram.total += count;
+}
+
+__attribute__((target("avx2")))
+inline void histogram_add_avx2(log_histogram& histogram, double const* const values, size_t const count) {
+  // not worth setting up the per-lane counters for
+  if (count < 4096)
+    return histogram_add_scalar(histogram, values, count);
+
+  auto const one  = _mm256_set1_pd(1.0);
+  auto const top  = _mm256_set1_pd(log_histogram_max_value);
+  auto const base = _mm256_set1_epi64x(static_cast<int64_t>((1023ull << log_histogram_sub_bits) - 1));
+
+  // every lane gets its own set of counters, so that consecutive values
+  // in the same bucket don't serialize on a single counter
+  std::vector<uint32_t> lanes(4 * log_histogram_buckets);
+  auto const flush = [&] {
+    for (size_t b = 0; b < log_histogram_buckets; ++b) {
+      histogram.counts[b] += uint64_t(lanes[b]) + lanes[log_histogram_buckets + b] +
+        lanes[2 * log_histogram_buckets + b] + lanes[3 * log_histogram_buckets + b];
+    }
+    std::fill(lanes.begin(), lanes.end(), 0);
+  };
+
+  size_t i = 0, since_flush = 0;
+  for (; i + 4 <= count; i += 4) {
+    auto const v = _mm256_min_pd(_mm256_loadu_pd(values + i), top);
+
+    auto const index = _mm256_sub_epi64(_mm256_srli_epi64(
+      _mm256_castpd_si256(v), 52 - log_histogram_sub_bits), base);
+
+    // bucket 0 for anything below 1
+    auto const small = _mm256_castpd_si256(_mm256_cmp_pd(v, one, _CMP_NGE_UQ));
+    auto const clamped = _mm256_andnot_si256(small, index);
+
+    uint64_t indices[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(indices), clamped);
+
+    ++lanes[indices[0]];
+    ++lanes[log_histogram_buckets + indices[1]];
+    ++lanes[2 * log_histogram_buckets + indices[2]];
+    ++lanes[3 * log_histogram_buckets + indices[3]];
+
+    // the 32-bit lane counters can't overflow between flushes
+    if (++since_flush == (1u << 31)) {
+      flush();
+      since_flush = 0;
+    }
+  }
+
+  flush();
+  histogram.total += i;
+
+  histogram_add_scalar(histogram, values + i, count - i);
+}
+
+inline void histogram_add(log_histogram& histogram, double const* const values, size_t const count) {
+  if (analysis_use_avx2())
+    histogram_add_avx2(histogram, values, count);
+  else
+    histogram_add_scalar(histogram, values, count);
+}
+
+inline void histogram_merge(log_histogram& histogram, log_histogram const& other) {
+  for (size_t b = 0; b < log_histogram_buckets; ++b)
+    histogram.counts[b] += other.counts[b];
+
+  histogram.total += other.total;
+}
+
+// Bucket that holds the value with the specified rank (0-based), and
+// the number of values in the buckets below it.
+inline size_t histogram_find_rank(log_histogram const& histogram, uint64_t const rank, uint64_t& below) {
+  below = 0;
+
+  for (size_t b = 0; b < log_histogram_buckets; ++b) {
+    if (below + histogram.counts[b] > rank)
+      return b;
+
+    below += histogram.counts[b];
+  }
+
+  return log_histogram_buckets - 1;
+}
+
+// Approximate quantile of the histogram (the middle of the bucket that
+// holds it), clamped to the exact range of the values if it's known.
+inline double histogram_quantile(log_histogram const& histogram, double const q,
+    value_range const range = { 0.0, log_histogram_max_value }) {
+  if (!histogram.total)
+    return NAN;
+
+  uint64_t below = 0;
+  auto const rank   = static_cast<uint64_t>(std::llround(q * (histogram.total - 1)));
+  auto const bucket = histogram_find_rank(histogram, rank, below);
+
+  auto const lower = log_histogram_lower_bound(bucket);
+  auto const upper = log_histogram_lower_bound(bucket + 1);
+
+  // every value in the first buckets is an integer (or below 1)
+  auto const middle = (upper - lower <= 1.0) ? lower : (lower + upper) / 2;
+  return std::clamp(middle, range.min, range.max);
+}
+
+// Number of values that are greater than the threshold, to the
+// resolution of the histogram (the bucket of the threshold is excluded).
+inline uint64_t histogram_count_above(log_histogram const& histogram, double const threshold) {
+  uint64_t above = 0;
+  for (auto b = log_histogram_bucket(threshold) + 1; b < log_histogram_buckets; ++b)
+    above += histogram.counts[b];
+
+  return above;
+}
+
+// Copy the values in [lower, upper) into the output.
+inline void gather_range_scalar(double const* const values, size_t const count,
+    double const lower, double const upper, std::vector<double>& output) {
+  for (size_t i = 0; i < count; ++i) {
+    if (values[i] >= lower && values[i] < upper)
+      output.push_back(values[i]);
+  }
+}
+
+__attribute__((target("avx2")))
+inline void gather_range_avx2(double const* const values, size_t const count,
+    double const lower, double const upper, std::vector<double>& output) {
+  auto const low  = _mm256_set1_pd(lower);
+  auto const high = _mm256_set1_pd(upper);
+
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    auto const v    = _mm256_loadu_pd(values + i);
+    auto const mask = _mm256_movemask_pd(_mm256_and_pd(
+      _mm256_cmp_pd(v, low, _CMP_GE_OQ), _mm256_cmp_pd(v, high, _CMP_LT_OQ)));
+
+    // most blocks have nothing in the range
+    for (auto bits = mask; bits; bits &= bits - 1)
+      output.push_back(values[i + __builtin_ctz(bits)]);
+  }
+
+  gather_range_scalar(values + i, count - i, lower, upper, output);
+}
+
+// Exact, linearly interpolated quantiles of an unsorted array (the same
+// as sorted_quantile() in stats.h on the sorted array). The histogram is
+// only built once for all of them.
+inline void exact_quantiles(double const* const values, size_t const count,
+    double const* const quantiles, size_t const quantile_count, double* const results) {
+  if (!count) {
+    std::fill(results, results + quantile_count, NAN);
+    return;
+  }
+
+  log_histogram histogram;
+  histogram_add(histogram, values, count);
+
+  // the value with the specified rank, selected within its bucket
+  auto const select = [&](uint64_t const rank) {
+    uint64_t below = 0;
+    auto const bucket = histogram_find_rank(histogram, rank, below);
+
+    auto const lower = (bucket == 0) ? -HUGE_VAL : log_histogram_lower_bound(bucket);
+    auto const upper = (bucket + 1 == log_histogram_buckets)
+      ? HUGE_VAL : log_histogram_lower_bound(bucket + 1);
+
+    std::vector<double> candidates;
+    candidates.reserve(histogram.counts[bucket]);
+
+    if (analysis_use_avx2())
+      gather_range_avx2(values, count, lower, upper, candidates);
+    else
+      gather_range_scalar(values, count, lower, upper, candidates);
+
+    auto const nth = candidates.begin() + (rank - below);
+    std::nth_element(candidates.begin(), nth, candidates.end());
+    return *nth;
+  };
+
+  for (size_t i = 0; i < quantile_count; ++i) {
+    auto const position = quantiles[i] * (count - 1);
+    auto const rank     = static_cast<uint64_t>(position);
+    auto const next     = std::min<uint64_t>(rank + 1, count - 1);
+
+    auto const a = select(rank);
+    auto const b = (next == rank) ? a : select(next);
+    results[i] = a + (b - a) * (position - rank);
+  }
+}
+
+inline double exact_quantile(double const* const values, size_t const count, double const q) {
+  double result = NAN;
+  exact_quantiles(values, count, &q, 1, &result);
+  return result;
+}
+
+// Streaming summary of a series across any number of runs, which
+// never holds on to the samples themselves.
+struct series_aggregate {
+  size_t runs = 0;
+  uint64_t count = 0;
+  value_range range = { HUGE_VAL, -HUGE_VAL };
+  double sum = 0;
+  log_histogram histogram;
+};
+
+inline void aggregate_add(series_aggregate& aggregate, double const* const values, size_t const count) {
+  if (!count)
+    return;
+
+  auto const range = minmax(values, count);
+  aggregate.range.min = std::min(aggregate.range.min, range.min);
+  aggregate.range.max = std::max(aggregate.range.max, range.max);
+
+  for (size_t i = 0; i < count; ++i)
+    aggregate.sum += values[i];
+
+  histogram_add(aggregate.histogram, values, count);
+
+  aggregate.runs  += 1;
+  aggregate.count += count;
+}
+
+inline void aggregate_merge(series_aggregate& aggregate, series_aggregate const& other) {
+  aggregate.range.min = std::min(aggregate.range.min, other.range.min);
+  aggregate.range.max = std::max(aggregate.range.max, other.range.max);
+  aggregate.sum   += other.sum;
+  aggregate.runs  += other.runs;
+  aggregate.count += other.count;
+  histogram_merge(aggregate.histogram, other.histogram);
+}
@@ -0,0 +1,382 @@
+// Measures the cost and jitter of the primitives that nohv's timing
+// detections are built on, using the exact same code (nohv/measure.h).
+//
+//   bench [--iterations <n>] [--cpu <n>] [--format json|csv] [--unit tsc|cycles]
+//         [--samples <path>] [--load none|stream|cpuid|avx]
+//         [--load-cpus sibling|others|all|<list>]
+//
+// Every primitive is measured as the TSC delta across an empty (or
+// minimal) bracket, which is the noise floor that any threshold built on
+// top of it has to clear. Results are printed as one JSON object (or one
+// CSV row) per primitive. Each row also has the ratio between core cycles
+// and reference cycles while the primitive was measured (when perf is
+// available), and --unit cycles reports every value in core cycles, which
+// is comparable between machines (and P-states) with different clocks. --samples additionally writes every raw sample
+// in the same "[#] <name> <series>: ..." format that the driver prints,
+// so two runs can be compared with regress.
+//
+// --load runs a load generator on other logical processors while the
+// primitives are measured (by default on the SMT sibling of the target
+// CPU, which shares the core's execution units and caches with it):
+//
+//   stream  read+write a 64MB buffer per thread (memory bandwidth, LLC)
+//   cpuid   CPUID in a loop (exit-heavy when virtualized)
+//   avx     256-bit FMAs (execution ports, and frequency licenses)
+//
+// The target is --cpu, or the CPU that bench started on. Rows have the
+// load in them, and the raw samples use the same series names as an idle
+// run, so "regress idle.txt loaded.txt" shows how far every primitive's
+// distribution (including the p99.9 tail) moved under contention.
+
+#include "load.h"
+#include "measure.h"
+#include "stats.h"
+
+#include <cpuid.h>
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+struct options {
+  size_t iterations = 100'000;
+  int cpu           = -1;
+  bool csv          = false;
+  bool cycles       = false;
+  char const* samples_path = nullptr;
+  load_kind load        = load_kind::none;
+  char const* load_cpus = "sibling";
+};
+
+// A single benchmarked primitive. measure() returns the number of TSC
+// ticks that a single invocation took.
+struct primitive {
+  char const* name;
+  std::function<uint64_t()> measure;
+};
+
+// Summary statistics of a set of samples.
+struct summary {
+  size_t count;
+  double min, p50, p90, p99, p999, max, mean, stddev;
+};
+
+static summary summarize(std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+
+  summary s = {};
+  s.count = values.size();
+  s.min   = values.front();
+  s.p50   = sorted_quantile(values, 0.5);
+  s.p90   = sorted_quantile(values, 0.9);
+  s.p99   = sorted_quantile(values, 0.99);
+  s.p999  = sorted_quantile(values, 0.999);
+  s.max   = values.back();
+
+  for (auto const v : values)
+    s.mean += v;
+  s.mean /= values.size();
+
+  for (auto const v : values)
+    s.stddev += (v - s.mean) * (v - s.mean);
+  s.stddev = std::sqrt(s.stddev / values.size());
+
+  return s;
+}
+
+static void print_summary(options const& opts, char const* const name,
+    summary const& s, double const cycles_per_tsc) {
+  auto const unit = opts.cycles ? "cycles" : "tsc";
+  auto const load = load_kind_name(opts.load);
+
+  if (opts.csv) {
+    std::printf("%s,%s,%s,%zu,%g,%g,%g,%g,%g,%g,%g,%g,%g\n", name, unit, load, s.count,
+      s.min, s.p50, s.p90, s.p99, s.p999, s.max, s.mean, s.stddev, cycles_per_tsc);
+  }
+  else {
+    std::printf("{\"primitive\":\"%s\",\"unit\":\"%s\",\"load\":\"%s\",\"count\":%zu,"
+      "\"min\":%g,\"p50\":%g,\"p90\":%g,\"p99\":%g,\"p99.9\":%g,\"max\":%g,\"mean\":%g,"
+      "\"stddev\":%g,\"cycles_per_tsc\":%g}\n", name, unit, load, s.count, s.min, s.p50,
+      s.p90, s.p99, s.p999, s.max, s.mean, s.stddev, cycles_per_tsc);
+  }
+}
+
+// Write the raw samples in the format that the driver uses.
+static void write_samples(FILE* const file, char const* const name, std::vector<double> const& values) {
+  for (size_t i = 0; i < values.size(); i += 16) {
+    std::fprintf(file, "[#] bench %s:", name);
+
+    for (size_t j = i; j < values.size() && j < i + 16; ++j)
+      std::fprintf(file, " %.0f", values[j]);
+
+    std::fprintf(file, "\n");
+  }
+}
+
+// rdpmc index of CPU_CLK_UNHALTED.REF_TSC (fixed counter #2 on Intel,
+// which perf exposes as ref-cycles), or -1 if user-mode RDPMC isn't
+// available.
+static int open_fixed_ctr2() {
+  perf_event_attr attr = {};
+  attr.type           = PERF_TYPE_HARDWARE;
+  attr.size           = sizeof(attr);
+  attr.config         = PERF_COUNT_HW_REF_CPU_CYCLES;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv     = 1;
+
+  auto const fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+  if (fd < 0)
+    return -1;
+
+  auto const page = static_cast<perf_event_mmap_page*>(mmap(nullptr,
+    sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0));
+
+  if (page == MAP_FAILED)
+    return -1;
+
+  if (!page->cap_user_rdpmc || !page->index)
+    return -1;
+
+  return static_cast<int>(page->index - 1);
+}
+
+// A pair of perf counters that measure the ratio between the actual core
+// clock and the reference clock (which ticks at the TSC rate), the same
+// way that the driver uses APERF and MPERF.
+struct core_clock {
+  int cycles_fd = -1;
+  int ref_fd    = -1;
+  uint64_t cycles, ref;
+};
+
+static int open_counter(uint64_t const config) {
+  perf_event_attr attr = {};
+  attr.type           = PERF_TYPE_HARDWARE;
+  attr.size           = sizeof(attr);
+  attr.config         = config;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv     = 1;
+
+  return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+static bool read_counter(int const fd, uint64_t& value) {
+  return fd >= 0 && read(fd, &value, sizeof(value)) == sizeof(value);
+}
+
+static void core_clock_begin(core_clock& clock) {
+  read_counter(clock.cycles_fd, clock.cycles);
+  read_counter(clock.ref_fd, clock.ref);
+}
+
+// Ratio of core cycles to reference cycles since core_clock_begin(),
+// or 1 if it can't be measured.
+static double core_clock_end(core_clock const& clock) {
+  uint64_t cycles = 0, ref = 0;
+  if (!read_counter(clock.cycles_fd, cycles) || !read_counter(clock.ref_fd, ref))
+    return 1.0;
+
+  if (ref <= clock.ref || cycles <= clock.cycles)
+    return 1.0;
+
+  return static_cast<double>(cycles - clock.cycles) / (ref - clock.ref);
+}
+
+static sigjmp_buf fault_buffer;
+
+static void fault_handler(int) {
+  siglongjmp(fault_buffer, 1);
+}
+
+// Parse a number of iterations, which has to be at least 1 for there to
+// be anything to summarize.
+static bool parse_iterations(char const* const text, size_t& iterations) {
+  char* end = nullptr;
+  auto const value = std::strtoull(text, &end, 0);
+
+  if (end == text || *end || !value)
+    return false;
+
+  iterations = value;
+  return true;
+}
+
+int main(int argc, char** argv) {
+  options opts;
+
+  for (int i = 1; i < argc; ++i) {
+    auto const has_value = (i + 1 < argc);
+
+    if (!std::strcmp(argv[i], "--iterations") && has_value && parse_iterations(argv[i + 1], opts.iterations))
+      ++i;
+    else if (!std::strcmp(argv[i], "--cpu") && has_value)
+      opts.cpu = std::atoi(argv[++i]);
+    else if (!std::strcmp(argv[i], "--format") && has_value)
+      opts.csv = !std::strcmp(argv[++i], "csv");
+    else if (!std::strcmp(argv[i], "--unit") && has_value)
+      opts.cycles = !std::strcmp(argv[++i], "cycles");
+    else if (!std::strcmp(argv[i], "--samples") && has_value)
+      opts.samples_path = argv[++i];
+    else if (!std::strcmp(argv[i], "--load") && has_value && parse_load_kind(argv[i + 1], opts.load))
+      ++i;
+    else if (!std::strcmp(argv[i], "--load-cpus") && has_value && load_cpus_valid(argv[i + 1]))
+      opts.load_cpus = argv[++i];
+    else {
+      std::fprintf(stderr, "usage: bench [--iterations <n>] [--cpu <n>] "
+        "[--format json|csv] [--unit tsc|cycles] [--samples <path>] "
+        "[--load none|stream|cpuid|avx] [--load-cpus sibling|others|all|<list>]\n");
+      return 2;
+    }
+  }
+
+  // the load has to be placed relative to a known CPU
+  if (opts.cpu < 0 && opts.load != load_kind::none)
+    opts.cpu = sched_getcpu();
+
+  if (opts.cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(opts.cpu, &set);
+
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+      std::perror("sched_setaffinity");
+      return 1;
+    }
+  }
+
+  struct sigaction action = {};
+  action.sa_handler = fault_handler;
+  action.sa_flags   = SA_NODEFER;
+  sigaction(SIGILL, &action, nullptr);
+
+  alignas(64) static uint8_t cacheline[64] = {};
+  auto const fixed_ctr2 = open_fixed_ctr2();
+
+  core_clock clock;
+  clock.cycles_fd = open_counter(PERF_COUNT_HW_CPU_CYCLES);
+  clock.ref_fd    = open_counter(PERF_COUNT_HW_REF_CPU_CYCLES);
+
+  if (clock.cycles_fd < 0 || clock.ref_fd < 0)
+    std::fprintf(stderr, "cycles: perf counters are not available, assuming nominal frequency\n");
+
+  std::vector<primitive> primitives = {
+    { "rdtsc", [] {
+      auto const start = fenced_rdtsc();
+      auto const end   = fenced_rdtsc();
+      return end - start;
+    } },
+    { "rdtscp", [] {
+      auto const start = fenced_rdtscp();
+      auto const end   = fenced_rdtscp();
+      return end - start;
+    } },
+    { "cpuid", [] {
+      unsigned int regs[4];
+      auto const start = fenced_rdtsc();
+      __cpuid(0, regs[0], regs[1], regs[2], regs[3]);
+      auto const end = fenced_rdtsc();
+      return end - start;
+    } },
+    { "time_cacheline", [] {
+      return time_cacheline(cacheline);
+    } },
+    { "fault", [] {
+      // UD2 -> SIGILL -> siglongjmp() back here
+      volatile uint64_t start = fenced_rdtsc();
+      if (!sigsetjmp(fault_buffer, 0))
+        __builtin_trap();
+      return fenced_rdtsc() - start;
+    } },
+  };
+
+  if (fixed_ctr2 >= 0) {
+    primitives.push_back({ "fixed_ctr2", [fixed_ctr2] {
+      _mm_lfence();
+      auto const start = __rdpmc(fixed_ctr2);
+      _mm_lfence();
+      auto const end = __rdpmc(fixed_ctr2);
+      _mm_lfence();
+      return static_cast<uint64_t>(end - start);
+    } });
+  }
+  else
+    std::fprintf(stderr, "fixed_ctr2: user-mode RDPMC is not available, skipping\n");
+
+  load_generator load;
+
+  if (opts.load != load_kind::none) {
+    auto const cpus = parse_load_cpus(opts.load_cpus, opts.cpu);
+
+    if (!load_kind_supported(opts.load)) {
+      std::fprintf(stderr, "load: %s is not supported on this processor\n", load_kind_name(opts.load));
+      return 1;
+    }
+
+    if (cpus.empty()) {
+      std::fprintf(stderr, "load: no CPUs to run on (\"%s\" relative to CPU %d)\n",
+        opts.load_cpus, opts.cpu);
+      return 1;
+    }
+
+    if (!load.start(opts.load, cpus)) {
+      std::fprintf(stderr, "load: failed to pin the load generator\n");
+      return 1;
+    }
+
+    std::string list;
+    for (auto const cpu : cpus)
+      list += (list.empty() ? "" : ",") + std::to_string(cpu);
+
+    std::fprintf(stderr, "load: %s on CPU(s) %s, measuring on CPU %d\n",
+      load_kind_name(opts.load), list.c_str(), opts.cpu);
+  }
+
+  FILE* samples_file = nullptr;
+  if (opts.samples_path && !(samples_file = std::fopen(opts.samples_path, "w"))) {
+    std::perror(opts.samples_path);
+    return 1;
+  }
+
+  if (opts.csv)
+    std::printf("primitive,unit,load,count,min,p50,p90,p99,p99.9,max,mean,stddev,cycles_per_tsc\n");
+
+  for (auto const& p : primitives) {
+    // warm up the caches and branch predictors
+    for (size_t i = 0; i < opts.iterations / 100 + 1; ++i)
+      p.measure();
+
+    std::vector<double> values(opts.iterations);
+
+    core_clock_begin(clock);
+
+    for (auto& v : values)
+      v = static_cast<double>(p.measure());
+
+    auto const cycles_per_tsc = core_clock_end(clock);
+
+    if (opts.cycles) {
+      for (auto& v : values)
+        v *= cycles_per_tsc;
+    }
+
+    print_summary(opts, p.name, summarize(values), cycles_per_tsc);
+
+    if (samples_file)
+      write_samples(samples_file, p.name, values);
+  }
+
+  if (samples_file)
+    std::fclose(samples_file);
+
+  return 0;
+}
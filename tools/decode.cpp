@@ -0,0 +1,142 @@
+// Converts the samples in a nohv log between the decimal "[#]" form and
+// the encoded "[#z]" form (CompressSamples, see nohv/encoding.h).
+//
+//   decode [--encode] [<log>]
+//
+// Reads the log from the specified file (or stdin) and writes it to
+// stdout with every "[#z]" line expanded into "[#]" lines, or with
+// --encode, every "[#]" line compacted into a "[#z]" line. Everything
+// else is passed through unchanged. The other tools read both forms, so
+// this is only needed for consumers that don't.
+
+#include "encoding.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Number of samples per "[#]" line, like the driver.
+inline constexpr size_t samples_per_line = 16;
+
+// Split a sample line into its prefix ("<detection> <series>:") and its
+// payload, or return false if it isn't one.
+static bool split_sample_line(std::string const& line, char const* const marker,
+    std::string& prefix, std::string& payload) {
+  auto const start = line.find(marker);
+  if (start == std::string::npos)
+    return false;
+
+  auto const colon = line.find(':', start);
+  if (colon == std::string::npos)
+    return false;
+
+  auto const body = start + std::strlen(marker);
+  prefix  = line.substr(body, colon + 1 - body);
+  payload = line.substr(colon + 1);
+  return true;
+}
+
+static bool expand_line(std::string const& line, std::ostream& output) {
+  std::string prefix, payload;
+  if (!split_sample_line(line, "[#z] ", prefix, payload))
+    return false;
+
+  std::istringstream tokens(payload);
+
+  std::string text;
+  if (!(tokens >> text))
+    return false;
+
+  std::vector<uint8_t> data(text.size() / 4 * 3);
+  auto const size = base64_decode(text.data(), text.size(), data.data());
+  if (size < 0)
+    return false;
+
+  sample_decoder decoder;
+  decoder_initialize(decoder, data.data(), static_cast<size_t>(size));
+
+  uint64_t value = 0;
+  auto pending = decode_sample(decoder, value);
+
+  while (pending) {
+    output << "[#] " << prefix;
+
+    for (size_t i = 0; pending && i < samples_per_line; ++i) {
+      output << ' ' << value;
+      pending = decode_sample(decoder, value);
+    }
+
+    output << '\n';
+  }
+
+  return true;
+}
+
+static bool compact_line(std::string const& line, std::ostream& output) {
+  std::string prefix, payload;
+  if (!split_sample_line(line, "[#] ", prefix, payload))
+    return false;
+
+  std::vector<uint64_t> values;
+  std::istringstream tokens(payload);
+  for (uint64_t value = 0; tokens >> value;)
+    values.push_back(value);
+
+  std::vector<uint8_t> data(values.size() * max_encoded_sample_size);
+
+  sample_encoder encoder;
+  encoder_initialize(encoder, data.data(), data.size());
+
+  for (auto const value : values)
+    encode_sample(encoder, value);
+
+  std::string text(base64_length(encoder.size) + 1, '\0');
+  base64_encode(data.data(), encoder.size, text.data());
+  text.pop_back();
+
+  output << "[#z] " << prefix << ' ' << text << '\n';
+  return true;
+}
+
+int main(int argc, char** argv) {
+  bool encode = false;
+  char const* path = nullptr;
+
+  for (int i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "--encode"))
+      encode = true;
+    else if (argv[i][0] != '-' && !path)
+      path = argv[i];
+    else {
+      std::fprintf(stderr, "usage: decode [--encode] [<log>]\n");
+      return 2;
+    }
+  }
+
+  std::ifstream file;
+  if (path) {
+    file.open(path);
+    if (!file) {
+      std::fprintf(stderr, "failed to read %s\n", path);
+      return 1;
+    }
+  }
+
+  auto& input = path ? static_cast<std::istream&>(file) : std::cin;
+
+  std::ios::sync_with_stdio(false);
+
+  for (std::string line; std::getline(input, line);) {
+    auto const converted = encode
+      ? compact_line(line, std::cout) : expand_line(line, std::cout);
+
+    if (!converted)
+      std::cout << line << '\n';
+  }
+
+  return 0;
+}
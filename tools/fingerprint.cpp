@@ -0,0 +1,350 @@
+// Trains the hypervisor signatures that the driver classifies hosts by
+// (nohv/signatures.h), and classifies logs against them.
+//
+//   fingerprint train [--output <file>] <family>=<log>...
+//   fingerprint classify <log>...
+//
+// A log holds a host for every set of "[#f]" lines that it contains (see
+// nohv/host-features.h). train labels every host in a log with the
+// family in front of it (a log can be given more than once, and a family
+// can have any number of logs), and writes signatures.h: the centroid
+// of every family (the median of every feature), how far its hosts are
+// from it, and a weight for every feature that scales it by how much it
+// varies within the families. It prints how many of the training hosts
+// the signatures classify correctly to stderr. classify prints the
+// family of every host with the signatures that this tool was built
+// with, the same way the driver does.
+//
+// Exits with 2 on usage errors.
+
+#include "host-features.h"
+#include "signatures.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using feature_vector = std::vector<int32_t>;
+
+// Detections that fail because of a bug that they cite, and the
+// hypervisors that have it. These aren't trained, since there are no logs
+// of most of them, but train writes them to signatures.h every time.
+static fingerprint_known_bug const known_bugs[] = {
+  // XSETBV uses RAX[63:32] (see xsetbv_detected_3)
+  { "xsetbv_detected_3", "hvpp, zpp_hypervisor, SimpleVisor or HyperDbg" },
+};
+
+static void print_usage() {
+  std::fprintf(stderr,
+    "usage: fingerprint train [--output <file>] <family>=<log>...\n"
+    "       fingerprint classify <log>...\n"
+    "  --output <file>    write signatures.h to a file instead of stdout\n");
+}
+
+// Read every host in a log: its "[#f] features" lines, concatenated up to
+// its "[#f] layout" line. Hosts that were printed with a different layout
+// (or whose lines are missing) are skipped.
+static bool load_features(std::string const& path, std::vector<feature_vector>& hosts) {
+  std::ifstream file(path);
+  if (!file)
+    return false;
+
+  feature_vector features;
+
+  for (std::string line; std::getline(file, line);) {
+    auto const start = line.find("[#f] ");
+    if (start == std::string::npos)
+      continue;
+
+    auto const colon = line.find(": ", start);
+    if (colon == std::string::npos)
+      continue;
+
+    auto const name = line.substr(start + 5, colon - start - 5);
+    std::istringstream tokens(line.substr(colon + 2));
+
+    if (name == "features") {
+      long value = 0;
+      while (tokens >> value)
+        features.push_back(static_cast<int32_t>(value));
+
+      continue;
+    }
+
+    if (name != "layout")
+      continue;
+
+    unsigned long layout = 0;
+    tokens >> layout;
+
+    if (layout != fingerprint_layout_version)
+      std::fprintf(stderr, "%s: skipping a host with feature layout %lu instead of %u\n",
+        path.c_str(), layout, fingerprint_layout_version);
+    else if (features.size() != fingerprint_feature_count)
+      std::fprintf(stderr, "%s: skipping a host with %zu feature(s) instead of %zu\n",
+        path.c_str(), features.size(), fingerprint_feature_count);
+    else
+      hosts.push_back(features);
+
+    features.clear();
+  }
+
+  return true;
+}
+
+struct family {
+  std::string name;
+  std::vector<feature_vector> hosts;
+  feature_vector centroid;
+  uint32_t radius = 0;
+};
+
+static int32_t median(std::vector<int32_t> values) {
+  std::sort(values.begin(), values.end());
+  return values[values.size() / 2];
+}
+
+static void train_centroids(std::vector<family>& families) {
+  for (auto& family : families) {
+    family.centroid.resize(fingerprint_feature_count);
+
+    for (size_t i = 0; i < fingerprint_feature_count; ++i) {
+      std::vector<int32_t> values;
+      for (auto const& host : family.hosts)
+        values.push_back(host[i]);
+
+      family.centroid[i] = median(std::move(values));
+    }
+  }
+}
+
+// The mean absolute deviation of every feature from its family's
+// centroid, pooled over every family. A feature that never varies
+// within a family gets the full weight (1.0), and a noisy one less.
+static std::vector<uint32_t> train_weights(std::vector<family> const& families) {
+  std::vector<uint32_t> weights(fingerprint_feature_count, feature_one);
+
+  for (size_t i = 0; i < fingerprint_feature_count; ++i) {
+    uint64_t deviation = 0, count = 0;
+
+    for (auto const& family : families) {
+      for (auto const& host : family.hosts) {
+        deviation += std::abs(host[i] - family.centroid[i]);
+        ++count;
+      }
+    }
+
+    if (count)
+      weights[i] = static_cast<uint32_t>(feature_one * feature_one / (deviation / count + feature_one));
+  }
+
+  return weights;
+}
+
+static void train_radii(std::vector<family>& families, std::vector<uint32_t> const& weights) {
+  for (auto& family : families) {
+    for (auto const& host : family.hosts) {
+      auto const distance = feature_distance(host.data(), family.centroid.data(), weights.data());
+      family.radius = std::max(family.radius, static_cast<uint32_t>(distance));
+    }
+  }
+}
+
+static void write_signatures(std::FILE* const output, std::vector<family> const& families,
+    std::vector<uint32_t> const& weights, size_t const host_count) {
+  std::fprintf(output,
+    "#pragma once\n"
+    "\n"
+    "// Generated by tools/fingerprint from %zu host(s) in %zu family(s), don't\n"
+    "// edit. To add a family, collect the \"[#f]\" lines of hosts that run it\n"
+    "// and retrain every family at once:\n"
+    "//\n"
+    "//   fingerprint train --output nohv/signatures.h <family>=<log>...\n"
+    "\n"
+    "#include \"host-features.h\"\n"
+    "\n"
+    "// the feature layout that the signatures were trained with\n"
+    "inline constexpr uint32_t fingerprint_signature_layout = %u;\n"
+    "\n", host_count, families.size(), fingerprint_layout_version);
+
+  std::fprintf(output, "inline constexpr uint32_t fingerprint_weights[fingerprint_feature_count] = {");
+  for (size_t i = 0; i < weights.size(); ++i)
+    std::fprintf(output, "%s%u%s", (i % 16) ? " " : "\n  ", weights[i], (i + 1 < weights.size()) ? "," : "");
+  std::fprintf(output, "\n};\n\n");
+
+  std::fprintf(output,
+    "inline constexpr size_t fingerprint_signature_count = %zu;\n"
+    "\n"
+    "// the last entry is a sentinel, so that the array is never empty\n"
+    "inline constexpr fingerprint_signature fingerprint_signatures[fingerprint_signature_count + 1] = {\n",
+    families.size());
+
+  for (auto const& family : families) {
+    std::fprintf(output, "  { \"%s\", {", family.name.c_str());
+    for (size_t i = 0; i < family.centroid.size(); ++i)
+      std::fprintf(output, "%s%d%s", (i % 16) ? " " : "\n    ", family.centroid[i],
+        (i + 1 < family.centroid.size()) ? "," : "");
+    std::fprintf(output, "\n  }, %u },\n", family.radius);
+  }
+
+  std::fprintf(output, "  { nullptr, {}, 0 }\n};\n");
+
+  std::fprintf(output,
+    "\n"
+    "// see known_bugs in tools/fingerprint\n"
+    "inline constexpr size_t fingerprint_known_bug_count = %zu;\n"
+    "\n"
+    "inline constexpr fingerprint_known_bug fingerprint_known_bugs[fingerprint_known_bug_count + 1] = {\n",
+    sizeof(known_bugs) / sizeof(known_bugs[0]));
+
+  for (auto const& bug : known_bugs) {
+    auto feature = false;
+    for (auto const check : fingerprint_checks)
+      feature |= !std::strcmp(check, bug.check);
+
+    if (!feature)
+      std::fprintf(stderr, "known bug of %s: %s isn't a feature\n", bug.families, bug.check);
+
+    std::fprintf(output, "  { \"%s\", \"%s\" },\n", bug.check, bug.families);
+  }
+
+  std::fprintf(output, "  { nullptr, nullptr }\n};\n");
+}
+
+static int train(int const argc, char** const argv) {
+  char const* output_path = nullptr;
+  std::vector<family> families;
+  std::map<std::string, size_t> indices;
+
+  for (int i = 0; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "--output") && i + 1 < argc) {
+      output_path = argv[++i];
+      continue;
+    }
+
+    auto const argument = std::string(argv[i]);
+    auto const equals   = argument.find('=');
+
+    if (argument[0] == '-' || equals == std::string::npos || equals == 0 ||
+        argument.find_first_of("\"\\") < equals) {
+      print_usage();
+      return 2;
+    }
+
+    auto const name = argument.substr(0, equals);
+    auto const path = argument.substr(equals + 1);
+
+    if (!indices.count(name)) {
+      indices[name] = families.size();
+      families.push_back({ name, {}, {}, 0 });
+    }
+
+    if (!load_features(path, families[indices[name]].hosts)) {
+      std::fprintf(stderr, "failed to read %s\n", path.c_str());
+      return 2;
+    }
+  }
+
+  // a family without hosts has no centroid
+  families.erase(std::remove_if(families.begin(), families.end(),
+    [](family const& family) { return family.hosts.empty(); }), families.end());
+
+  train_centroids(families);
+  auto const weights = train_weights(families);
+  train_radii(families, weights);
+
+  std::vector<fingerprint_signature> signatures(families.size());
+  for (size_t i = 0; i < families.size(); ++i) {
+    signatures[i].family = families[i].name.c_str();
+    std::copy(families[i].centroid.begin(), families[i].centroid.end(), signatures[i].centroid);
+    signatures[i].radius = families[i].radius;
+  }
+
+  size_t host_count = 0, correct = 0;
+
+  for (auto const& family : families) {
+    for (auto const& host : family.hosts) {
+      auto const match = fingerprint_classify(host.data(), signatures.data(),
+        signatures.size(), weights.data());
+
+      correct += match.known && family.name == match.family;
+      ++host_count;
+    }
+  }
+
+  std::fprintf(stderr, "%zu family(s), %zu host(s), %zu classified correctly.\n",
+    families.size(), host_count, correct);
+
+  auto const output = output_path ? std::fopen(output_path, "w") : stdout;
+  if (!output) {
+    std::fprintf(stderr, "failed to write %s\n", output_path);
+    return 2;
+  }
+
+  write_signatures(output, families, weights, host_count);
+
+  if (output_path)
+    std::fclose(output);
+
+  return 0;
+}
+
+static int classify(int const argc, char** const argv) {
+  if (!argc) {
+    print_usage();
+    return 2;
+  }
+
+  if (fingerprint_signature_count && fingerprint_signature_layout != fingerprint_layout_version) {
+    std::fprintf(stderr, "the signatures are for feature layout %u, retrain them\n",
+      fingerprint_signature_layout);
+    return 1;
+  }
+
+  for (int i = 0; i < argc; ++i) {
+    std::vector<feature_vector> hosts;
+
+    if (!load_features(argv[i], hosts)) {
+      std::fprintf(stderr, "failed to read %s\n", argv[i]);
+      return 2;
+    }
+
+    for (auto const& host : hosts) {
+      for (size_t j = 0; j < fingerprint_known_bug_count; ++j) {
+        auto const& bug = fingerprint_known_bugs[j];
+
+        if (fingerprint_has_known_bug(host.data(), bug))
+          std::printf("%s: %s() fails on %s\n", argv[i], bug.check, bug.families);
+      }
+
+      auto const match = fingerprint_classify(host.data(), fingerprint_signatures,
+        fingerprint_signature_count, fingerprint_weights);
+
+      if (!match.family)
+        std::printf("%s: no signatures\n", argv[i]);
+      else if (!match.known)
+        std::printf("%s: unknown (closest to %s)\n", argv[i], match.family);
+      else
+        std::printf("%s: %s (%u%% confidence)\n", argv[i], match.family, match.confidence);
+    }
+  }
+
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc >= 2 && !std::strcmp(argv[1], "train"))
+    return train(argc - 2, argv + 2);
+
+  if (argc >= 2 && !std::strcmp(argv[1], "classify"))
+    return classify(argc - 2, argv + 2);
+
+  print_usage();
+  return 2;
+}
@@ -0,0 +1,302 @@
+#pragma once
+
+// Background load that is pinned to other logical processors while a
+// benchmark runs, to see how contention (especially on the SMT sibling)
+// affects the latencies that are being measured.
+
+#include <cpuid.h>
+#include <immintrin.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class load_kind {
+  none,
+  stream, // read+write a buffer that is much larger than the LLC
+  cpuid,  // execute CPUID in a loop (a vm-exit every iteration)
+  avx     // 256-bit FMAs (AVX2 + FMA)
+};
+
+inline bool parse_load_kind(char const* const name, load_kind& kind) {
+  if (!std::strcmp(name, "none"))
+    kind = load_kind::none;
+  else if (!std::strcmp(name, "stream"))
+    kind = load_kind::stream;
+  else if (!std::strcmp(name, "cpuid"))
+    kind = load_kind::cpuid;
+  else if (!std::strcmp(name, "avx"))
+    kind = load_kind::avx;
+  else
+    return false;
+
+  return true;
+}
+
+inline char const* load_kind_name(load_kind const kind) {
+  switch (kind) {
+  case load_kind::stream: return "stream";
+  case load_kind::cpuid:  return "cpuid";
+  case load_kind::avx:    return "avx";
+  default:                return "none";
+  }
+}
+
+// Parse a CPU number, which has to be the whole string.
+inline bool parse_cpu(std::string const& text, int& cpu) {
+  if (text.empty() || text[0] < '0' || text[0] > '9')
+    return false;
+
+  char* end = nullptr;
+  auto const value = std::strtol(text.c_str(), &end, 10);
+
+  if (*end || value >= CPU_SETSIZE)
+    return false;
+
+  cpu = static_cast<int>(value);
+  return true;
+}
+
+// Parse a sysfs CPU list (e.g. "0-3,8,10-11").
+inline bool parse_cpu_list(std::string const& list, std::vector<int>& cpus) {
+  cpus.clear();
+
+  for (size_t pos = 0; pos < list.size();) {
+    auto const end   = list.find(',', pos);
+    auto const range = list.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+    auto const dash  = range.find('-');
+
+    if (!range.empty()) {
+      int first = 0, last = 0;
+
+      if (!parse_cpu(range.substr(0, dash), first))
+        return false;
+
+      if (dash == std::string::npos)
+        last = first;
+      else if (!parse_cpu(range.substr(dash + 1), last) || last < first)
+        return false;
+
+      for (int cpu = first; cpu <= last; ++cpu)
+        cpus.push_back(cpu);
+    }
+
+    if (end == std::string::npos)
+      break;
+
+    pos = end + 1;
+  }
+
+  return true;
+}
+
+inline std::vector<int> read_cpu_list(char const* const path) {
+  char buffer[1024] = {};
+
+  if (auto const file = std::fopen(path, "r")) {
+    if (!std::fgets(buffer, sizeof(buffer), file))
+      buffer[0] = '\0';
+
+    std::fclose(file);
+  }
+
+  std::string list(buffer);
+  while (!list.empty() && (list.back() == '\n' || list.back() == ' '))
+    list.pop_back();
+
+  std::vector<int> cpus;
+  if (!parse_cpu_list(list, cpus))
+    cpus.clear();
+
+  return cpus;
+}
+
+// Logical processors that share a core with the specified one (excluding it).
+inline std::vector<int> smt_siblings(int const cpu) {
+  auto const path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) +
+    "/topology/thread_siblings_list";
+
+  std::vector<int> siblings;
+  for (auto const sibling : read_cpu_list(path.c_str())) {
+    if (sibling != cpu)
+      siblings.push_back(sibling);
+  }
+
+  return siblings;
+}
+
+// Online logical processors that don't share a core with the specified one.
+inline std::vector<int> other_cores(int const cpu) {
+  auto const siblings = smt_siblings(cpu);
+
+  std::vector<int> others;
+  for (auto const other : read_cpu_list("/sys/devices/system/cpu/online")) {
+    if (other == cpu)
+      continue;
+
+    bool sibling = false;
+    for (auto const s : siblings)
+      sibling |= (s == other);
+
+    if (!sibling)
+      others.push_back(other);
+  }
+
+  return others;
+}
+
+inline bool load_cpus_valid(char const* const value) {
+  std::vector<int> cpus;
+
+  return !std::strcmp(value, "sibling") || !std::strcmp(value, "others") ||
+    !std::strcmp(value, "all") || parse_cpu_list(value, cpus);
+}
+
+// Parse a --load-cpus value: "sibling", "others", "all", or a CPU list
+// (see load_cpus_valid()).
+inline std::vector<int> parse_load_cpus(char const* const value, int const target) {
+  if (!std::strcmp(value, "sibling"))
+    return smt_siblings(target);
+
+  if (!std::strcmp(value, "others"))
+    return other_cores(target);
+
+  if (!std::strcmp(value, "all")) {
+    auto cpus = smt_siblings(target);
+    for (auto const cpu : other_cores(target))
+      cpus.push_back(cpu);
+    return cpus;
+  }
+
+  std::vector<int> cpus;
+  if (!parse_cpu_list(value, cpus))
+    cpus.clear();
+
+  return cpus;
+}
+
+inline bool load_kind_supported(load_kind const kind) {
+  if (kind == load_kind::avx)
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+
+  return true;
+}
+
+// Threads that run the specified load, one per logical processor,
+// until the generator is stopped (or destroyed).
+class load_generator {
+public:
+  ~load_generator() {
+    stop();
+  }
+
+  bool start(load_kind const kind, std::vector<int> const& cpus) {
+    stop_   = false;
+    ready_  = 0;
+    failed_ = false;
+
+    // every thread pins itself before it starts, so that none of the
+    // load ever runs on the wrong logical processor
+    for (auto const cpu : cpus) {
+      threads_.emplace_back([this, kind, cpu] {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+          failed_ = true;
+
+        ++ready_;
+
+        if (!failed_)
+          run(kind);
+      });
+    }
+
+    while (ready_ < threads_.size())
+      std::this_thread::yield();
+
+    if (failed_) {
+      stop();
+      return false;
+    }
+
+    return true;
+  }
+
+  void stop() {
+    stop_ = true;
+
+    for (auto& thread : threads_)
+      thread.join();
+
+    threads_.clear();
+  }
+
+private:
+  void run(load_kind const kind) {
+    switch (kind) {
+    case load_kind::stream: run_stream(); break;
+    case load_kind::cpuid:  run_cpuid(); break;
+    case load_kind::avx:    run_avx(); break;
+    default: break;
+    }
+  }
+
+  void run_stream() {
+    // 64MB per thread, which doesn't fit in any LLC
+    std::vector<uint64_t> buffer(8 * 1024 * 1024);
+
+    while (!stop_.load(std::memory_order_relaxed)) {
+      for (auto& value : buffer)
+        value += 1;
+    }
+
+    sink_ += buffer[0];
+  }
+
+  void run_cpuid() {
+    unsigned int regs[4] = {};
+
+    while (!stop_.load(std::memory_order_relaxed)) {
+      for (int i = 0; i < 64; ++i)
+        __cpuid(0, regs[0], regs[1], regs[2], regs[3]);
+    }
+
+    sink_ += regs[0];
+  }
+
+  __attribute__((target("avx2,fma"))) void run_avx() {
+    auto const a = _mm256_set1_ps(0.999f);
+    auto const b = _mm256_set1_ps(0.001f);
+
+    // enough independent accumulators to keep both FMA ports busy
+    __m256 acc[8];
+    for (auto& v : acc)
+      v = _mm256_set1_ps(1.0f);
+
+    while (!stop_.load(std::memory_order_relaxed)) {
+      for (int i = 0; i < 1024; ++i) {
+        for (auto& v : acc)
+          v = _mm256_fmadd_ps(v, a, b);
+      }
+    }
+
+    float out[8];
+    _mm256_storeu_ps(out, acc[0]);
+    sink_ += static_cast<uint64_t>(out[0]);
+  }
+
+  std::atomic<bool> stop_{ false };
+  std::atomic<bool> failed_{ false };
+  std::atomic<size_t> ready_{ 0 };
+  std::atomic<uint64_t> sink_{ 0 };
+  std::vector<std::thread> threads_;
+};
@@ -0,0 +1,73 @@
+#pragma once
+
+// Every detection that main.cpp runs, for the tools that run them outside
+// of the driver (roc and replay).
+
+#include "detections.h"
+
+#include <string.h>
+
+struct check {
+  char const* name;
+  bool (*detect)(cpu_caps const&);
+
+  // timing checks run on one processor of every core type, like main.cpp
+  bool per_core_type;
+};
+
+#define CHECK(x) { #x, x, false }
+#define TIMING_CHECK(x) { #x, x, true }
+
+inline check const checks[] = {
+  CHECK(cpuid_detected_1),
+  CHECK(msr_detected_1),
+  CHECK(msr_detected_2),
+  CHECK(cr0_detected_1),
+  CHECK(cr0_detected_2),
+  CHECK(cr0_detected_3),
+  CHECK(cr3_detected_1),
+  CHECK(cr3_detected_2),
+  CHECK(cr3_detected_3),
+  TIMING_CHECK(cr3_detected_4),
+  CHECK(cr4_detected_1),
+  CHECK(cr4_detected_2),
+  CHECK(cr4_detected_3),
+  CHECK(cr4_detected_4),
+  CHECK(xsetbv_detected_1),
+  CHECK(xsetbv_detected_2),
+  CHECK(xsetbv_detected_3),
+  CHECK(xsetbv_detected_4),
+  CHECK(xsetbv_detected_5),
+  CHECK(xstate_detected_1),
+  TIMING_CHECK(timing_detected_1),
+  CHECK(timing_detected_2),
+  TIMING_CHECK(timing_detected_3),
+  TIMING_CHECK(timing_detected_4),
+  TIMING_CHECK(timing_detected_5),
+  TIMING_CHECK(timing_detected_6),
+  TIMING_CHECK(timing_detected_7),
+  TIMING_CHECK(timing_detected_8),
+  CHECK(debug_detected_1),
+  CHECK(debug_detected_2),
+  CHECK(debug_detected_3),
+  TIMING_CHECK(debug_detected_4),
+  CHECK(vmx_detected_1),
+  CHECK(vmx_detected_2),
+  CHECK(vmx_detected_3),
+  CHECK(regs_detected_1),
+};
+
+#undef CHECK
+#undef TIMING_CHECK
+
+inline constexpr size_t check_count = sizeof(checks) / sizeof(checks[0]);
+
+// Look up a check by name, or return null if there is no such check.
+inline check const* find_check(char const* const name) {
+  for (auto const& c : checks) {
+    if (!strcmp(c.name, name))
+      return &c;
+  }
+
+  return nullptr;
+}
@@ -0,0 +1,883 @@
+#include "cpu.h"
+#include "caps.h"
+
+#include <ntddk.h>
+#include <aux_klib.h>
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <vector>
+
+// Nominal TSC frequency of every mocked machine.
+inline constexpr double tsc_frequency = 3'000'000'000.0;
+
+// The PM timer port that the mock FADT describes, and its frequency.
+inline constexpr unsigned short pm_timer_port = 0x408;
+inline constexpr double pm_timer_frequency = 3'579'545.0;
+
+// E-cores are slower at pretty much everything.
+inline constexpr double atom_latency_factor = 1.5;
+
+// Architectural bits that the model cares about.
+inline constexpr uint64_t cr0_et = 1ull << 4;
+inline constexpr uint64_t cr0_ne = 1ull << 5;
+inline constexpr uint64_t cr0_nw = 1ull << 29;
+inline constexpr uint64_t cr0_cd = 1ull << 30;
+inline constexpr uint64_t cr0_writable = 0xE005'003Full;
+
+inline constexpr uint64_t cr4_pae       = 1ull << 5;
+inline constexpr uint64_t cr4_la57      = 1ull << 12;
+inline constexpr uint64_t cr4_vmxe      = 1ull << 13;
+inline constexpr uint64_t cr4_pcide     = 1ull << 17;
+inline constexpr uint64_t cr4_supported = 0x01F7'7FFFull;
+
+inline constexpr uint32_t max_phys_bits   = 46;
+inline constexpr uint32_t max_linear_bits = 48;
+
+inline constexpr uint64_t mtrr_enable = 1ull << 11;
+
+// LBR, BTF, and bits 6-15 of IA32_DEBUGCTL
+inline constexpr uint64_t debugctl_supported = 0xFFC3;
+
+struct mock_processor {
+  uint8_t core_type;
+
+  uint64_t cr0, cr3, cr4, xcr0;
+  uint64_t dr[8];
+  uint64_t debugctl;
+
+  // offsets that the hypervisor applied to hide vm-exits
+  double tsc_offset;
+  double mperf_offset;
+  double ref_tsc_offset;
+
+  uint64_t fixed_ctr_ctrl;
+  uint64_t perf_global_ctrl;
+  uint64_t mtrr_def_type;
+};
+
+static mock_personality personality;
+static std::vector<mock_processor> processors;
+static uint32_t current = 0;
+
+// real time, in TSC ticks
+static double real_time = 0.0;
+
+// TSC offset for compensation_shared
+static double shared_tsc_offset = 0.0;
+
+// number of processors that are exiting at the same time (during an IPI)
+static uint32_t concurrency = 1;
+
+// number of vm-exits so far
+static uint64_t exit_count = 0;
+
+static std::mt19937_64 noise;
+
+static bool has_bug(mock_bug const bug) {
+  return personality.virtualized && (personality.bugs & (1u << bug));
+}
+
+static mock_processor& cpu() {
+  return processors[current];
+}
+
+[[noreturn]] static void raise_gp() {
+  throw mock_fault{ STATUS_PRIVILEGED_INSTRUCTION };
+}
+
+[[noreturn]] static void raise_ud() {
+  throw mock_fault{ STATUS_ILLEGAL_INSTRUCTION };
+}
+
+// Let the specified number of core cycles pass on the current processor.
+static void advance(double cycles) {
+  if (cpu().core_type == core_type_atom)
+    cycles *= atom_latency_factor;
+
+  if (personality.jitter_cycles > 0.0)
+    cycles += std::abs(std::normal_distribution<double>(0.0, personality.jitter_cycles)(noise));
+
+  if (personality.spike_rate > 0.0 &&
+      std::uniform_real_distribution<double>(0.0, 1.0)(noise) < personality.spike_rate)
+    cycles += personality.spike_cycles;
+
+  real_time += cycles / personality.freq_ratio;
+}
+
+// Cause a vm-exit, and hide it from the guest if the hypervisor does that.
+static void vm_exit() {
+  ++exit_count;
+
+  auto const start = real_time;
+  advance(personality.exit_cycles);
+
+  auto const hidden = (real_time - start) * personality.compensation_ratio;
+
+  if (personality.compensation == compensation_per_cpu)
+    cpu().tsc_offset -= hidden;
+  else if (personality.compensation == compensation_shared)
+    shared_tsc_offset -= hidden * concurrency;
+
+  if (personality.compensation != compensation_none) {
+    if (personality.compensate_mperf)
+      cpu().mperf_offset -= hidden;
+    if (personality.compensate_ref_tsc)
+      cpu().ref_tsc_offset -= hidden;
+  }
+
+  if (has_bug(bug_dr7_clobbered))
+    cpu().dr[7] = 0x400;
+
+  if (has_bug(bug_dr_clobbered)) {
+    for (uint32_t i = 0; i < 4; ++i)
+      cpu().dr[i] = 0;
+
+    cpu().dr[6] = 0xFFFF'0FF0;
+  }
+
+  if (has_bug(bug_debugctl_clobbered))
+    cpu().debugctl = 0;
+}
+
+// Whether memory accesses on the current processor are uncached.
+static bool uncached() {
+  if (has_bug(bug_cd_ignored))
+    return false;
+
+  return (cpu().cr0 & cr0_cd) || !(cpu().mtrr_def_type & mtrr_enable);
+}
+
+static uint64_t guest_tsc() {
+  auto tsc = real_time + cpu().tsc_offset;
+  if (personality.compensation == compensation_shared)
+    tsc += shared_tsc_offset;
+
+  return static_cast<uint64_t>(static_cast<int64_t>(tsc));
+}
+
+static uint64_t guest_mperf() {
+  return static_cast<uint64_t>(static_cast<int64_t>(real_time + cpu().mperf_offset));
+}
+
+static uint64_t guest_aperf() {
+  return static_cast<uint64_t>(static_cast<int64_t>(
+    (real_time + cpu().mperf_offset) * personality.freq_ratio));
+}
+
+static uint64_t xcr0_supported() {
+  return personality.avx512 ? 0xE7 : 0x07;
+}
+
+char const* mock_bug_name(uint32_t const bug) {
+  static char const* const names[bug_count] = {
+    "hypervisor_bit", "synthetic_msrs", "hidden_aperf_mperf", "cr0_ne_fixed",
+    "cr0_reserved_high", "cr0_reserved_low", "cr3_reserved", "cr3_bit63_pcide",
+    "cr3_bit63_no_pcide", "cr4_vmxe_visible", "cr4_vmxe_sticky", "cr4_reserved",
+    "xcr_index", "xcr0_unsupported", "xsetbv_rax_high", "xsetbv_rcx_high",
+    "xcr0_invalid", "dr7_clobbered", "vmxon_gp", "vmcall_no_ud", "rdtscp_high",
+    "cd_ignored", "gpr_clobbered", "xstate_clobbered", "dr_clobbered",
+    "debugctl_clobbered"
+  };
+
+  return (bug < bug_count) ? names[bug] : "unknown";
+}
+
+mock_personality mock_bare_metal(std::mt19937_64& rng) {
+  auto const uniform = [&](double const min, double const max) {
+    return std::uniform_real_distribution<double>(min, max)(rng);
+  };
+
+  auto const chance = [&](double const probability) {
+    return uniform(0.0, 1.0) < probability;
+  };
+
+  mock_personality p = {};
+  p.cpu_count     = 2 + static_cast<uint32_t>(uniform(0.0, 7.0));
+  p.hybrid        = chance(0.3);
+  p.freq_ratio    = uniform(0.4, 1.6);
+  p.cpuid_cycles  = static_cast<uint32_t>(uniform(80.0, 250.0));
+  p.rdtsc_cycles  = static_cast<uint32_t>(uniform(18.0, 40.0));
+  p.msr_cycles    = static_cast<uint32_t>(uniform(80.0, 200.0));
+  p.cr_cycles     = static_cast<uint32_t>(uniform(20.0, 60.0));
+  p.wb_gap_cycles = static_cast<uint32_t>(uniform(20.0, 60.0));
+  p.uc_gap_cycles = static_cast<uint32_t>(uniform(4'000.0, 16'000.0));
+  p.jitter_cycles = uniform(2.0, 30.0);
+  p.spike_rate    = chance(0.5) ? uniform(0.0, 1e-4) : 0.0;
+  p.spike_cycles  = static_cast<uint32_t>(uniform(20'000.0, 200'000.0));
+  p.aperf_mperf   = chance(0.9);
+  p.pcide         = chance(0.8);
+  p.avx512        = chance(0.4);
+  p.vmx_enabled   = chance(0.8);
+  return p;
+}
+
+mock_personality mock_virtualized(std::mt19937_64& rng, double const bug_probability) {
+  auto p = mock_bare_metal(rng);
+
+  auto const uniform = [&](double const min, double const max) {
+    return std::uniform_real_distribution<double>(min, max)(rng);
+  };
+
+  auto const chance = [&](double const probability) {
+    return uniform(0.0, 1.0) < probability;
+  };
+
+  p.virtualized = true;
+
+  for (uint32_t bug = 0; bug < bug_count; ++bug) {
+    if (chance(bug_probability))
+      p.bugs |= (1u << bug);
+  }
+
+  auto const compensation = uniform(0.0, 1.0);
+  p.compensation = (compensation < 0.4) ? compensation_none
+    : (compensation < 0.7) ? compensation_per_cpu : compensation_shared;
+
+  p.exit_cycles        = static_cast<uint32_t>(uniform(300.0, 4'000.0));
+  p.compensation_ratio = uniform(0.8, 1.2);
+  p.compensate_mperf   = chance(0.3);
+  p.compensate_ref_tsc = chance(0.3);
+  p.dr_exiting         = chance(0.5);
+  p.cr3_exiting        = chance(0.3);
+  p.io_exiting         = chance(0.5);
+  p.nested_vmx         = chance(0.2);
+  p.vmx_enabled        = chance(0.5);
+  return p;
+}
+
+void mock_load(mock_personality const& p, uint64_t const seed) {
+  personality       = p;
+  current           = 0;
+  real_time         = 0.0;
+  shared_tsc_offset = 0.0;
+  concurrency       = 1;
+  exit_count        = 0;
+  noise.seed(seed);
+
+  processors.assign(p.cpu_count, mock_processor{});
+
+  for (uint32_t i = 0; i < p.cpu_count; ++i) {
+    auto& processor = processors[i];
+    processor.core_type     = mock_core_type(i);
+    processor.cr0           = 0x8005'0033;
+    processor.cr3           = 0x1AD000 | (p.pcide ? 0x2 : 0x0);
+    processor.cr4           = 0x0035'06F8 | (p.pcide ? cr4_pcide : 0);
+    processor.xcr0          = xcr0_supported();
+    processor.dr[6]         = 0xFFFF'0FF0;
+    processor.dr[7]         = 0x400;
+    processor.mtrr_def_type = mtrr_enable | (1ull << 10) | 0x6;
+  }
+}
+
+void mock_set_processor(uint32_t const index) {
+  current = index;
+}
+
+uint64_t mock_real_time() {
+  return static_cast<uint64_t>(real_time);
+}
+
+uint8_t mock_core_type(uint32_t const index) {
+  if (!personality.hybrid)
+    return core_type_unknown;
+
+  // the first half of the processors are P-cores
+  return (index < personality.cpu_count / 2) ? core_type_core : core_type_atom;
+}
+
+uint64_t mock_rdtsc() {
+  // charge the code that ran since the previous intrinsic
+  advance(uncached() ? personality.uc_gap_cycles : personality.wb_gap_cycles);
+  advance(personality.rdtsc_cycles / 2.0);
+  auto const tsc = guest_tsc();
+  advance(personality.rdtsc_cycles / 2.0);
+  return tsc;
+}
+
+uint64_t mock_rdtscp(unsigned int* const aux) {
+  *aux = current;
+  return mock_rdtsc();
+}
+
+void mock_cpuid(int regs[4], int const leaf, int const subleaf) {
+  if (personality.virtualized)
+    vm_exit();
+  else
+    advance(personality.cpuid_cycles);
+
+  regs[0] = regs[1] = regs[2] = regs[3] = 0;
+
+  switch (static_cast<uint32_t>(leaf)) {
+  case 0x00:
+    regs[0] = personality.hybrid ? 0x1A : 0x16;
+    regs[1] = 0x756E'6547;
+    regs[2] = 0x6C65'746E;
+    regs[3] = 0x4965'6E69;
+    break;
+  case 0x01:
+    // VMX, XSAVE, OSXSAVE
+    regs[2] = (1 << 26) | (1 << 27);
+    if (!personality.virtualized || personality.vmx_enabled)
+      regs[2] |= (1 << 5);
+    if (has_bug(bug_hypervisor_bit))
+      regs[2] |= (1u << 31);
+    break;
+  case 0x06:
+    regs[2] = (personality.aperf_mperf && !has_bug(bug_hidden_aperf_mperf)) ? 1 : 0;
+    break;
+  case 0x07:
+    if (subleaf == 0 && personality.hybrid)
+      regs[3] = (1 << 15);
+    break;
+  case 0x0D:
+    if (subleaf == 0)
+      regs[0] = static_cast<int>(xcr0_supported());
+    break;
+  case 0x1A:
+    regs[0] = static_cast<int>(static_cast<uint32_t>(cpu().core_type) << 24);
+    break;
+  case 0x8000'0008:
+    regs[0] = static_cast<int>(max_phys_bits | (max_linear_bits << 8));
+    break;
+  }
+}
+
+uint64_t mock_readmsr(unsigned long const msr) {
+  advance(personality.msr_cycles);
+
+  // synthetic MSRs
+  if (msr >= 0x4000'0000 && msr <= 0x4000'00FF) {
+    if (!personality.virtualized)
+      raise_gp();
+
+    vm_exit();
+    if (has_bug(bug_synthetic_msrs))
+      return 0;
+
+    raise_gp();
+  }
+
+  switch (msr) {
+  case 0xE7:  // IA32_MPERF
+  case 0xE8:  // IA32_APERF
+    if (!personality.aperf_mperf && !has_bug(bug_hidden_aperf_mperf))
+      raise_gp();
+
+    return (msr == 0xE7) ? guest_mperf() : guest_aperf();
+  case 0x3A:  // IA32_FEATURE_CONTROL
+    if (personality.virtualized)
+      vm_exit();
+
+    return personality.vmx_enabled ? 0x5 : 0x1;
+  case 0x486: // IA32_VMX_CR0_FIXED0
+  case 0x487: // IA32_VMX_CR0_FIXED1
+  case 0x488: // IA32_VMX_CR4_FIXED0
+  case 0x489: // IA32_VMX_CR4_FIXED1
+    if (personality.virtualized) {
+      vm_exit();
+      if (!personality.vmx_enabled)
+        raise_gp();
+    }
+
+    if (msr == 0x486) return 0x8000'0021;
+    if (msr == 0x487) return 0xFFFF'FFFF;
+    if (msr == 0x488) return cr4_vmxe;
+    return cr4_supported;
+  case 0x38D: // IA32_FIXED_CTR_CTRL
+    return cpu().fixed_ctr_ctrl;
+  case 0x38F: // IA32_PERF_GLOBAL_CTRL
+    return cpu().perf_global_ctrl;
+  case 0x30B: // IA32_FIXED_CTR2
+    return static_cast<uint64_t>(static_cast<int64_t>(real_time + cpu().ref_tsc_offset));
+  case 0x2FF: // IA32_MTRR_DEF_TYPE
+    return cpu().mtrr_def_type;
+  case 0x1D9: // IA32_DEBUGCTL
+    return cpu().debugctl;
+  }
+
+  raise_gp();
+}
+
+void mock_writemsr(unsigned long const msr, uint64_t const value) {
+  advance(personality.msr_cycles);
+
+  switch (msr) {
+  case 0x38D: cpu().fixed_ctr_ctrl   = value; return;
+  case 0x38F: cpu().perf_global_ctrl = value; return;
+  case 0x1D9:
+    if (value & ~debugctl_supported)
+      raise_gp();
+
+    cpu().debugctl = value;
+    return;
+  case 0x2FF:
+    if (personality.virtualized)
+      vm_exit();
+
+    cpu().mtrr_def_type = value;
+    return;
+  }
+
+  raise_gp();
+}
+
+uint64_t mock_readcr(int const cr) {
+  if (cr == 3 && personality.virtualized && personality.cr3_exiting)
+    vm_exit();
+  else
+    advance(personality.cr_cycles / 4.0);
+
+  switch (cr) {
+  case 0: return cpu().cr0;
+  case 3: return cpu().cr3;
+  case 4: return cpu().cr4 | (has_bug(bug_cr4_vmxe_visible) ? cr4_vmxe : 0);
+  }
+
+  raise_ud();
+}
+
+static void write_cr0(uint64_t value) {
+  if (personality.virtualized)
+    vm_exit();
+  else
+    advance(personality.cr_cycles);
+
+  if (value >> 32) {
+    if (!has_bug(bug_cr0_reserved_high))
+      raise_gp();
+
+    value &= 0xFFFF'FFFF;
+  }
+
+  // reserved bits in CR0[31:0] are ignored
+  if (!has_bug(bug_cr0_reserved_low))
+    value = (value & cr0_writable) | cr0_et;
+
+  if ((value & cr0_nw) && !(value & cr0_cd))
+    raise_gp();
+
+  if (has_bug(bug_cr0_ne_fixed))
+    value |= cr0_ne;
+
+  cpu().cr0 = value;
+}
+
+static void write_cr3(uint64_t value) {
+  // the hypervisor only gets a chance to mess up if it intercepts CR3
+  auto const exiting = personality.virtualized && personality.cr3_exiting;
+
+  if (exiting)
+    vm_exit();
+  else
+    advance(personality.cr_cycles);
+
+  auto const bug = [&](mock_bug const b) {
+    return exiting && has_bug(b);
+  };
+
+  if (value & (1ull << 63)) {
+    // bit 63 is a no-flush hint with PCIDE=1, and reserved otherwise
+    if (cpu().cr4 & cr4_pcide) {
+      if (bug(bug_cr3_bit63_pcide))
+        raise_gp();
+    }
+    else if (!bug(bug_cr3_bit63_no_pcide))
+      raise_gp();
+
+    value &= ~(1ull << 63);
+  }
+
+  auto const reserved = ~((1ull << max_phys_bits) - 1) & ~(1ull << 63);
+  if ((value & reserved) && !bug(bug_cr3_reserved))
+    raise_gp();
+
+  cpu().cr3 = value;
+}
+
+static void write_cr4(uint64_t value) {
+  if (personality.virtualized)
+    vm_exit();
+  else
+    advance(personality.cr_cycles);
+
+  auto& processor = cpu();
+
+  if (!has_bug(bug_cr4_reserved)) {
+    if (value & ~cr4_supported)
+      raise_gp();
+
+    // PAE can't be cleared and LA57 can't be changed in IA-32e mode
+    if (!(value & cr4_pae) || ((value ^ processor.cr4) & cr4_la57))
+      raise_gp();
+  }
+  else
+    value &= cr4_supported;
+
+  // PCIDE can only be set while CR3[11:0] is zero
+  if ((value & cr4_pcide) && !(processor.cr4 & cr4_pcide) && (processor.cr3 & 0xFFF))
+    raise_gp();
+
+  if (has_bug(bug_cr4_vmxe_sticky))
+    value = (value & ~cr4_vmxe) | (processor.cr4 & cr4_vmxe);
+
+  processor.cr4 = value;
+}
+
+void mock_writecr(int const cr, uint64_t const value) {
+  switch (cr) {
+  case 0: write_cr0(value); return;
+  case 3: write_cr3(value); return;
+  case 4: write_cr4(value); return;
+  }
+
+  raise_ud();
+}
+
+uint64_t mock_readdr(unsigned int const dr) {
+  if (personality.virtualized && personality.dr_exiting)
+    vm_exit();
+  else
+    advance(personality.cr_cycles);
+
+  return cpu().dr[dr & 7];
+}
+
+void mock_writedr(unsigned int const dr, uint64_t const value) {
+  if (personality.virtualized && personality.dr_exiting)
+    vm_exit();
+  else
+    advance(personality.cr_cycles);
+
+  // DR7[10] is always set
+  cpu().dr[dr & 7] = ((dr & 7) == 7) ? (value | 0x400) : value;
+}
+
+uint64_t mock_xgetbv(unsigned int const xcr) {
+  advance(personality.cr_cycles);
+
+  if (xcr != 0)
+    raise_gp();
+
+  return cpu().xcr0;
+}
+
+// Whether the specified XCR0 value is architecturally valid.
+static bool valid_xcr0(uint64_t const value) {
+  // x87 must be set and AVX requires SSE
+  if (!(value & 0x1) || ((value & 0x4) && !(value & 0x2)))
+    return false;
+
+  // BNDREG and BNDCSR must be set together
+  if (((value >> 3) & 1) != ((value >> 4) & 1))
+    return false;
+
+  // opmask, ZMM_Hi256, and Hi16_ZMM must be set together, along with AVX
+  if ((value & 0xE0) && ((value & 0xE0) != 0xE0 || !(value & 0x4)))
+    return false;
+
+  return true;
+}
+
+void mock_xsetbv(uint64_t const rcx, uint64_t const rdx, uint64_t const rax) {
+  if (personality.virtualized)
+    vm_exit();
+  else
+    advance(personality.cr_cycles * 4.0);
+
+  auto const index = has_bug(bug_xsetbv_rcx_high) ? rcx : (rcx & 0xFFFF'FFFF);
+  auto const value = ((rdx & 0xFFFF'FFFF) << 32) |
+    (has_bug(bug_xsetbv_rax_high) ? rax : (rax & 0xFFFF'FFFF));
+
+  if (index != 0) {
+    if (has_bug(bug_xcr_index))
+      return;
+
+    raise_gp();
+  }
+
+  if ((value & ~xcr0_supported()) && !has_bug(bug_xcr0_unsupported))
+    raise_gp();
+
+  if (!valid_xcr0(value) && !has_bug(bug_xcr0_invalid))
+    raise_gp();
+
+  cpu().xcr0 = value;
+}
+
+unsigned char mock_vmxon(unsigned long long* const address) {
+  if (personality.virtualized) {
+    vm_exit();
+
+    // a hypervisor that emulates nested VMX checks the operand
+    if (personality.nested_vmx && personality.vmx_enabled && (cpu().cr4 & cr4_vmxe))
+      return 2;
+
+    if (has_bug(bug_vmxon_gp))
+      raise_gp();
+
+    raise_ud();
+  }
+
+  advance(personality.cr_cycles * 10.0);
+
+  if (!(cpu().cr4 & cr4_vmxe))
+    raise_ud();
+
+  if (!personality.vmx_enabled || !address)
+    raise_gp();
+
+  // VMfailInvalid if the VMXON region isn't a valid, aligned address
+  if ((*address & 0xFFF) || (*address >> max_phys_bits))
+    return 2;
+
+  return 0;
+}
+
+unsigned long mock_indword(unsigned short const port) {
+  if (personality.virtualized && personality.io_exiting)
+    vm_exit();
+  else
+    advance(1'500.0);
+
+  if (port != pm_timer_port)
+    return 0xFFFF'FFFF;
+
+  // the PM timer is a 24-bit counter of real time
+  return static_cast<unsigned long>(static_cast<uint64_t>(
+    real_time * pm_timer_frequency / tsc_frequency) & 0xFF'FFFF);
+}
+
+void mock_instruction(int const cycles) {
+  advance(cycles);
+}
+
+// The assembly stubs that the detections call.
+
+extern "C" bool check_rdtscp_regs() {
+  unsigned int aux = 0;
+  mock_rdtscp(&aux);
+  return has_bug(bug_rdtscp_high);
+}
+
+extern "C" void xsetbv_full(uint64_t const rcx, uint64_t const rdx, uint64_t const rax) {
+  mock_xsetbv(rcx, rdx, rax);
+}
+
+extern "C" void vmx_vmcall(uint64_t, uint64_t, uint64_t, uint64_t) {
+  if (!personality.virtualized)
+    raise_ud();
+
+  vm_exit();
+
+  if (!has_bug(bug_vmcall_no_ud))
+    raise_ud();
+}
+
+// The GPR snapshot stubs (see regs-asm.asm) start out with every register
+// unchanged, and let a hypervisor with bug_gpr_clobbered loose on R8-R11
+// if the instruction caused a vm-exit.
+template <typename Fn>
+static void snapshot(uint64_t* const regs, Fn&& instruction) {
+  regs[4] = 0xFFFF'F800'0000'1000;
+
+  auto const output = regs + 16;
+  std::copy(regs, regs + 16, output);
+
+  auto const exits = exit_count;
+  instruction(output);
+
+  if (exit_count != exits && has_bug(bug_gpr_clobbered))
+    std::fill(output + 8, output + 12, 0);
+}
+
+extern "C" void regs_cpuid(uint64_t* const regs) {
+  snapshot(regs, [&](uint64_t* const output) {
+    int values[4];
+    mock_cpuid(values, static_cast<int>(regs[0]), static_cast<int>(regs[1]));
+
+    output[0] = static_cast<uint32_t>(values[0]);
+    output[3] = static_cast<uint32_t>(values[1]);
+    output[1] = static_cast<uint32_t>(values[2]);
+    output[2] = static_cast<uint32_t>(values[3]);
+  });
+}
+
+extern "C" void regs_rdtscp(uint64_t* const regs) {
+  snapshot(regs, [&](uint64_t* const output) {
+    unsigned int aux = 0;
+    auto const tsc = mock_rdtscp(&aux);
+
+    // the upper halves are left alone with bug_rdtscp_high
+    auto const high = has_bug(bug_rdtscp_high) ? ~0xFFFF'FFFFull : 0;
+    output[0] = (output[0] & high) | (tsc & 0xFFFF'FFFF);
+    output[2] = (output[2] & high) | (tsc >> 32);
+    output[1] = (output[1] & high) | aux;
+  });
+}
+
+extern "C" void regs_rdmsr(uint64_t* const regs) {
+  snapshot(regs, [&](uint64_t* const output) {
+    auto const value = mock_readmsr(static_cast<unsigned long>(regs[1] & 0xFFFF'FFFF));
+    output[0] = value & 0xFFFF'FFFF;
+    output[2] = value >> 32;
+  });
+}
+
+extern "C" void regs_xgetbv(uint64_t* const regs) {
+  snapshot(regs, [&](uint64_t* const output) {
+    auto const value = mock_xgetbv(static_cast<unsigned int>(regs[1] & 0xFFFF'FFFF));
+    output[0] = value & 0xFFFF'FFFF;
+    output[2] = value >> 32;
+  });
+}
+
+extern "C" void regs_rdpid(uint64_t* const regs) {
+  snapshot(regs, [&](uint64_t* const output) {
+    // IA32_TSC_AUX, like RDTSCP
+    output[0] = current;
+  });
+}
+
+extern "C" void regs_vmcall(uint64_t* const regs) {
+  snapshot(regs, [&](uint64_t* const output) {
+    vmx_vmcall(output[1], output[2], output[8], output[9]);
+  });
+}
+
+// Vector and opmask registers, like xstate.cpp.
+struct xstate_registers {
+  uint8_t vectors[32][64];
+  uint64_t opmasks[8];
+};
+
+// The extended state stubs (see xstate-asm.asm) store what they loaded,
+// unless a hypervisor with bug_xstate_clobbered got to the first two.
+static void xstate(xstate_registers const* const input, xstate_registers* const output,
+    uint32_t const leaf, uint32_t const count, uint32_t const vector_count,
+    uint32_t const vector_size, uint32_t const opmask_count) {
+  auto const exits = exit_count;
+
+  for (uint32_t i = 0; i < count; ++i) {
+    int regs[4];
+    mock_cpuid(regs, static_cast<int>(leaf), 0);
+  }
+
+  for (uint32_t i = 0; i < vector_count; ++i)
+    memcpy(output->vectors[i], input->vectors[i], vector_size);
+
+  // KMOVW only stores the lower 16 bits
+  for (uint32_t i = 0; i < opmask_count; ++i)
+    memcpy(&output->opmasks[i], &input->opmasks[i], 2);
+
+  if (exit_count != exits && has_bug(bug_xstate_clobbered)) {
+    memset(output->vectors[0], 0, vector_size);
+    memset(output->vectors[1], 0, vector_size);
+  }
+}
+
+extern "C" void xstate_sse(xstate_registers const* const input,
+    xstate_registers* const output, uint32_t const leaf, uint32_t const count) {
+  xstate(input, output, leaf, count, 16, 16, 0);
+}
+
+extern "C" void xstate_avx(xstate_registers const* const input,
+    xstate_registers* const output, uint32_t const leaf, uint32_t const count) {
+  xstate(input, output, leaf, count, 16, 32, 0);
+}
+
+extern "C" void xstate_avx512(xstate_registers const* const input,
+    xstate_registers* const output, uint32_t const leaf, uint32_t const count) {
+  xstate(input, output, leaf, count, 32, 64, 8);
+}
+
+// The parts of the WDK that depend on the processor (see wdk.cpp for the rest).
+
+ULONG KeQueryActiveProcessorCountEx(USHORT) {
+  return personality.cpu_count;
+}
+
+ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER const number) {
+  if (number) {
+    number->Group    = 0;
+    number->Number   = static_cast<UCHAR>(current);
+    number->Reserved = 0;
+  }
+
+  return current;
+}
+
+NTSTATUS KeGetProcessorNumberFromIndex(ULONG const index, PPROCESSOR_NUMBER const number) {
+  if (index >= personality.cpu_count)
+    return STATUS_UNSUCCESSFUL;
+
+  number->Group    = 0;
+  number->Number   = static_cast<UCHAR>(index);
+  number->Reserved = 0;
+  return STATUS_SUCCESS;
+}
+
+void KeSetSystemGroupAffinityThread(PGROUP_AFFINITY const affinity, PGROUP_AFFINITY const previous) {
+  if (previous) {
+    *previous = {};
+    previous->Mask = 1ull << current;
+  }
+
+  current = static_cast<uint32_t>(__builtin_ctzll(affinity->Mask));
+}
+
+void KeRevertToUserGroupAffinityThread(PGROUP_AFFINITY const previous) {
+  current = static_cast<uint32_t>(__builtin_ctzll(previous->Mask));
+}
+
+// Every other processor is modeled as running the worker at the
+// same time, which is what matters for a shared TSC offset.
+ULONG_PTR KeIpiGenericCall(PKIPI_BROADCAST_WORKER const worker, ULONG_PTR const context) {
+  auto const previous = current;
+  concurrency = personality.cpu_count;
+
+  ULONG_PTR result = 0;
+  for (uint32_t i = 0; i < personality.cpu_count; ++i) {
+    current = i;
+    result  = worker(context);
+  }
+
+  concurrency = 1;
+  current     = previous;
+  return result;
+}
+
+LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER const frequency) {
+  if (frequency)
+    frequency->QuadPart = 10'000'000;
+
+  LARGE_INTEGER counter;
+  counter.QuadPart = static_cast<LONGLONG>(real_time * 10'000'000.0 / tsc_frequency);
+  return counter;
+}
+
+void KeStallExecutionProcessor(ULONG const microseconds) {
+  real_time += microseconds * tsc_frequency / 1'000'000.0;
+}
+
+NTSTATUS AuxKlibGetSystemFirmwareTable(ULONG const provider, ULONG const table,
+    PVOID const buffer, ULONG const length, PULONG const return_length) {
+  if (provider != 'ACPI' || table != 'PCAF')
+    return STATUS_UNSUCCESSFUL;
+
+  // an FADT with only the fields that the detections care about
+  UCHAR fadt[276] = {};
+  memcpy(fadt, "FACP", 4);
+  *reinterpret_cast<ULONG*>(fadt + 4)  = sizeof(fadt);
+  *reinterpret_cast<ULONG*>(fadt + 76) = pm_timer_port;
+
+  if (return_length)
+    *return_length = sizeof(fadt);
+
+  if (length < sizeof(fadt))
+    return STATUS_BUFFER_TOO_SMALL;
+
+  memcpy(buffer, fadt, sizeof(fadt));
+  return STATUS_SUCCESS;
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+// A software model of a processor (and optionally a hypervisor running
+// underneath it) that the detections run on when they're compiled against
+// the headers in mock/shim/. Every intrinsic executes against the model:
+// it takes a configurable amount of (virtual) time, may cause a vm-exit,
+// and may raise a fault, depending on the personality that is loaded.
+
+#include "wdk.h"
+
+#include <stdint.h>
+
+#include <random>
+
+// Hypervisor bugs that a personality can have. Most of these are bugs
+// that nohv documents in a specific real-world hypervisor.
+enum mock_bug : uint32_t {
+  bug_hypervisor_bit,     // CPUID.01H:ECX[31] is set
+  bug_synthetic_msrs,     // 0x40000000-0x400000FF are readable
+  bug_hidden_aperf_mperf, // APERF/MPERF are readable but hidden in CPUID
+  bug_cr0_ne_fixed,       // writes to CR0.NE are ignored
+  bug_cr0_reserved_high,  // no #GP for CR0[63:32]
+  bug_cr0_reserved_low,   // CR0[31:0] reserved bits are kept
+  bug_cr3_reserved,       // no #GP for CR3[62:MAXPHYADDR]
+  bug_cr3_bit63_pcide,    // #GP for CR3[63] while CR4.PCIDE=1
+  bug_cr3_bit63_no_pcide, // no #GP for CR3[63] while CR4.PCIDE=0
+  bug_cr4_vmxe_visible,   // CR4.VMXE reads as 1
+  bug_cr4_vmxe_sticky,    // writes to CR4.VMXE are ignored
+  bug_cr4_reserved,       // no #GP for reserved or unchangeable CR4 bits
+  bug_xcr_index,          // no #GP for XCRs other than XCR0
+  bug_xcr0_unsupported,   // no #GP for unsupported XCR0 bits
+  bug_xsetbv_rax_high,    // XSETBV uses RAX[63:32] (hvpp, SimpleVisor, ...)
+  bug_xsetbv_rcx_high,    // XSETBV uses RCX[63:32]
+  bug_xcr0_invalid,       // no #GP for invalid XCR0 combinations
+  bug_dr7_clobbered,      // DR7 isn't preserved across vm-exits
+  bug_vmxon_gp,           // VMXON injects #GP instead of #UD
+  bug_vmcall_no_ud,       // VMCALL returns instead of injecting #UD
+  bug_rdtscp_high,        // RDTSCP doesn't clear RAX/RCX/RDX[63:32]
+  bug_cd_ignored,         // EPT memory types ignore CR0.CD
+  bug_gpr_clobbered,      // R8-R11 aren't preserved across vm-exits
+  bug_xstate_clobbered,   // the host uses XMM0/XMM1 (or wider) without saving them
+  bug_dr_clobbered,       // DR0-DR3 and DR6 aren't preserved across vm-exits
+  bug_debugctl_clobbered, // IA32_DEBUGCTL is cleared by vm-exits
+  bug_count
+};
+
+// Short, printable name of a bug.
+char const* mock_bug_name(uint32_t bug);
+
+// How the hypervisor hides the time that it spends handling vm-exits.
+enum mock_compensation : uint32_t {
+  compensation_none,    // the TSC keeps ticking
+  compensation_per_cpu, // every logical processor's TSC offset is lowered
+  compensation_shared,  // one TSC offset is shared by every processor
+};
+
+// Everything about a mocked machine. Latencies are in core cycles, which
+// are converted into TSC ticks through freq_ratio.
+struct mock_personality {
+  // whether there is a hypervisor at all
+  bool virtualized;
+
+  // bitmask of mock_bug
+  uint32_t bugs;
+
+  uint32_t cpu_count;
+
+  // hybrid processors alternate between P-cores and E-cores
+  bool hybrid;
+
+  // actual core clock divided by the nominal (TSC) clock
+  double freq_ratio;
+
+  // native latency of CPUID, RDTSC, RDMSR/WRMSR, and MOV CR
+  uint32_t cpuid_cycles;
+  uint32_t rdtsc_cycles;
+  uint32_t msr_cycles;
+  uint32_t cr_cycles;
+
+  // code that runs in between two intrinsics (e.g. the loop in
+  // time_cacheline()), with WB memory and with UC memory
+  uint32_t wb_gap_cycles;
+  uint32_t uc_gap_cycles;
+
+  // standard deviation of the noise that is added to every instruction
+  double jitter_cycles;
+
+  // probability and cost of an SMI-like spike per instruction
+  double spike_rate;
+  uint32_t spike_cycles;
+
+  bool aperf_mperf;
+  bool pcide;
+  bool avx512;
+
+  // IA32_FEATURE_CONTROL has VMX enabled and locked, and the VMX
+  // fixed-bit MSRs are readable
+  bool vmx_enabled;
+
+  // round-trip latency of a vm-exit
+  uint32_t exit_cycles;
+
+  mock_compensation compensation;
+
+  // fraction of the exit latency that is subtracted from the TSC
+  double compensation_ratio;
+
+  // whether MPERF/APERF and REF_TSC are compensated as well
+  bool compensate_mperf;
+  bool compensate_ref_tsc;
+
+  // MOV DR, MOV CR3, and the PM timer port cause vm-exits
+  bool dr_exiting;
+  bool cr3_exiting;
+  bool io_exiting;
+
+  // VMXON is emulated well enough to return VMfailInvalid
+  bool nested_vmx;
+};
+
+// A bare-metal machine with randomized (but realistic) timing.
+mock_personality mock_bare_metal(std::mt19937_64& rng);
+
+// A virtualized machine with randomized timing and every bug enabled
+// with the specified probability.
+mock_personality mock_virtualized(std::mt19937_64& rng, double bug_probability);
+
+// Reset the mock processor and load the specified personality.
+void mock_load(mock_personality const& personality, uint64_t seed);
+
+// Run on the specified logical processor from now on.
+void mock_set_processor(uint32_t index);
+
+// Real (virtual) time that has passed since mock_load(), in TSC ticks.
+uint64_t mock_real_time();
+
+// Native core type of the specified logical processor.
+uint8_t mock_core_type(uint32_t index);
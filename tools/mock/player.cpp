@@ -0,0 +1,511 @@
+#include "player.h"
+
+#include "config.h"
+#include "trace.h"
+
+#include <ntddk.h>
+#include <aux_klib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fstream>
+#include <map>
+
+struct player_stream {
+  std::vector<uint8_t> data;
+  size_t position;
+  bool truncated;
+  trace_history history;
+};
+
+static std::vector<player_stream> streams;
+static uint32_t current = 0;
+
+static std::string hex(uint64_t const value) {
+  char text[24];
+  snprintf(text, sizeof(text), "0x%llx", static_cast<unsigned long long>(value));
+  return text;
+}
+
+// e.g. "readmsr(0x3a)"
+static std::string describe(trace_event const kind, uint64_t const* const arguments) {
+  auto const& format = trace_format(kind);
+
+  std::string text = format.name;
+  text += '(';
+
+  for (size_t i = 0; i < format.arguments; ++i) {
+    if (i)
+      text += ", ";
+    text += hex(arguments[i]);
+  }
+
+  return text + ')';
+}
+
+// Replay the next event on the current processor, which has to match the
+// specified instruction. Raises the exception that the instruction raised.
+static trace_decoded_event replay(trace_event const kind, std::vector<uint64_t> const& arguments) {
+  auto& stream = streams[current];
+
+  uint8_t const* position = stream.data.data() + stream.position;
+  auto const end = stream.data.data() + stream.data.size();
+
+  trace_decoded_event event;
+  if (!trace_decode_event(stream.history, position, end, event)) {
+    throw player_divergence{ "processor " + std::to_string(current) + " executed " +
+      describe(kind, arguments.data()) + " after the end of its trace" +
+      (stream.truncated ? " (which was truncated)" : "") };
+  }
+
+  auto matches = (event.kind == kind);
+  for (size_t i = 0; matches && i < arguments.size(); ++i)
+    matches = (event.fields[i] == arguments[i]);
+
+  if (!matches) {
+    throw player_divergence{ "processor " + std::to_string(current) + " executed " +
+      describe(kind, arguments.data()) + " instead of " + describe(event.kind, event.fields) };
+  }
+
+  stream.position = static_cast<size_t>(position - stream.data.data());
+
+  if (event.status)
+    throw mock_fault{ static_cast<long>(event.status) };
+
+  return event;
+}
+
+// Collect the "[#t]" lines of a log, by name.
+static bool read_trace_lines(std::string const& path,
+    std::map<std::string, std::vector<uint8_t>>& blobs) {
+  std::ifstream file(path);
+  if (!file)
+    return false;
+
+  for (std::string line; std::getline(file, line);) {
+    auto const start = line.find("[#t] ");
+    if (start == std::string::npos)
+      continue;
+
+    auto const colon = line.find(": ", start);
+    if (colon == std::string::npos)
+      continue;
+
+    auto const name = line.substr(start + 5, colon - start - 5);
+    auto text = line.substr(colon + 2);
+
+    while (!text.empty() && (text.back() == '\r' || text.back() == ' '))
+      text.pop_back();
+
+    auto& blob = blobs[name];
+    auto const offset = blob.size();
+    blob.resize(offset + text.size() / 4 * 3);
+
+    auto const size = base64_decode(text.data(), text.size(), blob.data() + offset);
+    if (size < 0)
+      return false;
+
+    blob.resize(offset + static_cast<size_t>(size));
+  }
+
+  return true;
+}
+
+static bool parse_script(std::vector<uint8_t> const& script, size_t const processor_count,
+    std::vector<player_section>& sections) {
+  auto position = script.data();
+  auto const end = script.data() + script.size();
+
+  uint64_t entry = 0;
+  while (decode_varint(position, end, entry)) {
+    if (entry == static_cast<uint64_t>(trace_script::result)) {
+      uint64_t result = 0;
+      if (sections.empty() || !decode_varint(position, end, result))
+        return false;
+
+      sections.back().has_result = true;
+      sections.back().result     = (result != 0);
+      continue;
+    }
+
+    if (entry != static_cast<uint64_t>(trace_script::section))
+      return false;
+
+    player_section section = {};
+
+    uint64_t length = 0, processor = 0;
+    if (!decode_varint(position, end, length) || static_cast<uint64_t>(end - position) < length)
+      return false;
+
+    section.name.assign(reinterpret_cast<char const*>(position), length);
+    position += length;
+
+    if (!decode_varint(position, end, processor) || processor >= processor_count)
+      return false;
+
+    section.processor = static_cast<uint32_t>(processor);
+
+    for (size_t i = 0; i < processor_count; ++i) {
+      uint64_t offset = 0;
+      if (!decode_varint(position, end, offset))
+        return false;
+
+      section.offsets.push_back(static_cast<size_t>(offset));
+    }
+
+    sections.push_back(std::move(section));
+  }
+
+  return position == end;
+}
+
+bool player_load(std::string const& path, std::vector<player_section>& sections,
+    std::string& error) {
+  std::map<std::string, std::vector<uint8_t>> blobs;
+  if (!read_trace_lines(path, blobs)) {
+    error = "failed to read the trace";
+    return false;
+  }
+
+  auto const& header = blobs["header"];
+  auto position = header.data();
+  auto const end = header.data() + header.size();
+
+  uint64_t values[6] = {};
+  for (auto& value : values) {
+    if (!decode_varint(position, end, value)) {
+      error = "no trace header (was this recorded with NohvRecord=true?)";
+      return false;
+    }
+  }
+
+  if (values[0] != trace_version) {
+    error = "unsupported trace version " + std::to_string(values[0]);
+    return false;
+  }
+
+  // every processor has a size and a flag in the header (a byte each at
+  // the very least), and every "[#t] <n>" stream has to belong to one
+  auto stray_stream = false;
+  for (auto const& [name, data] : blobs) {
+    if (!name.empty() && name.find_first_not_of("0123456789") == std::string::npos)
+      stray_stream |= (strtoull(name.c_str(), nullptr, 10) >= values[1]);
+  }
+
+  if (values[1] > static_cast<uint64_t>(end - position) / 2 || stray_stream) {
+    error = "the header has " + std::to_string(values[1]) + " processor(s), which doesn't match " +
+      "its size or the streams in the log";
+    return false;
+  }
+
+  auto const processor_count = static_cast<size_t>(values[1]);
+
+  config.irq_budget_us       = static_cast<ULONG>(values[2]);
+  config.timing_iterations   = static_cast<ULONG>(values[3]);
+  config.clock_window_ms     = static_cast<ULONG>(values[4]);
+  config.clock_tolerance_ppm = static_cast<ULONG>(values[5]);
+
+  streams.assign(processor_count, player_stream{});
+
+  // every processor's stream, and then the script
+  for (size_t i = 0; i <= processor_count; ++i) {
+    uint64_t size = 0, truncated = 0;
+    if (!decode_varint(position, end, size) || !decode_varint(position, end, truncated)) {
+      error = "truncated trace header";
+      return false;
+    }
+
+    auto const name = (i < processor_count) ? std::to_string(i) : std::string("script");
+    auto& data = blobs[name];
+
+    if (data.size() != size) {
+      error = "stream " + name + " has " + std::to_string(data.size()) +
+        " bytes instead of " + std::to_string(size) + " (is the log complete?)";
+      return false;
+    }
+
+    if (i == processor_count) {
+      if (truncated) {
+        error = "the script was truncated (increase RecordTraceKb)";
+        return false;
+      }
+
+      break;
+    }
+
+    streams[i].data      = std::move(data);
+    streams[i].truncated = (truncated != 0);
+  }
+
+  sections.clear();
+  if (!parse_script(blobs["script"], processor_count, sections)) {
+    error = "malformed script";
+    return false;
+  }
+
+  return true;
+}
+
+uint32_t player_processor_count() {
+  return static_cast<uint32_t>(streams.size());
+}
+
+bool player_truncated(uint32_t const processor) {
+  return streams[processor].truncated;
+}
+
+void player_begin(player_section const& section) {
+  current = section.processor;
+
+  for (size_t i = 0; i < streams.size(); ++i) {
+    streams[i].position = section.offsets[i];
+    trace_history_reset(streams[i].history);
+  }
+}
+
+std::string player_end(player_section const* const next) {
+  std::string leftover;
+
+  for (size_t i = 0; i < streams.size(); ++i) {
+    auto const expected = next ? next->offsets[i] : streams[i].data.size();
+    if (streams[i].position == expected)
+      continue;
+
+    if (!leftover.empty())
+      leftover += ", ";
+
+    leftover += "processor " + std::to_string(i) + " skipped " +
+      std::to_string(expected - streams[i].position) + " bytes of events";
+  }
+
+  return leftover;
+}
+
+// The intrinsics (see shim/intrin.h).
+
+uint64_t mock_rdtsc() {
+  return replay(trace_event::rdtsc, {}).fields[0];
+}
+
+uint64_t mock_rdtscp(unsigned int* const aux) {
+  auto const event = replay(trace_event::rdtscp, {});
+  *aux = static_cast<unsigned int>(event.fields[1]);
+  return event.fields[0];
+}
+
+void mock_cpuid(int regs[4], int const leaf, int const subleaf) {
+  auto const event = replay(trace_event::cpuid,
+    { static_cast<uint32_t>(leaf), static_cast<uint32_t>(subleaf) });
+
+  for (int i = 0; i < 4; ++i)
+    regs[i] = static_cast<int>(event.fields[2 + i]);
+}
+
+uint64_t mock_readmsr(unsigned long const msr) {
+  return replay(trace_event::readmsr, { msr }).fields[1];
+}
+
+void mock_writemsr(unsigned long const msr, uint64_t const value) {
+  replay(trace_event::writemsr, { msr, value });
+}
+
+uint64_t mock_readcr(int const cr) {
+  return replay(trace_event::readcr, { static_cast<uint64_t>(cr) }).fields[1];
+}
+
+void mock_writecr(int const cr, uint64_t const value) {
+  replay(trace_event::writecr, { static_cast<uint64_t>(cr), value });
+}
+
+uint64_t mock_readdr(unsigned int const dr) {
+  return replay(trace_event::readdr, { dr }).fields[1];
+}
+
+void mock_writedr(unsigned int const dr, uint64_t const value) {
+  replay(trace_event::writedr, { dr, value });
+}
+
+uint64_t mock_xgetbv(unsigned int const xcr) {
+  return replay(trace_event::xgetbv, { xcr }).fields[1];
+}
+
+void mock_xsetbv(uint64_t const rcx, uint64_t const rdx, uint64_t const rax) {
+  replay(trace_event::xsetbv, { rcx, rdx, rax });
+}
+
+unsigned char mock_vmxon(unsigned long long* const address) {
+  return static_cast<unsigned char>(
+    replay(trace_event::vmxon, { address ? *address : 0 }).fields[1]);
+}
+
+unsigned long mock_indword(unsigned short const port) {
+  return static_cast<unsigned long>(replay(trace_event::indword, { port }).fields[1]);
+}
+
+// time isn't simulated, every RDTSC returns what was recorded
+void mock_instruction(int) {}
+
+// The assembly stubs that the detections call.
+
+extern "C" bool check_rdtscp_regs() {
+  return replay(trace_event::rdtscp_regs, {}).fields[0] != 0;
+}
+
+extern "C" void xsetbv_full(uint64_t const rcx, uint64_t const rdx, uint64_t const rax) {
+  mock_xsetbv(rcx, rdx, rax);
+}
+
+extern "C" void vmx_vmcall(uint64_t const rcx, uint64_t const rdx, uint64_t const r8, uint64_t const r9) {
+  replay(trace_event::vmcall, { rcx, rdx, r8, r9 });
+}
+
+// The GPR snapshot stubs (see regs-asm.asm), which apply whatever the
+// instruction changed in every register.
+static void replay_regs(trace_regs const instruction, uint64_t* const regs) {
+  auto const event = replay(trace_event::regs,
+    { static_cast<uint64_t>(instruction), regs[0], regs[1] });
+
+  for (size_t i = 0; i < trace_gpr_count; ++i) {
+    uint64_t change = 0;
+    memcpy(&change, event.table + i * sizeof(change), sizeof(change));
+    regs[trace_gpr_count + i] = regs[i] ^ change;
+  }
+}
+
+extern "C" void regs_cpuid(uint64_t* const regs) {
+  replay_regs(trace_regs::cpuid, regs);
+}
+
+extern "C" void regs_rdtscp(uint64_t* const regs) {
+  replay_regs(trace_regs::rdtscp, regs);
+}
+
+extern "C" void regs_rdmsr(uint64_t* const regs) {
+  replay_regs(trace_regs::rdmsr, regs);
+}
+
+extern "C" void regs_xgetbv(uint64_t* const regs) {
+  replay_regs(trace_regs::xgetbv, regs);
+}
+
+extern "C" void regs_rdpid(uint64_t* const regs) {
+  replay_regs(trace_regs::rdpid, regs);
+}
+
+extern "C" void regs_vmcall(uint64_t* const regs) {
+  replay_regs(trace_regs::vmcall, regs);
+}
+
+// The extended state stubs (see xstate-asm.asm), which apply whatever
+// changed in every register that they stored.
+struct xstate_registers;
+
+static void replay_xstate(uint32_t const vector_size, xstate_registers const* const input,
+    xstate_registers* const output, uint32_t const leaf, uint32_t const count) {
+  auto const event = replay(trace_event::xstate, { vector_size, leaf, count });
+
+  auto const before = reinterpret_cast<uint8_t const*>(input);
+  auto const after  = reinterpret_cast<uint8_t*>(output);
+
+  for (size_t i = 0; i < trace_xstate_size; ++i)
+    after[i] = before[i] ^ event.table[i];
+}
+
+extern "C" void xstate_sse(xstate_registers const* const input,
+    xstate_registers* const output, uint32_t const leaf, uint32_t const count) {
+  replay_xstate(16, input, output, leaf, count);
+}
+
+extern "C" void xstate_avx(xstate_registers const* const input,
+    xstate_registers* const output, uint32_t const leaf, uint32_t const count) {
+  replay_xstate(32, input, output, leaf, count);
+}
+
+extern "C" void xstate_avx512(xstate_registers const* const input,
+    xstate_registers* const output, uint32_t const leaf, uint32_t const count) {
+  replay_xstate(64, input, output, leaf, count);
+}
+
+// The parts of the WDK that depend on the processor (see wdk.cpp for the rest).
+
+ULONG KeQueryActiveProcessorCountEx(USHORT) {
+  return player_processor_count();
+}
+
+ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER const number) {
+  if (number) {
+    number->Group    = static_cast<USHORT>(current / 64);
+    number->Number   = static_cast<UCHAR>(current % 64);
+    number->Reserved = 0;
+  }
+
+  return current;
+}
+
+NTSTATUS KeGetProcessorNumberFromIndex(ULONG const index, PPROCESSOR_NUMBER const number) {
+  if (index >= player_processor_count())
+    return STATUS_UNSUCCESSFUL;
+
+  number->Group    = static_cast<USHORT>(index / 64);
+  number->Number   = static_cast<UCHAR>(index % 64);
+  number->Reserved = 0;
+  return STATUS_SUCCESS;
+}
+
+void KeSetSystemGroupAffinityThread(PGROUP_AFFINITY const affinity, PGROUP_AFFINITY const previous) {
+  if (previous) {
+    *previous = {};
+    previous->Group = static_cast<USHORT>(current / 64);
+    previous->Mask  = 1ull << (current % 64);
+  }
+
+  current = affinity->Group * 64u + static_cast<uint32_t>(__builtin_ctzll(affinity->Mask));
+}
+
+void KeRevertToUserGroupAffinityThread(PGROUP_AFFINITY const previous) {
+  current = previous->Group * 64u + static_cast<uint32_t>(__builtin_ctzll(previous->Mask));
+}
+
+// Every processor's part of the trace is separate, so the order in which
+// they run the worker doesn't matter.
+ULONG_PTR KeIpiGenericCall(PKIPI_BROADCAST_WORKER const worker, ULONG_PTR const context) {
+  auto const previous = current;
+
+  ULONG_PTR result = 0;
+  for (uint32_t i = 0; i < player_processor_count(); ++i) {
+    current = i;
+    result  = worker(context);
+  }
+
+  current = previous;
+  return result;
+}
+
+LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER const frequency) {
+  auto const event = replay(trace_event::performance_counter, {});
+
+  if (frequency)
+    frequency->QuadPart = static_cast<LONGLONG>(event.fields[1]);
+
+  LARGE_INTEGER counter;
+  counter.QuadPart = static_cast<LONGLONG>(event.fields[0]);
+  return counter;
+}
+
+void KeStallExecutionProcessor(ULONG) {}
+
+NTSTATUS AuxKlibGetSystemFirmwareTable(ULONG const provider, ULONG const table,
+    PVOID const buffer, ULONG const length, PULONG const return_length) {
+  auto const event = replay(trace_event::firmware_table,
+    { provider, table, buffer ? length : 0 });
+
+  if (return_length)
+    *return_length = static_cast<ULONG>(event.fields[4]);
+
+  if (buffer && event.table_size)
+    memcpy(buffer, event.table, event.table_size);
+
+  return static_cast<NTSTATUS>(event.fields[3]);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+// A backend that the detections run on (instead of the mock processor in
+// cpu.h) which feeds them a trace that was recorded by a recording build
+// of nohv (see nohv/record.h and nohv/trace.h). Every intrinsic returns
+// exactly what the real instruction returned, or raises the exception that
+// it raised, as long as the detections ask for the same things in the same
+// order. Once they don't, a player_divergence is thrown.
+
+#include "wdk.h"
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// A part of the trace, which is either a detection or "initialize".
+struct player_section {
+  std::string name;
+
+  // logical processor that the section started on
+  uint32_t processor;
+
+  // offset of every processor's stream when the section started
+  std::vector<size_t> offsets;
+
+  // what the section returned in the recorded run
+  bool has_result;
+  bool result;
+};
+
+// Thrown by the intrinsics once the detections stop following the trace.
+struct player_divergence {
+  std::string reason;
+};
+
+// Load the "[#t]" lines of a log. This also applies the configuration
+// that the trace was recorded with. Returns false (with a reason) if
+// there is no complete trace in the log.
+bool player_load(std::string const& path, std::vector<player_section>& sections,
+  std::string& error);
+
+// Number of logical processors in the trace.
+uint32_t player_processor_count();
+
+// Whether the stream of the specified processor was cut short.
+bool player_truncated(uint32_t processor);
+
+// Start replaying a section: switch to its processor and move every
+// stream to where it was when the section started.
+void player_begin(player_section const& section);
+
+// Check that every event of the current section was replayed, given the
+// section that comes after it (or null). Returns an empty string if it
+// was, or a description of what was left over.
+std::string player_end(player_section const* next);
@@ -0,0 +1,197 @@
+// Replays traces that were recorded by a recording build of nohv (see
+// nohv/record.h) through the detections, compiled unchanged against a
+// backend that returns whatever the real instructions returned.
+//
+//   replay [--verbose] <log>...
+//
+// Every section of the trace (initialization, and then every detection
+// that ran) is replayed on the processor that it ran on, and the result is
+// compared against the recorded one. A section diverges if the detection
+// executes something other than what was recorded, which means that it
+// changed in a way that the trace can't answer for (e.g. it reads another
+// MSR). Every section is replayed on its own, so a divergence doesn't
+// affect the ones after it.
+//
+// This turns a log from a problematic machine into a deterministic test
+// that runs in milliseconds: after changing how a detection interprets
+// what it measured, replay shows exactly which results changed. The exit
+// code is 1 if any result changed or any section diverged.
+
+#include "checks.h"
+#include "player.h"
+
+#include "caps.h"
+#include "irq.h"
+#include "samples.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+enum class outcome {
+  same,
+  changed,
+  diverged,
+  unknown
+};
+
+static char const* result_name(player_section const& section, bool const has_result,
+    bool const result) {
+  if (!has_result)
+    return "-";
+
+  if (section.name == "initialize")
+    return result ? "ok" : "failed";
+
+  return result ? "detected" : "clean";
+}
+
+static bool initialize() {
+  if (!create_cpu_caps())
+    return false;
+
+  if (!irq_initialize()) {
+    free_cpu_caps();
+    return false;
+  }
+
+  if (!samples_initialize()) {
+    irq_free();
+    free_cpu_caps();
+    return false;
+  }
+
+  return true;
+}
+
+// Replay a single section, which has to be "initialize" or a detection.
+static outcome replay_section(player_section const& section, player_section const* const next,
+    bool& initialized, bool& result, std::string& reason) {
+  auto const c = find_check(section.name.c_str());
+
+  if (!c && section.name != "initialize") {
+    reason = "unknown section";
+    return outcome::unknown;
+  }
+
+  if (c && !initialized) {
+    reason = "the trace wasn't initialized";
+    return outcome::diverged;
+  }
+
+  player_begin(section);
+
+  try {
+    if (c)
+      result = c->detect(current_cpu_caps());
+    else
+      result = initialized = initialize();
+  }
+  catch (player_divergence const& divergence) {
+    reason = divergence.reason;
+    return outcome::diverged;
+  }
+  catch (mock_fault const& fault) {
+    // this would have been a bugcheck, so it can't have been recorded
+    char text[64];
+    std::snprintf(text, sizeof(text), "exception 0x%lx escaped", static_cast<unsigned long>(fault.code));
+    reason = text;
+    return outcome::diverged;
+  }
+
+  reason = player_end(next);
+  if (!reason.empty())
+    return outcome::diverged;
+
+  if (section.has_result && result != section.result)
+    return outcome::changed;
+
+  return outcome::same;
+}
+
+static bool replay_log(std::string const& path, size_t& differences) {
+  std::vector<player_section> sections;
+  std::string error;
+
+  if (!player_load(path, sections, error)) {
+    std::fprintf(stderr, "%s: %s\n", path.c_str(), error.c_str());
+    return false;
+  }
+
+  std::printf("%s: %zu section(s) on %u processor(s)\n", path.c_str(),
+    sections.size(), player_processor_count());
+
+  for (uint32_t i = 0; i < player_processor_count(); ++i) {
+    if (player_truncated(i))
+      std::printf("  processor %u's trace was truncated (increase RecordTraceKb)\n", i);
+  }
+
+  std::printf("  %-20s %9s %9s %9s\n", "section", "processor", "recorded", "replayed");
+
+  bool initialized = false;
+
+  for (size_t i = 0; i < sections.size(); ++i) {
+    auto const& section = sections[i];
+    auto const next = (i + 1 < sections.size()) ? &sections[i + 1] : nullptr;
+
+    bool result = false;
+    std::string reason;
+    auto const o = replay_section(section, next, initialized, result, reason);
+
+    auto const replayed = (o == outcome::same || o == outcome::changed);
+
+    std::printf("  %-20s %9u %9s %9s", section.name.c_str(), section.processor,
+      result_name(section, section.has_result, section.result),
+      result_name(section, replayed, result));
+
+    if (o == outcome::changed)
+      std::printf("  CHANGED");
+    else if (o == outcome::diverged)
+      std::printf("  DIVERGED: %s", reason.c_str());
+    else if (o == outcome::unknown)
+      std::printf("  %s", reason.c_str());
+
+    std::printf("\n");
+
+    differences += (o != outcome::same);
+  }
+
+  if (initialized) {
+    samples_free();
+    irq_free();
+    free_cpu_caps();
+  }
+
+  return true;
+}
+
+int main(int argc, char** argv) {
+  std::vector<std::string> paths;
+
+  for (int i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "--verbose"))
+      mock_set_verbose(true);
+    else if (argv[i][0] == '-') {
+      std::fprintf(stderr, "usage: replay [--verbose] <log>...\n");
+      return 2;
+    }
+    else
+      paths.push_back(argv[i]);
+  }
+
+  if (paths.empty()) {
+    std::fprintf(stderr, "usage: replay [--verbose] <log>...\n");
+    return 2;
+  }
+
+  size_t differences = 0;
+
+  for (auto const& path : paths) {
+    if (!replay_log(path, differences))
+      return 2;
+  }
+
+  std::printf("%zu difference(s)\n", differences);
+  return differences ? 1 : 0;
+}
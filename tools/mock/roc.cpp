@@ -0,0 +1,355 @@
+// Runs nohv's detections, compiled unchanged against the mock processor,
+// on thousands of randomized machines and reports how well every check
+// separates virtualized machines from bare metal.
+//
+//   roc [--count <n>] [--seed <n>] [--bug-rate <p>] [--bare-fraction <p>]
+//       [--clock-window <ms>] [--csv] [--verbose] [--calibrate]
+//
+// Half of the machines (--bare-fraction) are bare metal with randomized
+// latencies, jitter, SMI-like spikes, P-states, and core types. The rest
+// run under a hypervisor with a randomized exit latency, TSC compensation
+// scheme, and a random subset of known hypervisor bugs (each one enabled
+// with probability --bug-rate). For every check, the report has:
+//
+//   sensitivity  fraction of virtualized machines that were detected
+//   specificity  fraction of bare-metal machines that were NOT detected
+//   unique       virtualized machines that no other check detected
+//   faults       exceptions that escaped the check (a bugcheck in practice)
+//   cost_us      average (virtual) time that the check took
+//
+// followed by the sensitivity of every check by exit latency.
+//
+// --calibrate runs only the checks that run on every core type, recording
+// their samples like the driver does (tagged with the core type on hybrid
+// machines), and instead prints the distribution of the smallest sample
+// of every series per run, which is what the limits in timing.cpp,
+// cr3.cpp and debug.cpp are compared against. For timing_detected_6,
+// "uc/wb" is the ratio of the smallest UC and WB accesses. The latencies
+// of the mock machines are made up, so this isn't where the limits come
+// from.
+
+#include "checks.h"
+#include "cpu.h"
+#include "../results.h"
+#include "../stats.h"
+
+#include "caps.h"
+#include "config.h"
+#include "irq.h"
+#include "samples.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct options {
+  size_t count          = 1'000;
+  uint64_t seed         = 1;
+  double bug_rate       = 0.1;
+  double bare_fraction  = 0.5;
+  uint32_t clock_window = 20;
+  bool csv              = false;
+  bool verbose          = false;
+  bool calibrate        = false;
+};
+
+// Exit latency buckets (in core cycles) for the second table.
+inline constexpr uint32_t latency_buckets[] = { 500, 1'000, 2'000, 4'000 };
+inline constexpr size_t latency_bucket_count = sizeof(latency_buckets) / sizeof(latency_buckets[0]);
+
+struct check_stats {
+  size_t true_positives, false_positives;
+  size_t unique, faults;
+  double cost_ticks;
+
+  size_t bucket_detected[latency_bucket_count];
+};
+
+static size_t latency_bucket(uint32_t const exit_cycles) {
+  for (size_t i = 0; i < latency_bucket_count; ++i) {
+    if (exit_cycles < latency_buckets[i])
+      return i;
+  }
+
+  return latency_bucket_count - 1;
+}
+
+// Run a single check on the specified processor. Exceptions that escape
+// the check are counted as faults. With record, its samples are printed
+// the same way main.cpp does.
+static bool run_check(check const& c, uint32_t const processor, bool const record, bool& faulted) {
+  mock_set_processor(processor);
+
+  if (record) {
+    auto const core_type = mock_core_type(processor);
+    samples_begin(c.name, (core_type == core_type_unknown) ? nullptr : core_type_name(core_type));
+  }
+
+  bool detected = false;
+
+  try {
+    detected = c.detect(current_cpu_caps());
+  }
+  catch (mock_fault const&) {
+    faulted = true;
+  }
+
+  if (record)
+    samples_end();
+
+  return detected;
+}
+
+// Smallest sample of every series per run (see --calibrate), keyed by
+// "<detection>[@<tag>] <series>".
+using calibration_map = std::map<std::string, std::vector<double>>;
+
+// Add the smallest sample of every series that a run printed.
+static void add_calibration_run(std::string const& output, calibration_map& calibration) {
+  std::istringstream stream(output);
+
+  sample_map run;
+  parse_sample_log(stream, run);
+
+  for (auto const& [key, values] : run) {
+    if (!values.empty())
+      calibration[key].push_back(*std::min_element(values.begin(), values.end()));
+  }
+
+  // the ratio that timing_detected_6 compares
+  for (auto const& [key, values] : run) {
+    if (key.size() < 3 || key.compare(key.size() - 3, 3, " uc") || values.empty())
+      continue;
+
+    auto const wb = run.find(key.substr(0, key.size() - 3) + " wb");
+    if (wb == run.end() || wb->second.empty())
+      continue;
+
+    auto const wb_min = *std::min_element(wb->second.begin(), wb->second.end());
+    if (wb_min > 0)
+      calibration[key + "/wb"].push_back(*std::min_element(values.begin(), values.end()) / wb_min);
+  }
+}
+
+static void print_calibration(calibration_map& bare, calibration_map& virtualized) {
+  std::printf("smallest sample per run:\n%-34s %28s   %26s\n", "",
+    "bare metal", "virtualized");
+  std::printf("%-34s %8s %8s %8s %8s %8s %8s %8s\n", "series",
+    "min", "p0.1", "p99.9", "max", "p1", "p10", "p50");
+
+  for (auto& [key, values] : bare) {
+    auto& others = virtualized[key];
+
+    std::sort(values.begin(), values.end());
+    std::sort(others.begin(), others.end());
+
+    auto const quantile = [](std::vector<double> const& sorted, double const q) {
+      return sorted.empty() ? 0.0 : sorted_quantile(sorted, q);
+    };
+
+    std::printf("%-34s %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f\n", key.c_str(),
+      values.front(), quantile(values, 0.001), quantile(values, 0.999), values.back(),
+      quantile(others, 0.01), quantile(others, 0.1), quantile(others, 0.5));
+  }
+}
+
+int main(int argc, char** argv) {
+  options opts;
+
+  for (int i = 1; i < argc; ++i) {
+    auto const has_value = (i + 1 < argc);
+
+    if (!std::strcmp(argv[i], "--count") && has_value)
+      opts.count = std::strtoull(argv[++i], nullptr, 0);
+    else if (!std::strcmp(argv[i], "--seed") && has_value)
+      opts.seed = std::strtoull(argv[++i], nullptr, 0);
+    else if (!std::strcmp(argv[i], "--bug-rate") && has_value)
+      opts.bug_rate = std::atof(argv[++i]);
+    else if (!std::strcmp(argv[i], "--bare-fraction") && has_value)
+      opts.bare_fraction = std::atof(argv[++i]);
+    else if (!std::strcmp(argv[i], "--clock-window") && has_value)
+      opts.clock_window = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 0));
+    else if (!std::strcmp(argv[i], "--csv"))
+      opts.csv = true;
+    else if (!std::strcmp(argv[i], "--verbose"))
+      opts.verbose = true;
+    else if (!std::strcmp(argv[i], "--calibrate"))
+      opts.calibrate = true;
+    else {
+      std::fprintf(stderr, "usage: roc [--count <n>] [--seed <n>] [--bug-rate <p>] "
+        "[--bare-fraction <p>] [--clock-window <ms>] [--csv] [--verbose] [--calibrate]\n");
+      return 2;
+    }
+  }
+
+  // the PM timer check runs for the whole window in virtual time
+  config.clock_window_ms = opts.clock_window;
+
+  mock_set_verbose(opts.verbose);
+
+  std::mt19937_64 rng(opts.seed);
+
+  check_stats stats[check_count] = {};
+  size_t virtualized = 0, bare_metal = 0;
+  size_t any_detected = 0, any_false_positive = 0;
+  size_t bucket_total[latency_bucket_count] = {};
+
+  calibration_map bare_calibration, virtualized_calibration;
+  std::string output;
+
+  if (opts.calibrate)
+    mock_capture_output(&output);
+
+  for (size_t n = 0; n < opts.count; ++n) {
+    auto const bare = std::uniform_real_distribution<double>(0.0, 1.0)(rng) < opts.bare_fraction;
+    auto const personality = bare ? mock_bare_metal(rng) : mock_virtualized(rng, opts.bug_rate);
+
+    mock_load(personality, rng());
+
+    if (!create_cpu_caps() || !irq_initialize() || !samples_initialize()) {
+      std::fprintf(stderr, "failed to initialize machine #%zu\n", n);
+      return 1;
+    }
+
+    auto const bucket = latency_bucket(personality.exit_cycles);
+
+    if (bare)
+      ++bare_metal;
+    else {
+      ++virtualized;
+      ++bucket_total[bucket];
+    }
+
+    bool detected[check_count] = {};
+    size_t detected_count = 0;
+
+    for (size_t i = 0; i < check_count; ++i) {
+      auto const& c = checks[i];
+      auto const start = mock_real_time();
+      bool faulted = false;
+
+      if (opts.calibrate && !c.per_core_type)
+        continue;
+
+      detected[i] = run_check(c, 0, opts.calibrate, faulted);
+
+      // the first processor of every other core type
+      for (uint32_t cpu = 1; c.per_core_type && cpu < personality.cpu_count; ++cpu) {
+        bool seen = false;
+        for (uint32_t prev = 0; prev < cpu && !seen; ++prev)
+          seen = (mock_core_type(prev) == mock_core_type(cpu));
+
+        if (!seen)
+          detected[i] |= run_check(c, cpu, opts.calibrate, faulted);
+      }
+
+      stats[i].cost_ticks += static_cast<double>(mock_real_time() - start);
+      stats[i].faults     += faulted;
+
+      if (!detected[i])
+        continue;
+
+      ++detected_count;
+
+      if (bare)
+        ++stats[i].false_positives;
+      else {
+        ++stats[i].true_positives;
+        ++stats[i].bucket_detected[bucket];
+      }
+
+      if (opts.verbose)
+        std::printf("#%zu (%s): %s\n", n, bare ? "bare metal" : "virtualized", c.name);
+    }
+
+    if (detected_count == 1 && !bare) {
+      for (size_t i = 0; i < check_count; ++i)
+        stats[i].unique += detected[i];
+    }
+
+    if (detected_count && bare)
+      ++any_false_positive;
+    else if (detected_count)
+      ++any_detected;
+
+    if (opts.calibrate) {
+      add_calibration_run(output, bare ? bare_calibration : virtualized_calibration);
+      output.clear();
+    }
+
+    samples_free();
+    irq_free();
+    free_cpu_caps();
+  }
+
+  if (opts.calibrate) {
+    mock_capture_output(nullptr);
+    print_calibration(bare_calibration, virtualized_calibration);
+    return 0;
+  }
+
+  auto const ratio = [](size_t const a, size_t const b) {
+    return b ? static_cast<double>(a) / b : 0.0;
+  };
+
+  // virtual time is in nominal TSC ticks (3 GHz)
+  auto const cost_us = [&](check_stats const& s) {
+    return opts.count ? s.cost_ticks / opts.count / 3'000.0 : 0.0;
+  };
+
+  if (opts.csv) {
+    std::printf("check,sensitivity,specificity,unique,faults,cost_us");
+    for (auto const limit : latency_buckets)
+      std::printf(",sensitivity_lt_%u", limit);
+    std::printf("\n");
+
+    for (size_t i = 0; i < check_count; ++i) {
+      auto const& s = stats[i];
+      std::printf("%s,%g,%g,%zu,%zu,%g", checks[i].name,
+        ratio(s.true_positives, virtualized),
+        1.0 - ratio(s.false_positives, bare_metal), s.unique, s.faults, cost_us(s));
+
+      for (size_t b = 0; b < latency_bucket_count; ++b)
+        std::printf(",%g", ratio(s.bucket_detected[b], bucket_total[b]));
+      std::printf("\n");
+    }
+
+    return 0;
+  }
+
+  std::printf("%zu virtualized and %zu bare-metal machines (seed %llu, bug rate %g)\n\n",
+    virtualized, bare_metal, static_cast<unsigned long long>(opts.seed), opts.bug_rate);
+
+  std::printf("%-20s %11s %11s %7s %7s %10s\n",
+    "check", "sensitivity", "specificity", "unique", "faults", "cost_us");
+
+  for (size_t i = 0; i < check_count; ++i) {
+    auto const& s = stats[i];
+    std::printf("%-20s %11.3f %11.3f %7zu %7zu %10.1f\n", checks[i].name,
+      ratio(s.true_positives, virtualized), 1.0 - ratio(s.false_positives, bare_metal),
+      s.unique, s.faults, cost_us(s));
+  }
+
+  std::printf("%-20s %11.3f %11.3f\n\n", "any",
+    ratio(any_detected, virtualized), 1.0 - ratio(any_false_positive, bare_metal));
+
+  std::printf("sensitivity by exit latency (core cycles):\n%-20s", "check");
+  for (size_t b = 0; b < latency_bucket_count; ++b) {
+    auto const label = "<" + std::to_string(latency_buckets[b]);
+    std::printf(" %7s", label.c_str());
+  }
+  std::printf("\n");
+
+  for (size_t i = 0; i < check_count; ++i) {
+    std::printf("%-20s", checks[i].name);
+    for (size_t b = 0; b < latency_bucket_count; ++b)
+      std::printf(" %7.3f", ratio(stats[i].bucket_detected[b], bucket_total[b]));
+    std::printf("\n");
+  }
+
+  return 0;
+}
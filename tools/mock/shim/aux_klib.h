@@ -0,0 +1,9 @@
+#pragma once
+
+#include <ntddk.h>
+
+// Firmware tables come from the backend (the mock processor only has an
+// FADT, which describes the mock PM timer).
+NTSTATUS AuxKlibInitialize();
+NTSTATUS AuxKlibGetSystemFirmwareTable(ULONG provider, ULONG table,
+  PVOID buffer, ULONG length, PULONG return_length);
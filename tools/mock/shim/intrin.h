@@ -0,0 +1,59 @@
+#pragma once
+
+// Processor intrinsics, routed to the mock processor (see mock/cpu.h)
+// instead of the real one.
+
+#include <stdint.h>
+
+uint64_t mock_rdtsc();
+uint64_t mock_rdtscp(unsigned int* aux);
+void mock_cpuid(int regs[4], int leaf, int subleaf);
+uint64_t mock_readmsr(unsigned long msr);
+void mock_writemsr(unsigned long msr, uint64_t value);
+uint64_t mock_readcr(int cr);
+void mock_writecr(int cr, uint64_t value);
+uint64_t mock_readdr(unsigned int dr);
+void mock_writedr(unsigned int dr, uint64_t value);
+uint64_t mock_xgetbv(unsigned int xcr);
+void mock_xsetbv(uint64_t rcx, uint64_t rdx, uint64_t rax);
+unsigned char mock_vmxon(unsigned long long* address);
+unsigned long mock_indword(unsigned short port);
+void mock_instruction(int cost);
+
+inline unsigned long long __rdtsc() { return mock_rdtsc(); }
+inline unsigned long long __rdtscp(unsigned int* aux) { return mock_rdtscp(aux); }
+
+inline void __cpuid(int regs[4], int leaf) { mock_cpuid(regs, leaf, 0); }
+inline void __cpuidex(int regs[4], int leaf, int subleaf) { mock_cpuid(regs, leaf, subleaf); }
+
+inline unsigned long long __readmsr(unsigned long msr) { return mock_readmsr(msr); }
+inline void __writemsr(unsigned long msr, unsigned long long value) { mock_writemsr(msr, value); }
+
+inline unsigned long long __readcr0() { return mock_readcr(0); }
+inline unsigned long long __readcr3() { return mock_readcr(3); }
+inline unsigned long long __readcr4() { return mock_readcr(4); }
+inline void __writecr0(unsigned long long value) { mock_writecr(0, value); }
+inline void __writecr3(unsigned long long value) { mock_writecr(3, value); }
+inline void __writecr4(unsigned long long value) { mock_writecr(4, value); }
+
+inline unsigned long long __readdr(unsigned int dr) { return mock_readdr(dr); }
+inline void __writedr(unsigned int dr, unsigned long long value) { mock_writedr(dr, value); }
+
+// XSETBV ignores the upper halves of RCX and RAX, which the
+// 32-bit index and 64-bit value can't express
+inline unsigned long long _xgetbv(unsigned int xcr) { return mock_xgetbv(xcr); }
+inline void _xsetbv(unsigned int xcr, unsigned long long value) {
+  mock_xsetbv(xcr, value >> 32, value & 0xFFFF'FFFF);
+}
+
+inline unsigned char __vmx_on(unsigned long long* address) { return mock_vmxon(address); }
+inline unsigned long __indword(unsigned short port) { return mock_indword(port); }
+
+// instructions that don't have any architectural side effects that
+// the detections care about, but still take time
+inline void _disable() { mock_instruction(20); }
+inline void _enable() { mock_instruction(20); }
+inline void _mm_lfence() { mock_instruction(4); }
+inline void _mm_mfence() { mock_instruction(30); }
+inline void _mm_pause() { mock_instruction(40); }
+inline void __wbinvd() { mock_instruction(5'000); }
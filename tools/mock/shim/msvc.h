@@ -0,0 +1,37 @@
+#pragma once
+
+// MSVC/WDK keywords that the driver sources rely on. This header is
+// force-included (-include) before every driver source, since they use
+// __try/__except without including anything.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A processor exception that was raised by the mock processor.
+struct mock_fault {
+  long code;
+};
+
+// Marks the start and the end of an __except block. mock_end_except()
+// returns true if an exception was just handled.
+void mock_begin_except();
+bool mock_end_except();
+
+// Structured exception handling on top of C++ exceptions. The filter is
+// evaluated inside of the catch block, where GetExceptionCode() refers to
+// the caught fault, and the __except block itself is an if-statement that
+// only runs if the fault was handled. A filter of 0 re-raises the fault.
+#define __try try
+#define __except(...)\
+  catch (::mock_fault const& mock_fault_) {\
+    static_cast<void>(mock_fault_);\
+    if (!(__VA_ARGS__))\
+      throw;\
+    ::mock_begin_except();\
+  }\
+  if (::mock_end_except())
+
+#define GetExceptionCode() (mock_fault_.code)
+
+#define __forceinline inline
+#define __int64 long long
@@ -0,0 +1,165 @@
+#pragma once
+
+// The subset of the WDK that the detections use, implemented on top of
+// the mock processor (see mock/cpu.h).
+
+#include <intrin.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef long NTSTATUS;
+typedef unsigned char UCHAR, BOOLEAN, KIRQL;
+typedef unsigned short USHORT, WCHAR;
+typedef unsigned int ULONG;
+typedef long LONG;
+typedef unsigned long long ULONG64, ULONGLONG, ULONG_PTR, KAFFINITY;
+typedef long long LONGLONG, LONG64;
+typedef size_t SIZE_T;
+typedef void* PVOID;
+typedef void* HANDLE;
+typedef ULONG* PULONG;
+typedef USHORT* PUSHORT;
+typedef wchar_t const* PCWSTR;
+
+#define MAXUSHORT  0xFFFF
+#define MAXULONG   0xFFFF'FFFF
+#define MAXULONG64 0xFFFF'FFFF'FFFF'FFFFull
+#define MAXLONGLONG 0x7FFF'FFFF'FFFF'FFFFll
+#define MAXUINT64  0xFFFF'FFFF'FFFF'FFFFull
+
+#define PAGE_SIZE 0x1000
+
+#define STATUS_SUCCESS                ((NTSTATUS)0x00000000)
+#define STATUS_UNSUCCESSFUL           ((NTSTATUS)0xC0000001)
+#define STATUS_ACCESS_VIOLATION       ((NTSTATUS)0xC0000005)
+#define STATUS_ILLEGAL_INSTRUCTION    ((NTSTATUS)0xC000001D)
+#define STATUS_BUFFER_TOO_SMALL       ((NTSTATUS)0xC0000023)
+#define STATUS_PRIVILEGED_INSTRUCTION ((NTSTATUS)0xC0000096)
+#define STATUS_INSUFFICIENT_RESOURCES ((NTSTATUS)0xC000009A)
+
+#define NT_SUCCESS(status) ((NTSTATUS)(status) >= 0)
+
+#define ALL_PROCESSOR_GROUPS 0xFFFF
+
+#define FALSE 0
+#define TRUE  1
+
+#define RtlZeroMemory(destination, length) memset((destination), 0, (length))
+
+struct UNICODE_STRING {
+  USHORT Length;
+  USHORT MaximumLength;
+  wchar_t* Buffer;
+};
+
+typedef UNICODE_STRING* PUNICODE_STRING;
+
+struct PROCESSOR_NUMBER {
+  USHORT Group;
+  UCHAR Number;
+  UCHAR Reserved;
+};
+
+typedef PROCESSOR_NUMBER* PPROCESSOR_NUMBER;
+
+struct GROUP_AFFINITY {
+  KAFFINITY Mask;
+  USHORT Group;
+  USHORT Reserved[3];
+};
+
+typedef GROUP_AFFINITY* PGROUP_AFFINITY;
+
+union LARGE_INTEGER {
+  struct {
+    ULONG LowPart;
+    LONG HighPart;
+  };
+  LONGLONG QuadPart;
+};
+
+typedef LARGE_INTEGER* PLARGE_INTEGER;
+
+union PHYSICAL_ADDRESS {
+  struct {
+    ULONG LowPart;
+    LONG HighPart;
+  };
+  LONGLONG QuadPart;
+};
+
+enum KPROCESSOR_MODE {
+  KernelMode,
+  UserMode
+};
+
+enum MEMORY_CACHING_TYPE {
+  MmNonCached,
+  MmCached,
+  MmWriteCombined
+};
+
+enum MM_PAGE_PRIORITY {
+  LowPagePriority,
+  NormalPagePriority = 16,
+  HighPagePriority   = 32
+};
+
+#define MdlMappingNoExecute 0x40000000
+
+#define MM_ANY_NODE_OK               0x80000000
+#define MM_ALLOCATE_FULLY_REQUIRED   0x00000004
+#define MM_ALLOCATE_FAST_LARGE_PAGES 0x00000040
+
+// large page allocations always fail, so the pool is used instead
+struct MDL;
+typedef MDL* PMDL;
+
+enum POOL_TYPE {
+  NonPagedPool,
+  NonPagedPoolNx = 512
+};
+
+typedef ULONG_PTR (*PKIPI_BROADCAST_WORKER)(ULONG_PTR);
+
+#define XSTATE_MASK_LEGACY 0x3
+
+struct XSTATE_SAVE {
+  ULONG64 Mask;
+};
+
+typedef XSTATE_SAVE* PXSTATE_SAVE;
+
+ULONG DbgPrint(char const* format, ...);
+
+// Raises a mock_fault with the specified code.
+[[noreturn]] void ExRaiseStatus(NTSTATUS status);
+
+LONG InterlockedExchange(LONG volatile* target, LONG value);
+LONG64 InterlockedIncrement64(LONG64 volatile* addend);
+
+PVOID ExAllocatePoolWithTag(POOL_TYPE type, SIZE_T size, ULONG tag);
+void ExFreePoolWithTag(PVOID pointer, ULONG tag);
+void ExFreePool(PVOID pointer);
+
+PMDL MmAllocateNodePagesForMdlEx(PHYSICAL_ADDRESS low, PHYSICAL_ADDRESS high,
+  PHYSICAL_ADDRESS skip, SIZE_T size, MEMORY_CACHING_TYPE type, ULONG node, ULONG flags);
+PVOID MmMapLockedPagesSpecifyCache(PMDL mdl, KPROCESSOR_MODE mode, MEMORY_CACHING_TYPE type,
+  PVOID address, ULONG bugcheck, ULONG priority);
+void MmUnmapLockedPages(PVOID address, PMDL mdl);
+void MmFreePagesFromMdl(PMDL mdl);
+
+ULONG KeQueryActiveProcessorCountEx(USHORT group);
+ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER number);
+NTSTATUS KeGetProcessorNumberFromIndex(ULONG index, PPROCESSOR_NUMBER number);
+void KeSetSystemGroupAffinityThread(PGROUP_AFFINITY affinity, PGROUP_AFFINITY previous);
+void KeRevertToUserGroupAffinityThread(PGROUP_AFFINITY previous);
+ULONG_PTR KeIpiGenericCall(PKIPI_BROADCAST_WORKER worker, ULONG_PTR context);
+
+ULONG64 RtlGetEnabledExtendedFeatures(ULONG64 mask);
+NTSTATUS KeSaveExtendedProcessorState(ULONG64 mask, PXSTATE_SAVE save);
+void KeRestoreExtendedProcessorState(PXSTATE_SAVE save);
+
+LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER frequency);
+void KeStallExecutionProcessor(ULONG microseconds);
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <ntddk.h>
+
+NTSTATUS RtlStringCbPrintfA(char* destination, size_t size, char const* format, ...);
+NTSTATUS RtlStringCbPrintfExA(char* destination, size_t size, char** end,
+  size_t* remaining, ULONG flags, char const* format, ...);
@@ -0,0 +1,118 @@
+// Runs nohv's detections on a single randomized mock machine (see roc),
+// compiled as a recording build (see nohv/record.h), and prints the log
+// that the driver would have printed, trace included.
+//
+//   synth [--seed <n>] [--bare-metal] [--bug-rate <p>]
+//
+// The machine is virtualized unless --bare-metal is specified, and the
+// same seed always produces the same log. This is what the fixtures that
+// "make check" replays are generated with (see "make fixtures"): they
+// don't say anything about real hardware, but they pin down every
+// decision that the detections make based on what they measured, so
+// replay catches any change in them.
+//
+// Exits with 2 on usage errors.
+
+#include "checks.h"
+#include "cpu.h"
+
+#include "caps.h"
+#include "config.h"
+#include "irq.h"
+#include "record.h"
+#include "samples.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+
+struct options {
+  uint64_t seed   = 1;
+  bool bare_metal = false;
+  double bug_rate = 0.3;
+};
+
+static void run_check(check const& c, uint32_t const processor) {
+  mock_set_processor(processor);
+
+  record_begin(c.name);
+
+  bool detected = false;
+
+  try {
+    detected = c.detect(current_cpu_caps());
+  }
+  catch (mock_fault const&) {
+    DbgPrint("[!] %s() raised an exception.\n", c.name);
+  }
+
+  record_end(detected);
+
+  DbgPrint("[%c] %s check: %s().\n", detected ? '-' : '+',
+    detected ? "Failed" : "Passed", c.name);
+}
+
+int main(int argc, char** argv) {
+  options opts;
+
+  for (int i = 1; i < argc; ++i) {
+    auto const has_value = (i + 1 < argc);
+
+    if (!std::strcmp(argv[i], "--seed") && has_value)
+      opts.seed = std::strtoull(argv[++i], nullptr, 0);
+    else if (!std::strcmp(argv[i], "--bare-metal"))
+      opts.bare_metal = true;
+    else if (!std::strcmp(argv[i], "--bug-rate") && has_value)
+      opts.bug_rate = std::atof(argv[++i]);
+    else {
+      std::fprintf(stderr, "usage: synth [--seed <n>] [--bare-metal] [--bug-rate <p>]\n");
+      return 2;
+    }
+  }
+
+  // the PM timer check runs for the whole window in virtual time
+  config.clock_window_ms = 20;
+
+  mock_set_verbose(true);
+
+  std::mt19937_64 rng(opts.seed);
+  auto const personality = opts.bare_metal ? mock_bare_metal(rng) : mock_virtualized(rng, opts.bug_rate);
+
+  mock_load(personality, rng());
+
+  if (!record_initialize()) {
+    std::fprintf(stderr, "failed to allocate the trace\n");
+    return 1;
+  }
+
+  mock_set_processor(0);
+
+  record_begin("initialize");
+  auto const initialized = create_cpu_caps() && irq_initialize() && samples_initialize();
+  record_end(initialized);
+
+  if (!initialized) {
+    std::fprintf(stderr, "failed to initialize the machine\n");
+    return 1;
+  }
+
+  for (auto const& c : checks) {
+    run_check(c, 0);
+
+    // the first processor of every other core type
+    for (uint32_t cpu = 1; c.per_core_type && cpu < personality.cpu_count; ++cpu) {
+      bool seen = false;
+      for (uint32_t prev = 0; prev < cpu && !seen; ++prev)
+        seen = (mock_core_type(prev) == mock_core_type(cpu));
+
+      if (!seen)
+        run_check(c, cpu);
+    }
+  }
+
+  mock_set_processor(0);
+  record_finish();
+
+  return 0;
+}
@@ -0,0 +1,136 @@
+#include "wdk.h"
+
+#include <ntddk.h>
+#include <ntstrsafe.h>
+#include <aux_klib.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+
+static bool verbose = false;
+static std::string* captured = nullptr;
+
+static thread_local bool except_taken = false;
+
+void mock_set_verbose(bool const enabled) {
+  verbose = enabled;
+}
+
+void mock_capture_output(std::string* const output) {
+  captured = output;
+}
+
+void mock_begin_except() {
+  except_taken = true;
+}
+
+bool mock_end_except() {
+  auto const taken = except_taken;
+  except_taken = false;
+  return taken;
+}
+
+ULONG DbgPrint(char const* const format, ...) {
+  if (!verbose && !captured)
+    return 0;
+
+  // DbgPrint() truncates at 512 bytes as well
+  char buffer[512];
+
+  va_list args;
+  va_start(args, format);
+  vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+
+  if (verbose)
+    fputs(buffer, stdout);
+
+  if (captured)
+    captured->append(buffer);
+
+  return 0;
+}
+
+PVOID ExAllocatePoolWithTag(POOL_TYPE, SIZE_T const size, ULONG) {
+  return malloc(size);
+}
+
+void ExFreePoolWithTag(PVOID const pointer, ULONG) {
+  free(pointer);
+}
+
+void ExFreePool(PVOID const pointer) {
+  free(pointer);
+}
+
+PMDL MmAllocateNodePagesForMdlEx(PHYSICAL_ADDRESS, PHYSICAL_ADDRESS,
+    PHYSICAL_ADDRESS, SIZE_T, MEMORY_CACHING_TYPE, ULONG, ULONG) {
+  return nullptr;
+}
+
+PVOID MmMapLockedPagesSpecifyCache(PMDL, KPROCESSOR_MODE, MEMORY_CACHING_TYPE,
+    PVOID, ULONG, ULONG) {
+  return nullptr;
+}
+
+void MmUnmapLockedPages(PVOID, PMDL) {}
+
+void MmFreePagesFromMdl(PMDL) {}
+
+void ExRaiseStatus(NTSTATUS const status) {
+  throw mock_fault{ status };
+}
+
+LONG InterlockedExchange(LONG volatile* const target, LONG const value) {
+  return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+}
+
+LONG64 InterlockedIncrement64(LONG64 volatile* const addend) {
+  return __atomic_add_fetch(addend, 1, __ATOMIC_SEQ_CST);
+}
+
+NTSTATUS RtlStringCbPrintfA(char* const destination, size_t const size, char const* const format, ...) {
+  va_list args;
+  va_start(args, format);
+  auto const length = vsnprintf(destination, size, format, args);
+  va_end(args);
+
+  return (length >= 0 && static_cast<size_t>(length) < size) ? STATUS_SUCCESS : STATUS_BUFFER_TOO_SMALL;
+}
+
+NTSTATUS RtlStringCbPrintfExA(char* const destination, size_t const size, char** const end,
+    size_t* const remaining, ULONG, char const* const format, ...) {
+  va_list args;
+  va_start(args, format);
+  auto const length = vsnprintf(destination, size, format, args);
+  va_end(args);
+
+  auto const written = std::min(static_cast<size_t>(std::max(length, 0)), size ? size - 1 : 0);
+
+  if (end)
+    *end = destination + written;
+  if (remaining)
+    *remaining = size - written;
+
+  return (static_cast<size_t>(length) < size) ? STATUS_SUCCESS : STATUS_BUFFER_TOO_SMALL;
+}
+
+NTSTATUS AuxKlibInitialize() {
+  return STATUS_SUCCESS;
+}
+
+// The mock kernel enables every feature, and there's no extended state to
+// save since the mock processor doesn't have any.
+ULONG64 RtlGetEnabledExtendedFeatures(ULONG64 const mask) {
+  return mask;
+}
+
+NTSTATUS KeSaveExtendedProcessorState(ULONG64 const mask, PXSTATE_SAVE const save) {
+  save->Mask = mask;
+  return STATUS_SUCCESS;
+}
+
+void KeRestoreExtendedProcessorState(PXSTATE_SAVE) {}
@@ -0,0 +1,14 @@
+#pragma once
+
+// The parts of the WDK (see shim/ntddk.h) that are the same no matter
+// which backend the detections run on: the mock processor (cpu.cpp) or a
+// recorded trace (player.cpp).
+
+#include <string>
+
+// Enable or disable DbgPrint() output.
+void mock_set_verbose(bool verbose);
+
+// Append everything that DbgPrint() prints to the specified string, or
+// stop with null. This works whether or not output is enabled.
+void mock_capture_output(std::string* output);
@@ -0,0 +1,132 @@
+// Compares the raw samples of two nohv runs (e.g. one for each build of
+// a hypervisor) and flags every series whose latency regressed with
+// statistical significance.
+//
+//   regress [options] <baseline log> <candidate log>
+//
+// A series is flagged as a regression when the one-sided Mann-Whitney U
+// test rejects "candidate is not slower" at --alpha, and the lower bound
+// of the bootstrap confidence interval of the median ratio is above
+// 1 + --min-effect. The Kolmogorov-Smirnov p-value is reported as well,
+// since it also catches changes in the shape of the distribution (e.g. a
+// longer tail) that don't move the median.
+//
+// Exits with 1 if any regression was found, 2 on usage errors.
+
+#include "results.h"
+#include "stats.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+struct options {
+  double alpha      = 0.01;
+  double min_effect = 0.02;
+  double confidence = 0.95;
+  size_t resamples  = 2000;
+  size_t min_count  = 5;
+  bool csv          = false;
+};
+
+static void print_usage() {
+  std::fprintf(stderr,
+    "usage: regress [options] <baseline log> <candidate log>\n"
+    "  --alpha <p>        significance level (default 0.01)\n"
+    "  --min-effect <r>   minimum relative median shift to flag (default 0.02)\n"
+    "  --confidence <c>   bootstrap confidence level (default 0.95)\n"
+    "  --resamples <n>    bootstrap resamples (default 2000)\n"
+    "  --min-count <n>    skip series with fewer samples (default 5)\n"
+    "  --csv              print machine-readable output\n");
+}
+
+int main(int argc, char** argv) {
+  options opts;
+  std::vector<std::string> paths;
+
+  for (int i = 1; i < argc; ++i) {
+    auto const has_value = (i + 1 < argc);
+
+    if (!std::strcmp(argv[i], "--alpha") && has_value)
+      opts.alpha = std::atof(argv[++i]);
+    else if (!std::strcmp(argv[i], "--min-effect") && has_value)
+      opts.min_effect = std::atof(argv[++i]);
+    else if (!std::strcmp(argv[i], "--confidence") && has_value)
+      opts.confidence = std::atof(argv[++i]);
+    else if (!std::strcmp(argv[i], "--resamples") && has_value)
+      opts.resamples = std::strtoull(argv[++i], nullptr, 0);
+    else if (!std::strcmp(argv[i], "--min-count") && has_value)
+      opts.min_count = std::strtoull(argv[++i], nullptr, 0);
+    else if (!std::strcmp(argv[i], "--csv"))
+      opts.csv = true;
+    else if (argv[i][0] == '-') {
+      print_usage();
+      return 2;
+    }
+    else
+      paths.push_back(argv[i]);
+  }
+
+  if (paths.size() != 2) {
+    print_usage();
+    return 2;
+  }
+
+  sample_map baseline, candidate;
+  for (size_t i = 0; i < 2; ++i) {
+    if (!load_sample_log(paths[i], i == 0 ? baseline : candidate)) {
+      std::fprintf(stderr, "failed to read %s\n", paths[i].c_str());
+      return 2;
+    }
+  }
+
+  if (opts.csv)
+    std::printf("series,n_baseline,n_candidate,median_baseline,median_candidate,"
+      "ratio,ratio_low,ratio_high,mwu_p,ks_d,ks_p,verdict\n");
+  else
+    std::printf("%-32s %7s %7s %10s %10s %8s %19s %9s %9s  %s\n", "series", "n(a)",
+      "n(b)", "median(a)", "median(b)", "ratio", "ratio CI", "MWU p", "KS p", "verdict");
+
+  size_t regressions = 0;
+
+  for (auto const& [name, a] : baseline) {
+    auto const it = candidate.find(name);
+    if (it == candidate.end())
+      continue;
+
+    auto const& b = it->second;
+    if (a.size() < opts.min_count || b.size() < opts.min_count)
+      continue;
+
+    auto const median_a = median(a);
+    auto const median_b = median(b);
+    auto const slower   = mann_whitney_u(a, b);
+    auto const faster   = mann_whitney_u(b, a);
+    auto const ks       = kolmogorov_smirnov(a, b);
+    auto const ci       = bootstrap_median_ratio(a, b,
+      opts.confidence, opts.resamples, std::hash<std::string>{}(name));
+
+    char const* verdict = "unchanged";
+    if (slower.p_value < opts.alpha && ci.first > 1 + opts.min_effect) {
+      verdict = "REGRESSION";
+      ++regressions;
+    }
+    else if (faster.p_value < opts.alpha && ci.second < 1 - opts.min_effect)
+      verdict = "improved";
+    else if (ks.p_value < opts.alpha)
+      verdict = "distribution changed";
+
+    if (opts.csv) {
+      std::printf("%s,%zu,%zu,%g,%g,%g,%g,%g,%g,%g,%g,%s\n", name.c_str(), a.size(),
+        b.size(), median_a, median_b, median_b / median_a, ci.first, ci.second,
+        slower.p_value, ks.statistic, ks.p_value, verdict);
+    }
+    else {
+      std::printf("%-32s %7zu %7zu %10.1f %10.1f %8.3f [%8.3f, %8.3f] %9.2g %9.2g  %s\n",
+        name.c_str(), a.size(), b.size(), median_a, median_b, median_b / median_a,
+        ci.first, ci.second, slower.p_value, ks.p_value, verdict);
+    }
+  }
+
+  return regressions ? 1 : 0;
+}
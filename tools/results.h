@@ -0,0 +1,95 @@
+#pragma once
+
+#include "encoding.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Raw samples of a single run, keyed by "<detection> <series>"
+// (e.g. "timing_detected_1 tsc").
+using sample_map = std::map<std::string, std::vector<double>>;
+
+// Decode the base64 payload of a "[#z]" line (see nohv/encoding.h).
+inline bool decode_sample_line(std::string const& text, std::vector<double>& values) {
+  std::vector<uint8_t> data(text.size() / 4 * 3);
+
+  auto const size = base64_decode(text.data(), text.size(), data.data());
+  if (size < 0)
+    return false;
+
+  sample_decoder decoder;
+  decoder_initialize(decoder, data.data(), static_cast<size_t>(size));
+
+  for (uint64_t value = 0; decode_sample(decoder, value);)
+    values.push_back(static_cast<double>(value));
+
+  return true;
+}
+
+// Parse the sample lines out of a debug log. Every line has one of the
+// following formats (anything before the marker is ignored, so logs
+// from DebugView or WinDbg can be used as-is):
+//
+//   [#] <detection> <series>: <sample> <sample> ...
+//   [#z] <detection> <series>: <base64>
+inline bool parse_sample_log(std::istream& stream, sample_map& samples) {
+  std::string line;
+
+  while (std::getline(stream, line)) {
+    auto marker = line.find("[#] ");
+    auto encoded = false;
+
+    if (marker == std::string::npos) {
+      if ((marker = line.find("[#z] ")) == std::string::npos)
+        continue;
+
+      encoded = true;
+    }
+
+    std::istringstream tokens(line.substr(marker + (encoded ? 5 : 4)));
+
+    std::string detection, series;
+    if (!(tokens >> detection >> series) || series.empty() || series.back() != ':')
+      continue;
+
+    series.pop_back();
+
+    auto& values = samples[detection + " " + series];
+
+    std::string text;
+    if (encoded && tokens >> text)
+      decode_sample_line(text, values);
+
+    // this is where most of the time goes for large logs, so the samples
+    // are parsed directly instead of through the stream
+    auto const offset = tokens.tellg();
+
+    if (!encoded && offset >= 0) {
+      auto position = line.c_str() + marker + 4 + static_cast<size_t>(offset);
+
+      for (char* end = nullptr;; position = end) {
+        auto const value = std::strtoull(position, &end, 10);
+        if (end == position)
+          break;
+
+        values.push_back(static_cast<double>(value));
+      }
+    }
+  }
+
+  return true;
+}
+
+// Parse the sample lines out of the specified file.
+inline bool load_sample_log(std::string const& path, sample_map& samples) {
+  std::ifstream file(path);
+  if (!file)
+    return false;
+
+  return parse_sample_log(file, samples);
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+// Result of a two-sample test.
+struct test_result {
+  double statistic;
+  double p_value;
+};
+
+// Linearly interpolated quantile of an already-sorted sample.
+inline double sorted_quantile(std::vector<double> const& sorted, double const q) {
+  if (sorted.empty())
+    return NAN;
+
+  auto const position = q * (sorted.size() - 1);
+  auto const lower    = static_cast<size_t>(position);
+  auto const upper    = std::min(lower + 1, sorted.size() - 1);
+
+  return sorted[lower] + (sorted[upper] - sorted[lower]) * (position - lower);
+}
+
+// Median of an unsorted sample.
+inline double median(std::vector<double> values) {
+  if (values.empty())
+    return NAN;
+
+  auto const middle = values.begin() + values.size() / 2;
+  std::nth_element(values.begin(), middle, values.end());
+
+  if (values.size() % 2)
+    return *middle;
+
+  return (*middle + *std::max_element(values.begin(), middle)) / 2;
+}
+
+// One-sided Mann-Whitney U test of whether b tends to be larger than a. The
+// p-value uses the normal approximation with a correction for ties, which
+// is accurate enough for the sample sizes that nohv produces.
+inline test_result mann_whitney_u(std::vector<double> const& a, std::vector<double> const& b) {
+  struct entry {
+    double value;
+    bool from_b;
+  };
+
+  std::vector<entry> combined;
+  combined.reserve(a.size() + b.size());
+
+  for (auto const v : a)
+    combined.push_back({ v, false });
+  for (auto const v : b)
+    combined.push_back({ v, true });
+
+  std::sort(combined.begin(), combined.end(), [](auto const& x, auto const& y) {
+    return x.value < y.value;
+  });
+
+  double const n1 = a.size(), n2 = b.size(), n = n1 + n2;
+
+  // sum of the ranks of b, where tied values share their average rank
+  double rank_sum_b = 0, tie_term = 0;
+
+  for (size_t i = 0; i < combined.size();) {
+    auto j = i;
+    while (j < combined.size() && combined[j].value == combined[i].value)
+      ++j;
+
+    auto const rank = (i + 1 + j) / 2.0;
+    for (auto k = i; k < j; ++k) {
+      if (combined[k].from_b)
+        rank_sum_b += rank;
+    }
+
+    double const t = j - i;
+    tie_term += t * t * t - t;
+
+    i = j;
+  }
+
+  auto const u     = rank_sum_b - n2 * (n2 + 1) / 2;
+  auto const mean  = n1 * n2 / 2;
+  auto const sigma = std::sqrt(n1 * n2 / 12 * ((n + 1) - tie_term / (n * (n - 1))));
+
+  if (sigma == 0)
+    return { u, 0.5 };
+
+  // continuity correction
+  auto const z = (u - mean - 0.5) / sigma;
+  return { u, 0.5 * std::erfc(z / std::sqrt(2.0)) };
+}
+
+// Two-sided two-sample Kolmogorov-Smirnov test, using the asymptotic
+// distribution of the statistic.
+inline test_result kolmogorov_smirnov(std::vector<double> a, std::vector<double> b) {
+  std::sort(a.begin(), a.end());
+  std::sort(b.begin(), b.end());
+
+  double d = 0;
+  size_t i = 0, j = 0;
+
+  while (i < a.size() && j < b.size()) {
+    auto const value = std::min(a[i], b[j]);
+    while (i < a.size() && a[i] == value)
+      ++i;
+    while (j < b.size() && b[j] == value)
+      ++j;
+
+    d = std::max(d, std::abs(double(i) / a.size() - double(j) / b.size()));
+  }
+
+  auto const en     = std::sqrt(double(a.size()) * b.size() / (a.size() + b.size()));
+  auto const lambda = (en + 0.12 + 0.11 / en) * d;
+
+  // Q_KS(lambda) = 2 * sum((-1)^(k-1) * exp(-2 * k^2 * lambda^2)), which
+  // only converges for larger lambdas (where it approaches 1 otherwise)
+  double p = 0, sign = 1;
+  for (int k = 1; k <= 100; ++k) {
+    auto const term = sign * 2 * std::exp(-2 * k * k * lambda * lambda);
+    p += term;
+    sign = -sign;
+
+    if (std::abs(term) < 1e-10)
+      return { d, std::clamp(p, 0.0, 1.0) };
+  }
+
+  return { d, 1.0 };
+}
+
+// Bootstrap percentile confidence interval of median(b) / median(a).
+inline std::pair<double, double> bootstrap_median_ratio(std::vector<double> const& a,
+    std::vector<double> const& b, double const confidence, size_t const resamples, uint64_t const seed) {
+  std::mt19937_64 rng(seed);
+  std::uniform_int_distribution<size_t> pick_a(0, a.size() - 1), pick_b(0, b.size() - 1);
+
+  std::vector<double> ratios(resamples), ra(a.size()), rb(b.size());
+
+  for (auto& ratio : ratios) {
+    for (auto& v : ra)
+      v = a[pick_a(rng)];
+    for (auto& v : rb)
+      v = b[pick_b(rng)];
+
+    ratio = median(rb) / median(ra);
+  }
+
+  std::sort(ratios.begin(), ratios.end());
+
+  auto const alpha = 1 - confidence;
+  return { sorted_quantile(ratios, alpha / 2), sorted_quantile(ratios, 1 - alpha / 2) };
+}